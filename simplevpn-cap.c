@@ -0,0 +1,224 @@
+/* simplevpn-cap.c -- Capture of tunneled packets to a memory-mapped ring */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "simplevpn-cap.h"
+
+volatile int cap_enabled = 0;
+
+static char *cap_map;
+static struct cap_file_hdr *cap_hdr;
+static int next_ring = 0;
+static __thread struct cap_ring_hdr *my_ring;
+static __thread int no_ring;
+
+// Filter. Packets must match every part that is set.
+static unsigned int filter_host = 0;	// Network byte order, 0 for any
+static int filter_proto = -1;
+
+static size_t ring_bytes(void)
+{
+	return 64 + (size_t)cap_hdr->slots * cap_hdr->slot_size;
+}
+
+/*
+ * cap_open
+ *
+ * Creates the capture file at path with room for nrings threads of slots
+ * records each, keeping snaplen bytes of every packet, and maps it. Capture
+ * starts once cap_enabled is set. Returns -1 if the file can't be set up.
+ */
+int cap_open(const char *path, int nrings, int slots, int snaplen)
+{
+	size_t slot_size, len;
+	int fd;
+
+	if(snaplen < 20 || snaplen > CAP_MAX_SNAPLEN)
+	{
+		fprintf(stderr, "Capture length must be between 20 and %d\n", CAP_MAX_SNAPLEN);
+		return -1;
+	}
+	slot_size = (sizeof(struct cap_rec) + snaplen + 63) & ~(size_t)63;
+	len = sizeof(struct cap_file_hdr) + (size_t)nrings * (64 + (size_t)slots * slot_size);
+
+	if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+	{
+		perror(path);
+		return -1;
+	}
+	// Allocate and map every page up front so that forwarding threads never
+	// take a page fault writing a record.
+	if((errno = posix_fallocate(fd, 0, len)) != 0)
+	{
+		perror("posix_fallocate()");
+		close(fd);
+		return -1;
+	}
+	cap_map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if(cap_map == MAP_FAILED)
+	{
+		perror("mmap()");
+		return -1;
+	}
+
+	cap_hdr = (struct cap_file_hdr*)cap_map;
+	cap_hdr->magic = CAP_MAGIC;
+	cap_hdr->version = CAP_VERSION;
+	cap_hdr->nrings = nrings;
+	cap_hdr->slots = slots;
+	cap_hdr->slot_size = slot_size;
+	cap_hdr->snaplen = snaplen;
+	return 0;
+}
+
+/*
+ * cap_set_filter
+ *
+ * Parses a filter such as "host 10.0.1.2 proto tcp". host matches either
+ * address of an IPv4 packet. proto takes tcp, udp, icmp or a number.
+ * Returns -1 if expr doesn't parse.
+ */
+int cap_set_filter(const char *expr)
+{
+	char *copy = strdup(expr), *save, *tok;
+	int ret = 0;
+
+	for(tok = strtok_r(copy, " ", &save); tok != NULL; tok = strtok_r(NULL, " ", &save))
+	{
+		char *arg = strtok_r(NULL, " ", &save);
+
+		if(arg == NULL)
+		{
+			ret = -1;
+			break;
+		}
+		if(strcmp(tok, "host") == 0)
+		{
+			struct in_addr a;
+
+			if(inet_aton(arg, &a) == 0)
+			{
+				ret = -1;
+				break;
+			}
+			filter_host = a.s_addr;
+		}
+		else if(strcmp(tok, "proto") == 0)
+		{
+			if(strcasecmp(arg, "tcp") == 0)
+				filter_proto = 6;
+			else if(strcasecmp(arg, "udp") == 0)
+				filter_proto = 17;
+			else if(strcasecmp(arg, "icmp") == 0)
+				filter_proto = 1;
+			else
+				filter_proto = atoi(arg);
+		}
+		else
+		{
+			ret = -1;
+			break;
+		}
+	}
+	free(copy);
+	return ret;
+}
+
+static int cap_match(const unsigned char *p, int len)
+{
+	if(len < 20)
+		return 0;
+
+	switch(p[0] >> 4)
+	{
+	case 4:
+		if(filter_host != 0 && memcmp(p + 12, &filter_host, 4) != 0 && memcmp(p + 16, &filter_host, 4) != 0)
+			return 0;
+		return filter_proto < 0 || p[9] == filter_proto;
+	case 6:
+		if(filter_host != 0 || len < 40)
+			return 0;
+		return filter_proto < 0 || p[6] == filter_proto;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * cap_packet
+ *
+ * Copies a packet that matches the filter into the calling thread's ring,
+ * overwriting the oldest record once the ring is full. Threads that come
+ * along after every ring has been taken are not captured.
+ */
+void cap_packet(const char *buf, int len, int dir)
+{
+	struct cap_ring_hdr *ring = my_ring;
+	struct cap_rec *rec;
+	struct timespec ts;
+	uint64_t seq;
+	int caplen;
+
+	if(!cap_match((const unsigned char*)buf, len))
+		return;
+
+	if(ring == NULL)
+	{
+		int i;
+
+		if(no_ring)
+			return;
+		i = __atomic_fetch_add(&next_ring, 1, __ATOMIC_RELAXED);
+		if(i >= (int)cap_hdr->nrings)
+		{
+			no_ring = 1;
+			return;
+		}
+		ring = my_ring = (struct cap_ring_hdr*)(cap_map + sizeof(struct cap_file_hdr) + i * ring_bytes());
+	}
+
+	seq = ring->head;
+	rec = (struct cap_rec*)((char*)ring + 64 + (seq % cap_hdr->slots) * cap_hdr->slot_size);
+	caplen = (len > (int)cap_hdr->snaplen) ? (int)cap_hdr->snaplen : len;
+
+	// Mark the slot as being written before touching it.
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec->caplen = caplen;
+	rec->origlen = len;
+	rec->dir = dir;
+	memcpy(rec->data, buf, caplen);
+
+	__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,95 @@
+/* simplevpn-cap.h -- Capture of tunneled packets to a memory-mapped ring */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_CAP_H
+#define SIMPLEVPN_CAP_H
+
+#include <stdint.h>
+
+#define CAP_MAGIC   0x53564350	// "SVCP"
+#define CAP_VERSION 1
+
+// Each thread that captures gets a ring of its own, so writing a record
+// takes no lock. A capture file has room for this many threads.
+#define CAP_DEFAULT_RINGS 4
+#define CAP_DEFAULT_SLOTS 65536
+
+// Bytes of each packet that are kept. Copying whole packets into a ring
+// much bigger than the CPU caches costs more than the rest of forwarding,
+// so by default only the headers are kept.
+#define CAP_DEFAULT_SNAPLEN 128
+#define CAP_MAX_SNAPLEN     65535
+
+#define CAP_DIR_IN  0		// Came out of the tunnel
+#define CAP_DIR_OUT 1		// Going into the tunnel
+
+/*
+ * struct cap_file_hdr
+ *
+ * Start of a capture file. It is followed by nrings rings, each a struct
+ * cap_ring_hdr padded to 64 bytes and then slots slots of slot_size bytes.
+ * Every record takes one slot, which holds up to snaplen bytes of the
+ * packet. All fields are in host byte order.
+ */
+struct cap_file_hdr
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nrings;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint32_t snaplen;
+	uint32_t reserved[10];
+};
+
+struct cap_ring_hdr
+{
+	uint64_t head;		// Records ever written to this ring
+	uint64_t reserved[7];
+};
+
+/*
+ * struct cap_rec
+ *
+ * One captured packet. seq is the record's number plus one, and is zero
+ * while the slot is being written, so readers can tell a complete record
+ * from one that is being overwritten.
+ */
+struct cap_rec
+{
+	uint64_t seq;
+	uint64_t ts_ns;		// CLOCK_REALTIME
+	uint32_t caplen;
+	uint32_t origlen;
+	uint8_t dir;
+	uint8_t reserved[7];
+	unsigned char data[];
+};
+
+extern volatile int cap_enabled;
+
+int cap_open(const char *path, int nrings, int slots, int snaplen);
+int cap_set_filter(const char *expr);
+void cap_packet(const char *buf, int len, int dir);
+
+// Costs one predictable branch while capture is off.
+#define CAP_PACKET(buf, len, dir) do { if(__builtin_expect(cap_enabled, 0)) cap_packet(buf, len, dir); } while(0)
+
+#endif
@@ -0,0 +1,205 @@
+/* simplevpn-cap2pcap.c -- Export a simplevpn capture file as pcap */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Reads the rings of a capture file written by srv or cli -C, merges them
+ * in time order and writes the packets out as a pcap file that tcpdump and
+ * wireshark can read. The capture file can be exported while it is still
+ * being written to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "simplevpn-cap.h"
+
+#define PCAP_MAGIC_NS 0xa1b23c4d	// Nanosecond timestamps
+#define LINKTYPE_RAW  101		// Bare IPv4 or IPv6 packets
+
+struct pcap_file_hdr
+{
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_hdr
+{
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t caplen;
+	uint32_t origlen;
+};
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const struct cap_rec *x = *(struct cap_rec* const*)a, *y = *(struct cap_rec* const*)b;
+
+	if(x->ts_ns != y->ts_ns)
+		return (x->ts_ns > y->ts_ns) ? 1 : -1;
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+void usage(char *progname)
+{
+	printf("%s: export a simplevpn capture file as pcap\n\n", progname);
+	printf("usage: %s [-d in|out] <capture file> <pcap file>\n\n", progname);
+	printf("\t-d <dir>\tOptional. Only export packets coming out of (in) or going into\n\t\t\t(out) the tunnel.\n");
+	printf("\tUse - as the pcap file to write to stdout.\n");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct cap_file_hdr *hdr;
+	struct cap_rec **recs;
+	struct pcap_file_hdr ph;
+	struct stat st;
+	char *map;
+	FILE *out;
+	int c, fd, dir = -1;
+	long n = 0, torn = 0, i;
+	uint32_t r;
+
+	while ((c = getopt (argc, argv, "d:")) != -1)
+	{
+		switch (c)
+		{
+		case 'd':
+			if(strcmp(optarg, "in") == 0)
+				dir = CAP_DIR_IN;
+			else if(strcmp(optarg, "out") == 0)
+				dir = CAP_DIR_OUT;
+			else
+			{
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if(argc - optind != 2)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	if((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		perror("mmap()");
+		return 1;
+	}
+	hdr = (struct cap_file_hdr*)map;
+	if((size_t)st.st_size < sizeof(*hdr) || hdr->magic != CAP_MAGIC || hdr->version != CAP_VERSION || hdr->snaplen + sizeof(struct cap_rec) > hdr->slot_size ||
+	   (size_t)st.st_size < sizeof(*hdr) + (size_t)hdr->nrings * (64 + (size_t)hdr->slots * hdr->slot_size))
+	{
+		fprintf(stderr, "%s is not a simplevpn capture file\n", argv[optind]);
+		return 1;
+	}
+
+	// Copy out every complete record. A record whose sequence number
+	// changes while we copy it was overwritten by the writer.
+	recs = malloc((size_t)hdr->nrings * hdr->slots * sizeof(struct cap_rec*));
+	for(r = 0; r < hdr->nrings; r++)
+	{
+		char *ring = map + sizeof(*hdr) + r * (64 + (size_t)hdr->slots * hdr->slot_size);
+		uint64_t head = __atomic_load_n(&((struct cap_ring_hdr*)ring)->head, __ATOMIC_ACQUIRE);
+		uint64_t s = (head > hdr->slots) ? head - hdr->slots : 0;
+
+		for(; s < head; s++)
+		{
+			struct cap_rec *rec = (struct cap_rec*)(ring + 64 + (s % hdr->slots) * hdr->slot_size);
+			struct cap_rec *copy;
+
+			if(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != s + 1 || rec->caplen > hdr->snaplen)
+			{
+				torn++;
+				continue;
+			}
+			copy = malloc(sizeof(struct cap_rec) + rec->caplen);
+			memcpy(copy, rec, sizeof(struct cap_rec) + rec->caplen);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != s + 1)
+			{
+				free(copy);
+				torn++;
+				continue;
+			}
+			if(dir >= 0 && copy->dir != dir)
+			{
+				free(copy);
+				continue;
+			}
+			recs[n++] = copy;
+		}
+	}
+	qsort(recs, n, sizeof(struct cap_rec*), cmp_rec);
+
+	out = (strcmp(argv[optind + 1], "-") == 0) ? stdout : fopen(argv[optind + 1], "w");
+	if(out == NULL)
+	{
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	memset(&ph, 0, sizeof(ph));
+	ph.magic = PCAP_MAGIC_NS;
+	ph.version_major = 2;
+	ph.version_minor = 4;
+	ph.snaplen = hdr->snaplen;
+	ph.linktype = LINKTYPE_RAW;
+	fwrite(&ph, sizeof(ph), 1, out);
+
+	for(i = 0; i < n; i++)
+	{
+		struct pcap_rec_hdr rh;
+
+		rh.ts_sec = recs[i]->ts_ns / 1000000000;
+		rh.ts_nsec = recs[i]->ts_ns % 1000000000;
+		rh.caplen = recs[i]->caplen;
+		rh.origlen = recs[i]->origlen;
+		fwrite(&rh, sizeof(rh), 1, out);
+		fwrite(recs[i]->data, recs[i]->caplen, 1, out);
+		free(recs[i]);
+	}
+	if(out != stdout)
+		fclose(out);
+	fprintf(stderr, "%ld packets exported, %ld slots skipped\n", n, torn);
+	free(recs);
+	return 0;
+}
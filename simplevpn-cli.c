@@ -16,7 +16,61 @@
 #include <unistd.h>
 #include <net/route.h>
 #include <netdb.h>
+#include <time.h>
+#include <poll.h>
+#include "simplevpn-pkt.h"
+#include "simplevpn-txq.h"
+#include "simplevpn-tune.h"
+#include "simplevpn-stripe.h"
+#include "simplevpn-p2p.h"
+#include "simplevpn-cap.h"
+#include "simplevpn-shm.h"
+#include "simplevpn-dgram.h"
+#include "simplevpn-race.h"
+#include "simplevpn-comp.h"
+
+// Bytes of tun traffic we hold while the server connection is backed up.
+#define CLI_TXQ_LIMIT (256 * 1024)
+
+// Packets passed in each direction before we look at the other one, when
+// talking to the server through shared memory.
+#define LOCAL_BATCH 64
+
+// Seconds an address request over UDP is sent again for before we give up.
+#define UDP_ADDR_TRIES 10
 
+/*
+ * struct stream
+ *
+ * One connection to the server. A striped tunnel has one for each stream
+ * the server lets us open, and the first one also carries interactive
+ * traffic and control messages. Otherwise there is only the first.
+ */
+struct stream
+{
+	int fd;			// -1 while not connected
+	int conn_fd;		// Extra stream still connecting, or -1
+	int framed;		// Frames carry sequence numbers
+	struct txq txq;
+	struct tune tune;
+	char *rxbuf;
+	int rxlen;
+	time_t last_tx;		// Keepalives are due SOCK_TIMEOUT / 4 after this
+	struct comp comp;	// Used if txq.comp points to it
+};
+
+static struct stream streams[STRIPE_MAX_STREAMS];
+static int nstreams = 1;		// Streams we may have open
+static unsigned int stripe_ip, stripe_cookie;	// To join extra streams with
+static struct addr_subnet subnets[ADDR_MAX_SUBNETS];	// Networks behind us
+static int nsubnets;
+static unsigned int tx_seq;		// Last bulk packet numbered, host byte order
+static int tx_turn;
+static struct reorder rx;
+static int socktype = SOCK_STREAM;	// SOCK_DGRAM to tunnel over UDP
+static struct dgram udp_tunnel;		// Sends on the first stream over UDP
+static int compress_wanted;		// Ask the server to compress headers
+static int compressing;			// The server agreed to on this connection
 
 struct ip_header
 {
@@ -208,73 +262,698 @@ static int set_ip(const char *name, unsigned int ip, unsigned int mask)
 	return 0;
 }
 
-int register_static_ip(int net_fd, int ip, char *devname)
+/*
+ * set_mtu
+ *
+ * Configure the MTU of interface "name".
+ */
+static int set_mtu(const char *name, int mtu)
+{
+	struct ifreq ifr;
+	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	int err;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ);
+	ifr.ifr_mtu = mtu;
+	err = ioctl(sockfd, SIOCSIFMTU, &ifr);
+	if(err < 0)
+		perror("ioctl SIOCSIFMTU");
+
+	close(sockfd) ;
+	return err;
+}
+
+/*
+ * read_addr_reply
+ *
+ * Reads the server's answer to an address request. Exactly one message is
+ * read so that any traffic right behind it stays in the socket for the main
+ * loop. Returns the length of the reply, or 0 if the server closed the
+ * connection.
+ */
+static int read_addr_reply(int net_fd, char *buffer, int size)
+{
+	int len;
+
+	if(read_n(net_fd, buffer, 20) == 0)
+		return 0;
+
+	len = frame_len(buffer, 20);
+	if(len <= 20 || len > size)
+		return 20;
+	if(read_n(net_fd, buffer + 20, len - 20) == 0)
+		return 0;
+	return len;
+}
+
+/*
+ * ask_server
+ *
+ * Sends the address request in buffer, len bytes long, and reads the
+ * server's answer back into buffer, which has room for size bytes. Over UDP
+ * either may be lost, so the request goes out again every second, and
+ * anything else that comes back first is passed over. The answer is the
+ * only frame from address 0. Returns the length of the answer, 0 if there
+ * was none, or -1 if the request couldn't be sent.
+ */
+static int ask_server(int net_fd, char *buffer, int len, int size)
+{
+	char req[ADDR_REQ_MAX];
+	struct pollfd pfd;
+	int i, n;
+
+	if(socktype == SOCK_STREAM)
+	{
+		if(cwrite(net_fd, buffer, len) <= 0)
+			return -1;
+		return read_addr_reply(net_fd, buffer, size);
+	}
+
+	memcpy(req, buffer, len);
+	for(i = 0; i < UDP_ADDR_TRIES; i++)
+	{
+		// Nothing listens on the port while the server restarts.
+		if(send(net_fd, req, len, 0) < 0 && errno != ECONNREFUSED)
+			return -1;
+		pfd.fd = net_fd;
+		pfd.events = POLLIN;
+		while(poll(&pfd, 1, 1000) > 0)
+		{
+			n = recv(net_fd, buffer, size, 0);
+			if(n >= 20 && ((struct ip_header*)buffer)->source_ip == 0)
+				return n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * addr_request_len
+ *
+ * Asks for streams streams in the address request in buffer if we want more
+ * than one, lists the subnets we advertise and adds the ADDR_FLAG_* bits in
+ * flags. buffer must have room for ADDR_REQ_MAX bytes. Returns the length
+ * of the request.
+ */
+static int addr_request_len(char *buffer, int streams, unsigned int flags)
+{
+	struct ip_header *iphdr = (struct ip_header*)buffer;
+	struct addr_req_opts *opts = (struct addr_req_opts*)(buffer + 20);
+	int len = ADDR_REQ_LEN + nsubnets * sizeof(struct addr_subnet);
+
+	if(streams <= 1 && nsubnets == 0 && flags == 0)
+		return 20;
+	opts->streams = htons(streams);
+	opts->subnets = htons(nsubnets);
+	memcpy(buffer + ADDR_REQ_LEN, subnets, nsubnets * sizeof(struct addr_subnet));
+	if(flags != 0)
+	{
+		flags = htonl(flags);
+		memcpy(buffer + len, &flags, sizeof(flags));
+		len += sizeof(flags);
+	}
+	iphdr->packet_len = htons(len);
+	return len;
+}
+
+/*
+ * add_subnet
+ *
+ * Adds the network given as "address/length" in str to the ones we
+ * advertise. Returns -1 if it can't be parsed or there are too many.
+ */
+static int add_subnet(char *str)
+{
+	struct addr_subnet *sn = &subnets[nsubnets];
+	char *slash = strchr(str, '/');
+	struct in_addr a;
+	int len;
+
+	if(nsubnets == ADDR_MAX_SUBNETS || slash == NULL)
+		return -1;
+	*slash = 0;
+	len = atoi(slash + 1);
+	if(inet_aton(str, &a) == 0 || len < 1 || len > 32)
+		return -1;
+	memset(sn, 0, sizeof(*sn));
+	sn->net = a.s_addr & htonl(0xffffffff << (32 - len));
+	sn->len = len;
+	nsubnets++;
+	return 0;
+}
+
+/*
+ * addr_reply_streams
+ *
+ * Returns the number of streams the server lets us stripe over, or 0 if the
+ * tunnel isn't striped.
+ */
+static int addr_reply_streams(char *buffer, int len)
+{
+	if(len < ADDR_REPLY_LEN)
+		return 0;
+	return ntohs(((struct addr_reply_opts*)(buffer + 20))->streams);
+}
+
+/*
+ * addr_reply_flags
+ *
+ * Returns the ADDR_FLAG_* bits the server agreed to.
+ */
+static unsigned int addr_reply_flags(char *buffer, int len)
+{
+	unsigned int flags;
+
+	if(len < ADDR_REPLY_MAX)
+		return 0;
+	memcpy(&flags, buffer + ADDR_REPLY_LEN, sizeof(flags));
+	return ntohl(flags);
+}
+
+/*
+ * configure_tun
+ *
+ * Sets up interface "name" with the address, netmask and MTU from the
+ * server's answer to an address request. Servers that don't push a netmask
+ * and MTU get the defaults. Returns the MTU.
+ */
+static int configure_tun(const char *name, char *buffer, int len)
+{
+	struct ip_header *iphdr = (struct ip_header*)buffer;
+	unsigned int mask = DEFAULT_TUN_NETMASK;
+	int mtu = DEFAULT_TUN_MTU;
+
+	if(len >= ADDR_REPLY_LEN)
+	{
+		struct addr_reply_opts *opts = (struct addr_reply_opts*)(buffer + 20);
+
+		mask = ntohl(opts->netmask);
+		if(ntohs(opts->mtu) >= 576)
+			mtu = ntohs(opts->mtu);
+	}
+
+	printf("Interface %s: netmask %08x mtu %d\n", name, mask, mtu);
+	set_ip(name, ntohl(iphdr->dest_ip), mask);
+	set_mtu(name, mtu);
+	return mtu;
+}
+
+/*
+ * register_static_ip
+ *
+ * Asks the server for address ip and configures the tun interface with it.
+ * On entry *streams is how many streams we would like to stripe over, and
+ * on return how many we may. Returns the tunnel MTU.
+ */
+int register_static_ip(int net_fd, int ip, char *devname, int *streams)
 {
 	char *buffer;
-	int nread;
+	int nread, mtu;
 
 	// Static IP
-	buffer = malloc(100);
+	buffer = malloc(ADDR_REQ_MAX);
 	struct ip_header *iphdr = (struct ip_header*)buffer;
-	memset(buffer,0,100);
+	memset(buffer,0,ADDR_REQ_MAX);
 	iphdr->vers = 0x45;
 	iphdr->ip_header_len = 20;
 	iphdr->ttl = 64;
 	iphdr->source_ip = ip;
-	if(cwrite(net_fd, buffer, 20) <= 0)
+	if((nread = ask_server(net_fd, buffer, addr_request_len(buffer, *streams, compress_wanted ? ADDR_FLAG_COMPRESS : 0), ADDR_REQ_MAX)) < 0)
 	{
 		printf("error: write failed while requesting static IP address from server.\n");
 		exit(1);
 	}
 
-	nread = cread(net_fd, buffer, 100) ;
-
 	if(nread == 0)
 	{
 		// Connection closed while trying to assign a statick IP. This means that someone else already has that address.
+		// Over UDP the server doesn't answer at all.
 		fprintf(stderr, "ERROR: Requested static IP address already in use.\n");
 		exit(0);
 	}
 
-	set_ip(devname, ntohl(iphdr->dest_ip), 0xffff0000);
+	mtu = configure_tun(devname, buffer, nread);
+	*streams = addr_reply_streams(buffer, nread);
+	compressing = (addr_reply_flags(buffer, nread) & ADDR_FLAG_COMPRESS) != 0;
 	if(add_host_route(devname, (in_addr_t)ntohl(iphdr->dest_ip)) < 0)
 		printf("add_host_route returned\n");
 
 	// Set the interface address.
 	free(buffer) ;
 
-	return 0;
+	return mtu;
 }
 
 
-int get_ip_from_server(int net_fd, char *devname)
+/*
+ * get_ip_from_server
+ *
+ * Asks the server to assign us an address and configures the tun interface
+ * with it. *streams is as for register_static_ip(). Returns the tunnel MTU.
+ */
+int get_ip_from_server(int net_fd, char *devname, int *streams)
 {
 	char *buffer;
+	int nread, mtu;
 
 	// Get IP Address from server
-	buffer = malloc(100) ;
+	buffer = malloc(ADDR_REQ_MAX) ;
 	struct ip_header *iphdr = (struct ip_header*)buffer ;
-	memset(buffer,0,100) ;
+	memset(buffer,0,ADDR_REQ_MAX) ;
 	iphdr->vers = 0x45 ;
 	iphdr->ip_header_len = 20 ;
 	iphdr->ttl = 64;
-	if(cwrite(net_fd, buffer, 20) <= 0)
+	if((nread = ask_server(net_fd, buffer, addr_request_len(buffer, *streams, compress_wanted ? ADDR_FLAG_COMPRESS : 0), ADDR_REQ_MAX)) < 0)
 	{
 		printf("error: write failed while getting IP address from server\n");
 		exit(1);
 	}
 
-	cread(net_fd, buffer, 100) ;
+	if(nread == 0)
+	{
+		printf("error: no answer from server while getting IP address\n");
+		exit(1);
+	}
 	printf("Got IP response: %08x\n", ntohl(iphdr->dest_ip)) ;
 
-	set_ip(devname, ntohl(iphdr->dest_ip), 0xffff0000);
+	mtu = configure_tun(devname, buffer, nread);
+	*streams = addr_reply_streams(buffer, nread);
+	compressing = (addr_reply_flags(buffer, nread) & ADDR_FLAG_COMPRESS) != 0;
 
 	// Set the interface address.
 	free(buffer) ;
 
+	return mtu;
+}
+
+/*
+ * stream_open
+ *
+ * Starts stream s on the connected socket fd. Headers are compressed on it
+ * if the server agreed to that, starting from empty slots.
+ */
+static void stream_open(struct stream *s, int fd, int framed)
+{
+	s->fd = fd;
+	s->framed = framed;
+	s->rxlen = 0;
+	s->last_tx = time(NULL);
+	txq_init(&s->txq, CLI_TXQ_LIMIT);
+	tune_init(&s->tune, fd);
+	if(socktype == SOCK_DGRAM && dgram_open(&udp_tunnel, fd) < 0)
+	{
+		printf("Could not set up UDP socket\n");
+		exit(1);
+	}
+	if(compressing)
+	{
+		comp_init(&s->comp);
+		s->txq.comp = &s->comp;
+	}
+}
+
+static void stream_close(struct stream *s)
+{
+	if(socktype == SOCK_DGRAM)
+		dgram_close(&udp_tunnel);
+	close(s->fd);
+	s->fd = -1;
+	s->framed = 0;
+	s->rxlen = 0;
+	s->last_tx = time(NULL);
+	txq_purge(&s->txq);
+}
+
+/*
+ * stream_flush
+ *
+ * Writes as much of s's txq as will go without blocking, and returns what
+ * txq_flush() does. Over UDP each packet goes in a datagram of its own.
+ */
+static int stream_flush(struct stream *s)
+{
+	if(socktype == SOCK_DGRAM)
+		return dgram_flush(&udp_tunnel, &s->txq, NULL);
+	return txq_flush(&s->txq, s->fd);
+}
+
+/*
+ * stream_frame_len
+ *
+ * Returns the length of the frame at off in s's receive buffer, as
+ * frame_len() does.
+ */
+static int stream_frame_len(struct stream *s, int off)
+{
+	int hdr = s->framed ? STRIPE_HDR_LEN : 0;
+
+	if(s->txq.comp != NULL)
+		return comp_frame_len(s->rxbuf + off, s->rxlen - off, hdr);
+	if(hdr)
+		return stripe_frame_len(s->rxbuf + off, s->rxlen - off);
+	return frame_len(s->rxbuf + off, s->rxlen - off);
+}
+
+/*
+ * stream_joined
+ *
+ * Finishes opening extra stream i once its connect has completed, by
+ * asking to join the tunnel. The join request is the only frame on the
+ * stream without a sequence number. Returns -1 if the connect failed.
+ */
+static int stream_joined(int i)
+{
+	struct stream *s = &streams[i];
+	char buf[CTL_MSG_LEN];
+	struct ctl_msg msg;
+	int fd = s->conn_fd, err, len;
+	socklen_t errlen = sizeof(err);
+
+	s->conn_fd = -1;
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+		err = errno;
+	if(err != 0)
+	{
+		errno = err;
+		perror("connect(stream)");
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = CTL_STRIPE_JOIN;
+	msg.port = htons(i);
+	msg.vpn_ip = stripe_ip;
+	msg.id = stripe_cookie;
+	len = ctl_build(buf, &msg);
+	if(write(fd, buf, len) != len)
+	{
+		close(fd);
+		return -1;
+	}
+	stream_open(s, fd, 1);
 	return 0;
 }
 
+/*
+ * stream_join
+ *
+ * Starts opening extra stream i of a striped tunnel to the server at
+ * remote. The connect doesn't block, so the rest of the tunnel keeps going
+ * while it is under way, and stream_joined() finishes the job once the
+ * socket is writable. Returns 0 if the stream is open already, or -1 if it
+ * isn't open yet or couldn't be. We try again later.
+ */
+static int stream_join(int i, struct sockaddr_in *remote)
+{
+	struct stream *s = &streams[i];
+	int fd, ret;
+
+	if(s->conn_fd >= 0)
+		return -1;
+	if((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		return -1;
+	if((ret = connect(fd, (struct sockaddr*)remote, sizeof(*remote))) < 0 && errno != EINPROGRESS)
+	{
+		perror("connect(stream)");
+		close(fd);
+		return -1;
+	}
+	s->conn_fd = fd;
+	return (ret < 0) ? -1 : stream_joined(i);
+}
+
+/*
+ * pick_stream
+ *
+ * Returns the stream to send p on. Bulk packets on a striped tunnel go on
+ * whichever stream has the least waiting and are numbered, everything else
+ * goes on the first stream unnumbered.
+ */
+static struct stream *pick_stream(struct pkt *p)
+{
+	struct stream *best = &streams[0];
+	int i;
+
+	if(!best->framed)
+		return best;
+	p->flags |= PKT_SEQ;
+	if(p->prio != PKT_PRIO_BULK)
+		return best;
+
+	// Streams that keep up all have empty queues, so ties go round
+	// them in turn.
+	tx_turn = (tx_turn + 1) % nstreams;
+	best = NULL;
+	for(i = 0; i < nstreams; i++)
+	{
+		struct stream *s = &streams[(tx_turn + i) % nstreams];
+
+		if(s->fd >= 0 && (best == NULL || s->txq.bytes < best->txq.bytes))
+			best = s;
+	}
+
+	// A packet that is going to be dropped must not use up a number.
+	if(!txq_full(&best->txq, p))
+	{
+		tx_seq = stripe_seq_next(tx_seq);
+		p->seq = htonl(tx_seq);
+	}
+	return best;
+}
+
+/*
+ * deliver
+ *
+ * Writes a packet from the server to the tun interface.
+ */
+static void deliver(int tun_fd, char *frame, int len, int tun_mtu)
+{
+	pkt_clamp_mss(frame, len, tun_mtu);
+	CAP_PACKET(frame, len, CAP_DIR_IN);
+	if(write(tun_fd, frame, len) <= 0)
+	{
+		printf("tun_fd = %08x buffer = %p nread = %d\n", tun_fd, frame, len) ;
+		perror("write to tun_fd") ;
+	}
+}
+
+static void deliver_list(int tun_fd, struct pkt *p, int tun_mtu)
+{
+	struct pkt *next;
+
+	for(; p != NULL; p = next)
+	{
+		next = p->next;
+		deliver(tun_fd, p->data, p->len, tun_mtu);
+		pkt_free(p);
+	}
+}
+
+/*
+ * local_request
+ *
+ * Asks the server for address ip, or any address if ip is 0, over the rings
+ * of l, and configures the tun interface with the answer. Returns the
+ * tunnel MTU, or 0 if the server went away or refused the address.
+ */
+static int local_request(struct shm_link *l, int sock, unsigned int ip, char *devname)
+{
+	char buffer[ADDR_REQ_MAX], *frame;
+	struct ip_header *iphdr = (struct ip_header*)buffer;
+	struct pollfd pfd[2];
+	int len, mtu;
+
+	memset(buffer, 0, sizeof(buffer));
+	iphdr->vers = 0x45;
+	iphdr->ip_header_len = 20;
+	iphdr->ttl = 64;
+	iphdr->source_ip = ip;
+	if(shm_write(&l->tx, buffer, addr_request_len(buffer, 1, 0)) < 0)
+		return 0;
+	shm_wake_reader(&l->tx);
+
+	while((frame = shm_peek(&l->rx, &len)) == NULL)
+	{
+		if(len < 0)
+			return 0;
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = l->rx.wait_fd;
+		pfd[1].events = POLLIN;
+		if(shm_reader_sleep(&l->rx) && poll(pfd, 2, -1) < 0 && errno != EINTR)
+			return 0;
+		shm_woken(&l->rx);
+		// The server closes the connection rather than answer with an
+		// address that is in use.
+		if(pfd[0].revents)
+			return 0;
+	}
+
+	if(len > (int)sizeof(buffer))
+		len = sizeof(buffer);
+	memcpy(buffer, frame, len);
+	shm_release(&l->rx);
+	shm_wake_writer(&l->rx);
+
+	printf("Got IP response: %08x\n", ntohl(iphdr->dest_ip));
+	mtu = configure_tun(devname, buffer, len);
+	if(ip != 0 && add_host_route(devname, (in_addr_t)ntohl(iphdr->dest_ip)) < 0)
+		printf("add_host_route returned\n");
+	return mtu;
+}
+
+/*
+ * local_loop
+ *
+ * Passes packets between the tun interface and the server's rings until
+ * the server goes away. Packets are read from the tun interface straight
+ * into the ring and written to it straight out of the ring.
+ */
+static void local_loop(struct shm_link *l, int sock, int tun_fd, int tun_mtu)
+{
+	time_t last_tx = time(NULL);
+
+	while(1)
+	{
+		struct pollfd pfd[3];
+		time_t now = time(NULL);
+		int n, len, busy = 0;
+		char *frame;
+
+		// From the server to the tun interface.
+		for(n = 0; n < LOCAL_BATCH && (frame = shm_peek(&l->rx, &len)) != NULL; n++)
+		{
+			struct ip_header *iphdr = (struct ip_header*)frame;
+
+			// Keepalive echoes and control messages from the
+			// server aren't meant for the tun interface.
+			if(len >= 20 && !(iphdr->source_ip == -1 && iphdr->dest_ip == -1))
+				deliver(tun_fd, frame, len, tun_mtu);
+			shm_release(&l->rx);
+		}
+		if(frame == NULL && len < 0)
+		{
+			printf("Garbage on ring from server.\n");
+			return;
+		}
+		if(n > 0)
+		{
+			shm_wake_writer(&l->rx);
+			busy = 1;
+		}
+
+		// From the tun interface to the server, while there is room.
+		for(n = 0; n < LOCAL_BATCH && (frame = shm_reserve(&l->tx, tun_mtu)) != NULL; n++)
+		{
+			if((len = read(tun_fd, frame, tun_mtu)) <= 0)
+				break;
+			pkt_clamp_mss(frame, len, tun_mtu);
+			CAP_PACKET(frame, len, CAP_DIR_OUT);
+			shm_commit(&l->tx, len);
+		}
+		if(n > 0)
+		{
+			shm_wake_reader(&l->tx);
+			last_tx = now;
+			busy = 1;
+		}
+
+		if(now - last_tx >= SOCK_TIMEOUT / 4)
+		{
+			char ka[20];
+			struct ip_header *iphdr = (struct ip_header*)ka;
+
+			memset(ka, 0, sizeof(ka));
+			iphdr->vers = 0x45;
+			iphdr->ip_header_len = 20;
+			iphdr->ttl = 64;
+			iphdr->dest_ip = -1;
+			iphdr->source_ip = -1;
+			if(shm_write(&l->tx, ka, sizeof(ka)) == 0)
+			{
+				shm_wake_reader(&l->tx);
+				last_tx = now;
+			}
+		}
+
+		if(busy)
+			continue;
+
+		// Nothing to do. Tell the server to wake us for its next packet,
+		// and for room in our ring if it is full.
+		if(!shm_reader_sleep(&l->rx))
+			continue;
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = l->rx.wait_fd;
+		pfd[1].events = POLLIN;
+		pfd[2].events = POLLIN;
+		if(shm_reserve(&l->tx, tun_mtu) != NULL)
+			pfd[2].fd = tun_fd;
+		else if(shm_writer_sleep(&l->tx, tun_mtu))
+			pfd[2].fd = l->tx.wait_fd;
+		else
+			continue;
+		if(poll(pfd, 3, (last_tx + SOCK_TIMEOUT / 4 - now) * 1000) < 0 && errno != EINTR)
+		{
+			perror("poll()");
+			exit(1);
+		}
+		shm_woken(&l->rx);
+		shm_woken(&l->tx);
+		if(pfd[0].revents)
+			return;
+	}
+}
+
+/*
+ * run_local
+ *
+ * Talks to a server on this host through its local socket at path instead
+ * of over TCP, connecting again whenever the server goes away. Never
+ * returns.
+ */
+static void run_local(const char *path, char *devname, int tun_fd, unsigned int ip)
+{
+	struct shm_link l;
+	int sock, mtu, first = 1;
+
+	fcntl(tun_fd, F_SETFL, fcntl(tun_fd, F_GETFL) | O_NONBLOCK);
+	while(1)
+	{
+		if((sock = shm_connect(path)) < 0)
+		{
+			perror(path);
+			sleep(1);
+			continue;
+		}
+		if(shm_take(sock, &l) < 0)
+		{
+			close(sock);
+			sleep(1);
+			continue;
+		}
+		printf("CLIENT: Connected to server at %s\n", path);
+
+		if((mtu = local_request(&l, sock, ip, devname)) == 0 && first && ip != 0)
+		{
+			fprintf(stderr, "ERROR: Requested static IP address already in use.\n");
+			exit(0);
+		}
+		first = 0;
+		if(mtu > 0)
+			local_loop(&l, sock, tun_fd, mtu);
+
+		printf("Connection closed by remote host.\n");
+		shm_close(&l);
+		close(sock);
+		sleep(2);
+	}
+}
+
 /*
  * usage
  *
@@ -283,10 +962,18 @@ int get_ip_from_server(int net_fd, char *devname)
 void usage(char *progname)
 {
 	printf("%s: simpleVPN client application\n\n", progname);
-	printf("\t-s <server ip>\tRequired. Specify server address\n");
+	printf("\t-s <server>\tRequired. Server as host or host:port. Repeat for more servers to fail over to.\n");
 	printf("\t-a <local ip>\tOptional. Request static address on the VPN\n");
 	printf("\t-p <port>\tOptional. Specify port that the server listens on.\n");
-	printf("\t-u\t\tOptional. Use UDP instead of TCP. NOT IMPLEMENTED.\n");
+	printf("\t-u\t\tOptional. Tunnel over UDP instead of TCP. The server must allow it.\n");
+	printf("\t-d\t\tOptional. Never set up direct paths to other clients.\n");
+	printf("\t-C <file>\tOptional. Capture tunneled packets to file.\n");
+	printf("\t-F <filter>\tOptional. Only capture packets matching \"host <ip> proto <p>\".\n");
+	printf("\t-S <bytes>\tOptional. Bytes of each packet to capture. Default %d.\n", CAP_DEFAULT_SNAPLEN);
+	printf("\t-k <streams>\tOptional. Stripe the tunnel over this many connections. Default 1.\n");
+	printf("\t-r <net/len>\tOptional. Have the server route this subnet to us. May be repeated.\n");
+	printf("\t-T <path>\tOptional. Connect to a server on this host through its local socket instead of -s.\n");
+	printf("\t-z\t\tOptional. Compress packet headers, for slow links.\n");
 
 	printf("\n");
 }
@@ -296,30 +983,78 @@ int main(int argc, char **argv)
 	char *devname = malloc(IFNAMSIZ+1) ;
 	char *str = malloc(50) ;
 	char *buffer ;
-	char *port_str = NULL;
 	int tun_fd = tun_alloc(devname) ;
 	int net_fd = 0, sock_fd = 0;
 	unsigned int ip = 0;
 	struct sockaddr_in remote;
 	unsigned short port = 2002;
-	char *server_domain = NULL;
+	char *server_specs[RACE_MAX_SERVERS];
+	int nspecs = 0;
 	unsigned short nread;
-	int n;
-	int socktype = SOCK_STREAM;
+	int n, i;
 	int c ;
-	struct addrinfo *hints = malloc(sizeof(struct addrinfo));
-	struct addrinfo *result = malloc(sizeof(struct addrinfo));
-
-	while ((c = getopt (argc, argv, "us:a:p:")) != -1)
+	struct stream *st;
+	struct pkt *p;
+	char *tunbuf = malloc(PKT_MAX_FRAME);
+	char *scratch = malloc(COMP_MAX_LEN + COMP_GROWTH);
+	int tun_mtu;
+	int direct = 1, udp_fd = -1;
+	char *cap_file = NULL;
+	int snaplen = CAP_DEFAULT_SNAPLEN;
+	int want_streams = 1, granted;
+	char *local_path = NULL;
+
+	while ((c = getopt (argc, argv, "us:a:p:dC:F:S:k:r:T:z")) != -1)
 	{
 		switch (c)
 		{
+		case 'd':
+			direct = 0;
+			break;
+		case 'C':
+			cap_file = optarg;
+			break;
+		case 'F':
+			if(cap_set_filter(optarg) < 0)
+			{
+				printf("Bad capture filter %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'S':
+			snaplen = atoi(optarg);
+			break;
+		case 'k':
+			want_streams = atoi(optarg);
+			if(want_streams < 1 || want_streams > STRIPE_MAX_STREAMS)
+			{
+				printf("Streams must be between 1 and %d\n", STRIPE_MAX_STREAMS);
+				return -1;
+			}
+			break;
+		case 'r':
+			if(add_subnet(optarg) < 0)
+			{
+				printf("Bad subnet %s, or more than %d\n", optarg, ADDR_MAX_SUBNETS);
+				return -1;
+			}
+			break;
+		case 'T':
+			local_path = optarg;
+			break;
+		case 'z':
+			compress_wanted = 1;
+			break;
 		case 'a':
 			ip = inet_addr(optarg) ;
 			break ;
 		case 's':
-			server_domain = malloc(strlen(optarg)+2);
-			strcpy(server_domain, optarg);
+			if(nspecs == RACE_MAX_SERVERS)
+			{
+				printf("At most %d servers\n", RACE_MAX_SERVERS);
+				return -1;
+			}
+			server_specs[nspecs++] = optarg;
 			break ;
 		case 'u':
 			socktype = SOCK_DGRAM;
@@ -335,12 +1070,31 @@ int main(int argc, char **argv)
 	}
 
 
-	if(server_domain == NULL)
+	if(nspecs == 0 && local_path == NULL)
 	{
 		usage(argv[0]);
 		printf("Please specify a server using the -s argument\n");
 		return -1 ;
 	}
+	for(i = 0; i < nspecs; i++)
+		if(race_add_server(server_specs[i], port) < 0)
+		{
+			printf("Bad server %s\n", server_specs[i]);
+			return -1;
+		}
+
+	if(socktype == SOCK_DGRAM && want_streams > 1)
+	{
+		printf("Striping needs TCP, using one stream\n");
+		want_streams = 1;
+	}
+
+	if(cap_file != NULL)
+	{
+		if(cap_open(cap_file, CAP_DEFAULT_RINGS, CAP_DEFAULT_SLOTS, snaplen) < 0)
+			exit(1);
+		cap_enabled = 1;
+	}
 
 	if(tun_fd <= 0)
 	{
@@ -350,61 +1104,111 @@ int main(int argc, char **argv)
 
 //	printf("New tun device = %s\n", devname) ;
 
-	if ( (sock_fd = socket(AF_INET, socktype, 0)) < 0) {
-		perror("socket()");
-		exit(1);
-	}
-
-	// Look up the IP address associated with the user-supplied domain
-	memset(hints, 0, sizeof(struct addrinfo));
-	hints->ai_family = AF_UNSPEC;
-	hints->ai_socktype = SOCK_DGRAM;
-	hints->ai_flags = AI_PASSIVE;
-	hints->ai_protocol = 0;
-	hints->ai_canonname = NULL;
-	hints->ai_addr = NULL;
-	hints->ai_next = NULL;
-	port_str = malloc(20);
-	sprintf(port_str, "%d", (int)(port & 0xffff));
-	getaddrinfo(server_domain, port_str, hints, &result);
-	memcpy(&remote, result->ai_addr, sizeof(struct sockaddr_in));
-//	printf("domain = %s\nIP = %08x\n", server_domain, ((struct sockaddr_in*)result->ai_addr)->sin_addr.s_addr);
-
+	if(local_path != NULL)
+		run_local(local_path, devname, tun_fd, ip);
 
-	/* connection request */
-	if (connect(sock_fd, (struct sockaddr*) &remote, sizeof(remote)) < 0)
+	// Connect to whichever server answers first.
+	if((sock_fd = race_connect(socktype, &remote)) < 0)
 	{
-		perror("connect()");
+		printf("Could not connect to any server\n");
 		exit(1);
 	}
 
 	net_fd = sock_fd;
 	printf("CLIENT: Connected to server %s\n", inet_ntoa(remote.sin_addr));
+	for(i = 0; i < STRIPE_MAX_STREAMS; i++)
+	{
+		streams[i].fd = -1;
+		streams[i].conn_fd = -1;
+		streams[i].rxbuf = malloc(2 * PKT_MAX_FRAME + STRIPE_HDR_LEN);
+	}
+	reorder_init(&rx, 1);
 
+	granted = want_streams;
 	if(ip == 0)
 	{
-		get_ip_from_server(net_fd, devname);
+		tun_mtu = get_ip_from_server(net_fd, devname, &granted);
 	}
 	else
 	{
-		register_static_ip(net_fd, ip, devname);
+		tun_mtu = register_static_ip(net_fd, ip, devname, &granted);
+	}
+
+	// Everything after the server's reply on a striped tunnel is numbered.
+	stream_open(&streams[0], net_fd, granted > 0);
+
+	// Direct paths to other clients go over a UDP socket that the server
+	// tells us how to register.
+	if(direct)
+	{
+		if((udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+			perror("socket(SOCK_DGRAM)");
+		else
+			p2p_client_init(udp_fd, &remote);
 	}
-	int maxfd = (tun_fd > net_fd)?tun_fd:net_fd;
 	
 	while(1)
 	{
-		fd_set rd_set ;
+		fd_set rd_set, wr_set ;
 		struct timeval timeout;
-
-		// If we come close to timing out, we will send a keep-alive packet.
-		timeout.tv_sec = SOCK_TIMEOUT / 4;
+		int tick_ms = p2p_tick();
+		int hold_ms = reorder_wait_ms(&rx);
+		time_t now = time(NULL), keepalive_due = SOCK_TIMEOUT / 4;
+		int maxfd = tun_fd, room = 0;
+
+		// If we come close to timing out, we will send a keep-alive
+		// packet on each stream. Traffic on direct paths doesn't
+		// count, since the server never sees it.
+		for(i = 0; i < nstreams; i++)
+			if(streams[i].last_tx + SOCK_TIMEOUT / 4 - now < keepalive_due)
+				keepalive_due = streams[i].last_tx + SOCK_TIMEOUT / 4 - now;
+		timeout.tv_sec = (keepalive_due > 0) ? keepalive_due : 0;
 		timeout.tv_usec = 0;
+		if(tick_ms >= 0 && tick_ms < timeout.tv_sec * 1000)
+		{
+			timeout.tv_sec = tick_ms / 1000;
+			timeout.tv_usec = (tick_ms % 1000) * 1000;
+		}
+		if(hold_ms >= 0 && hold_ms < timeout.tv_sec * 1000 + timeout.tv_usec / 1000)
+		{
+			timeout.tv_sec = hold_ms / 1000;
+			timeout.tv_usec = (hold_ms % 1000) * 1000;
+		}
 
 		FD_ZERO(&rd_set) ;
-		FD_SET(tun_fd,&rd_set) ;
-		FD_SET(net_fd,&rd_set);
+		FD_ZERO(&wr_set) ;
+		for(i = 0; i < nstreams; i++)
+		{
+			st = &streams[i];
+			if(st->conn_fd >= 0)
+			{
+				// Writable once the connect is done, one way or
+				// the other.
+				FD_SET(st->conn_fd,&wr_set);
+				if(st->conn_fd > maxfd)
+					maxfd = st->conn_fd;
+			}
+			if(st->fd < 0)
+				continue;
+			FD_SET(st->fd,&rd_set);
+			if(!txq_empty(&st->txq))
+				FD_SET(st->fd,&wr_set);
+			if(st->txq.bytes < st->txq.limit)
+				room = 1;
+			if(st->fd > maxfd)
+				maxfd = st->fd;
+		}
+		// Leave packets in the tun device while we are backed up.
+		if(room)
+			FD_SET(tun_fd,&rd_set) ;
+		if(udp_fd >= 0)
+		{
+			FD_SET(udp_fd,&rd_set);
+			if(udp_fd > maxfd)
+				maxfd = udp_fd;
+		}
 
-		int ret = select(maxfd + 1, &rd_set, NULL, NULL, &timeout);
+		int ret = select(maxfd + 1, &rd_set, &wr_set, NULL, &timeout);
 
 		if (ret < 0 && errno == EINTR)
 			continue;
@@ -415,9 +1219,23 @@ int main(int argc, char **argv)
 			exit(1);
 		}
 
-		if(ret == 0)
+		for(i = 0; i < nstreams; i++)
+			if(streams[i].conn_fd >= 0 && FD_ISSET(streams[i].conn_fd, &wr_set))
+				stream_joined(i);
+
+		// Stop waiting for packets that went down with a stream.
+		if(reorder_wait_ms(&rx) == 0)
+			deliver_list(tun_fd, reorder_flush(&rx), tun_mtu);
+
+		now = time(NULL);
+		for(i = 0; i < nstreams && now - streams[i].last_tx < SOCK_TIMEOUT / 4; i++)
+			;
+		if(i < nstreams)
 		{
-			// Timeout
+			// Send keepalive on every stream that needs one. It goes
+			// through the txq so it can't land in the middle of a
+			// partly written packet. Streams that went down are
+			// opened again at the same time.
 			buffer = malloc(100) ;
 			struct ip_header *iphdr = (struct ip_header*)buffer ;
 			memset(buffer,0,100) ;
@@ -426,100 +1244,225 @@ int main(int argc, char **argv)
 			iphdr->ttl = 64;
 			iphdr->dest_ip = -1 ;
 			iphdr->source_ip = -1;
-			
-			do
+
+			for(i = 0; i < nstreams; i++)
 			{
-				// Send keepalive
-				if(cwrite(net_fd, buffer, 20) <= 0)
+				st = &streams[i];
+				if(now - st->last_tx < SOCK_TIMEOUT / 4)
+					continue;
+				st->last_tx = now;
+				if(st->fd < 0 && stream_join(i, &remote) < 0)
+					continue;
+				if((p = pkt_alloc(20)) != NULL)
 				{
-					printf("error: cwrite failed while sending keepalive\n");
-					exit(1);
+					memcpy(p->data, buffer, 20);
+					p->prio = PKT_PRIO_INTERACTIVE;
+					if(st->framed)
+						p->flags |= PKT_SEQ;
+					txq_push(&st->txq, p);
 				}
-				
-				timeout.tv_sec = 1;
-				timeout.tv_usec = 0;
-
-				FD_ZERO(&rd_set) ;
-				FD_SET(net_fd,&rd_set);
-			}while(select(maxfd + 1, &rd_set, NULL, NULL, &timeout) == 0);
-
-			// Set the interface address.
+			}
 			free(buffer) ;
+		}
+
+		if(ret == 0)
+		{
+			for(i = 0; i < nstreams; i++)
+				if(streams[i].fd >= 0 && !txq_empty(&streams[i].txq) && stream_flush(&streams[i]) < 0)
+					printf("error: write failed while sending keepalive\n");
 			continue;
 		}
 
 		if(FD_ISSET(tun_fd, &rd_set))
 		{
-			buffer = malloc(2000);
-			*(int*)buffer = 0 ;
 			/* data from tun/tap: just read it and write it to the network */
 
-			nread = cread(tun_fd, buffer, 2000);
+			nread = cread(tun_fd, tunbuf, PKT_MAX_FRAME);
+			pkt_clamp_mss(tunbuf, nread, tun_mtu);
+			CAP_PACKET(tunbuf, nread, CAP_DIR_OUT);
 
-			/* write length + packet */
-			if(cwrite(net_fd, buffer, nread) <= 0)
+			/* queue the packet by traffic class and write what we can,
+			 * unless there is a direct path to its destination */
+			if(!p2p_send(tunbuf, nread) && (p = pkt_alloc(nread)) != NULL)
 			{
-				printf("error: writing to net_fd\n");
-				exit(1) ;
+				memcpy(p->data, tunbuf, nread);
+				p->prio = pkt_classify(tunbuf, nread);
+				st = pick_stream(p);
+				st->last_tx = time(NULL);
+				txq_push(&st->txq, p);
 			}
-			free(buffer);
 		}
 
-		if(FD_ISSET(net_fd, &rd_set))
+		if(udp_fd >= 0 && FD_ISSET(udp_fd, &rd_set))
 		{
-			ioctl(net_fd, FIONREAD,&n);
-
-			buffer = malloc(n);
-			*(int*) buffer = 0 ;
+			char *frame;
+			int len;
 
-			if(n == 0)
+			/* packets from other clients on direct paths */
+			while((len = p2p_recv(tunbuf, PKT_MAX_FRAME, &frame)) >= 0)
 			{
-				printf("Connection closed by remote host.\n");
-	close(sock_fd) ;
+				if(len < 20)
+					continue;
+				pkt_clamp_mss(frame, len, tun_mtu);
+				CAP_PACKET(frame, len, CAP_DIR_IN);
+				if(write(tun_fd, frame, len) <= 0)
+					perror("write to tun_fd") ;
+			}
+		}
 
-	while ( (sock_fd = socket(AF_INET, socktype, 0)) < 0) {
-		perror("socket()");
-		sleep(1) ;
-	}
+		for(i = 0; i < nstreams; i++)
+		{
+			st = &streams[i];
+			if(st->fd < 0)
+				continue;
+			if(!txq_empty(&st->txq) && stream_flush(st) < 0)
+				printf("error: writing to net_fd\n");
+			if(tune_update(&st->tune, st->fd, time(NULL)))
+				printf("Path is losing %u%% of what is sent, switching to %s\n", st->tune.loss, TUNE_CC);
+		}
+
+		for(i = 0; i < nstreams; i++)
+		{
+			int len, hdr, off = 0;
+			unsigned int seq;
 
-	// Look up the IP address associated with the user-supplied domain
-	memset(hints, 0, sizeof(struct addrinfo));
-	hints->ai_family = AF_UNSPEC;
-	hints->ai_socktype = SOCK_DGRAM;
-	hints->ai_flags = AI_PASSIVE;
-	hints->ai_protocol = 0;
-	hints->ai_canonname = NULL;
-	hints->ai_addr = NULL;
-	hints->ai_next = NULL;
-	getaddrinfo(server_domain, "2002", hints, &result);
-	memcpy(&remote, result->ai_addr, sizeof(struct sockaddr_in));
+			st = &streams[i];
+			if(st->fd < 0 || !FD_ISSET(st->fd, &rd_set))
+				continue;
 
-	// Attempt to reconnect.
-	while (connect(sock_fd, (struct sockaddr*) &remote, sizeof(remote)) < 0)
+			// Over UDP each read is one datagram, which is one frame,
+			// and an empty one means nothing.
+			n = read(st->fd, st->rxbuf + st->rxlen, 2 * PKT_MAX_FRAME + STRIPE_HDR_LEN - st->rxlen);
+			if((n < 0 && (errno == EINTR || errno == EAGAIN)) || (n == 0 && socktype == SOCK_DGRAM))
+				continue;
+
+			if(n <= 0 && i > 0)
+			{
+				// An extra stream went down, probably with
+				// packets we are waiting for.
+				printf("Stream %d closed by remote host.\n", i);
+				stream_close(st);
+				deliver_list(tun_fd, reorder_flush(&rx), tun_mtu);
+				continue;
+			}
+
+			if(n <= 0)
+			{
+				printf("Connection closed by remote host.\n");
+	for(i = 0; i < nstreams; i++)
 	{
-		perror("connect()");
-		sleep(1) ;
+		if(streams[i].fd >= 0)
+			stream_close(&streams[i]);
+		if(streams[i].conn_fd >= 0)
+		{
+			close(streams[i].conn_fd);
+			streams[i].conn_fd = -1;
+		}
 	}
+	deliver_list(tun_fd, reorder_flush(&rx), tun_mtu);
+	reorder_init(&rx, 1);
+	nstreams = 1;
+	tx_seq = 0;
+
+	// Attempt to reconnect, to the same server or to any other that is
+	// up.
+	while((sock_fd = race_connect(socktype, &remote)) < 0)
+		sleep(1);
 
 	net_fd = sock_fd;
 	printf("CLIENT: Connected to server %s\n", inet_ntoa(remote.sin_addr));
+	if(udp_fd >= 0)
+		p2p_client_init(udp_fd, &remote);
 
 	// Re-register the IP address with the server after we have reconnected.
-	register_static_ip(net_fd, ip, devname);
+	granted = want_streams;
+	tun_mtu = register_static_ip(net_fd, ip, devname, &granted);
+	stream_open(&streams[0], net_fd, granted > 0);
 				sleep(2) ;
-				continue ;
+				break ;
 			}
 
-			// read packet
-			nread = read(net_fd, buffer, n);
+			st->rxlen += n;
 
-			// now buffer[] contains a full packet or frame, write it into the tun/tap interface
-			if(write(tun_fd, buffer, nread) <= 0)
+			// The server sends packets back to back on the stream.
+			// Split them apart and hand them to the tun interface
+			// one at a time, in order on a striped tunnel.
+			hdr = st->framed ? STRIPE_HDR_LEN : 0;
+			while((len = stream_frame_len(st, off)) > 0 && len <= st->rxlen - off)
 			{
-				printf("tun_fd = %08x buffer = %p nread = %d\n", tun_fd, buffer, nread) ;
-				perror("write to tun_fd") ;
+				char *frame = st->rxbuf + off + hdr;
+				struct ip_header *iphdr;
+
+				seq = 0;
+				if(hdr)
+				{
+					memcpy(&seq, st->rxbuf + off, sizeof(seq));
+					seq = ntohl(seq);
+				}
+				off += len;
+				len -= hdr;
+
+				if(st->txq.comp != NULL && (len = comp_expand(&st->comp, frame, len, &frame, scratch)) < 0)
+				{
+					// Our slots don't match the server's any
+					// more. Start over on a new connection.
+					printf("Bad compressed frame on stream %d\n", i);
+					shutdown(st->fd, SHUT_RDWR);
+					off = st->rxlen;
+					len = 0;
+					break;
+				}
+				iphdr = (struct ip_header*)frame;
+
+				// Keepalive echoes and control messages from the
+				// server aren't meant for the tun interface.
+				if(iphdr->source_ip == -1 && iphdr->dest_ip == -1)
+				{
+					struct ctl_msg *msg = (struct ctl_msg*)(frame + 20);
+
+					if((unsigned char)iphdr->protocol != CTL_PROTO || len < CTL_MSG_LEN)
+						continue;
+					if(msg->type != CTL_STRIPE)
+					{
+						p2p_handle_ctl(msg);
+						continue;
+					}
+
+					// Open the rest of our streams.
+					stripe_ip = msg->vpn_ip;
+					stripe_cookie = msg->id;
+					nstreams = (ntohs(msg->port) < want_streams) ? ntohs(msg->port) : want_streams;
+					if(nstreams < 1)
+						nstreams = 1;
+					printf("Striping over %d streams\n", nstreams);
+					for(n = 1; n < nstreams; n++)
+						if(streams[n].fd < 0)
+							stream_join(n, &remote);
+					continue;
+				}
+
+				if(seq == 0 || reorder_in_order(&rx, seq))
+					deliver(tun_fd, frame, len, tun_mtu);
+				else if((p = pkt_alloc(len)) != NULL)
+				{
+					memcpy(p->data, frame, len);
+					deliver_list(tun_fd, reorder_push(&rx, p, seq), tun_mtu);
+				}
 			}
-			free(buffer);
+
+			if(len < 0)
+			{
+				printf("Garbage on stream from server. Discarding %d bytes.\n", st->rxlen - off);
+				off = st->rxlen;
+			}
+
+			// A datagram is never continued in the next one.
+			if(socktype == SOCK_DGRAM)
+				off = st->rxlen;
+
+			// Keep any partial packet for the next read.
+			memmove(st->rxbuf, st->rxbuf + off, st->rxlen - off);
+			st->rxlen -= off;
 		}
 	}
 
@@ -0,0 +1,698 @@
+/* simplevpn-cluster.c -- Forwarding between cooperating server nodes */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Several server nodes can share one VPN. Each node hands out addresses from
+ * its own slice of the /16, so address allocation needs no coordination.
+ * Every node keeps a persistent TCP trunk open to each of its peers and uses
+ * it to send them tunneled packets and control messages. Trunks only carry
+ * traffic in one direction: a node reads from the trunks its peers opened to
+ * it and writes to the ones it opened itself.
+ *
+ * Nodes tell each other which client addresses they own with JOIN and LEAVE
+ * messages as clients come and go, and repeat the whole list every
+ * CLUSTER_ANNOUNCE_INTERVAL seconds to repair anything that was lost. A
+ * packet for an address no node has claimed goes to the node whose slice the
+ * address is in. Packets that arrived over a trunk are never sent over
+ * another one, so stale ownership can't make a packet loop.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "simplevpn-cluster.h"
+#include "simplevpn-sched.h"
+#include "simplevpn-txq.h"
+#include "simplevpn-tune.h"
+#include "simplevpn-log.h"
+
+// Bytes of traffic that may be waiting for one trunk.
+#define TRUNK_TXQ_LIMIT (1024 * 1024)
+
+// Addresses per ANNOUNCE message, keeping each one under 64k.
+#define ANNOUNCE_CHUNK 8192
+
+struct peer
+{
+	char *name;
+	struct sockaddr_in addr;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// Signalled when the txq goes non-empty
+	struct txq txq;
+	int node;		// -1 until the peer has said hello
+	int connected;
+};
+
+static int self = -1;
+static int nnodes = 1;
+static unsigned int cluster_net;	// Host byte order
+static unsigned short cluster_port;
+static struct peer *peers[CLUSTER_MAX_PEERS];
+static int npeers = 0;
+
+// Outbound trunk to each node, or NULL if it is down.
+static struct peer *volatile peer_by_node[CLUSTER_MAX_NODES];
+
+// Owner of every address in the /16, indexed by the low 16 bits. 0 means no
+// node has claimed the address, otherwise it is the node number plus one.
+// Entries are single bytes, so the forwarding thread reads them without a
+// lock.
+static volatile unsigned char owner[65536];
+static unsigned short owner_gen[65536];
+static unsigned int node_gen[CLUSTER_MAX_NODES];
+
+// Addresses owned by this node, for full announcements.
+static pthread_mutex_t local_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char local_owned[65536];
+static unsigned int local_gen = 0;
+
+int cluster_enabled(void)
+{
+	return self >= 0;
+}
+
+/*
+ * cluster_add_peer
+ *
+ * Adds a peer given as host:port. Must be called before cluster_init().
+ */
+int cluster_add_peer(const char *hostport)
+{
+	struct addrinfo hints, *result;
+	struct peer *peer;
+	char *host, *colon;
+
+	if(npeers >= CLUSTER_MAX_PEERS)
+		return -1;
+
+	host = strdup(hostport);
+	if(host == NULL || (colon = strrchr(host, ':')) == NULL)
+	{
+		free(host);
+		return -1;
+	}
+	*colon = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, colon + 1, &hints, &result) != 0)
+	{
+		free(host);
+		return -1;
+	}
+	free(host);
+
+	peer = calloc(1, sizeof(struct peer));
+	if(peer == NULL)
+	{
+		freeaddrinfo(result);
+		return -1;
+	}
+	peer->name = strdup(hostport);
+	memcpy(&peer->addr, result->ai_addr, sizeof(struct sockaddr_in));
+	freeaddrinfo(result);
+
+	pthread_mutex_init(&peer->lock, NULL);
+	pthread_cond_init(&peer->cond, NULL);
+	txq_init(&peer->txq, TRUNK_TXQ_LIMIT);
+	peer->node = -1;
+	peers[npeers++] = peer;
+	return 0;
+}
+
+/*
+ * cluster_partition
+ *
+ * Narrows [*start, *end] (host byte order) to the part of the address range
+ * this node hands out. The third octet is split evenly between the nodes, and
+ * the .0 address at the start of a slice is skipped.
+ */
+void cluster_partition(unsigned int *start, unsigned int *end)
+{
+	unsigned int lo = (self * 256) / nnodes;
+	unsigned int hi = ((self + 1) * 256) / nnodes;
+
+	if(!cluster_enabled())
+		return;
+
+	if(*start < cluster_net + (lo << 8) + 1)
+		*start = cluster_net + (lo << 8) + 1;
+	if(*end > cluster_net + (hi << 8) - 1)
+		*end = cluster_net + (hi << 8) - 1;
+}
+
+static int partition_owner(unsigned int host_ip)
+{
+	return (((host_ip >> 8) & 0xff) * nnodes) / 256;
+}
+
+static struct pkt *make_msg(int type, int naddrs)
+{
+	int len = sizeof(struct cluster_msg) + naddrs * sizeof(unsigned int);
+	struct pkt *p = pkt_alloc(len);
+	struct cluster_msg *msg;
+
+	if(p == NULL)
+		return NULL;
+
+	msg = (struct cluster_msg*)p->data;
+	msg->type = type;
+	msg->node = self;
+	msg->len = htons(len);
+	msg->gen = 0;
+	p->prio = PKT_PRIO_INTERACTIVE;
+	return p;
+}
+
+/*
+ * peer_push
+ *
+ * Queues a packet or control message on a peer's trunk. Must be called with
+ * the peer's lock held. Consumes p.
+ */
+static void peer_push(struct peer *peer, struct pkt *p)
+{
+	int was_empty = txq_empty(&peer->txq);
+
+	if(txq_push(&peer->txq, p) == 0 && was_empty)
+		pthread_cond_signal(&peer->cond);
+}
+
+/*
+ * queue_full_announce
+ *
+ * Queues the list of addresses this node owns on a trunk, followed by an END
+ * marker for the new generation. Must be called with the peer's lock held.
+ */
+static void queue_full_announce(struct peer *peer)
+{
+	struct pkt *p = NULL;
+	struct cluster_msg *msg = NULL;
+	unsigned int gen, i;
+	int n = 0;
+
+	pthread_mutex_lock(&local_lock);
+	gen = ++local_gen;
+	for(i = 0; i < 65536; i++)
+	{
+		if(!local_owned[i])
+			continue;
+
+		if(p == NULL)
+		{
+			if((p = make_msg(CLUSTER_MSG_ANNOUNCE, ANNOUNCE_CHUNK)) == NULL)
+				break;
+			msg = (struct cluster_msg*)p->data;
+			msg->gen = htonl(gen);
+			n = 0;
+		}
+		msg->addrs[n++] = htonl(cluster_net | i);
+		if(n == ANNOUNCE_CHUNK)
+		{
+			peer_push(peer, p);
+			p = NULL;
+		}
+	}
+	pthread_mutex_unlock(&local_lock);
+
+	if(p != NULL)
+	{
+		p->len = sizeof(struct cluster_msg) + n * sizeof(unsigned int);
+		msg->len = htons(p->len);
+		peer_push(peer, p);
+	}
+
+	if((p = make_msg(CLUSTER_MSG_END, 0)) != NULL)
+	{
+		((struct cluster_msg*)p->data)->gen = htonl(gen);
+		peer_push(peer, p);
+	}
+}
+
+static void broadcast(int type, unsigned int ip)
+{
+	int i;
+
+	for(i = 0; i < npeers; i++)
+	{
+		struct peer *peer = peers[i];
+		struct pkt *p;
+
+		pthread_mutex_lock(&peer->lock);
+		if(peer->connected && (p = make_msg(type, 1)) != NULL)
+		{
+			((struct cluster_msg*)p->data)->addrs[0] = ip;
+			peer_push(peer, p);
+		}
+		pthread_mutex_unlock(&peer->lock);
+	}
+}
+
+static int in_net(unsigned int ip)
+{
+	return (ntohl(ip) & 0xffff0000) == cluster_net;
+}
+
+/*
+ * cluster_join
+ *
+ * Tells the other nodes that a client with VPN address ip (network byte
+ * order) is now connected to this one.
+ */
+void cluster_join(unsigned int ip)
+{
+	if(!cluster_enabled() || !in_net(ip))
+		return;
+
+	pthread_mutex_lock(&local_lock);
+	local_owned[ntohl(ip) & 0xffff] = 1;
+	pthread_mutex_unlock(&local_lock);
+	broadcast(CLUSTER_MSG_JOIN, ip);
+}
+
+/*
+ * cluster_leave
+ *
+ * Tells the other nodes that the client with VPN address ip is gone.
+ */
+void cluster_leave(unsigned int ip)
+{
+	if(!cluster_enabled() || !in_net(ip))
+		return;
+
+	pthread_mutex_lock(&local_lock);
+	local_owned[ntohl(ip) & 0xffff] = 0;
+	pthread_mutex_unlock(&local_lock);
+	broadcast(CLUSTER_MSG_LEAVE, ip);
+}
+
+/*
+ * cluster_forward
+ *
+ * Sends a packet that has no local destination to the node that owns its
+ * destination address. Returns 0 if the packet was taken (it may still be
+ * dropped if the trunk is backed up), or -1 if no other node should get it,
+ * in which case the caller still owns p.
+ */
+int cluster_forward(struct pkt *p)
+{
+	unsigned int dest = ntohl(*(unsigned int*)(p->data + 16));
+	struct peer *peer;
+	int node;
+
+	if(!cluster_enabled() || (p->flags & PKT_FROM_PEER) || (p->data[0] >> 4) != 4)
+		return -1;
+	if((dest & 0xffff0000) != cluster_net)
+		return -1;
+
+	node = owner[dest & 0xffff];
+	node = (node != 0) ? node - 1 : partition_owner(dest);
+	if(node == self || (peer = peer_by_node[node]) == NULL)
+		return -1;
+
+	pthread_mutex_lock(&peer->lock);
+	peer_push(peer, p);
+	pthread_mutex_unlock(&peer->lock);
+	return 0;
+}
+
+/*
+ * cluster_in_partition
+ *
+ * Returns 1 if ip (network byte order) is in the slice of the pool this node
+ * hands out, or if this server is not part of a cluster.
+ */
+int cluster_in_partition(unsigned int ip)
+{
+	return !cluster_enabled() || partition_owner(ntohl(ip)) == self;
+}
+
+/*
+ * cluster_address_unclaimed
+ *
+ * Returns 1 if ip (network byte order) belongs to another node's slice but no
+ * node currently has a client using it. A client that moves here from a node
+ * that went down may then keep its address.
+ */
+int cluster_address_unclaimed(unsigned int ip)
+{
+	unsigned int host_ip = ntohl(ip);
+
+	if(!cluster_enabled() || (host_ip & 0xffff0000) != cluster_net)
+		return 0;
+	return partition_owner(host_ip) != self && owner[host_ip & 0xffff] == 0;
+}
+
+static void forget_node(int node)
+{
+	int i;
+
+	for(i = 0; i < 65536; i++)
+		if(owner[i] == node + 1)
+			owner[i] = 0;
+}
+
+/*
+ * apply_msg
+ *
+ * Updates the ownership table from a control message sent by node.
+ */
+static void apply_msg(int node, struct cluster_msg *msg)
+{
+	int n = (ntohs(msg->len) - sizeof(struct cluster_msg)) / sizeof(unsigned int);
+	int i;
+
+	switch(msg->type)
+	{
+	case CLUSTER_MSG_ANNOUNCE:
+		node_gen[node] = ntohl(msg->gen);
+		// Fall through
+	case CLUSTER_MSG_JOIN:
+		for(i = 0; i < n; i++)
+		{
+			unsigned int ip = ntohl(msg->addrs[i]);
+
+			if((ip & 0xffff0000) != cluster_net)
+				continue;
+			owner[ip & 0xffff] = node + 1;
+			owner_gen[ip & 0xffff] = node_gen[node];
+		}
+		break;
+	case CLUSTER_MSG_LEAVE:
+		for(i = 0; i < n; i++)
+		{
+			unsigned int ip = ntohl(msg->addrs[i]);
+
+			if((ip & 0xffff0000) == cluster_net && owner[ip & 0xffff] == node + 1)
+				owner[ip & 0xffff] = 0;
+		}
+		break;
+	case CLUSTER_MSG_END:
+		node_gen[node] = ntohl(msg->gen);
+		for(i = 0; i < 65536; i++)
+			if(owner[i] == node + 1 && owner_gen[i] != (unsigned short)node_gen[node])
+				owner[i] = 0;
+		break;
+	}
+}
+
+static int trunk_frame_len(const char *buf, int avail)
+{
+	const unsigned char *p = (const unsigned char*)buf;
+	int len;
+
+	if(avail < 1 || (p[0] >> 4) != 0xc)
+		return frame_len(buf, avail);
+	if(avail < 4)
+		return 0;
+	len = (p[2] << 8) | p[3];
+	return (len < (int)sizeof(struct cluster_msg)) ? -1 : len;
+}
+
+static int send_hello(int fd)
+{
+	struct cluster_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = CLUSTER_MSG_HELLO;
+	msg.node = self;
+	msg.len = htons(sizeof(msg));
+	return (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg)) ? 0 : -1;
+}
+
+static int recv_hello(int fd)
+{
+	struct cluster_msg msg;
+	int got = 0, n;
+
+	while(got < (int)sizeof(msg))
+	{
+		n = read(fd, (char*)&msg + got, sizeof(msg) - got);
+		if(n <= 0)
+			return -1;
+		got += n;
+	}
+	if(msg.type != CLUSTER_MSG_HELLO || msg.node >= nnodes || msg.node == self)
+		return -1;
+	return msg.node;
+}
+
+/*
+ * trunkThread
+ *
+ * Reads a trunk that a peer opened to us. Tunneled packets go to the
+ * scheduler like traffic from any local client. Control messages update the
+ * ownership table.
+ */
+static void *trunkThread(void *arg)
+{
+	int fd = (int)(long)arg;
+	char *buffer = malloc(2 * PKT_MAX_FRAME);
+	struct sched_queue rxq;
+	int rxlen = 0, node;
+	struct timeval timeout = { 5, 0 };
+
+	pthread_detach(pthread_self());
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if(buffer == NULL || (node = recv_hello(fd)) < 0 || send_hello(fd) < 0)
+	{
+		free(buffer);
+		close(fd);
+		return NULL;
+	}
+	timeout.tv_sec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	log_info("[cluster] Trunk from node %d up", node);
+	sched_queue_init(&rxq);
+
+	while(1)
+	{
+		int n, len, off = 0;
+
+		n = read(fd, buffer + rxlen, 2 * PKT_MAX_FRAME - rxlen);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+		rxlen += n;
+
+		while((len = trunk_frame_len(buffer + off, rxlen - off)) > 0 && len <= rxlen - off)
+		{
+			char *frame = buffer + off;
+
+			off += len;
+			if(((unsigned char)frame[0] >> 4) == 0xc)
+			{
+				apply_msg(node, (struct cluster_msg*)frame);
+			}
+			else
+			{
+				struct pkt *p = pkt_alloc(len);
+
+				if(p == NULL)
+					continue;
+				memcpy(p->data, frame, len);
+				p->prio = pkt_classify(frame, len);
+				p->flags |= PKT_FROM_PEER;
+				sched_enqueue(&rxq, p);
+			}
+		}
+		if(len < 0)
+			break;
+
+		memmove(buffer, buffer + off, rxlen - off);
+		rxlen -= off;
+	}
+
+	log_info("[cluster] Trunk from node %d down", node);
+	sched_queue_destroy(&rxq);
+	forget_node(node);
+	free(buffer);
+	close(fd);
+	return NULL;
+}
+
+static void *listenThread(void *arg)
+{
+	int sock_fd = (int)(long)arg;
+
+	while(1)
+	{
+		pthread_t th;
+		int fd = accept(sock_fd, NULL, NULL);
+
+		if(fd < 0)
+		{
+			if(errno != EINTR)
+				log_err("[cluster] accept(): %m");
+			continue;
+		}
+		if(pthread_create(&th, NULL, trunkThread, (void*)(long)fd) != 0)
+			close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * peerThread
+ *
+ * Keeps the outbound trunk to one peer connected and writes whatever is
+ * queued for it. Also sends a full announcement of our addresses every
+ * CLUSTER_ANNOUNCE_INTERVAL seconds.
+ */
+static void *peerThread(void *arg)
+{
+	struct peer *peer = (struct peer*)arg;
+
+	while(1)
+	{
+		struct timeval timeout = { 5, 0 };
+		time_t next_announce;
+		struct tune tune;
+		int fd, node;
+
+		if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		{
+			log_err("[cluster] socket(): %m");
+			sleep(1);
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		if(connect(fd, (struct sockaddr*)&peer->addr, sizeof(peer->addr)) < 0 || send_hello(fd) < 0 || (node = recv_hello(fd)) < 0)
+		{
+			close(fd);
+			sleep(1);
+			continue;
+		}
+		tune_init(&tune, fd);
+
+		pthread_mutex_lock(&peer->lock);
+		txq_purge(&peer->txq);
+		peer->node = node;
+		peer->connected = 1;
+		queue_full_announce(peer);
+		pthread_mutex_unlock(&peer->lock);
+		peer_by_node[node] = peer;
+		next_announce = time(NULL) + CLUSTER_ANNOUNCE_INTERVAL;
+		log_info("[cluster] Trunk to node %d (%s) up", node, peer->name);
+
+		while(1)
+		{
+			struct pollfd pfd;
+			int ret;
+
+			pthread_mutex_lock(&peer->lock);
+			if(time(NULL) >= next_announce)
+			{
+				queue_full_announce(peer);
+				next_announce = time(NULL) + CLUSTER_ANNOUNCE_INTERVAL;
+			}
+			ret = txq_flush(&peer->txq, fd);
+			if(ret == 0)
+			{
+				struct timespec until = { next_announce, 0 };
+
+				pthread_cond_timedwait(&peer->cond, &peer->lock, &until);
+			}
+			pthread_mutex_unlock(&peer->lock);
+
+			if(ret < 0)
+				break;
+			if(tune_update(&tune, fd, time(NULL)))
+				log_info("[cluster] Trunk to node %d is losing %u%% of what is sent, switching to %s", node, tune.loss, TUNE_CC);
+			if(ret == 0)
+				continue;
+
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			if(poll(&pfd, 1, 1000) > 0 && (pfd.revents & (POLLERR | POLLHUP)))
+				break;
+		}
+
+		log_info("[cluster] Trunk to node %d (%s) down", node, peer->name);
+		peer_by_node[node] = NULL;
+		pthread_mutex_lock(&peer->lock);
+		peer->connected = 0;
+		txq_purge(&peer->txq);
+		pthread_mutex_unlock(&peer->lock);
+		close(fd);
+		sleep(1);
+	}
+	return NULL;
+}
+
+/*
+ * cluster_init
+ *
+ * Makes this server node number node of nodes, serving the /16 starting at
+ * net (host byte order), and starts the trunk threads. Peers must already
+ * have been added with cluster_add_peer(). Trunks from peers are accepted on
+ * port.
+ */
+void cluster_init(int node, int nodes, unsigned int net, unsigned short port)
+{
+	struct sockaddr_in local;
+	pthread_t th;
+	int sock_fd, optval = 1, i;
+
+	self = node;
+	nnodes = nodes;
+	cluster_net = net;
+	cluster_port = port;
+
+	if((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		log_err("[cluster] socket(): %m");
+		exit(1);
+	}
+	setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+	// A new server taking over from this one during an upgrade binds
+	// the port while we still hold it. Peers reconnect once we are gone.
+	setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = htons(cluster_port);
+	if(bind(sock_fd, (struct sockaddr*)&local, sizeof(local)) < 0 || listen(sock_fd, CLUSTER_MAX_NODES) < 0)
+	{
+		log_err("[cluster] bind(): %m");
+		exit(1);
+	}
+
+	pthread_create(&th, NULL, listenThread, (void*)(long)sock_fd);
+	for(i = 0; i < npeers; i++)
+		pthread_create(&peers[i]->thread, NULL, peerThread, peers[i]);
+
+	log_info("[cluster] Node %d of %d, trunk port %d, %d peers", self, nnodes, cluster_port, npeers);
+}
@@ -0,0 +1,68 @@
+/* simplevpn-cluster.h -- Forwarding between cooperating server nodes */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_CLUSTER_H
+#define SIMPLEVPN_CLUSTER_H
+
+#include "simplevpn-pkt.h"
+
+#define CLUSTER_MAX_NODES 64
+#define CLUSTER_MAX_PEERS (CLUSTER_MAX_NODES - 1)
+
+// Seconds between full announcements of the addresses a node owns.
+#define CLUSTER_ANNOUNCE_INTERVAL 10
+
+// Cluster control messages share the trunk stream with tunneled packets. Their
+// first nibble (0xc) can't be mistaken for an IP version.
+#define CLUSTER_MSG_HELLO    0xc1
+#define CLUSTER_MSG_ANNOUNCE 0xc2
+#define CLUSTER_MSG_END      0xc3
+#define CLUSTER_MSG_JOIN     0xc4
+#define CLUSTER_MSG_LEAVE    0xc5
+
+/*
+ * struct cluster_msg
+ *
+ * Header of a control message on a trunk. HELLO carries no addresses. An
+ * ANNOUNCE lists addresses owned by the sender as of generation gen, and the
+ * END that follows the last ANNOUNCE chunk tells the receiver to forget any
+ * address of the sender's that was not in that generation.
+ */
+struct cluster_msg
+{
+	unsigned char type;
+	unsigned char node;
+	unsigned short len;	// Total length, network byte order
+	unsigned int gen;	// Network byte order
+	unsigned int addrs[];	// Network byte order
+};
+
+int cluster_add_peer(const char *hostport);
+void cluster_init(int node, int nodes, unsigned int net, unsigned short port);
+int cluster_enabled(void);
+void cluster_partition(unsigned int *start, unsigned int *end);
+
+void cluster_join(unsigned int ip);
+void cluster_leave(unsigned int ip);
+int cluster_forward(struct pkt *p);
+int cluster_in_partition(unsigned int ip);
+int cluster_address_unclaimed(unsigned int ip);
+
+#endif
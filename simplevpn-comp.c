@@ -0,0 +1,440 @@
+/* simplevpn-comp.c -- Compressing the headers of tunneled packets */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <netinet/in.h>
+#include "simplevpn-comp.h"
+
+// Fields a COMP_DELTA frame carries changes to, in the order they follow
+// the byte saying which are there. Each change is a byte from 1 to 255, or
+// 0 and two more bytes.
+#define CH_ID    0x01	// IP ID went up by something other than 1
+#define CH_SEQ   0x02
+#define CH_ACK   0x04
+#define CH_WIN   0x08
+#define CH_TSVAL 0x10
+#define CH_TSECR 0x20
+#define CH_PSH   0x40	// Not a change. PSH is set on this segment
+
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+#define TCPOPT_TS     8
+#define TCPOPT_TS_LEN 10
+
+static unsigned int get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+void comp_init(struct comp *c)
+{
+	memset(c, 0, sizeof(struct comp));
+}
+
+/*
+ * header_len
+ *
+ * Returns the length of the IP and TCP or UDP header of the packet in b,
+ * or 0 if the packet isn't one we compress.
+ */
+static int header_len(const unsigned char *b, int len)
+{
+	int hlen;
+
+	if(len < 20 || b[0] != 0x45 || get16(b + 2) != len || (get16(b + 6) & 0x3fff) != 0)
+		return 0;
+	switch(b[9])
+	{
+	case IPPROTO_TCP:
+		if(len < 40)
+			return 0;
+		hlen = 20 + (b[32] >> 4) * 4;
+		if(hlen < 40 || hlen > len || (b[33] & ~TCP_PSH) != TCP_ACK)
+			return 0;
+		return hlen;
+	case IPPROTO_UDP:
+		return (len >= 28) ? 28 : 0;
+	}
+	return 0;
+}
+
+/*
+ * find_ts
+ *
+ * Returns the offset of the timestamp option in the TCP header in b, or -1
+ * if there isn't one.
+ */
+static int find_ts(const unsigned char *b, int hlen)
+{
+	int off = 40;
+
+	while(off < hlen)
+	{
+		if(b[off] == 0)
+			break;
+		if(b[off] == 1)
+		{
+			off++;
+			continue;
+		}
+		if(off + 1 >= hlen || b[off + 1] < 2)
+			break;
+		if(b[off] == TCPOPT_TS && b[off + 1] == TCPOPT_TS_LEN && off + TCPOPT_TS_LEN <= hlen)
+			return off;
+		off += b[off + 1];
+	}
+	return -1;
+}
+
+static unsigned char *put_change(unsigned char *o, unsigned int d)
+{
+	if(d >= 1 && d <= 255)
+		*o++ = d;
+	else
+	{
+		*o++ = 0;
+		*o++ = d >> 8;
+		*o++ = d;
+	}
+	return o;
+}
+
+static const unsigned char *get_change(const unsigned char *q, const unsigned char *end, unsigned int *d)
+{
+	if(q >= end)
+		return NULL;
+	if(*q != 0)
+	{
+		*d = *q;
+		return q + 1;
+	}
+	if(q + 3 > end)
+		return NULL;
+	*d = get16(q + 1);
+	return q + 3;
+}
+
+/*
+ * delta
+ *
+ * Writes what changed between the header in slot s and the one in b to o,
+ * starting with the byte saying which fields did. Returns the number of
+ * bytes written, or -1 if the header can't be sent as changes.
+ */
+static int delta(struct comp_slot *s, const unsigned char *b, int hlen, unsigned char *o)
+{
+	const unsigned char *old = s->hdr;
+	unsigned char *start = o, *mask = o++;
+	unsigned int d;
+	int ts;
+
+	// TOS, DF, TTL and everything after the TCP checksum but the
+	// timestamps must be as they were.
+	if(s->hlen != hlen || memcmp(old, b, 2) != 0 || memcmp(old + 6, b + 6, 4) != 0)
+		return -1;
+
+	*mask = 0;
+	if((d = (get16(b + 4) - get16(old + 4)) & 0xffff) != 1)
+	{
+		*mask |= CH_ID;
+		o = put_change(o, d);
+	}
+
+	if(b[9] == IPPROTO_UDP)
+	{
+		memcpy(o, b + 26, 2);
+		return o + 2 - start;
+	}
+
+	if(old[32] != b[32] || (old[33] & ~TCP_PSH) != (b[33] & ~TCP_PSH) || memcmp(old + 38, b + 38, 2) != 0)
+		return -1;
+	if((ts = find_ts(b, hlen)) < 0)
+	{
+		if(memcmp(old + 40, b + 40, hlen - 40) != 0)
+			return -1;
+	}
+	else if(memcmp(old + 40, b + 40, ts + 2 - 40) != 0 || memcmp(old + ts + TCPOPT_TS_LEN, b + ts + TCPOPT_TS_LEN, hlen - ts - TCPOPT_TS_LEN) != 0)
+		return -1;
+
+	if((d = get32(b + 24) - get32(old + 24)) > 0xffff)
+		return -1;
+	if(d != 0)
+	{
+		*mask |= CH_SEQ;
+		o = put_change(o, d);
+	}
+	if((d = get32(b + 28) - get32(old + 28)) > 0xffff)
+		return -1;
+	if(d != 0)
+	{
+		*mask |= CH_ACK;
+		o = put_change(o, d);
+	}
+	if((d = (get16(b + 34) - get16(old + 34)) & 0xffff) != 0)
+	{
+		*mask |= CH_WIN;
+		o = put_change(o, d);
+	}
+	if(ts >= 0)
+	{
+		if((d = get32(b + ts + 2) - get32(old + ts + 2)) > 0xffff)
+			return -1;
+		if(d != 0)
+		{
+			*mask |= CH_TSVAL;
+			o = put_change(o, d);
+		}
+		if((d = get32(b + ts + 6) - get32(old + ts + 6)) > 0xffff)
+			return -1;
+		if(d != 0)
+		{
+			*mask |= CH_TSECR;
+			o = put_change(o, d);
+		}
+	}
+	if(b[33] & TCP_PSH)
+		*mask |= CH_PSH;
+	memcpy(o, b + 36, 2);
+	return o + 2 - start;
+}
+
+/*
+ * comp_compress
+ *
+ * Rewrites p, which is about to be written to the connection c belongs to,
+ * as a COMP_FULL or COMP_DELTA frame if it is a packet we compress. Returns
+ * the number of bytes p got shorter by.
+ */
+int comp_compress(struct comp *c, struct pkt *p)
+{
+	unsigned char *b = (unsigned char*)p->data, hdr[32];
+	struct comp_slot *s = NULL;
+	int hlen, i, n, len, reuse = 0, saved;
+
+	if((hlen = header_len(b, p->len)) == 0)
+		return 0;
+
+	c->clock++;
+	for(i = 0; i < COMP_SLOTS; i++)
+	{
+		s = &c->tx[i];
+		if(s->hlen != 0 && s->hdr[9] == b[9] && memcmp(s->hdr + 12, b + 12, 12) == 0)
+			break;
+		// Otherwise the flow gets an empty slot, or the one that has
+		// gone unused longest.
+		if(c->tx[reuse].hlen != 0 && (s->hlen == 0 || (unsigned short)(c->clock - s->used) > (unsigned short)(c->clock - c->tx[reuse].used)))
+			reuse = i;
+	}
+
+	if(i < COMP_SLOTS && (n = delta(s, b, hlen, hdr + 3)) >= 0 && (len = 3 + n + p->len - hlen) <= COMP_MAX_LEN)
+	{
+		memcpy(s->hdr, b, hlen);
+		s->used = c->clock;
+		hdr[0] = (COMP_DELTA << 4) | (len >> 8);
+		hdr[1] = len;
+		hdr[2] = i;
+		memmove(b + 3 + n, b + hlen, p->len - hlen);
+		memcpy(b, hdr, 3 + n);
+		saved = p->len - len;
+		p->len = len;
+		return saved;
+	}
+
+	if(i == COMP_SLOTS)
+		i = reuse;
+	s = &c->tx[i];
+	memcpy(s->hdr, b, hlen);
+	s->hlen = hlen;
+	s->used = c->clock;
+	b[0] = (COMP_FULL << 4) | i;
+	return 0;
+}
+
+/*
+ * comp_frame_len
+ *
+ * Like frame_len() for a connection that compresses, for a frame with hdr
+ * bytes in front of it. The length returned includes them.
+ */
+int comp_frame_len(const char *buf, int avail, int hdr)
+{
+	const unsigned char *p = (const unsigned char*)buf + hdr;
+	int len;
+
+	if(avail <= hdr)
+		return 0;
+	switch(p[0] >> 4)
+	{
+	case COMP_FULL:
+		if(avail < hdr + 4)
+			return 0;
+		len = get16(p + 2);
+		return (len < 28) ? -1 : hdr + len;
+	case COMP_DELTA:
+		if(avail < hdr + 2)
+			return 0;
+		len = ((p[0] & 0xf) << 8) | p[1];
+		return (len < 6) ? -1 : hdr + len;
+	}
+	if((len = frame_len(buf + hdr, avail - hdr)) <= 0)
+		return len;
+	return hdr + len;
+}
+
+static unsigned int ip_cksum(const unsigned char *b)
+{
+	unsigned int sum = 0;
+	int i;
+
+	for(i = 0; i < 20; i += 2)
+		sum += get16(b + i);
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+/*
+ * comp_expand
+ *
+ * Turns frame, len bytes received on the connection c belongs to, back into
+ * an IP packet. A COMP_FULL frame is fixed up where it is and any other
+ * frame but COMP_DELTA is left alone, and *out points into frame. A
+ * COMP_DELTA frame is expanded into scratch, which must have room for len +
+ * COMP_GROWTH bytes. Returns the length of the packet, or -1 if the frame
+ * doesn't make sense, in which case the slots can't be trusted any more.
+ */
+int comp_expand(struct comp *c, char *frame, int len, char **out, char *scratch)
+{
+	unsigned char *b = (unsigned char*)frame, h[COMP_HDR_MAX];
+	const unsigned char *q, *end = b + len;
+	struct comp_slot *s;
+	unsigned int d, mask;
+	int hlen, ts, total;
+
+	*out = frame;
+	switch(b[0] >> 4)
+	{
+	case COMP_FULL:
+		s = &c->rx[b[0] & 0xf];
+		b[0] = 0x45;
+		if((hlen = header_len(b, len)) == 0)
+			return -1;
+		memcpy(s->hdr, b, hlen);
+		s->hlen = hlen;
+		return len;
+	case COMP_DELTA:
+		break;
+	default:
+		return len;
+	}
+
+	if(len < 6 || b[2] >= COMP_SLOTS || (s = &c->rx[b[2]])->hlen == 0)
+		return -1;
+	hlen = s->hlen;
+	memcpy(h, s->hdr, hlen);
+	mask = b[3];
+	q = b + 4;
+
+	d = 1;
+	if((mask & CH_ID) && (q = get_change(q, end, &d)) == NULL)
+		return -1;
+	put16(h + 4, get16(h + 4) + d);
+
+	if(h[9] == IPPROTO_TCP)
+	{
+		if(mask & CH_SEQ)
+		{
+			if((q = get_change(q, end, &d)) == NULL)
+				return -1;
+			put32(h + 24, get32(h + 24) + d);
+		}
+		if(mask & CH_ACK)
+		{
+			if((q = get_change(q, end, &d)) == NULL)
+				return -1;
+			put32(h + 28, get32(h + 28) + d);
+		}
+		if(mask & CH_WIN)
+		{
+			if((q = get_change(q, end, &d)) == NULL)
+				return -1;
+			put16(h + 34, get16(h + 34) + d);
+		}
+		ts = find_ts(h, hlen);
+		if((mask & (CH_TSVAL | CH_TSECR)) && ts < 0)
+			return -1;
+		if(mask & CH_TSVAL)
+		{
+			if((q = get_change(q, end, &d)) == NULL)
+				return -1;
+			put32(h + ts + 2, get32(h + ts + 2) + d);
+		}
+		if(mask & CH_TSECR)
+		{
+			if((q = get_change(q, end, &d)) == NULL)
+				return -1;
+			put32(h + ts + 6, get32(h + ts + 6) + d);
+		}
+		h[33] = (mask & CH_PSH) ? (h[33] | TCP_PSH) : (h[33] & ~TCP_PSH);
+		if(q + 2 > end)
+			return -1;
+		memcpy(h + 36, q, 2);
+	}
+	else
+	{
+		if(q + 2 > end)
+			return -1;
+		memcpy(h + 26, q, 2);
+	}
+	q += 2;
+
+	total = hlen + (end - q);
+	put16(h + 2, total);
+	if(h[9] == IPPROTO_UDP)
+		put16(h + 24, total - 20);
+	put16(h + 10, 0);
+	put16(h + 10, ip_cksum(h));
+
+	memcpy(s->hdr, h, hlen);
+	memcpy(scratch, h, hlen);
+	memcpy(scratch + hlen, q, end - q);
+	*out = scratch;
+	return total;
+}
@@ -0,0 +1,98 @@
+/* simplevpn-comp.h -- Compressing the headers of tunneled packets */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_COMP_H
+#define SIMPLEVPN_COMP_H
+
+#include "simplevpn-pkt.h"
+
+/*
+ * Most of the IPv4 and TCP or UDP header of a packet is the same as that of
+ * the packet before it in the same flow. On a connection where both sides
+ * agreed to it (ADDR_FLAG_COMPRESS), the sender keeps the last header of
+ * each of up to COMP_SLOTS flows and sends only what changed, the way Van
+ * Jacobson compression does on serial links (RFC 1144). The receiver keeps
+ * the same headers and puts the packets back together. A TCP acknowledgment
+ * with timestamps goes from 52 bytes to about 12.
+ *
+ * A connection is a reliable stream, so both ends see the same packets in
+ * the same order and their slots can't drift apart. Each connection, and
+ * each stream of a striped tunnel, has slots of its own for each direction,
+ * and they start out empty on every new connection. Packets are compressed
+ * as they are written, after the txq has put them in order.
+ *
+ * Besides plain IP packets, a compressing connection carries two kinds of
+ * frames, told apart by the first 4 bits:
+ *
+ *   COMP_FULL   The whole packet, with 0x7s in place of the 0x45 it
+ *               starts with. Its header goes in slot s. Used for the
+ *               first packet of a flow and whenever a header has changed
+ *               in a way that can't be compressed.
+ *
+ *   COMP_DELTA  0x8 and 12 bits of frame length, the slot, a byte saying
+ *               which fields changed, the changes, the TCP or UDP checksum
+ *               and the payload.
+ *
+ * Packets that aren't IPv4 TCP or UDP, fragments and TCP segments with
+ * flags other than ACK and PSH go as they are.
+ */
+#define COMP_SLOTS   16
+#define COMP_HDR_MAX (20 + 60)	// IPv4 header without options, TCP header with
+#define COMP_MAX_LEN 4095	// Longest COMP_DELTA frame
+
+#define COMP_FULL  0x7
+#define COMP_DELTA 0x8
+
+// Bytes a COMP_DELTA frame can grow by when it is expanded.
+#define COMP_GROWTH COMP_HDR_MAX
+
+/*
+ * struct comp_slot
+ *
+ * The last header of one flow. An empty slot has hlen 0.
+ */
+struct comp_slot
+{
+	unsigned char hdr[COMP_HDR_MAX];
+	unsigned char hlen;
+	unsigned char reserved;
+	unsigned short used;	// When the slot was last used, to pick one to reuse
+};
+
+/*
+ * struct comp
+ *
+ * Compression state of one connection. tx is only touched by whoever
+ * flushes the connection's txq and rx by whoever reads from it.
+ */
+struct comp
+{
+	struct comp_slot tx[COMP_SLOTS];
+	struct comp_slot rx[COMP_SLOTS];
+	unsigned short clock;
+	unsigned short reserved;
+};
+
+void comp_init(struct comp *c);
+int comp_frame_len(const char *buf, int avail, int hdr);
+int comp_compress(struct comp *c, struct pkt *p);
+int comp_expand(struct comp *c, char *frame, int len, char **out, char *scratch);
+
+#endif
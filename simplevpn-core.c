@@ -0,0 +1,801 @@
+/* simplevpn-core.c -- Server logic that doesn't depend on the transport */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "simplevpn-core.h"
+#include "simplevpn-pool.h"
+#include "simplevpn-lease.h"
+#include "simplevpn-route.h"
+#include "simplevpn-cluster.h"
+#include "simplevpn-cap.h"
+#include "simplevpn-p2p.h"
+#include "simplevpn-log.h"
+
+struct ip_header
+{
+	char vers;
+	char ip_header_len;
+	short packet_len;
+	short id;
+	short fragment_offset;
+	char ttl;
+	char protocol;
+	short cksum;
+	int source_ip;
+	int dest_ip;
+};
+
+static unsigned int range_low, range_high;	// Host byte order
+
+static const struct core_io *io;
+static unsigned int core_netmask;
+static int core_mtu;
+static struct core_stats stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int tx_pending = 0;	// Peers with a non-empty txq
+
+// Clients that haven't got an address yet, and the rest. Each list is in
+// order of when we last heard from its clients, so the ones due to time out
+// are always at the front. The streams of a striped client that have no
+// address of their own count as having one.
+#define LIST_JOINING 0
+#define LIST_JOINED  1
+static struct core_peer *list_head[2], *list_tail[2];
+
+/*
+ * core_pool_init
+ *
+ * Fills the address pool with the usable addresses between start and end
+ * (host byte order), skipping network and broadcast style addresses.
+ */
+void core_pool_init(unsigned int start, unsigned int end, unsigned int mask)
+{
+	range_low = start;
+	range_high = end;
+
+	pool_init(start);
+	while(start <= end)
+	{
+		pool_add(start++);
+
+		while((start & mask) == start)
+			start++;
+
+		// Low-order byte of the address can't be 255
+		if((start & 0xff) == 0xff || (start & 0xff) == 0)
+			start++;
+		if((start & 0xff00) == 0xff00 || (start & 0xff00) == 0)
+			start += 0x0100;
+	}
+}
+
+/*
+ * core_in_range
+ *
+ * Returns 1 if ip (network byte order) is between the first and last
+ * address of the pool.
+ */
+int core_in_range(unsigned int ip)
+{
+	ip = ntohl(ip);
+	return ip >= range_low && ip <= range_high;
+}
+
+/*
+ * core_frame_kind
+ *
+ * Returns what the frame of len bytes in buf is, one of CORE_*.
+ */
+int core_frame_kind(const char *buf, int len)
+{
+	const struct ip_header *iphdr = (const struct ip_header*)buf;
+
+	if(len < 20 || (buf[0] >> 4) != 4)
+		return CORE_IGNORE;
+	if(iphdr->source_ip == 0 && iphdr->dest_ip == 0)
+		return CORE_ADDR_REQ;
+	if(iphdr->dest_ip == 0)
+		return CORE_STATIC_REQ;
+	if(iphdr->source_ip == -1 && iphdr->dest_ip == -1)
+	{
+		if((unsigned char)iphdr->protocol == CTL_PROTO && len >= (int)CTL_MSG_LEN &&
+		   ((const struct ctl_msg*)(buf + 20))->type == CTL_STRIPE_JOIN)
+			return CORE_JOIN;
+		return CORE_KEEPALIVE;
+	}
+	return CORE_DATA;
+}
+
+/*
+ * core_addr_streams
+ *
+ * Returns how many streams the client that sent the address request in buf
+ * would like to stripe over.
+ */
+int core_addr_streams(const char *buf, int len)
+{
+	if(len < (int)ADDR_REQ_LEN)
+		return 1;
+	return ntohs(((const struct addr_req_opts*)(buf + 20))->streams);
+}
+
+/*
+ * core_addr_flags
+ *
+ * Returns the ADDR_FLAG_* bits at the end of the address request in buf, or
+ * -1 if the client is too old to send any.
+ */
+int core_addr_flags(const char *buf, int len)
+{
+	unsigned int flags;
+	int n;
+
+	if(len < (int)ADDR_REQ_LEN)
+		return -1;
+	n = ntohs(((const struct addr_req_opts*)(buf + 20))->subnets);
+	if(n > ADDR_MAX_SUBNETS || len < (int)(ADDR_REQ_LEN + n * sizeof(struct addr_subnet) + sizeof(flags)))
+		return -1;
+	memcpy(&flags, buf + ADDR_REQ_LEN + n * sizeof(struct addr_subnet), sizeof(flags));
+	return ntohl(flags) & 0x7fffffff;
+}
+
+/*
+ * core_addr_reply
+ *
+ * Builds the answer to the address request req in reply, which must have
+ * room for ADDR_REPLY_MAX bytes: the request's header with address ip in
+ * the destination field, followed by the interface settings. netmask is in
+ * host byte order. streams is 0 unless the client may stripe. flags are the
+ * ADDR_FLAG_* bits granted, or -1 to leave them out for a client that sent
+ * none. Returns the length of the reply.
+ */
+int core_addr_reply(char *reply, const char *req, unsigned int ip, unsigned int netmask, int mtu, int streams, int flags)
+{
+	struct ip_header *iphdr = (struct ip_header*)reply;
+	struct addr_reply_opts *opts = (struct addr_reply_opts*)(reply + 20);
+	unsigned int word = htonl(flags);
+	int len = (flags < 0) ? ADDR_REPLY_LEN : ADDR_REPLY_MAX;
+
+	memcpy(reply, req, 20);
+	iphdr->packet_len = htons(len);
+	iphdr->source_ip = 0;
+	iphdr->dest_ip = ip;
+	opts->netmask = htonl(netmask);
+	opts->mtu = htons(mtu);
+	opts->streams = htons(streams);
+	if(flags >= 0)
+		memcpy(reply + ADDR_REPLY_LEN, &word, sizeof(word));
+	return len;
+}
+
+/*
+ * core_grant
+ *
+ * Returns an address for a client at internet address inet_ip: the one it
+ * had before a restart, or any free one. Returns 0 if the pool is empty.
+ */
+unsigned int core_grant(unsigned int inet_ip)
+{
+	unsigned int ip = lease_take(inet_ip);
+
+	return (ip != 0) ? ip : pool_grant();
+}
+
+/*
+ * core_claim
+ *
+ * Takes address ip, which a client asked for by name, if it is free.
+ * Returns 1 if it was.
+ */
+int core_claim(unsigned int ip)
+{
+	return pool_claim(ip) || lease_claim(ip);
+}
+
+/*
+ * core_release
+ *
+ * Gives back the address of a client that has gone away. Returns 1 if it
+ * went back into the pool.
+ */
+int core_release(unsigned int ip)
+{
+	lease_end(ip);
+	return pool_release(ip);
+}
+
+static void list_unlink(struct core_peer *peer)
+{
+	int l = peer->list;
+
+	if(peer->prev != NULL)
+		peer->prev->next = peer->next;
+	else
+		list_head[l] = peer->next;
+	if(peer->next != NULL)
+		peer->next->prev = peer->prev;
+	else
+		list_tail[l] = peer->prev;
+}
+
+static void list_append(struct core_peer *peer)
+{
+	int l = (peer->ip != -1 || peer->striped) ? LIST_JOINED : LIST_JOINING;
+
+	peer->list = l;
+	peer->next = NULL;
+	peer->prev = list_tail[l];
+	if(list_tail[l] != NULL)
+		list_tail[l]->next = peer;
+	else
+		list_head[l] = peer;
+	list_tail[l] = peer;
+}
+
+/*
+ * relist
+ *
+ * Moves peer to the idle list it belongs on now, unless it has timed out.
+ */
+static void relist(struct core_peer *peer)
+{
+	if(peer->list < 0)
+		return;
+	list_unlink(peer);
+	list_append(peer);
+}
+
+/*
+ * touch
+ *
+ * Notes that we heard from peer at time now. Everything behind a peer in
+ * its list was heard from at the same time or later, so if that was now as
+ * well it can stay where it is. Under load that saves taking the lock for
+ * every packet. Returns -1 if peer has already timed out.
+ */
+static int touch(struct core_peer *peer, time_t now)
+{
+	int ret = 0;
+
+	if(peer->last_rx == now)
+		return 0;
+	core_lock();
+	if(peer->list < 0)
+		ret = -1;
+	else
+	{
+		peer->last_rx = now;
+		relist(peer);
+	}
+	core_unlock();
+	return ret;
+}
+
+void core_init(const struct core_io *transport, unsigned int netmask, int mtu)
+{
+	io = transport;
+	core_netmask = netmask;
+	core_mtu = mtu;
+	memset(&stats, 0, sizeof(stats));
+	list_head[LIST_JOINING] = list_tail[LIST_JOINING] = NULL;
+	list_head[LIST_JOINED] = list_tail[LIST_JOINED] = NULL;
+}
+
+void core_lock(void)
+{
+	pthread_mutex_lock(&lock);
+}
+
+void core_unlock(void)
+{
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * core_peer_init
+ *
+ * Sets up peer for a client that connected from inet_ip at time now. conn
+ * is whatever the transport wants back in its callbacks. Packets from the
+ * client are charged to budget, if there is one, and at most txq_limit
+ * bytes may wait to be written to it.
+ */
+void core_peer_init(struct core_peer *peer, void *conn, unsigned int inet_ip, struct mem_budget *budget, int txq_limit, time_t now)
+{
+	peer->conn = conn;
+	peer->ip = -1;
+	peer->inet_ip = inet_ip;
+	peer->striped = 0;
+	peer->last_rx = now;
+	peer->budget = budget;
+	sched_queue_init(&peer->rxq);
+	sched_apply_limits(&peer->rxq, -1);
+	txq_init(&peer->txq, txq_limit);
+
+	core_lock();
+	list_append(peer);
+	stats.peers++;
+	core_unlock();
+}
+
+/*
+ * core_find
+ *
+ * Returns the connected peer with VPN address ip, or NULL. Must be called
+ * with the core lock held.
+ */
+struct core_peer *core_find(unsigned int ip)
+{
+	struct core_peer *peer = route_lookup(ip);
+
+	return (peer != NULL && peer->ip == ip) ? peer : NULL;
+}
+
+/*
+ * core_unassign
+ *
+ * Takes peer's VPN address away from it and puts it back in the pool. Must
+ * be called with the core lock held.
+ */
+void core_unassign(struct core_peer *peer)
+{
+	if(peer->ip == -1)
+		return;
+	cluster_leave(peer->ip);
+	route_del(peer->ip, 32, peer);
+	core_release(peer->ip);
+	peer->ip = -1;
+	relist(peer);
+}
+
+/*
+ * core_assign
+ *
+ * Gives peer the VPN address ip and routes it there. An address peer had
+ * before goes back in the pool. Returns -1, and leaves peer as it was, if
+ * ip is already routed to another peer. Must be called with the core lock
+ * held.
+ */
+int core_assign(struct core_peer *peer, unsigned int ip)
+{
+	if(ip == peer->ip)
+		return 0;
+	if(route_add(ip, 32, peer) < 0)
+	{
+		log_warn("Could not route %08x", ntohl(ip));
+		return -1;
+	}
+	core_unassign(peer);
+	peer->ip = ip;
+	relist(peer);
+	sched_apply_limits(&peer->rxq, ip);
+	cluster_join(ip);
+	stats.joins++;
+	return 0;
+}
+
+/*
+ * core_queue
+ *
+ * Appends p to the packets waiting to be written to peer. Packets are
+ * dropped if too much is already waiting. On a striped stream every packet
+ * goes out with a sequence number, which is 0 unless the caller numbered
+ * it. Must be called with the core lock held.
+ */
+void core_queue(struct core_peer *peer, struct pkt *p)
+{
+	int was_empty = txq_empty(&peer->txq);
+
+	if(peer->striped)
+		p->flags |= PKT_SEQ;
+	else
+		p->flags &= ~PKT_SEQ;
+
+	if(txq_push(&peer->txq, p) == 0 && was_empty)
+		tx_pending++;
+}
+
+/*
+ * core_queue_partial
+ *
+ * Puts p, the rest of a packet peer has already seen the start of, at the
+ * front of its txq. Must be called with the core lock held.
+ */
+void core_queue_partial(struct core_peer *peer, struct pkt *p)
+{
+	if(txq_empty(&peer->txq))
+		tx_pending++;
+	txq_push_partial(&peer->txq, p);
+}
+
+/*
+ * core_flush
+ *
+ * Writes as much of peer's txq as will go without blocking. Whatever
+ * doesn't fit goes out on a later call. If the connection is dead the
+ * queue is thrown away and the transport will notice and clean up. Must be
+ * called with the core lock held.
+ */
+void core_flush(struct core_peer *peer)
+{
+	if(txq_empty(&peer->txq))
+		return;
+	if(io->flush(peer) <= 0)
+		tx_pending--;
+}
+
+/*
+ * core_reply
+ *
+ * Sends a control message (address assignment, keepalive) back to peer.
+ * This goes through the same txq as forwarded traffic so it can't land in
+ * the middle of a partly written packet. Must be called with the core lock
+ * held.
+ */
+void core_reply(struct core_peer *peer, const char *buf, int len)
+{
+	struct pkt *p = pkt_alloc(len);
+
+	if(p == NULL)
+		return;
+	memcpy(p->data, buf, len);
+	p->prio = PKT_PRIO_INTERACTIVE;
+	core_queue(peer, p);
+	core_flush(peer);
+}
+
+/*
+ * core_tx_pending
+ *
+ * Returns how many peers have packets waiting to be written to them. Must
+ * be called with the core lock held.
+ */
+int core_tx_pending(void)
+{
+	return tx_pending;
+}
+
+/*
+ * answer
+ *
+ * Replies to the address request req now that peer has its address. Must
+ * be called with the core lock held.
+ */
+static void answer(struct core_peer *peer, const char *req, int len)
+{
+	char reply[ADDR_REPLY_MAX];
+
+	if(io->answer != NULL)
+		io->answer(peer, req, len);
+	else
+		core_reply(peer, reply, core_addr_reply(reply, req, peer->ip, core_netmask, core_mtu, 0, core_addr_flags(req, len) < 0 ? -1 : 0));
+}
+
+/*
+ * core_input
+ *
+ * Deals with one frame that arrived from peer at time now. Address requests
+ * and keepalives are answered right away. Everything else is queued for
+ * core_forward(). Returns -1 if the client should be disconnected, in which
+ * case the transport closes its connection and calls core_peer_gone().
+ */
+int core_input(struct core_peer *peer, const char *buf, int len, time_t now)
+{
+	const struct ip_header *iphdr = (const struct ip_header*)buf;
+	int kind = core_frame_kind(buf, len), claimed;
+	unsigned int ip;
+	struct pkt *p;
+
+	if(touch(peer, now) < 0)
+		return -1;
+	if(kind == CORE_IGNORE)
+		return 0;	// Only IPv4 is routed on the VPN
+
+	// The extra streams of a striped client only have the address of
+	// their first stream, and only carry its traffic.
+	if(peer->striped && peer->ip == -1 && (kind == CORE_ADDR_REQ || kind == CORE_STATIC_REQ))
+		return -1;
+
+	switch(kind)
+	{
+	case CORE_ADDR_REQ:
+		// If the client does not already have an address, give it back
+		// the one it had before a restart, or take one from the pool.
+		// Only the transport's thread for peer writes peer->ip, so it
+		// can be read without the lock here.
+		ip = 0;
+		if(peer->ip == -1 && (ip = core_grant(peer->inet_ip)) == 0)
+		{
+			log_err("Address pool exhausted");
+			core_lock();
+			stats.refused++;
+			core_unlock();
+			return -1;
+		}
+
+		core_lock();
+		if(ip != 0 && core_assign(peer, ip) < 0)
+		{
+			stats.refused++;
+			core_unlock();
+			core_release(ip);
+			return -1;
+		}
+		// Otherwise, just respond with the address it already has.
+		log_info("Got address request. Assigning 0x%08x", ntohl(peer->ip));
+		answer(peer, buf, len);
+		core_unlock();
+		lease_grant(peer->ip, peer->inet_ip);
+		return 0;
+
+	case CORE_STATIC_REQ:
+		// Take the requested address out of the pool. Addresses from
+		// another node's slice were never in it, and may be taken if
+		// no node has a client using them.
+		ip = iphdr->source_ip;
+		core_lock();
+		if(ip != peer->ip)
+		{
+			claimed = core_claim(ip);
+			if(!(claimed || (cluster_address_unclaimed(ip) && core_find(ip) == NULL)) || core_assign(peer, ip) < 0)
+			{
+				// Address in use. The client goes, and any
+				// address it had goes back in the pool.
+				log_err("Client requested a static address that is already in use: %08x", ntohl(ip));
+				if(claimed)
+					core_release(ip);
+				core_unassign(peer);
+				stats.refused++;
+				core_unlock();
+				return -1;
+			}
+		}
+		answer(peer, buf, len);
+		core_unlock();
+		lease_grant(peer->ip, peer->inet_ip);
+		return 0;
+
+	case CORE_JOIN:
+		// An extra stream of a striped client.
+		if(io->join == NULL)
+			return -1;
+		core_lock();
+		if(peer->ip != -1 || peer->striped || io->join(peer, buf, len) < 0)
+		{
+			core_unlock();
+			return -1;
+		}
+		peer->striped = 1;
+		relist(peer);
+		core_unlock();
+		return 0;
+
+	case CORE_KEEPALIVE:
+		core_lock();
+		stats.keepalives++;
+		core_reply(peer, buf, len);
+		core_unlock();
+		return 0;
+	}
+
+	// If the client has a self-assigned address in the pool's range,
+	// then record it. An address another client has stays with that
+	// client, and the packet is dropped.
+	if(!peer->striped && iphdr->dest_ip != -1 && iphdr->source_ip != peer->ip && core_in_range(iphdr->source_ip))
+	{
+		ip = iphdr->source_ip;
+		if((claimed = core_claim(ip)))
+			log_warn("Client has self-assigned IP that is in free list: %08x...", ntohl(ip));
+		core_lock();
+		if(core_assign(peer, ip) < 0)
+		{
+			core_unlock();
+			if(claimed)
+				core_release(ip);
+			log_warn("Client sent from %08x, which another client has", ntohl(ip));
+			return 0;
+		}
+		core_unlock();
+		lease_grant(ip, peer->inet_ip);
+	}
+
+	// Ordinary traffic. Hand it to core_forward(). TCP SYNs get their MSS
+	// clamped on the way through so neither end of a connection sends
+	// segments that don't fit the tunnel, even if its client is too old
+	// to clamp them itself.
+	if((p = pkt_alloc(len)) == NULL)
+		return 0;
+	memcpy(p->data, buf, len);
+	pkt_clamp_mss(p->data, len, core_mtu);
+	p->prio = pkt_classify(buf, len);
+	if(peer->budget != NULL)
+		pkt_charge(p, peer->budget);
+	if(io->receive != NULL)
+		io->receive(peer, p);
+	else
+		sched_enqueue(&peer->rxq, p);
+	return 0;
+}
+
+/*
+ * core_backlogged
+ *
+ * Returns 1 if peer has as much queued as it may. A transport should stop
+ * reading from it until core_forward() has made room, as TCP flow control
+ * does for the server, because core_input() would block.
+ */
+int core_backlogged(struct core_peer *peer)
+{
+	return peer->rxq.bytes >= SCHED_QUEUE_LIMIT;
+}
+
+/*
+ * route
+ *
+ * Queues p for the peer its destination is routed to, by VPN address or by
+ * a subnet, and returns that peer. Otherwise hands it to the node of the
+ * cluster that owns the address, or drops it if there is none, and returns
+ * NULL. Must be called with the core lock held.
+ */
+static struct core_peer *route(struct pkt *p)
+{
+	struct ip_header *iphdr = (struct ip_header*)p->data;
+	struct core_peer *dest = route_lookup(iphdr->dest_ip);
+
+	// Every packet that passes through the server comes by here.
+	CAP_PACKET(p->data, p->len, CAP_DIR_IN);
+
+	if(dest != NULL)
+	{
+		stats.forwarded++;
+		if(io->deliver != NULL)
+			return io->deliver(dest, p);
+		core_queue(dest, p);
+		return dest;
+	}
+
+	stats.unroutable++;
+	if(cluster_forward(p) < 0)
+		pkt_free(p);
+	return NULL;
+}
+
+/*
+ * core_forward
+ *
+ * Takes up to max packets from the clients' queues in the order picked by
+ * the scheduler and queues each for the client it is routed to. Each
+ * destination's share of a batch is written in one go, so the kernel can
+ * put several packets in a segment. Returns the number of packets taken.
+ * If wait_ms isn't NULL it is set to how long until the scheduler may have
+ * more, as sched_dequeue() does.
+ */
+int core_forward(int max, int *wait_ms)
+{
+	struct pkt *batch[32];
+	struct core_peer *dests[32];
+	int n, i, j, ndests, total = 0, wait;
+
+	while(total < max)
+	{
+		n = sched_dequeue(batch, (max - total < 32) ? max - total : 32, &wait);
+		if(wait_ms != NULL)
+			*wait_ms = wait;
+		if(n == 0)
+			break;
+
+		ndests = 0;
+		core_lock();
+		for(i = 0; i < n; i++)
+		{
+			struct core_peer *dest = route(batch[i]);
+
+			if(dest == NULL)
+				continue;
+			for(j = 0; j < ndests && dests[j] != dest; j++)
+				;
+			if(j == ndests)
+				dests[ndests++] = dest;
+		}
+		for(j = 0; j < ndests; j++)
+			core_flush(dests[j]);
+		core_unlock();
+		total += n;
+	}
+	return total;
+}
+
+/*
+ * core_expire
+ *
+ * Drops the clients we haven't heard from in too long as of time now.
+ * Returns when the next one is due to time out, or 0 if nobody is
+ * connected.
+ */
+time_t core_expire(time_t now)
+{
+	static const int timeout[2] = { CORE_HANDSHAKE_TIMEOUT, CORE_IDLE_TIMEOUT };
+	time_t next = 0;
+	int l;
+
+	core_lock();
+	for(l = 0; l < 2; l++)
+	{
+		struct core_peer *peer;
+
+		while((peer = list_head[l]) != NULL && peer->last_rx + timeout[l] <= now)
+		{
+			list_unlink(peer);
+			peer->list = -1;
+			stats.timeouts++;
+			io->drop(peer);
+		}
+		if(peer != NULL && (next == 0 || peer->last_rx + timeout[l] < next))
+			next = peer->last_rx + timeout[l];
+	}
+	core_unlock();
+	return next;
+}
+
+/*
+ * core_peer_gone
+ *
+ * Forgets peer, whose connection has gone away, and gives back its address.
+ * Whatever it sent that hasn't been forwarded yet, and whatever is waiting
+ * to be written to it, is thrown away.
+ */
+void core_peer_gone(struct core_peer *peer)
+{
+	unsigned int ip = peer->ip;
+
+	core_lock();
+	if(peer->list >= 0)
+		list_unlink(peer);
+	peer->list = -1;
+	if(ip != -1)
+	{
+		cluster_leave(ip);
+		route_del(ip, 32, peer);
+	}
+	if(!txq_empty(&peer->txq))
+		tx_pending--;
+	txq_purge(&peer->txq);
+	stats.peers--;
+	core_unlock();
+
+	// Now that nobody can find the peer, its address can go back into
+	// the pool. Addresses from another cluster node's slice go back to
+	// that node, not here.
+	if(ip != -1)
+	{
+		if(core_release(ip))
+			log_info("Reclaimed IP %08x", ntohl(ip));
+		else
+			log_err("Problem reclaiming IP address %08x", ntohl(ip));
+	}
+	sched_queue_destroy(&peer->rxq);
+}
+
+const struct core_stats *core_stats(void)
+{
+	return &stats;
+}
@@ -0,0 +1,158 @@
+/* simplevpn-core.h -- Server logic that doesn't depend on the transport */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_CORE_H
+#define SIMPLEVPN_CORE_H
+
+#include <time.h>
+#include "simplevpn-pkt.h"
+#include "simplevpn-sched.h"
+#include "simplevpn-txq.h"
+#include "simplevpn-mem.h"
+
+/*
+ * Everything the server does with a client's frames once they have been
+ * read, whether the client is on a TCP connection, a shared memory ring or
+ * nothing but a struct in a simulation: what a frame means, which address
+ * the client gets, answering keepalives, timing out idle clients and
+ * forwarding through the scheduler, the routing table and each client's
+ * txq. A transport reads frames and hands them to core_input(), and is
+ * given a struct core_io for writing them out. The server's transport
+ * (simplevpn-srv.c) adds striping, direct paths and subnets through the
+ * optional hooks, and keeps sockets, threads and handover to itself.
+ *
+ * Time is whatever the caller says it is, so a simulation can run hours of
+ * virtual time for 100k clients in one thread and come out the same every
+ * time (see simplevpn-sim.c).
+ *
+ * The routing table, the idle lists and every peer's txq are protected by
+ * the core lock. core_input(), core_forward(), core_expire() and
+ * core_peer_gone() take it themselves. Everything else that says so must
+ * be called with it held, and so are the hooks in struct core_io.
+ */
+
+// Kinds of frames a client sends.
+#define CORE_IGNORE     0	// Not IPv4, so not routed on the VPN
+#define CORE_DATA       1
+#define CORE_ADDR_REQ   2	// Address request: source and destination 0
+#define CORE_STATIC_REQ 3	// Request for the address in the source field
+#define CORE_KEEPALIVE  4	// Source and destination -1
+#define CORE_JOIN       5	// CTL_STRIPE_JOIN on an extra stream
+
+// Seconds a client may stay silent, and may take to ask for an address.
+#define CORE_IDLE_TIMEOUT      60
+#define CORE_HANDSHAKE_TIMEOUT 10
+
+/*
+ * struct core_peer
+ *
+ * A client as far as the core is concerned. The transport embeds it in its
+ * own state for the client and hands it back to the core with each frame.
+ * Routes point at peers.
+ */
+struct core_peer
+{
+	struct core_peer *next;		// In an idle list, least recently heard from first
+	struct core_peer *prev;
+	int list;			// Idle list it is on, or -1 once timed out or gone
+	void *conn;			// The transport's own handle
+	unsigned int ip;		// VPN address, network byte order, or -1
+	unsigned int inet_ip;		// Internet address, network byte order
+	int striped;			// One of the streams of a striped client
+	time_t last_rx;
+	struct mem_budget *budget;	// Charged for packets from it, or NULL
+	struct sched_queue rxq;		// Packets from this client waiting to be forwarded
+	struct txq txq;			// Packets waiting to be written to this client
+};
+
+/*
+ * struct core_io
+ *
+ * A transport for the core. flush() writes as much of peer's txq as will go
+ * without blocking, and returns 0 once it is empty, 1 if the rest has to
+ * wait or -1 if the connection has failed, as txq_flush() does. drop()
+ * closes the connection of a peer that timed out. It must not call back
+ * into the core. The transport calls core_peer_gone() once it has noticed.
+ *
+ * The rest may be NULL. answer() replies to an address request once peer
+ * has its address, in place of the plain reply of core_addr_reply().
+ * join() makes peer one of the streams of a striped client, from the
+ * CTL_STRIPE_JOIN frame in buf, and returns -1 to refuse it. receive()
+ * takes a packet from peer in place of its rxq. deliver() queues a packet
+ * routed to peer, and returns the peer it was queued to, or NULL if it was
+ * dropped.
+ */
+struct core_io
+{
+	int (*flush)(struct core_peer *peer);
+	void (*drop)(struct core_peer *peer);
+	void (*answer)(struct core_peer *peer, const char *req, int len);
+	int (*join)(struct core_peer *peer, const char *buf, int len);
+	void (*receive)(struct core_peer *peer, struct pkt *p);
+	struct core_peer *(*deliver)(struct core_peer *peer, struct pkt *p);
+};
+
+/*
+ * struct core_stats
+ *
+ * Counts kept by the core since core_init(). They only change with the
+ * core lock held.
+ */
+struct core_stats
+{
+	long joins;		// Addresses handed out
+	long refused;		// Static requests for addresses in use, pool exhausted
+	long keepalives;
+	long forwarded;
+	long unroutable;	// No client has the destination
+	long timeouts;
+	long peers;		// Connected right now
+};
+
+void core_pool_init(unsigned int start, unsigned int end, unsigned int mask);
+int core_in_range(unsigned int ip);
+int core_frame_kind(const char *buf, int len);
+int core_addr_streams(const char *buf, int len);
+int core_addr_flags(const char *buf, int len);
+int core_addr_reply(char *reply, const char *req, unsigned int ip, unsigned int netmask, int mtu, int streams, int flags);
+unsigned int core_grant(unsigned int inet_ip);
+int core_claim(unsigned int ip);
+int core_release(unsigned int ip);
+
+void core_init(const struct core_io *io, unsigned int netmask, int mtu);
+void core_lock(void);
+void core_unlock(void);
+void core_peer_init(struct core_peer *peer, void *conn, unsigned int inet_ip, struct mem_budget *budget, int txq_limit, time_t now);
+struct core_peer *core_find(unsigned int ip);
+int core_assign(struct core_peer *peer, unsigned int ip);
+void core_unassign(struct core_peer *peer);
+void core_queue(struct core_peer *peer, struct pkt *p);
+void core_queue_partial(struct core_peer *peer, struct pkt *p);
+void core_flush(struct core_peer *peer);
+void core_reply(struct core_peer *peer, const char *buf, int len);
+int core_tx_pending(void);
+int core_input(struct core_peer *peer, const char *buf, int len, time_t now);
+int core_backlogged(struct core_peer *peer);
+int core_forward(int max, int *wait_ms);
+time_t core_expire(time_t now);
+void core_peer_gone(struct core_peer *peer);
+const struct core_stats *core_stats(void);
+
+#endif
@@ -0,0 +1,218 @@
+/* simplevpn-dgram.c -- Batched datagram I/O for tunnels over UDP */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE	// recvmmsg(), sendmmsg()
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "simplevpn-dgram.h"
+
+// Receive buffers are rounded up so that every one of them starts aligned.
+#define SOCK_RX_BUF ((PKT_MAX_FRAME + 63) & ~63)
+
+/*
+ * struct sock_rx
+ *
+ * Receive state of the plain sockets backend. Each datagram of a batch
+ * lands in a buffer of its own, so nothing is copied.
+ */
+struct sock_rx
+{
+	struct mmsghdr hdr[DGRAM_BATCH];
+	struct iovec iov[DGRAM_BATCH];
+	char buf[DGRAM_BATCH][SOCK_RX_BUF];
+};
+
+static int sock_open(struct dgram *d)
+{
+	return 0;
+}
+
+// Receive buffers are only set up for the first recv(), so a socket that
+// is only sent on doesn't pay for them.
+static int sock_rx_alloc(struct dgram *d)
+{
+	struct sock_rx *s = malloc(sizeof(struct sock_rx));
+	int i;
+
+	if(s == NULL)
+		return -1;
+	memset(s->hdr, 0, sizeof(s->hdr));
+	for(i = 0; i < DGRAM_BATCH; i++)
+	{
+		s->iov[i].iov_base = s->buf[i];
+		s->iov[i].iov_len = SOCK_RX_BUF;
+		s->hdr[i].msg_hdr.msg_iov = &s->iov[i];
+		s->hdr[i].msg_hdr.msg_iovlen = 1;
+		s->hdr[i].msg_hdr.msg_name = &d->rx[i].addr;
+		d->rx[i].data = s->buf[i];
+	}
+	d->priv = s;
+	return 0;
+}
+
+static int sock_recv(struct dgram *d)
+{
+	struct sock_rx *s;
+	int i, n;
+
+	if(d->priv == NULL && sock_rx_alloc(d) < 0)
+		return -1;
+	s = d->priv;
+	for(i = 0; i < DGRAM_BATCH; i++)
+		s->hdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	n = recvmmsg(d->fd, s->hdr, DGRAM_BATCH, MSG_DONTWAIT, NULL);
+	if(n < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	for(i = 0; i < n; i++)
+		d->rx[i].len = s->hdr[i].msg_len;
+	return n;
+}
+
+static int sock_send(struct dgram *d, struct dgram_msg *m, int n)
+{
+	struct mmsghdr hdr[DGRAM_BATCH];
+	struct iovec iov[DGRAM_BATCH];
+	int i;
+
+	if(n > DGRAM_BATCH)
+		n = DGRAM_BATCH;
+	memset(hdr, 0, n * sizeof(struct mmsghdr));
+	for(i = 0; i < n; i++)
+	{
+		iov[i].iov_base = m[i].data;
+		iov[i].iov_len = m[i].len;
+		hdr[i].msg_hdr.msg_iov = &iov[i];
+		hdr[i].msg_hdr.msg_iovlen = 1;
+		if(m[i].addr.sin_family != 0)
+		{
+			hdr[i].msg_hdr.msg_name = &m[i].addr;
+			hdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
+	}
+	return sendmmsg(d->fd, hdr, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void sock_close(struct dgram *d)
+{
+	free(d->priv);
+}
+
+static const struct dgram_ops sock_ops = { "sockets", sock_open, sock_recv, sock_send, sock_close };
+
+// Backends in the order they are tried. Plain sockets work everywhere, so
+// they come last. One that needs support from the kernel or the NIC, such
+// as AF_XDP, goes ahead of them and fails to open where it has none.
+static const struct dgram_ops *backends[] = { &sock_ops };
+
+/*
+ * dgram_open
+ *
+ * Sets up d for the UDP socket fd with the first backend that works.
+ * Returns -1 if none does.
+ */
+int dgram_open(struct dgram *d, int fd)
+{
+	unsigned int i;
+
+	memset(d, 0, sizeof(struct dgram));
+	d->fd = fd;
+	for(i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+	{
+		d->ops = backends[i];
+		if(d->ops->open(d) == 0)
+			return 0;
+	}
+	d->ops = NULL;
+	return -1;
+}
+
+/*
+ * dgram_recv
+ *
+ * Takes in the datagrams waiting on d's socket, up to DGRAM_BATCH, and
+ * returns how many are in d->rx. Returns 0 if there are none, or -1 if the
+ * socket has failed.
+ */
+int dgram_recv(struct dgram *d)
+{
+	return d->ops->recv(d);
+}
+
+/*
+ * dgram_flush
+ *
+ * Sends as much of q to to as will go without blocking, one packet per
+ * datagram, in batches. to is NULL for a connected socket. Returns 0 once
+ * the queue is empty or 1 if the socket filled up first, like txq_flush().
+ * A datagram the kernel won't take is only a lost packet, so there is no
+ * failure, and the rest of the queue goes on.
+ */
+int dgram_flush(struct dgram *d, struct txq *q, const struct sockaddr_in *to)
+{
+	struct dgram_msg m[DGRAM_BATCH];
+	struct pkt *p[DGRAM_BATCH];
+	int i, n, sent;
+
+	while(1)
+	{
+		for(n = 0; n < DGRAM_BATCH && (p[n] = txq_pop(q)) != NULL; n++)
+		{
+			if(to != NULL)
+				m[n].addr = *to;
+			else
+				m[n].addr.sin_family = 0;
+			m[n].data = p[n]->data;
+			m[n].len = p[n]->len;
+		}
+		if(n == 0)
+			return 0;
+
+		sent = d->ops->send(d, m, n);
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			sent = 0;
+		else if(sent < 0)
+		{
+			// The first one was refused, and would be again.
+			q->drops++;
+			sent = 1;
+		}
+		for(i = 0; i < sent; i++)
+		{
+			q->bytes -= p[i]->len;
+			pkt_free(p[i]);
+		}
+
+		// What didn't go goes back in front, in the same order.
+		for(i = n - 1; i >= sent; i--)
+			txq_unpop(q, p[i]);
+		if(sent == 0)
+			return 1;
+	}
+}
+
+void dgram_close(struct dgram *d)
+{
+	if(d->ops != NULL)
+		d->ops->close(d);
+	d->ops = NULL;
+	d->priv = NULL;
+}
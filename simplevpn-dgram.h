@@ -0,0 +1,88 @@
+/* simplevpn-dgram.h -- Batched datagram I/O for tunnels over UDP */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_DGRAM_H
+#define SIMPLEVPN_DGRAM_H
+
+#include <netinet/in.h>
+#include "simplevpn-txq.h"
+
+// Datagrams moved to or from the kernel in one call.
+#define DGRAM_BATCH 32
+
+// Socket buffers for the server's UDP socket, which every UDP client shares.
+#define DGRAM_SOCK_BUF (4 * 1024 * 1024)
+
+/*
+ * struct dgram_msg
+ *
+ * One datagram and the address it came from or is going to. An address
+ * family of 0 means the socket's own peer, for a connected socket.
+ */
+struct dgram_msg
+{
+	struct sockaddr_in addr;
+	char *data;
+	int len;
+};
+
+struct dgram;
+
+/*
+ * struct dgram_ops
+ *
+ * A way of moving datagrams through a UDP socket. open() sets up the
+ * backend's state for d->fd, and returns -1 if the backend can't be used
+ * with it on this host, in which case the next one is tried. recv() fills
+ * d->rx with what has arrived and returns how many there are, without
+ * blocking. send() sends up to n datagrams without blocking and returns how
+ * many went, or -1 with errno set if the first one didn't.
+ */
+struct dgram_ops
+{
+	const char *name;
+	int (*open)(struct dgram *d);
+	int (*recv)(struct dgram *d);
+	int (*send)(struct dgram *d, struct dgram_msg *m, int n);
+	void (*close)(struct dgram *d);
+};
+
+/*
+ * struct dgram
+ *
+ * A UDP socket and the backend that moves its datagrams. rx holds the
+ * batch the last recv() took in, and belongs to the one thread that reads
+ * the socket. Sending needs nothing from d but the backend, so several
+ * threads may send as long as each has its own packets.
+ */
+struct dgram
+{
+	int fd;
+	const struct dgram_ops *ops;
+	void *priv;		// The backend's own state
+	struct dgram_msg rx[DGRAM_BATCH];
+};
+
+int dgram_open(struct dgram *d, int fd);
+int dgram_recv(struct dgram *d);
+int dgram_flush(struct dgram *d, struct txq *q, const struct sockaddr_in *to);
+void dgram_close(struct dgram *d);
+
+#endif
@@ -0,0 +1,947 @@
+/* simplevpn-e2e.c -- Benchmark srv and cli end to end in network namespaces */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs a real server and real clients on one machine and measures what the
+ * tunnel does between them. The server and every client get a network
+ * namespace of their own, joined by veth pairs that can be given netem delay,
+ * loss and a rate. Client 0 is also a site gateway for a LAN namespace behind
+ * it, which the other clients reach through the server.
+ *
+ * Traffic comes from threads in this process that enter the namespaces, so
+ * the only CPU time charged to srv and cli is the tunnel's own. Each phase
+ * runs for the same time, with UDP probes between clients 0 and 1 timing
+ * round trips throughout:
+ *
+ *   idle  Probes only.
+ *   tcp   Every client sends TCP streams to the next one.
+ *   udp   Every client sends UDP at a fixed rate to the next one.
+ *   out   Every other client sends TCP streams to the host on the LAN.
+ *
+ * Reports throughput, round trip percentiles and CPU seconds of srv and cli
+ * per gigabit for each phase, on stdout and as one line of JSON appended to
+ * a report file, so runs before and after a change can be compared.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define E2E_MAX_CLIENTS 16
+#define E2E_MAX_CONNS   64	// TCP connections one namespace accepts
+#define E2E_NS          "svpn-"
+#define E2E_LAN_NET     "10.201.0.0/24"
+#define E2E_LAN_HOST    "10.201.0.2"
+
+#define PORT_TCP  5201
+#define PORT_UDP  5202
+#define PORT_ECHO 5203
+
+#define CHUNK            (64 * 1024)
+#define UDP_PAYLOAD      1200
+#define PROBE_INTERVAL   10	// ms
+#define PROBE_TIMEOUT    1000	// ms
+#define START_TIMEOUT    10	// Seconds for the server and clients to come up
+
+struct node
+{
+	char ns[32];
+	char log[320];
+	pid_t pid;
+	struct in_addr vpn_ip;	// Address on the tun interface
+	pthread_t server;	// Thread serving sinks and echo in the namespace
+};
+
+struct source
+{
+	pthread_t tid;
+	struct node *from;
+	struct sockaddr_in to;
+	int udp;
+};
+
+struct result
+{
+	const char *name;
+	double secs;
+	double mbit;
+	double offered;		// UDP Mbit/s sent, 0 for TCP
+	double delivered;	// Of that, Mbit/s that got there in the end
+	double srv_cpu, cli_cpu;
+	double *lat;
+	long nlat, lost;
+};
+
+static struct node srv_node, lan_node, clients[E2E_MAX_CLIENTS];
+static int nclients = 3, streams = 2, seconds = 10, probe_size = 64;
+static double udp_mbit = 50, delay_ms, loss_pct, rate_mbit;
+static const char *bindir = ".", *logdir = "/tmp", *report = "e2e-report.json";
+static const char *srv_opts = "-D 0 -v 1", *cli_opts = "";
+static int self_ns = -1;
+
+static volatile sig_atomic_t stopping;
+static int serving;
+static uint64_t phase_end;
+static long rx_bytes, tx_udp;	// Updated with __atomic
+
+static double *lat;
+static long nlat, lost, lat_max;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+static double pct(double *v, long n, double p)
+{
+	return n ? v[(long)(n * p)] : 0.0;
+}
+
+/*
+ * run
+ *
+ * Runs a shell command built from fmt. Returns its exit status, and says
+ * what failed unless quiet is set.
+ */
+static int run(int quiet, const char *fmt, ...)
+{
+	char cmd[512];
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	vsnprintf(cmd, sizeof(cmd), fmt, ap);
+	va_end(ap);
+	if(quiet)
+		strncat(cmd, " >/dev/null 2>&1", sizeof(cmd) - strlen(cmd) - 1);
+	ret = system(cmd);
+	ret = WIFEXITED(ret) ? WEXITSTATUS(ret) : -1;
+	if(ret != 0 && !quiet)
+		fprintf(stderr, "Failed: %s\n", cmd);
+	return ret;
+}
+
+/*
+ * ns_enter
+ *
+ * Moves the calling thread into namespace ns, or back to the one we
+ * started in if ns is NULL.
+ */
+static int ns_enter(const char *ns)
+{
+	char path[64];
+	int fd, ret;
+
+	if(ns == NULL)
+		return setns(self_ns, CLONE_NEWNET);
+	snprintf(path, sizeof(path), "/run/netns/%s", ns);
+	if((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	ret = setns(fd, CLONE_NEWNET);
+	close(fd);
+	return ret;
+}
+
+/*
+ * netem
+ *
+ * Gives dev in ns the delay, loss and rate asked for, if any. A run with
+ * links that were meant to be shaped and aren't would be misleading, so it
+ * fails if they can't be.
+ */
+static int netem(const char *ns, const char *dev)
+{
+	char rate[32] = "";
+
+	if(delay_ms <= 0 && loss_pct <= 0 && rate_mbit <= 0)
+		return 0;
+	if(rate_mbit > 0)
+		snprintf(rate, sizeof(rate), " rate %gmbit", rate_mbit);
+	return run(0, "ip netns exec %s tc qdisc add dev %s root netem delay %gms loss %g%%%s", ns, dev, delay_ms, loss_pct, rate);
+}
+
+static void teardown(void)
+{
+	int i;
+
+	for(i = 0; i < nclients; i++)
+		if(clients[i].pid > 0)
+			kill(clients[i].pid, SIGTERM);
+	if(srv_node.pid > 0)
+		kill(srv_node.pid, SIGTERM);
+	while(wait(NULL) > 0)
+		;
+	for(i = 0; i < E2E_MAX_CLIENTS; i++)
+		run(1, "ip netns del " E2E_NS "c%d", i);
+	run(1, "ip netns del " E2E_NS "srv");
+	run(1, "ip netns del " E2E_NS "lan");
+}
+
+/*
+ * setup
+ *
+ * Creates the namespaces: the server's, one per client with a veth pair to
+ * the server's, and the LAN behind client 0. Client i reaches the server
+ * at 10.200.i.1.
+ */
+static int setup(void)
+{
+	char dev[16];
+	int i;
+
+	snprintf(srv_node.ns, sizeof(srv_node.ns), E2E_NS "srv");
+	snprintf(lan_node.ns, sizeof(lan_node.ns), E2E_NS "lan");
+	if(run(0, "ip netns add %s", srv_node.ns) || run(0, "ip -n %s link set lo up", srv_node.ns))
+		return -1;
+
+	for(i = 0; i < nclients; i++)
+	{
+		char *ns = clients[i].ns;
+
+		snprintf(ns, sizeof(clients[i].ns), E2E_NS "c%d", i);
+		if(run(0, "ip netns add %s", ns) || run(0, "ip -n %s link set lo up", ns) ||
+		   run(0, "ip link add sv%d netns %s type veth peer name eth0 netns %s", i, srv_node.ns, ns) ||
+		   run(0, "ip -n %s addr add 10.200.%d.1/24 dev sv%d", srv_node.ns, i, i) ||
+		   run(0, "ip -n %s link set sv%d up", srv_node.ns, i) ||
+		   run(0, "ip -n %s addr add 10.200.%d.2/24 dev eth0", ns, i) ||
+		   run(0, "ip -n %s link set eth0 up", ns))
+			return -1;
+		snprintf(clients[i].log, sizeof(clients[i].log), "%.256s/%.31s.log", logdir, clients[i].ns);
+		snprintf(dev, sizeof(dev), "sv%d", i);
+		if(netem(srv_node.ns, dev) || netem(ns, "eth0"))
+			return -1;
+	}
+
+	// Client 0 forwards between the VPN and its LAN.
+	if(run(0, "ip netns add %s", lan_node.ns) || run(0, "ip -n %s link set lo up", lan_node.ns) ||
+	   run(0, "ip link add lan0 netns %s type veth peer name eth0 netns %s", clients[0].ns, lan_node.ns) ||
+	   run(0, "ip -n %s addr add 10.201.0.1/24 dev lan0", clients[0].ns) ||
+	   run(0, "ip -n %s link set lan0 up", clients[0].ns) ||
+	   run(0, "ip -n %s addr add " E2E_LAN_HOST "/24 dev eth0", lan_node.ns) ||
+	   run(0, "ip -n %s link set eth0 up", lan_node.ns) ||
+	   run(0, "ip -n %s route add 10.0.0.0/16 via 10.201.0.1", lan_node.ns) ||
+	   run(0, "ip netns exec %s sysctl -qw net.ipv4.ip_forward=1", clients[0].ns))
+		return -1;
+	inet_aton(E2E_LAN_HOST, &lan_node.vpn_ip);
+	snprintf(srv_node.log, sizeof(srv_node.log), "%.256s/%.31s.log", logdir, srv_node.ns);
+	return 0;
+}
+
+/*
+ * spawn
+ *
+ * Starts bindir/prog in n's namespace with the arguments in args, which
+ * are split on spaces, and its output going to n's log.
+ */
+static int spawn(struct node *n, const char *prog, const char *args)
+{
+	char path[256], buf[512], *argv[64], *tok;
+	int argc = 0, fd;
+
+	snprintf(path, sizeof(path), "%s/%s", bindir, prog);
+	snprintf(buf, sizeof(buf), "%s", args);
+	argv[argc++] = path;
+	for(tok = strtok(buf, " "); tok != NULL && argc < 63; tok = strtok(NULL, " "))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
+
+	if((n->pid = fork()) < 0)
+		return -1;
+	if(n->pid > 0)
+		return 0;
+
+	if(ns_enter(n->ns) < 0 || (fd = open(n->log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		_exit(127);
+	dup2(fd, 1);
+	dup2(fd, 2);
+	close(fd);
+	execv(path, argv);
+	perror(path);
+	_exit(127);
+}
+
+/*
+ * tun_address
+ *
+ * Waits for the client in n to configure its tun interface, and records
+ * the address it got.
+ */
+static int tun_address(struct node *n)
+{
+	struct ifreq ifr;
+	uint64_t give_up = now_ns() + START_TIMEOUT * 1000000000ULL;
+	int fd, ret = -1;
+
+	if(ns_enter(n->ns) < 0)
+		return -1;
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	while(ret < 0 && now_ns() < give_up && !stopping)
+	{
+		memset(&ifr, 0, sizeof(ifr));
+		strcpy(ifr.ifr_name, "tun0");
+		if(ioctl(fd, SIOCGIFADDR, &ifr) == 0)
+		{
+			n->vpn_ip = ((struct sockaddr_in*)&ifr.ifr_addr)->sin_addr;
+			ret = 0;
+		}
+		else
+			usleep(50000);
+	}
+	close(fd);
+	ns_enter(NULL);
+	return ret;
+}
+
+/*
+ * wait_listening
+ *
+ * Waits until the server takes connections on client 0's link.
+ */
+static int wait_listening(void)
+{
+	struct sockaddr_in sa;
+	uint64_t give_up = now_ns() + START_TIMEOUT * 1000000000ULL;
+	int fd, ret = -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(2002);
+	inet_aton("10.200.0.1", &sa.sin_addr);
+	if(ns_enter(clients[0].ns) < 0)
+		return -1;
+	while(ret < 0 && now_ns() < give_up && !stopping)
+	{
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		ret = connect(fd, (struct sockaddr*)&sa, sizeof(sa));
+		close(fd);
+		if(ret < 0)
+			usleep(50000);
+	}
+	ns_enter(NULL);
+	return ret;
+}
+
+static int listen_on(int type, int port)
+{
+	struct sockaddr_in sa;
+	int fd = socket(AF_INET, type, 0), one = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || (type == SOCK_STREAM && listen(fd, E2E_MAX_CONNS) < 0))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * serve
+ *
+ * Sinks TCP and UDP traffic sent to node arg, counting what arrives, and
+ * echoes probes back to where they came from.
+ */
+static void *serve(void *arg)
+{
+	struct node *n = arg;
+	struct pollfd fds[3 + E2E_MAX_CONNS];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	char *buf = malloc(CHUNK * 4);
+	int nfds = 3, i, r;
+
+	if(ns_enter(n->ns) < 0)
+		return NULL;
+	fds[0].fd = listen_on(SOCK_STREAM, PORT_TCP);
+	fds[1].fd = listen_on(SOCK_DGRAM, PORT_UDP);
+	fds[2].fd = listen_on(SOCK_DGRAM, PORT_ECHO);
+	for(i = 0; i < 3; i++)
+		fds[i].events = POLLIN;
+
+	while(__atomic_load_n(&serving, __ATOMIC_RELAXED))
+	{
+		if(poll(fds, nfds, 100) <= 0)
+			continue;
+
+		if((fds[0].revents & POLLIN) && nfds < 3 + E2E_MAX_CONNS && (r = accept(fds[0].fd, NULL, NULL)) >= 0)
+		{
+			fds[nfds].fd = r;
+			fds[nfds++].events = POLLIN;
+		}
+		while((fds[1].revents & POLLIN) && (r = recv(fds[1].fd, buf, CHUNK, MSG_DONTWAIT)) > 0)
+			__atomic_add_fetch(&rx_bytes, r, __ATOMIC_RELAXED);
+		while((fds[2].revents & POLLIN) && (fromlen = sizeof(from)) &&
+		      (r = recvfrom(fds[2].fd, buf, CHUNK, MSG_DONTWAIT, (struct sockaddr*)&from, &fromlen)) > 0)
+			sendto(fds[2].fd, buf, r, 0, (struct sockaddr*)&from, fromlen);
+
+		for(i = 3; i < nfds; i++)
+		{
+			if(fds[i].revents == 0)
+				continue;
+			r = recv(fds[i].fd, buf, CHUNK * 4, MSG_DONTWAIT);
+			if(r > 0)
+			{
+				__atomic_add_fetch(&rx_bytes, r, __ATOMIC_RELAXED);
+				continue;
+			}
+			if(r < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			close(fds[i].fd);
+			fds[i--] = fds[--nfds];
+		}
+	}
+
+	for(i = 0; i < nfds; i++)
+		close(fds[i].fd);
+	free(buf);
+	return NULL;
+}
+
+static int phase_over(void)
+{
+	return stopping || now_ns() >= __atomic_load_n(&phase_end, __ATOMIC_RELAXED);
+}
+
+/*
+ * send_tcp
+ *
+ * Sends as fast as the tunnel takes it until the phase is over.
+ */
+static void *send_tcp(void *arg)
+{
+	struct source *s = arg;
+	struct timeval tv = { 0, 100000 };
+	char *buf = calloc(1, CHUNK);
+	int fd;
+
+	if(ns_enter(s->from->ns) < 0)
+		return NULL;
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if(connect(fd, (struct sockaddr*)&s->to, sizeof(s->to)) == 0)
+		while(!phase_over())
+			if(send(fd, buf, CHUNK, MSG_NOSIGNAL) < 0 && errno != EAGAIN && errno != EINTR)
+				break;
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * send_udp
+ *
+ * Sends UDP_PAYLOAD byte datagrams evenly spaced at udp_mbit until the
+ * phase is over.
+ */
+static void *send_udp(void *arg)
+{
+	struct source *s = arg;
+	char buf[UDP_PAYLOAD];
+	uint64_t gap = UDP_PAYLOAD * 8 * 1000.0 / udp_mbit, next = now_ns(), now;
+	int fd;
+
+	if(ns_enter(s->from->ns) < 0)
+		return NULL;
+	memset(buf, 0, sizeof(buf));
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	connect(fd, (struct sockaddr*)&s->to, sizeof(s->to));
+	while(!phase_over())
+	{
+		now = now_ns();
+		if(now < next)
+		{
+			struct timespec ts = { 0, (next - now < 1000000) ? next - now : 1000000 };
+
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		if(send(fd, buf, sizeof(buf), 0) > 0)
+			__atomic_add_fetch(&tx_udp, sizeof(buf), __ATOMIC_RELAXED);
+		next += gap;
+	}
+	close(fd);
+	return NULL;
+}
+
+/*
+ * probe
+ *
+ * Times round trips from client 0 to client 1's echo port every
+ * PROBE_INTERVAL ms until the phase is over. A probe not back within
+ * PROBE_TIMEOUT ms counts as lost.
+ */
+static void *probe(void *arg)
+{
+	struct sockaddr_in to;
+	struct timeval tv = { 0, 20000 };
+	char buf[2048];
+	uint64_t seq = 0, sent, next = now_ns(), got;
+	int fd, r;
+
+	(void)arg;
+	if(ns_enter(clients[0].ns) < 0)
+		return NULL;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(PORT_ECHO);
+	to.sin_addr = clients[1].vpn_ip;
+	memset(buf, 0, sizeof(buf));
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	connect(fd, (struct sockaddr*)&to, sizeof(to));
+
+	while(!phase_over() && nlat < lat_max)
+	{
+		seq++;
+		memcpy(buf, &seq, sizeof(seq));
+		sent = now_ns();
+		send(fd, buf, probe_size, 0);
+		while(1)
+		{
+			r = recv(fd, buf, sizeof(buf), 0);
+			if(r >= (int)sizeof(seq) && memcmp(buf, &seq, sizeof(seq)) == 0)
+			{
+				lat[nlat++] = (now_ns() - sent) / 1e6;
+				break;
+			}
+			if(now_ns() - sent > PROBE_TIMEOUT * 1000000ULL)
+			{
+				lost++;
+				break;
+			}
+		}
+		next += PROBE_INTERVAL * 1000000ULL;
+		got = now_ns();
+		if(got < next)
+			usleep((next - got) / 1000);
+		else
+			next = got;
+	}
+	close(fd);
+	return NULL;
+}
+
+/*
+ * cpu_seconds
+ *
+ * Returns the user and system time pid has used so far.
+ */
+static double cpu_seconds(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime;
+	FILE *f;
+	int n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if((f = fopen(path, "r")) == NULL)
+		return 0;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n > 0 ? n : 0] = '\0';
+	// The command name may have spaces in it, but not a ')'.
+	if((p = strrchr(buf, ')')) == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return 0;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double cli_cpu_seconds(void)
+{
+	double t = 0;
+	int i;
+
+	for(i = 0; i < nclients; i++)
+		t += cpu_seconds(clients[i].pid);
+	return t;
+}
+
+/*
+ * quiet
+ *
+ * Waits, up to 5 s, for the last phase's traffic to drain out of the
+ * tunnel and returns the bytes received so far.
+ */
+static long quiet(void)
+{
+	long last = -1, now = __atomic_load_n(&rx_bytes, __ATOMIC_RELAXED);
+	int i;
+
+	for(i = 0; i < 25 && now != last && !stopping; i++)
+	{
+		usleep(200000);
+		last = now;
+		now = __atomic_load_n(&rx_bytes, __ATOMIC_RELAXED);
+	}
+	return now;
+}
+
+/*
+ * run_phase
+ *
+ * Runs the sources for seconds seconds with probes going, and fills in r.
+ */
+static void run_phase(struct result *r, struct source *src, int nsrc)
+{
+	pthread_t prober;
+	uint64_t start;
+	double srv0, cli0;
+	long rx0, rx1;
+	int i;
+
+	nlat = lost = 0;
+	rx0 = quiet();
+	__atomic_store_n(&tx_udp, 0, __ATOMIC_RELAXED);
+	srv0 = cpu_seconds(srv_node.pid);
+	cli0 = cli_cpu_seconds();
+	start = now_ns();
+	__atomic_store_n(&phase_end, start + seconds * 1000000000ULL, __ATOMIC_RELAXED);
+
+	pthread_create(&prober, NULL, probe, NULL);
+	for(i = 0; i < nsrc; i++)
+		pthread_create(&src[i].tid, NULL, src[i].udp ? send_udp : send_tcp, &src[i]);
+	while(!phase_over())
+		usleep(10000);
+
+	r->secs = (now_ns() - start) / 1e9;
+	rx1 = __atomic_load_n(&rx_bytes, __ATOMIC_RELAXED);
+	r->mbit = (rx1 - rx0) * 8 / r->secs / 1e6;
+	r->srv_cpu = cpu_seconds(srv_node.pid) - srv0;
+	r->cli_cpu = cli_cpu_seconds() - cli0;
+
+	for(i = 0; i < nsrc; i++)
+		pthread_join(src[i].tid, NULL);
+	pthread_join(prober, NULL);
+	r->lat = malloc((nlat + 1) * sizeof(double));
+	memcpy(r->lat, lat, nlat * sizeof(double));
+	r->nlat = nlat;
+	r->lost = lost;
+	qsort(r->lat, r->nlat, sizeof(double), cmp_double);
+
+	// Datagrams still queued at the deadline aren't lost, so UDP loss waits
+	// for them.
+	if(__atomic_load_n(&tx_udp, __ATOMIC_RELAXED) > 0)
+	{
+		r->offered = __atomic_load_n(&tx_udp, __ATOMIC_RELAXED) * 8 / r->secs / 1e6;
+		r->delivered = (quiet() - rx0) * 8 / r->secs / 1e6;
+	}
+}
+
+static double per_gbit(struct result *r, double cpu)
+{
+	return (r->mbit > 0) ? cpu / (r->mbit * r->secs / 1000) : 0;
+}
+
+static void print_result(struct result *r)
+{
+	printf("%-5s %9.1f Mbit/s", r->name, r->mbit);
+	if(r->offered > 0)
+		printf(" of %.1f sent (%.2f%% lost)", r->offered, 100 * (1 - r->delivered / r->offered));
+	printf(", rtt p50 %.3f ms p90 %.3f ms p99 %.3f ms max %.3f ms (%ld lost)",
+		pct(r->lat, r->nlat, 0.5), pct(r->lat, r->nlat, 0.9), pct(r->lat, r->nlat, 0.99),
+		r->nlat ? r->lat[r->nlat - 1] : 0.0, r->lost);
+	printf(", cpu srv %.2f s cli %.2f s", r->srv_cpu, r->cli_cpu);
+	if(r->mbit > 0)
+		printf(", %.2f s/Gbit", per_gbit(r, r->srv_cpu + r->cli_cpu));
+	printf("\n");
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for(; *s != '\0'; s++)
+	{
+		if(*s == '"' || *s == '\\')
+			fputc('\\', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * write_report
+ *
+ * Appends the run to the report file as one line of JSON.
+ */
+static void write_report(struct result *res, int nres)
+{
+	char when[32];
+	time_t t = time(NULL);
+	FILE *f;
+	int i;
+
+	if((f = fopen(report, "a")) == NULL)
+	{
+		perror(report);
+		return;
+	}
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S%z", localtime(&t));
+	fprintf(f, "{\"time\": \"%s\", \"clients\": %d, \"streams\": %d, \"seconds\": %d, \"udp_mbit\": %g, "
+		"\"probe_bytes\": %d, \"delay_ms\": %g, \"loss_pct\": %g, \"rate_mbit\": %g, \"srv_opts\": ",
+		when, nclients, streams, seconds, udp_mbit, probe_size, delay_ms, loss_pct, rate_mbit);
+	json_string(f, srv_opts);
+	fprintf(f, ", \"cli_opts\": ");
+	json_string(f, cli_opts);
+	fprintf(f, ", \"phases\": {");
+	for(i = 0; i < nres; i++)
+	{
+		struct result *r = &res[i];
+
+		fprintf(f, "%s\"%s\": {\"mbit\": %.3f, \"offered_mbit\": %.3f, \"udp_loss_pct\": %.3f, \"rtt_p50_ms\": %.4f, \"rtt_p90_ms\": %.4f, "
+			"\"rtt_p99_ms\": %.4f, \"rtt_max_ms\": %.4f, \"probes\": %ld, \"probes_lost\": %ld, "
+			"\"srv_cpu_s\": %.3f, \"cli_cpu_s\": %.3f, \"srv_cpu_s_per_gbit\": %.4f, \"cli_cpu_s_per_gbit\": %.4f}",
+			i ? ", " : "", r->name, r->mbit, r->offered, r->offered > 0 ? 100 * (1 - r->delivered / r->offered) : 0.0,
+			pct(r->lat, r->nlat, 0.5), pct(r->lat, r->nlat, 0.9), pct(r->lat, r->nlat, 0.99),
+			r->nlat ? r->lat[r->nlat - 1] : 0.0, r->nlat + r->lost, r->lost,
+			r->srv_cpu, r->cli_cpu, per_gbit(r, r->srv_cpu), per_gbit(r, r->cli_cpu));
+	}
+	fprintf(f, "}}\n");
+	fclose(f);
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+void usage(char *progname)
+{
+	printf("%s: benchmark srv and cli end to end in network namespaces (needs root)\n\n", progname);
+	printf("usage: %s [options]\n\n", progname);
+	printf("\t-n <clients>\tOptional. Clients to start, 2 to %d. Default 3.\n", E2E_MAX_CLIENTS);
+	printf("\t-t <seconds>\tOptional. Length of each phase. Default 10.\n");
+	printf("\t-P <streams>\tOptional. TCP streams each client sends. Default 2.\n");
+	printf("\t-u <mbit/s>\tOptional. UDP rate each client sends. Default 50.\n");
+	printf("\t-q <bytes>\tOptional. Size of the probes timing round trips. Default 64.\n");
+	printf("\t-d <ms>\t\tOptional. Delay netem adds to each link in each direction.\n");
+	printf("\t-l <percent>\tOptional. Loss netem adds to each link in each direction.\n");
+	printf("\t-r <mbit/s>\tOptional. Rate netem limits each link to in each direction.\n");
+	printf("\t-S <options>\tOptional. Server options. Default \"%s\".\n", srv_opts);
+	printf("\t-C <options>\tOptional. Client options.\n");
+	printf("\t-b <dir>\tOptional. Where srv and cli are. Default the current directory.\n");
+	printf("\t-L <dir>\tOptional. Where the server and clients log to. Default %s.\n", logdir);
+	printf("\t-o <file>\tOptional. Report to append a line of JSON to. Default %s.\n", report);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct source src[E2E_MAX_CLIENTS * 8];
+	struct result res[4];
+	char args[512];
+	int c, i, j, n, nres = 0, ret = 1;
+
+	while ((c = getopt (argc, argv, "n:t:P:u:q:d:l:r:S:C:b:L:o:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n':
+			nclients = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'P':
+			streams = atoi(optarg);
+			break;
+		case 'u':
+			udp_mbit = atof(optarg);
+			break;
+		case 'q':
+			probe_size = atoi(optarg);
+			break;
+		case 'd':
+			delay_ms = atof(optarg);
+			break;
+		case 'l':
+			loss_pct = atof(optarg);
+			break;
+		case 'r':
+			rate_mbit = atof(optarg);
+			break;
+		case 'S':
+			srv_opts = optarg;
+			break;
+		case 'C':
+			cli_opts = optarg;
+			break;
+		case 'b':
+			bindir = optarg;
+			break;
+		case 'L':
+			logdir = optarg;
+			break;
+		case 'o':
+			report = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if(optind != argc || nclients < 2 || nclients > E2E_MAX_CLIENTS || seconds < 1 || streams < 1 || streams > 8 ||
+	   udp_mbit <= 0 || probe_size < (int)sizeof(uint64_t) || probe_size > 1400)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	if(geteuid() != 0)
+	{
+		fprintf(stderr, "%s needs root to create network namespaces\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+	self_ns = open("/proc/self/ns/net", O_RDONLY);
+	lat_max = seconds * 1000 / PROBE_INTERVAL + 16;
+	lat = malloc(lat_max * sizeof(double));
+
+	// Anything left over from a run that was killed goes first.
+	teardown();
+	if(setup() < 0)
+		goto out;
+
+	if(spawn(&srv_node, "srv", srv_opts) < 0 || wait_listening() < 0)
+	{
+		fprintf(stderr, "Server did not come up, see %s\n", srv_node.log);
+		goto out;
+	}
+	for(i = 0; i < nclients; i++)
+	{
+		snprintf(args, sizeof(args), "-s 10.200.%d.1 %s %s", i, (i == 0) ? "-r " E2E_LAN_NET : "", cli_opts);
+		if(spawn(&clients[i], "cli", args) < 0)
+			goto out;
+	}
+	for(i = 0; i < nclients; i++)
+	{
+		if(tun_address(&clients[i]) < 0)
+		{
+			fprintf(stderr, "Client %d did not get an address, see %s\n", i, clients[i].log);
+			goto out;
+		}
+		if(i > 0 && run(0, "ip -n %s route add " E2E_LAN_NET " dev tun0", clients[i].ns))
+			goto out;
+	}
+
+	__atomic_store_n(&serving, 1, __ATOMIC_RELAXED);
+	for(i = 0; i < nclients; i++)
+		pthread_create(&clients[i].server, NULL, serve, &clients[i]);
+	pthread_create(&lan_node.server, NULL, serve, &lan_node);
+	usleep(200000);
+
+	printf("%d clients, %d s per phase, netem delay %g ms loss %g%% rate %g Mbit/s, srv \"%s\" cli \"%s\"\n",
+		nclients, seconds, delay_ms, loss_pct, rate_mbit, srv_opts, cli_opts);
+
+	for(c = 0; c < 4 && !stopping; c++)
+	{
+		struct result *r = &res[nres];
+
+		memset(r, 0, sizeof(*r));
+		memset(src, 0, sizeof(src));
+		n = 0;
+		switch(c)
+		{
+		case 0:
+			r->name = "idle";
+			break;
+		case 1:
+		case 2:
+			r->name = (c == 1) ? "tcp" : "udp";
+			for(i = 0; i < nclients; i++)
+			{
+				for(j = 0; j < ((c == 1) ? streams : 1); j++, n++)
+				{
+					src[n].from = &clients[i];
+					src[n].udp = (c == 2);
+					src[n].to.sin_family = AF_INET;
+					src[n].to.sin_port = htons((c == 1) ? PORT_TCP : PORT_UDP);
+					src[n].to.sin_addr = clients[(i + 1) % nclients].vpn_ip;
+				}
+			}
+			break;
+		case 3:
+			r->name = "out";
+			for(i = 1; i < nclients; i++)
+			{
+				for(j = 0; j < streams; j++, n++)
+				{
+					src[n].from = &clients[i];
+					src[n].to.sin_family = AF_INET;
+					src[n].to.sin_port = htons(PORT_TCP);
+					src[n].to.sin_addr = lan_node.vpn_ip;
+				}
+			}
+			break;
+		}
+		run_phase(r, src, n);
+		if(stopping)
+			break;
+		print_result(r);
+		fflush(stdout);
+		nres++;
+	}
+
+	__atomic_store_n(&serving, 0, __ATOMIC_RELAXED);
+	for(i = 0; i < nclients; i++)
+		pthread_join(clients[i].server, NULL);
+	pthread_join(lan_node.server, NULL);
+	if(!stopping)
+	{
+		write_report(res, nres);
+		printf("Appended to %s\n", report);
+		ret = 0;
+	}
+
+out:
+	teardown();
+	return ret;
+}
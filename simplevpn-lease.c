@@ -0,0 +1,279 @@
+/* simplevpn-lease.c -- Address leases that survive a server restart */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The server records which client holds each address in a memory mapped
+ * file, one fixed slot per address, so keeping it current is a couple of
+ * stores and reading it back after a restart needs no parsing. The kernel
+ * writes the pages out, so the file survives the server dying as well.
+ *
+ * On a cold start, every address that was in use is taken out of the pool
+ * and set aside for a while. A client that reconnects from the internet
+ * address that held one gets it back instead of a new one. Whatever hasn't
+ * been picked up when the grace period runs out goes back into the pool.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "simplevpn-lease.h"
+#include "simplevpn-log.h"
+
+#define RES_BUCKETS 4096	// Hash of set aside addresses by internet address
+
+static struct lease_file_hdr *lease_hdr = NULL;
+static struct lease *leases;
+static unsigned int lease_net;	// Host byte order
+
+// Addresses set aside after a cold start, chained by the internet address
+// of the client that held them. Protected by res_lock.
+static pthread_mutex_t res_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t res_until[POOL_SIZE];
+static int res_next[POOL_SIZE];
+static int res_head[RES_BUCKETS];
+static int nreserved = 0;
+
+static int lease_index(unsigned int ip)
+{
+	ip = ntohl(ip);
+	if((ip & POOL_MASK) != lease_net)
+		return -1;
+	return ip & ~POOL_MASK;
+}
+
+static unsigned int res_bucket(unsigned int inet_ip)
+{
+	return (inet_ip * 2654435761U) >> 20;
+}
+
+/*
+ * lease_open
+ *
+ * Maps the lease file at path, creating it if needed, for the pool's network
+ * starting at net (host byte order). A file for a different network is wiped.
+ * Returns -1 if the file can't be set up.
+ */
+int lease_open(const char *path, unsigned int net)
+{
+	size_t len = sizeof(struct lease_file_hdr) + POOL_SIZE * sizeof(struct lease);
+	void *map;
+	int fd, i;
+
+	if((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+	{
+		perror(path);
+		return -1;
+	}
+	if(ftruncate(fd, len) < 0)
+	{
+		perror("ftruncate()");
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		perror("mmap()");
+		return -1;
+	}
+
+	lease_hdr = map;
+	leases = (struct lease*)(lease_hdr + 1);
+	lease_net = net & POOL_MASK;
+	if(lease_hdr->magic != LEASE_MAGIC || lease_hdr->version != LEASE_VERSION || lease_hdr->net != lease_net || lease_hdr->count != POOL_SIZE)
+	{
+		memset(map, 0, len);
+		lease_hdr->version = LEASE_VERSION;
+		lease_hdr->net = lease_net;
+		lease_hdr->count = POOL_SIZE;
+		lease_hdr->magic = LEASE_MAGIC;
+	}
+
+	for(i = 0; i < RES_BUCKETS; i++)
+		res_head[i] = -1;
+	return 0;
+}
+
+/*
+ * lease_grant
+ *
+ * Records that the client at internet address inet_ip holds ip. Both are
+ * in network byte order.
+ */
+void lease_grant(unsigned int ip, unsigned int inet_ip)
+{
+	int i;
+
+	if(lease_hdr == NULL || (i = lease_index(ip)) < 0)
+		return;
+	leases[i].inet_ip = inet_ip;
+	leases[i].since = time(NULL);
+	leases[i].ip = ip;
+}
+
+void lease_end(unsigned int ip)
+{
+	int i;
+
+	if(lease_hdr == NULL || (i = lease_index(ip)) < 0)
+		return;
+	leases[i].ip = 0;
+}
+
+/*
+ * lease_restore
+ *
+ * Called on a cold start, after the pool has been filled. Takes every
+ * address that was leased when the server last ran out of the pool and sets
+ * it aside for grace seconds. Returns the number of addresses set aside.
+ */
+int lease_restore(int grace)
+{
+	time_t until = time(NULL) + grace;
+	int i, n = 0;
+
+	if(lease_hdr == NULL)
+		return 0;
+
+	pthread_mutex_lock(&res_lock);
+	for(i = 0; i < POOL_SIZE; i++)
+	{
+		unsigned int b;
+
+		if(leases[i].ip == 0)
+			continue;
+		if(!pool_claim(leases[i].ip))
+		{
+			// Not ours to hand out any more.
+			leases[i].ip = 0;
+			continue;
+		}
+		b = res_bucket(leases[i].inet_ip);
+		res_until[i] = until;
+		res_next[i] = res_head[b];
+		res_head[b] = i;
+		n++;
+	}
+	__atomic_store_n(&nreserved, n, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&res_lock);
+	return n;
+}
+
+/*
+ * unreserve
+ *
+ * Takes address number i off its chain. Must be called with res_lock held.
+ */
+static void unreserve(int i)
+{
+	int *link = &res_head[res_bucket(leases[i].inet_ip)];
+
+	while(*link != i)
+		link = &res_next[*link];
+	*link = res_next[i];
+	res_until[i] = 0;
+	__atomic_sub_fetch(&nreserved, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * lease_take
+ *
+ * Returns an address set aside for a client reconnecting from inet_ip, or
+ * 0 if there is none. The address is the caller's from then on.
+ */
+unsigned int lease_take(unsigned int inet_ip)
+{
+	unsigned int ip = 0;
+	int i;
+
+	if(__atomic_load_n(&nreserved, __ATOMIC_ACQUIRE) == 0)
+		return 0;
+
+	pthread_mutex_lock(&res_lock);
+	for(i = res_head[res_bucket(inet_ip)]; i >= 0; i = res_next[i])
+	{
+		if(leases[i].inet_ip == inet_ip)
+		{
+			ip = leases[i].ip;
+			unreserve(i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&res_lock);
+	return ip;
+}
+
+/*
+ * lease_claim
+ *
+ * Hands a set aside address to a client that asked for it by name. Returns
+ * 1 if ip was set aside.
+ */
+int lease_claim(unsigned int ip)
+{
+	int i, ret = 0;
+
+	if(__atomic_load_n(&nreserved, __ATOMIC_ACQUIRE) == 0 || (i = lease_index(ip)) < 0)
+		return 0;
+
+	pthread_mutex_lock(&res_lock);
+	if(res_until[i] != 0)
+	{
+		unreserve(i);
+		ret = 1;
+	}
+	pthread_mutex_unlock(&res_lock);
+	return ret;
+}
+
+/*
+ * lease_expire
+ *
+ * Puts addresses that nobody came back for within the grace period back in
+ * the pool.
+ */
+void lease_expire(time_t now)
+{
+	int i, n = 0;
+
+	if(__atomic_load_n(&nreserved, __ATOMIC_ACQUIRE) == 0)
+		return;
+
+	pthread_mutex_lock(&res_lock);
+	for(i = 0; i < POOL_SIZE; i++)
+	{
+		unsigned int ip = leases[i].ip;
+
+		if(res_until[i] == 0 || res_until[i] > now)
+			continue;
+		unreserve(i);
+		leases[i].ip = 0;
+		pool_release(ip);
+		n++;
+	}
+	pthread_mutex_unlock(&res_lock);
+	if(n > 0)
+		log_info("Released %d addresses of clients that did not come back", n);
+}
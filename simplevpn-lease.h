@@ -0,0 +1,70 @@
+/* simplevpn-lease.h -- Address leases that survive a server restart */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_LEASE_H
+#define SIMPLEVPN_LEASE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "simplevpn-pool.h"
+
+#define LEASE_MAGIC   0x5356504c
+#define LEASE_VERSION 1
+
+// After a cold start, an address that was in use stays set aside this many
+// seconds for a client reconnecting from the same internet address.
+#define LEASE_GRACE 120
+
+/*
+ * struct lease_file_hdr
+ *
+ * Start of a lease file. It is followed by one struct lease for every
+ * address in the pool, indexed by the host part of the address.
+ */
+struct lease_file_hdr
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t net;		// Host byte order
+	uint32_t count;
+};
+
+/*
+ * struct lease
+ *
+ * The client holding an address. An entry with ip 0 is free. Addresses are
+ * in network byte order.
+ */
+struct lease
+{
+	uint32_t ip;
+	uint32_t inet_ip;
+	int64_t since;
+};
+
+int lease_open(const char *path, unsigned int net);
+void lease_grant(unsigned int ip, unsigned int inet_ip);
+void lease_end(unsigned int ip);
+int lease_restore(int grace);
+unsigned int lease_take(unsigned int inet_ip);
+int lease_claim(unsigned int ip);
+void lease_expire(time_t now);
+
+#endif
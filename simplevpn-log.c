@@ -0,0 +1,323 @@
+/* simplevpn-log.c -- Logging that never blocks the thread doing it */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "simplevpn-log.h"
+
+/*
+ * struct log_rec
+ *
+ * A message waiting in a ring. seq orders messages from all threads.
+ */
+struct log_rec
+{
+	unsigned long seq;
+	struct timespec ts;
+	int level;
+	int tid;
+	int suppressed;		// Messages from the same call site not logged before this one
+	char msg[LOG_MSG_MAX];
+};
+
+/*
+ * struct log_ring
+ *
+ * One thread's messages. Only the thread moves head and only the flusher
+ * moves tail. The flusher frees the ring once the thread has exited and
+ * everything in it has been written.
+ */
+struct log_ring
+{
+	struct log_ring *next;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int flush_head;	// Where the flusher stopped this time
+	long dropped;			// Messages that found the ring full
+	int dead;			// The thread has exited
+	int tid;
+	struct log_rec recs[LOG_RING_SLOTS];
+};
+
+int log_level = LOG_INFO;
+
+static const char *level_names[] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+static struct log_ring *rings = NULL;		// Pushed onto by threads, unlinked by the flusher
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;	// Only ever taken by whoever flushes
+static pthread_key_t ring_key;
+static __thread struct log_ring *my_ring;
+static int running = 0;
+static unsigned long next_seq = 0;
+
+static struct log_rec **batch = NULL;		// Messages being flushed, sorted by seq
+static int batch_size = 0;
+
+static void ring_exit(void *arg)
+{
+	struct log_ring *r = arg;
+
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_get
+ *
+ * Returns the calling thread's ring, setting it up the first time the
+ * thread logs. Returns NULL if there is no flusher to empty it.
+ */
+static struct log_ring *ring_get(void)
+{
+	struct log_ring *r = my_ring;
+
+	if(r != NULL || !__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+		return r;
+	r = calloc(1, sizeof(struct log_ring));
+	if(r == NULL)
+		return NULL;
+	r->tid = syscall(SYS_gettid);
+	pthread_setspecific(ring_key, r);
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	my_ring = r;
+	return r;
+}
+
+/*
+ * emit
+ *
+ * Writes one message out, errors and warnings to stderr and the rest to
+ * stdout.
+ */
+static void emit(struct log_rec *rec)
+{
+	static FILE *last = NULL;
+	FILE *f = rec->level <= LOG_WARN ? stderr : stdout;
+	char when[32];
+	struct tm tm;
+	int len = strlen(rec->msg);
+
+	if(len > 0 && rec->msg[len - 1] == '\n')
+		rec->msg[--len] = '\0';
+	// Keep the order when both go to the same place.
+	if(last != NULL && last != f)
+		fflush(last);
+	last = f;
+	localtime_r(&rec->ts.tv_sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(f, "%s.%03ld %s [%d] %s", when, rec->ts.tv_nsec / 1000000, level_names[rec->level], rec->tid, rec->msg);
+	if(rec->suppressed)
+		fprintf(f, " (%d more like this not logged)", rec->suppressed);
+	fputc('\n', f);
+}
+
+static int seq_cmp(const void *a, const void *b)
+{
+	const struct log_rec *x = *(struct log_rec* const*)a, *y = *(struct log_rec* const*)b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void unlink_ring(struct log_ring *r)
+{
+	struct log_ring *expected = r, *p;
+
+	if(__atomic_compare_exchange_n(&rings, &expected, r->next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+	// Another thread pushed its ring in front of this one. Nothing but
+	// the flusher changes the links after the head.
+	for(p = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); p->next != r; p = p->next)
+		;
+	p->next = r->next;
+}
+
+/*
+ * drain
+ *
+ * Writes out everything in the rings in the order it was logged, and frees
+ * the rings of threads that have exited. Called with flush_lock held.
+ */
+static void drain(void)
+{
+	struct log_ring *r, *next;
+	struct log_rec **grown, note;
+	unsigned int t;
+	long dropped;
+	int n = 0, i, dead;
+
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+	{
+		r->flush_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for(t = r->tail; t != r->flush_head; t++)
+		{
+			if(n == batch_size)
+			{
+				grown = realloc(batch, (batch_size + 1024) * sizeof(*batch));
+				if(grown == NULL)
+					break;
+				batch = grown;
+				batch_size += 1024;
+			}
+			batch[n++] = &r->recs[t & (LOG_RING_SLOTS - 1)];
+		}
+		r->flush_head = t;
+	}
+	qsort(batch, n, sizeof(*batch), seq_cmp);
+	for(i = 0; i < n; i++)
+		emit(batch[i]);
+
+	memset(&note, 0, sizeof(note));
+	note.level = LOG_WARN;
+	clock_gettime(CLOCK_REALTIME_COARSE, &note.ts);
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = next)
+	{
+		next = r->next;
+		dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&r->tail, r->flush_head, __ATOMIC_RELEASE);
+		dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if(dropped)
+		{
+			note.tid = r->tid;
+			snprintf(note.msg, sizeof(note.msg), "Log ring full, %ld messages lost", dropped);
+			emit(&note);
+		}
+		// dead was read first, so the thread can't have logged anything
+		// since head was.
+		if(dead && r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		{
+			unlink_ring(r);
+			free(r);
+		}
+	}
+	fflush(stdout);
+	fflush(stderr);
+}
+
+static void *flushThread(void *arg)
+{
+	struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+
+	for(;;)
+	{
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&flush_lock);
+		drain();
+		pthread_mutex_unlock(&flush_lock);
+	}
+	return NULL;
+}
+
+/*
+ * log_init
+ *
+ * Starts the flusher. Until it is running, messages are written out by
+ * the thread logging them. Messages above level are not logged.
+ */
+void log_init(int level)
+{
+	pthread_t t;
+
+	log_level = level;
+	fflush(stdout);
+	pthread_key_create(&ring_key, ring_exit);
+	if(pthread_create(&t, NULL, flushThread, NULL) != 0)
+		return;
+	pthread_detach(t);
+	atexit(log_flush);
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * log_msg
+ *
+ * Logs a message from call site lim. The log_*() macros fill in lim and
+ * skip the call when level is filtered out. errno is left alone, so %m
+ * can be used.
+ */
+void log_msg(int level, struct log_limit *lim, const char *fmt, ...)
+{
+	struct log_ring *r;
+	struct log_rec *rec, local;
+	struct timespec ts;
+	long second;
+	unsigned int head;
+	int saved_errno = errno;
+	va_list ap;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	second = __atomic_load_n(&lim->second, __ATOMIC_RELAXED);
+	if(second != ts.tv_sec && __atomic_compare_exchange_n(&lim->second, &second, ts.tv_sec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&lim->count, 0, __ATOMIC_RELAXED);
+	if(__atomic_add_fetch(&lim->count, 1, __ATOMIC_RELAXED) > LOG_BURST)
+	{
+		__atomic_add_fetch(&lim->suppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	r = ring_get();
+	if(r == NULL)
+		rec = &local;
+	else
+	{
+		head = r->head;
+		if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS)
+		{
+			__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		rec = &r->recs[head & (LOG_RING_SLOTS - 1)];
+	}
+	rec->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+	rec->ts = ts;
+	rec->level = level;
+	rec->tid = r != NULL ? r->tid : getpid();
+	rec->suppressed = __atomic_exchange_n(&lim->suppressed, 0, __ATOMIC_RELAXED);
+	errno = saved_errno;
+	va_start(ap, fmt);
+	vsnprintf(rec->msg, LOG_MSG_MAX, fmt, ap);
+	va_end(ap);
+	errno = saved_errno;
+
+	if(r == NULL)
+		emit(rec);
+	else
+		__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * log_flush
+ *
+ * Writes out everything logged so far. Called at exit, and before the
+ * server hands over to a new one.
+ */
+void log_flush(void)
+{
+	pthread_mutex_lock(&flush_lock);
+	drain();
+	pthread_mutex_unlock(&flush_lock);
+}
@@ -0,0 +1,80 @@
+/* simplevpn-log.h -- Logging that never blocks the thread doing it */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_LOG_H
+#define SIMPLEVPN_LOG_H
+
+/*
+ * Every thread that logs gets a ring of its own. log_msg() formats the
+ * message into the next free slot and returns. It takes no lock and makes
+ * no system call, so the forwarding thread and the client threads can log
+ * while holding the core lock. A flusher thread started by log_init()
+ * collects the rings, puts the messages back in the order they were logged
+ * and writes them out, errors and warnings to stderr and the rest to
+ * stdout. A message that finds its thread's ring full is counted and
+ * dropped, and the count is written out in its place.
+ *
+ * Each call site may log LOG_BURST messages a second. Messages past that
+ * are counted, and the count is added to the next one that gets through.
+ * A disconnect storm or a client sending garbage costs one line a second
+ * instead of one per packet.
+ */
+
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+#define LOG_RING_SLOTS 64	// Messages a thread can log between flushes. Power of 2
+#define LOG_MSG_MAX    160	// Longer messages are cut short
+#define LOG_FLUSH_MS   50
+#define LOG_BURST      10	// Messages a call site may log each second
+
+/*
+ * struct log_limit
+ *
+ * Rate limit state of one call site. The log_*() macros keep one of these
+ * for each place they are used.
+ */
+struct log_limit
+{
+	long second;		// Second count was started in
+	int count;
+	int suppressed;		// Messages not logged since the last that was
+};
+
+extern int log_level;
+
+#define log_at(level, ...) do { \
+		static struct log_limit log_lim_; \
+		if((level) <= log_level) \
+			log_msg((level), &log_lim_, __VA_ARGS__); \
+	} while(0)
+
+#define log_err(...)   log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+void log_init(int level);
+void log_msg(int level, struct log_limit *lim, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void log_flush(void);
+
+#endif
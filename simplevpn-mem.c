@@ -0,0 +1,427 @@
+/* simplevpn-mem.c -- Slab caches, packet buffer arenas and memory budgets */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "simplevpn-mem.h"
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+/*
+ * struct mem_hdr
+ *
+ * Sits in front of every mem_alloc() buffer so mem_free() knows which
+ * cache it came from. Buffers too big for any size class are malloc'd and
+ * have no cache.
+ */
+struct mem_hdr
+{
+	struct mem_cache *cache;
+	size_t size;		// Usable bytes after the header
+};
+
+/*
+ * struct mem_mag
+ *
+ * A thread's private stock of free objects from one cache.
+ */
+struct mem_mag
+{
+	int n;
+	int warm;		// Set once this thread has come back for more
+	void *objs[MEM_MAG_SIZE];
+};
+
+// Packet buffer size classes, header included. 1536 fits a packet from a
+// 1400 byte MTU tunnel and the largest holds a maximum size frame.
+static const size_t class_sizes[] = { 128, 512, 1536, 2048, 8192, 32768, 131072 };
+static const char *class_names[] = { "buf-128", "buf-512", "buf-1536", "buf-2048", "buf-8192", "buf-32k", "buf-128k" };
+#define MEM_NCLASSES (sizeof(class_sizes) / sizeof(class_sizes[0]))
+
+// Every cache also keeps a bump pointer into its newest arena, so objects
+// are only touched once they are handed out.
+static struct mem_cache caches[MEM_MAX_CACHES];
+static char *bump[MEM_MAX_CACHES], *bump_end[MEM_MAX_CACHES];
+static int ncaches = 0;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mem_cache *classes[MEM_NCLASSES];
+static struct mem_cache *budget_cache;
+
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mag_key;
+static __thread struct mem_mag mags[MEM_MAX_CACHES];
+static __thread int mag_registered;
+
+static int use_hugepages = 0;
+static size_t mem_limit = 0;		// 0 means no limit
+static size_t arena_bytes = 0;
+static size_t large_bytes = 0;
+
+static struct mem_cache *cache_init(const char *name, size_t size)
+{
+	struct mem_cache *c;
+
+	pthread_mutex_lock(&caches_lock);
+	if(ncaches == MEM_MAX_CACHES)
+	{
+		pthread_mutex_unlock(&caches_lock);
+		return NULL;
+	}
+	c = &caches[ncaches];
+	memset(c, 0, sizeof(struct mem_cache));
+	c->name = name;
+	c->size = (size < sizeof(void*)) ? sizeof(void*) : (size + 15) & ~(size_t)15;
+	c->index = ncaches++;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_mutex_unlock(&caches_lock);
+	return c;
+}
+
+/*
+ * mag_drain
+ *
+ * Gives n objects from the end of thread's magazine m back to cache c.
+ */
+static void mag_drain(struct mem_cache *c, struct mem_mag *m, int n)
+{
+	pthread_mutex_lock(&c->lock);
+	while(n-- > 0 && m->n > 0)
+	{
+		void *obj = m->objs[--m->n];
+
+		*(void**)obj = c->free_list;
+		c->free_list = obj;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * mag_flush
+ *
+ * Runs when a thread exits, so the objects it was holding on to aren't
+ * lost.
+ */
+static void mag_flush(void *arg)
+{
+	int i;
+
+	for(i = 0; i < ncaches; i++)
+		mag_drain(&caches[i], &mags[i], MEM_MAG_SIZE);
+}
+
+static void mag_register(void)
+{
+	mag_registered = 1;
+	pthread_setspecific(mag_key, (void*)1);
+}
+
+static void mem_setup(void)
+{
+	unsigned int i;
+
+	pthread_key_create(&mag_key, mag_flush);
+	for(i = 0; i < MEM_NCLASSES; i++)
+		classes[i] = cache_init(class_names[i], class_sizes[i]);
+	budget_cache = cache_init("budget", sizeof(struct mem_budget));
+}
+
+/*
+ * mem_init
+ *
+ * Sets up the allocator. Arenas come from huge pages if hugepages is set
+ * and the system has some reserved, and the arenas and oversized buffers
+ * together may not grow past limit bytes (0 for no limit). Programs that
+ * are happy with the defaults don't need to call this.
+ */
+void mem_init(int hugepages, size_t limit)
+{
+	use_hugepages = hugepages;
+	mem_limit = limit;
+	pthread_once(&setup_once, mem_setup);
+}
+
+size_t mem_total(void)
+{
+	return __atomic_load_n(&arena_bytes, __ATOMIC_RELAXED) + __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * arena_grow
+ *
+ * Maps a new arena for cache c. Must be called with c's lock held. Returns
+ * -1 if the memory limit has been reached or the system is out of memory.
+ */
+static int arena_grow(struct mem_cache *c)
+{
+	char *chunk = MAP_FAILED;
+
+	if(mem_limit != 0 && mem_total() + MEM_CHUNK > mem_limit)
+		return -1;
+
+	if(use_hugepages)
+	{
+		chunk = mmap(NULL, MEM_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(chunk == MAP_FAILED)
+		{
+			perror("mmap(MAP_HUGETLB), using normal pages");
+			use_hugepages = 0;
+		}
+	}
+	if(chunk == MAP_FAILED)
+		chunk = mmap(NULL, MEM_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(chunk == MAP_FAILED)
+		return -1;
+
+	bump[c->index] = chunk;
+	bump_end[c->index] = chunk + (MEM_CHUNK / c->size) * c->size;
+	__atomic_add_fetch(&arena_bytes, MEM_CHUNK, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * mag_refill
+ *
+ * Fills up to half of thread's magazine m from cache c's free list, or
+ * takes one new object if the free list is empty. A thread's first refill
+ * only takes one object, so a crowd of threads that each allocate once
+ * doesn't hoard the free list.
+ */
+static void mag_refill(struct mem_cache *c, struct mem_mag *m)
+{
+	int want = m->warm ? MEM_MAG_SIZE / 2 : 1;
+
+	if(!mag_registered)
+		mag_register();
+	m->warm = 1;
+
+	pthread_mutex_lock(&c->lock);
+	while(m->n < want)
+	{
+		void *obj = c->free_list;
+
+		if(obj != NULL)
+		{
+			c->free_list = *(void**)obj;
+		}
+		else
+		{
+			// Fresh objects are handed out one at a time.
+			if(m->n > 0)
+				break;
+			if(bump[c->index] == bump_end[c->index] && arena_grow(c) < 0)
+				break;
+			obj = bump[c->index];
+			bump[c->index] += c->size;
+			c->objs++;
+		}
+		m->objs[m->n++] = obj;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+struct mem_cache *mem_cache_create(const char *name, size_t size)
+{
+	pthread_once(&setup_once, mem_setup);
+	if(size > MEM_CHUNK)
+		return NULL;
+	return cache_init(name, size);
+}
+
+void *mem_cache_alloc(struct mem_cache *c)
+{
+	struct mem_mag *m = &mags[c->index];
+
+	if(m->n == 0)
+		mag_refill(c, m);
+	if(m->n == 0)
+		return NULL;
+	__atomic_add_fetch(&c->inuse, 1, __ATOMIC_RELAXED);
+	return m->objs[--m->n];
+}
+
+void mem_cache_free(struct mem_cache *c, void *obj)
+{
+	struct mem_mag *m = &mags[c->index];
+
+	if(!mag_registered)
+		mag_register();
+	if(m->n == MEM_MAG_SIZE)
+		mag_drain(c, m, MEM_MAG_SIZE / 2);
+	m->objs[m->n++] = obj;
+	__atomic_sub_fetch(&c->inuse, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_alloc
+ *
+ * Returns a buffer of at least len bytes from the smallest size class that
+ * fits, or NULL if the memory limit has been reached.
+ */
+void *mem_alloc(size_t len)
+{
+	size_t need = len + sizeof(struct mem_hdr);
+	struct mem_hdr *h;
+	unsigned int i;
+
+	pthread_once(&setup_once, mem_setup);
+	for(i = 0; i < MEM_NCLASSES; i++)
+	{
+		if(need > class_sizes[i])
+			continue;
+		if((h = mem_cache_alloc(classes[i])) == NULL)
+			return NULL;
+		h->cache = classes[i];
+		h->size = class_sizes[i] - sizeof(struct mem_hdr);
+		return h + 1;
+	}
+
+	if(mem_limit != 0 && mem_total() + need > mem_limit)
+		return NULL;
+	if((h = malloc(need)) == NULL)
+		return NULL;
+	h->cache = NULL;
+	h->size = len;
+	__atomic_add_fetch(&large_bytes, need, __ATOMIC_RELAXED);
+	return h + 1;
+}
+
+void mem_free(void *p)
+{
+	struct mem_hdr *h;
+
+	if(p == NULL)
+		return;
+	h = (struct mem_hdr*)p - 1;
+	if(h->cache != NULL)
+	{
+		mem_cache_free(h->cache, h);
+		return;
+	}
+	__atomic_sub_fetch(&large_bytes, h->size + sizeof(struct mem_hdr), __ATOMIC_RELAXED);
+	free(h);
+}
+
+size_t mem_usable(void *p)
+{
+	return ((struct mem_hdr*)p - 1)->size;
+}
+
+struct mem_budget *mem_budget_create(long limit)
+{
+	struct mem_budget *b;
+
+	pthread_once(&setup_once, mem_setup);
+	if((b = mem_cache_alloc(budget_cache)) == NULL)
+		return NULL;
+	b->used = 0;
+	b->limit = limit;
+	b->refs = 1;
+	b->waiting = 0;
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	return b;
+}
+
+static void budget_put(struct mem_budget *b)
+{
+	if(__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->cond);
+	mem_cache_free(budget_cache, b);
+}
+
+/*
+ * mem_budget_release
+ *
+ * Drops the owner's reference. The budget is freed once nothing is charged
+ * to it any more.
+ */
+void mem_budget_release(struct mem_budget *b)
+{
+	budget_put(b);
+}
+
+/*
+ * mem_budget_charge
+ *
+ * Charges n bytes to b. Returns 1 if b is now over its limit.
+ */
+int mem_budget_charge(struct mem_budget *b, long n)
+{
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+	return __atomic_add_fetch(&b->used, n, __ATOMIC_SEQ_CST) > b->limit;
+}
+
+void mem_budget_uncharge(struct mem_budget *b, long n)
+{
+	if(__atomic_sub_fetch(&b->used, n, __ATOMIC_SEQ_CST) <= b->limit && __atomic_load_n(&b->waiting, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&b->lock);
+		pthread_cond_signal(&b->cond);
+		pthread_mutex_unlock(&b->lock);
+	}
+	budget_put(b);
+}
+
+/*
+ * mem_budget_wait
+ *
+ * Blocks the owner of b while it is over its limit.
+ */
+void mem_budget_wait(struct mem_budget *b)
+{
+	if(__atomic_load_n(&b->used, __ATOMIC_SEQ_CST) <= b->limit)
+		return;
+
+	pthread_mutex_lock(&b->lock);
+	__atomic_store_n(&b->waiting, 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&b->used, __ATOMIC_SEQ_CST) > b->limit)
+		pthread_cond_wait(&b->cond, &b->lock);
+	__atomic_store_n(&b->waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * mem_report
+ *
+ * Prints how much memory the caches hold and how much of it is in use.
+ */
+void mem_report(FILE *f)
+{
+	int i;
+
+	fprintf(f, "Memory: %zu KB in arenas%s, %zu KB in large buffers", __atomic_load_n(&arena_bytes, __ATOMIC_RELAXED) / 1024, use_hugepages ? " (huge pages)" : "", __atomic_load_n(&large_bytes, __ATOMIC_RELAXED) / 1024);
+	if(mem_limit != 0)
+		fprintf(f, ", limit %zu KB", mem_limit / 1024);
+	fprintf(f, "\n");
+
+	for(i = 0; i < ncaches; i++)
+	{
+		struct mem_cache *c = &caches[i];
+
+		if(c->objs == 0)
+			continue;
+		fprintf(f, "  %-10s %7zu bytes %8ld in use %8ld allocated %8zu KB\n", c->name, c->size, __atomic_load_n(&c->inuse, __ATOMIC_RELAXED), c->objs, c->objs * c->size / 1024);
+	}
+}
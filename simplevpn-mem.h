@@ -0,0 +1,91 @@
+/* simplevpn-mem.h -- Slab caches, packet buffer arenas and memory budgets */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_MEM_H
+#define SIMPLEVPN_MEM_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// Caches grow by this much at a time. It is the size of a huge page, so
+// arenas can be backed by huge pages when they are available.
+#define MEM_CHUNK      (2 * 1024 * 1024)
+#define MEM_MAX_CACHES 16
+
+// Objects each thread keeps for itself so most allocations and frees don't
+// take the cache lock.
+#define MEM_MAG_SIZE 8
+
+/*
+ * struct mem_cache
+ *
+ * Objects of one size, carved out of MEM_CHUNK sized arenas. Freed objects
+ * go on a free list and are reused, never returned to the system.
+ */
+struct mem_cache
+{
+	const char *name;
+	size_t size;
+	int index;		// Slot in each thread's magazine table
+	pthread_mutex_t lock;
+	void *free_list;
+	long objs;		// Objects carved out of arenas so far
+	long inuse;
+};
+
+/*
+ * struct mem_budget
+ *
+ * Bytes one client is holding on the server. used may go over limit, and
+ * the client's thread waits in mem_budget_wait() until enough has been freed.
+ * The budget stays around until its owner and every packet charged to it
+ * are gone.
+ */
+struct mem_budget
+{
+	long used;
+	long limit;
+	int refs;		// Owner plus one per charged object
+	int waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+void mem_init(int hugepages, size_t limit);
+
+struct mem_cache *mem_cache_create(const char *name, size_t size);
+void *mem_cache_alloc(struct mem_cache *c);
+void mem_cache_free(struct mem_cache *c, void *obj);
+
+void *mem_alloc(size_t len);
+void mem_free(void *p);
+size_t mem_usable(void *p);
+
+struct mem_budget *mem_budget_create(long limit);
+void mem_budget_release(struct mem_budget *b);
+int mem_budget_charge(struct mem_budget *b, long n);
+void mem_budget_uncharge(struct mem_budget *b, long n);
+void mem_budget_wait(struct mem_budget *b);
+
+size_t mem_total(void);
+void mem_report(FILE *f);
+
+#endif
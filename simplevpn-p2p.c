@@ -0,0 +1,381 @@
+/* simplevpn-p2p.c -- Direct client-to-client shortcuts */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Two clients that send each other a lot of traffic through the server can
+ * talk directly instead. Every client has a UDP socket that it registers with
+ * the server's rendezvous socket, which lets the server see the client's
+ * public UDP endpoint. When the server notices a heavy flow between two
+ * clients it sends each of them the other's endpoint and a session id. Both
+ * clients then send punch datagrams to each other, which opens a path
+ * through most NATs. Once a datagram arrives from the peer, packets for it go
+ * over UDP. If punching fails, or the peer goes quiet, packets simply keep
+ * going through the server.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "simplevpn-p2p.h"
+
+#define P2P_MAX_SHORTCUTS 64
+#define P2P_FLOWS 4096
+
+#define SHORTCUT_FREE     0
+#define SHORTCUT_PUNCHING 1
+#define SHORTCUT_UP       2
+
+struct shortcut
+{
+	unsigned int vpn_ip;
+	struct sockaddr_in addr;
+	unsigned int session;
+	int state;
+	long long started;	// All times in ms
+	long long last_rx;
+	long long last_tx;
+};
+
+struct flow
+{
+	unsigned int a;
+	unsigned int b;
+	unsigned int bytes;
+	time_t window;
+	time_t introduced;
+};
+
+static int udp_fd = -1;
+static struct sockaddr_in server_addr;
+static unsigned int my_cookie = 0;
+static unsigned int my_vpn_ip = 0;
+static long long last_register = 0;
+static struct shortcut shortcuts[P2P_MAX_SHORTCUTS];
+static struct flow flows[P2P_FLOWS];
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * ctl_build
+ *
+ * Wraps msg in the IP header used for control messages on the tunnel
+ * stream. buf must have room for CTL_MSG_LEN bytes. Returns the length.
+ */
+int ctl_build(char *buf, struct ctl_msg *msg)
+{
+	memset(buf, 0, 20);
+	buf[0] = 0x45;
+	buf[2] = CTL_MSG_LEN >> 8;
+	buf[3] = CTL_MSG_LEN & 0xff;
+	buf[8] = 64;
+	buf[9] = CTL_PROTO;
+	memset(buf + 12, 0xff, 8);
+	memcpy(buf + 20, msg, sizeof(struct ctl_msg));
+	return CTL_MSG_LEN;
+}
+
+/*
+ * p2p_account
+ *
+ * Counts len bytes of traffic between VPN addresses a and b. Returns 1 when
+ * the pair has passed threshold bytes within the current window and should
+ * be introduced to each other. Pairs that were introduced recently are not
+ * introduced again until P2P_INTRO_RETRY has passed. Only the forwarding
+ * thread calls this, so the table has no lock.
+ */
+int p2p_account(unsigned int a, unsigned int b, int len, time_t now, unsigned int threshold)
+{
+	struct flow *f;
+
+	if(a > b)
+	{
+		unsigned int t = a;
+		a = b;
+		b = t;
+	}
+
+	f = &flows[((a * 2654435761U) ^ (b * 40503U)) % P2P_FLOWS];
+	if(f->a != a || f->b != b)
+	{
+		f->a = a;
+		f->b = b;
+		f->bytes = 0;
+		f->window = now;
+		f->introduced = 0;
+	}
+
+	if(now - f->window >= P2P_WINDOW)
+	{
+		f->bytes = 0;
+		f->window = now;
+	}
+	f->bytes += len;
+
+	if(f->bytes < threshold || (f->introduced != 0 && now - f->introduced < P2P_INTRO_RETRY))
+		return 0;
+	f->introduced = now;
+	return 1;
+}
+
+void p2p_client_init(int fd, struct sockaddr_in *server)
+{
+	udp_fd = fd;
+	memcpy(&server_addr, server, sizeof(server_addr));
+	my_cookie = 0;
+}
+
+static int p2p_sendto(struct sockaddr_in *to, int type, unsigned int id, const char *payload, int len)
+{
+	struct p2p_hdr hdr;
+	struct iovec iov[2];
+	struct msghdr mh;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = htonl(P2P_MAGIC);
+	hdr.type = type;
+	hdr.id = id;
+	hdr.vpn_ip = my_vpn_ip;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void*)payload;
+	iov[1].iov_len = len;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = to;
+	mh.msg_namelen = sizeof(struct sockaddr_in);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = (len > 0) ? 2 : 1;
+
+	return sendmsg(udp_fd, &mh, MSG_DONTWAIT);
+}
+
+static struct shortcut *find_shortcut(unsigned int vpn_ip)
+{
+	int i;
+
+	for(i = 0; i < P2P_MAX_SHORTCUTS; i++)
+		if(shortcuts[i].state != SHORTCUT_FREE && shortcuts[i].vpn_ip == vpn_ip)
+			return &shortcuts[i];
+	return NULL;
+}
+
+static void do_register(void)
+{
+	p2p_sendto(&server_addr, P2P_REGISTER, my_cookie, NULL, 0);
+	last_register = now_ms();
+}
+
+/*
+ * p2p_handle_ctl
+ *
+ * Acts on a control message from the server.
+ */
+void p2p_handle_ctl(struct ctl_msg *msg)
+{
+	struct shortcut *s;
+	int i;
+
+	if(udp_fd < 0)
+		return;
+
+	switch(msg->type)
+	{
+	case CTL_UDP_COOKIE:
+		my_cookie = msg->id;
+		my_vpn_ip = msg->vpn_ip;
+		server_addr.sin_port = msg->port;
+		do_register();
+		break;
+
+	case CTL_PEER:
+		if((s = find_shortcut(msg->vpn_ip)) == NULL)
+		{
+			for(i = 0; i < P2P_MAX_SHORTCUTS && shortcuts[i].state != SHORTCUT_FREE; i++)
+				;
+			if(i == P2P_MAX_SHORTCUTS)
+				return;
+			s = &shortcuts[i];
+		}
+		memset(s, 0, sizeof(struct shortcut));
+		s->vpn_ip = msg->vpn_ip;
+		s->addr.sin_family = AF_INET;
+		s->addr.sin_addr.s_addr = msg->addr;
+		s->addr.sin_port = msg->port;
+		s->session = msg->id;
+		s->state = SHORTCUT_PUNCHING;
+		s->started = now_ms();
+		printf("[p2p] Trying direct path to %s\n", inet_ntoa(*(struct in_addr*)&s->vpn_ip));
+		break;
+	}
+}
+
+/*
+ * p2p_send
+ *
+ * Sends a packet read from the tun interface straight to its destination if
+ * there is a working direct path to it. Returns 1 if it was sent, or 0 if it
+ * should go through the server.
+ */
+int p2p_send(const char *buf, int len)
+{
+	struct shortcut *s;
+
+	if(udp_fd < 0 || len < 20 || ((unsigned char)buf[0] >> 4) != 4)
+		return 0;
+
+	s = find_shortcut(*(unsigned int*)(buf + 16));
+	if(s == NULL || s->state != SHORTCUT_UP)
+		return 0;
+
+	if(p2p_sendto(&s->addr, P2P_DATA, s->session, buf, len) < 0)
+		return 0;
+	s->last_tx = now_ms();
+	return 1;
+}
+
+/*
+ * p2p_recv
+ *
+ * Reads one datagram from the UDP socket into buf. If it carries a tunneled
+ * packet, *pkt is pointed at it and its length is returned. Returns 0 for
+ * datagrams that were handled here, or -1 when there is nothing to read.
+ */
+int p2p_recv(char *buf, int size, char **pkt)
+{
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+	struct p2p_hdr *hdr = (struct p2p_hdr*)buf;
+	struct shortcut *s;
+	int n;
+
+	n = recvfrom(udp_fd, buf, size, MSG_DONTWAIT, (struct sockaddr*)&from, &fromlen);
+	if(n < 0)
+		return -1;
+	if(n < (int)sizeof(struct p2p_hdr) || ntohl(hdr->magic) != P2P_MAGIC)
+		return 0;
+
+	s = find_shortcut(hdr->vpn_ip);
+	if(s == NULL || s->session != hdr->id)
+		return 0;
+
+	s->last_rx = now_ms();
+	if(s->state == SHORTCUT_PUNCHING)
+	{
+		// NATs may have given the peer a different port than the one
+		// the server saw, so answer wherever it came from.
+		memcpy(&s->addr, &from, sizeof(from));
+		s->state = SHORTCUT_UP;
+		s->last_tx = s->last_rx;
+		printf("[p2p] Direct path to %s is up\n", inet_ntoa(*(struct in_addr*)&s->vpn_ip));
+	}
+
+	switch(hdr->type)
+	{
+	case P2P_PUNCH:
+		// The peer may not have heard from us yet.
+		p2p_sendto(&s->addr, P2P_KEEPALIVE, s->session, NULL, 0);
+		return 0;
+	case P2P_DATA:
+		*pkt = buf + sizeof(struct p2p_hdr);
+		return n - sizeof(struct p2p_hdr);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * p2p_tick
+ *
+ * Sends punches and keepalives that are due and gives up on direct paths
+ * that failed or went quiet. Returns the number of ms until it needs to be
+ * called again, or -1 if there is nothing to do.
+ */
+int p2p_tick(void)
+{
+	long long now = now_ms();
+	long long next = -1;
+	int i;
+
+	if(udp_fd < 0)
+		return -1;
+
+	if(my_cookie != 0)
+	{
+		if(now - last_register >= P2P_REGISTER_INTERVAL * 1000)
+			do_register();
+		next = last_register + P2P_REGISTER_INTERVAL * 1000 - now;
+	}
+
+	for(i = 0; i < P2P_MAX_SHORTCUTS; i++)
+	{
+		struct shortcut *s = &shortcuts[i];
+		long long due;
+
+		if(s->state == SHORTCUT_PUNCHING)
+		{
+			if(now - s->started >= P2P_PUNCH_TIMEOUT * 1000)
+			{
+				printf("[p2p] No direct path to %s, staying on the relay\n", inet_ntoa(*(struct in_addr*)&s->vpn_ip));
+				s->state = SHORTCUT_FREE;
+				continue;
+			}
+			if(now - s->last_tx >= P2P_PUNCH_MS)
+			{
+				p2p_sendto(&s->addr, P2P_PUNCH, s->session, NULL, 0);
+				s->last_tx = now;
+			}
+			due = s->last_tx + P2P_PUNCH_MS - now;
+		}
+		else if(s->state == SHORTCUT_UP)
+		{
+			if(now - s->last_rx >= P2P_IDLE_TIMEOUT * 1000)
+			{
+				printf("[p2p] Direct path to %s went quiet, back to the relay\n", inet_ntoa(*(struct in_addr*)&s->vpn_ip));
+				s->state = SHORTCUT_FREE;
+				continue;
+			}
+			if(now - s->last_tx >= P2P_KEEPALIVE_INTERVAL * 1000)
+			{
+				p2p_sendto(&s->addr, P2P_KEEPALIVE, s->session, NULL, 0);
+				s->last_tx = now;
+			}
+			due = s->last_tx + P2P_KEEPALIVE_INTERVAL * 1000 - now;
+		}
+		else
+		{
+			continue;
+		}
+
+		if(next < 0 || due < next)
+			next = due;
+	}
+
+	return (int)next;
+}
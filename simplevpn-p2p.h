@@ -0,0 +1,107 @@
+/* simplevpn-p2p.h -- Direct client-to-client shortcuts */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_P2P_H
+#define SIMPLEVPN_P2P_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+// IP protocol number used for control messages from the server on the
+// tunnel stream (RFC 3692 experimentation value). Control messages have
+// source and destination addresses of -1, like keepalives.
+#define CTL_PROTO 253
+
+#define CTL_UDP_COOKIE  1	// Register with the server's rendezvous socket
+#define CTL_PEER        2	// Try a direct path to another client
+#define CTL_STRIPE      3	// Open more streams to the server
+#define CTL_STRIPE_JOIN 4	// Client to server, first frame on an extra stream
+
+/*
+ * struct ctl_msg
+ *
+ * Payload of a control message. For CTL_UDP_COOKIE, addr and port are unused,
+ * vpn_ip is the receiving client's own address and id is the cookie it must
+ * present when it registers. For CTL_PEER, addr and port are the peer's
+ * public UDP endpoint, vpn_ip is its VPN address and id is the session both
+ * clients put in their datagrams. CTL_STRIPE tells a client that asked to
+ * stripe its tunnel how many streams it may have in all (port) and the
+ * cookie (id) it joins them with. A client sends
+ * CTL_STRIPE_JOIN with its VPN address, the cookie and the stream's index
+ * in port as the first frame on each extra stream.
+ */
+struct ctl_msg
+{
+	unsigned char type;
+	unsigned char reserved;
+	unsigned short port;	// Network byte order
+	unsigned int addr;	// Network byte order
+	unsigned int vpn_ip;	// Network byte order
+	unsigned int id;
+};
+
+#define CTL_MSG_LEN (20 + sizeof(struct ctl_msg))
+
+#define P2P_MAGIC     0x53565032
+#define P2P_REGISTER  1		// Client to server rendezvous socket
+#define P2P_PUNCH     2
+#define P2P_DATA      3		// Followed by one tunneled packet
+#define P2P_KEEPALIVE 4
+
+/*
+ * struct p2p_hdr
+ *
+ * Header of every datagram on the direct path. id is the cookie for
+ * P2P_REGISTER and the session for everything else.
+ */
+struct p2p_hdr
+{
+	unsigned int magic;	// Network byte order
+	unsigned char type;
+	unsigned char reserved[3];
+	unsigned int id;
+	unsigned int vpn_ip;	// Sender's VPN address, network byte order
+};
+
+// Pairs of clients that exchange this many bytes through the server within
+// P2P_WINDOW seconds are told about each other.
+#define P2P_DEFAULT_THRESHOLD (1024 * 1024)
+#define P2P_WINDOW        10
+#define P2P_INTRO_RETRY   300	// Seconds before a pair is introduced again
+
+#define P2P_PUNCH_MS      200	// Between hole punching attempts
+#define P2P_PUNCH_TIMEOUT 5	// Seconds before falling back to the relay
+#define P2P_KEEPALIVE_INTERVAL 5
+#define P2P_REGISTER_INTERVAL 20	// Keeps the NAT mapping to the server open
+#define P2P_IDLE_TIMEOUT  15	// Seconds of silence before a direct path is dropped
+
+int ctl_build(char *buf, struct ctl_msg *msg);
+
+// Server side
+int p2p_account(unsigned int a, unsigned int b, int len, time_t now, unsigned int threshold);
+
+// Client side
+void p2p_client_init(int udp_fd, struct sockaddr_in *server);
+void p2p_handle_ctl(struct ctl_msg *msg);
+int p2p_send(const char *buf, int len);
+int p2p_recv(char *buf, int size, char **pkt);
+int p2p_tick(void);
+
+#endif
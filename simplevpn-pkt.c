@@ -0,0 +1,334 @@
+/* simplevpn-pkt.c -- Packet buffers and stream framing */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "simplevpn-pkt.h"
+
+struct pkt *pkt_alloc(int len)
+{
+	struct pkt *p = mem_alloc(sizeof(struct pkt) + len);
+
+	if(p == NULL)
+		return NULL;
+
+	p->next = NULL;
+	p->len = len;
+	p->prio = PKT_PRIO_BULK;
+	p->flags = 0;
+	p->budget = NULL;
+	p->seq = 0;
+	return p;
+}
+
+void pkt_free(struct pkt *p)
+{
+	if(p->budget != NULL)
+		mem_budget_uncharge(p->budget, mem_usable(p));
+	mem_free(p);
+}
+
+/*
+ * pkt_charge
+ *
+ * Charges the memory p takes up to budget b until p is freed. Returns 1 if
+ * b is now over its limit.
+ */
+int pkt_charge(struct pkt *p, struct mem_budget *b)
+{
+	p->budget = b;
+	return mem_budget_charge(b, mem_usable(p));
+}
+
+/*
+ * frame_len
+ *
+ * The tunnel carries raw IP packets back to back on a TCP stream, so packet
+ * boundaries have to be recovered from the IP headers themselves. Returns the
+ * length of the packet at the start of buf, 0 if more bytes are needed to
+ * tell, or -1 if buf does not start with an IP header.
+ *
+ * Address requests and keepalives are bare 20-byte IPv4 headers whose total
+ * length field is usually left at zero, so any IPv4 length shorter than a
+ * header is treated as a 20-byte control message.
+ */
+int frame_len(const char *buf, int avail)
+{
+	const unsigned char *p = (const unsigned char*)buf;
+	int len;
+
+	if(avail < 1)
+		return 0;
+
+	switch(p[0] >> 4)
+	{
+	case 4:
+		if(avail < 4)
+			return 0;
+		len = (p[2] << 8) | p[3];
+		if(len < 20)
+			len = 20;
+		return len;
+	case 6:
+		if(avail < 6)
+			return 0;
+		return 40 + ((p[4] << 8) | p[5]);
+	default:
+		return -1;
+	}
+}
+
+static int port_is_interactive(int port)
+{
+	return port == 22 || port == 53;
+}
+
+/*
+ * pkt_classify
+ *
+ * Picks a traffic class for a packet by looking at its inner IP header.
+ * Packets marked EF or network control, ICMP, DNS, TCP segments with no
+ * payload (ACKs, SYNs, FINs), small SSH segments and other small UDP
+ * datagrams (VoIP, games) are interactive. Everything else is bulk.
+ */
+int pkt_classify(const char *buf, int len)
+{
+	const unsigned char *p = (const unsigned char*)buf;
+	const unsigned char *l4;
+	int hlen, proto, dscp, l4len;
+
+	if(len <= 20)
+		return PKT_PRIO_INTERACTIVE;	// Keepalives and address requests
+
+	switch(p[0] >> 4)
+	{
+	case 4:
+		hlen = (p[0] & 0x0f) * 4;
+		dscp = p[1] >> 2;
+		proto = p[9];
+		// Non-first fragments carry no transport header.
+		if(((p[6] & 0x1f) | p[7]) != 0)
+			proto = -1;
+		break;
+	case 6:
+		hlen = 40;
+		dscp = (((p[0] & 0x0f) << 4) | (p[1] >> 4)) >> 2;
+		proto = p[6];
+		break;
+	default:
+		return PKT_PRIO_BULK;
+	}
+
+	if(dscp == 46 || dscp >= 48)
+		return PKT_PRIO_INTERACTIVE;	// EF, CS6, CS7
+	if(dscp == 8)
+		return PKT_PRIO_BULK;		// CS1 asks to be treated as background
+	if(len > PKT_SMALL || hlen < 20 || hlen >= len)
+		return PKT_PRIO_BULK;
+
+	l4 = p + hlen;
+	l4len = len - hlen;
+	switch(proto)
+	{
+	case 1:		// ICMP
+	case 58:	// ICMPv6
+	case 17:	// UDP: DNS, VoIP, games
+		return PKT_PRIO_INTERACTIVE;
+	case 6:		// TCP
+		if(l4len < 20)
+			return PKT_PRIO_BULK;
+		if(l4len == ((l4[12] >> 4) * 4))
+			return PKT_PRIO_INTERACTIVE;	// No payload
+		if(port_is_interactive((l4[0] << 8) | l4[1]) || port_is_interactive((l4[2] << 8) | l4[3]))
+			return PKT_PRIO_INTERACTIVE;
+		return PKT_PRIO_BULK;
+	default:
+		return PKT_PRIO_BULK;
+	}
+}
+
+/*
+ * pkt_flow_hash
+ *
+ * Hashes the addresses, protocol and ports of the packet in buf, so that
+ * every packet of one connection hashes the same. Fragments are hashed
+ * without ports, as only the first one has them.
+ */
+unsigned int pkt_flow_hash(const char *buf, int len)
+{
+	const unsigned char *p = (const unsigned char*)buf;
+	unsigned int h = 2166136261u;	// FNV-1a
+	int i, hlen, proto, start, end;
+
+	if(len >= 20 && (p[0] >> 4) == 4)
+	{
+		hlen = (p[0] & 0x0f) * 4;
+		proto = p[9];
+		start = 12;
+		end = 20;
+		if((p[6] & 0x3f) | p[7])
+			proto |= 0x100;		// More fragments, or not the first
+	}
+	else if(len >= 40 && (p[0] >> 4) == 6)
+	{
+		hlen = 40;
+		proto = p[6];
+		start = 8;
+		end = 40;
+	}
+	else
+		return 0;
+
+	for(i = start; i < end; i++)
+		h = (h ^ p[i]) * 16777619u;
+	h = (h ^ proto) * 16777619u;
+	if((proto == 6 || proto == 17) && len >= hlen + 4)
+		for(i = hlen; i < hlen + 4; i++)
+			h = (h ^ p[i]) * 16777619u;
+	return h ^ (h >> 16);
+}
+
+/*
+ * csum_update16
+ *
+ * Incrementally updates a ones' complement checksum after a 16-bit field
+ * changed from old to new (RFC 1624). Fields that start on an odd byte offset
+ * contribute to the sum byte-swapped.
+ */
+static void csum_update16(unsigned char *csum, unsigned int old, unsigned int new, int odd)
+{
+	unsigned int sum;
+
+	if(odd)
+	{
+		old = ((old & 0xff) << 8) | (old >> 8);
+		new = ((new & 0xff) << 8) | (new >> 8);
+	}
+
+	sum = (~((csum[0] << 8) | csum[1]) & 0xffff) + (~old & 0xffff) + new;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+	csum[0] = sum >> 8;
+	csum[1] = sum & 0xff;
+}
+
+/*
+ * pkt_set_ce
+ *
+ * Marks the packet in buf Congestion Experienced (RFC 3168) if its sender
+ * said it understands ECN, patching the IPv4 header checksum. Returns 1 if
+ * the packet is marked now, or 0 if it has to be dropped instead.
+ */
+int pkt_set_ce(char *buf, int len)
+{
+	unsigned char *p = (unsigned char*)buf;
+	unsigned int old;
+
+	switch(len >= 20 ? p[0] >> 4 : 0)
+	{
+	case 4:
+		if((p[1] & 0x03) == 0)
+			return 0;
+		old = (p[0] << 8) | p[1];
+		p[1] |= 0x03;
+		csum_update16(p + 10, old, (p[0] << 8) | p[1], 0);
+		return 1;
+	case 6:
+		if(len < 40 || (p[1] & 0x30) == 0)
+			return 0;
+		p[1] |= 0x30;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * pkt_clamp_mss
+ *
+ * If buf holds a TCP SYN whose MSS option would produce segments too big for
+ * a tunnel with the given MTU, lowers the MSS and patches the TCP checksum.
+ * Returns 1 if the packet was changed.
+ */
+int pkt_clamp_mss(char *buf, int len, int mtu)
+{
+	unsigned char *p = (unsigned char*)buf;
+	unsigned char *tcp;
+	int hlen, doff, mss, i;
+
+	switch(p[0] >> 4)
+	{
+	case 4:
+		hlen = (p[0] & 0x0f) * 4;
+		if(p[9] != 6 || ((p[6] & 0x1f) | p[7]) != 0)
+			return 0;
+		mss = mtu - 40;
+		break;
+	case 6:
+		hlen = 40;
+		if(p[6] != 6)
+			return 0;
+		mss = mtu - 60;
+		break;
+	default:
+		return 0;
+	}
+
+	if(hlen < 20 || len < hlen + 20)
+		return 0;
+	tcp = p + hlen;
+	if((tcp[13] & 0x02) == 0)
+		return 0;	// Only SYNs carry an MSS
+	doff = (tcp[12] >> 4) * 4;
+	if(doff < 20 || hlen + doff > len)
+		return 0;
+
+	i = 20;
+	while(i < doff)
+	{
+		int kind = tcp[i], olen;
+
+		if(kind == 0)
+			break;		// End of options
+		if(kind == 1)
+		{
+			i++;		// NOP
+			continue;
+		}
+		if(i + 1 >= doff)
+			break;
+		olen = tcp[i + 1];
+		if(olen < 2 || i + olen > doff)
+			break;
+
+		if(kind == 2 && olen == 4)
+		{
+			int old = (tcp[i + 2] << 8) | tcp[i + 3];
+
+			if(old <= mss)
+				return 0;
+			tcp[i + 2] = mss >> 8;
+			tcp[i + 3] = mss & 0xff;
+			csum_update16(tcp + 16, old, mss, (i + 2) & 1);
+			return 1;
+		}
+		i += olen;
+	}
+	return 0;
+}
@@ -0,0 +1,133 @@
+/* simplevpn-pkt.h -- Packet buffers and stream framing */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_PKT_H
+#define SIMPLEVPN_PKT_H
+
+#include "simplevpn-mem.h"
+
+// Largest frame that can appear on the tunnel stream. IPv6 packets can be
+// up to 40 bytes of header plus a 64k payload.
+#define PKT_MAX_FRAME (65535 + 40)
+
+// Traffic classes. Interactive packets are written ahead of bulk ones.
+#define PKT_PRIO_INTERACTIVE 0
+#define PKT_PRIO_BULK        1
+#define PKT_NPRIO            2
+
+// Packets longer than this are never considered interactive unless their
+// DSCP says so.
+#define PKT_SMALL 256
+
+// pkt flags
+#define PKT_FROM_PEER 0x01	// Arrived over a cluster trunk
+#define PKT_SEQ       0x02	// Written with its sequence number in front
+
+// MTU and netmask given to clients unless the server is told otherwise.
+#define DEFAULT_TUN_MTU     1400
+#define DEFAULT_TUN_NETMASK 0xffff0000
+
+/*
+ * struct addr_reply_opts
+ *
+ * The server's answer to an address request is the 20-byte request header,
+ * with the assigned address in the destination field, followed by these
+ * settings for the client's tun interface. The header's total length field
+ * covers them. Clients that predate this only look at the header, and older
+ * servers send the header alone, so both sides fall back to the defaults
+ * when the settings are missing.
+ */
+struct addr_reply_opts
+{
+	unsigned int netmask;	// Network byte order
+	unsigned short mtu;	// Network byte order
+	unsigned short streams;	// Network byte order, see below
+};
+
+#define ADDR_REPLY_LEN (20 + sizeof(struct addr_reply_opts))
+
+/*
+ * struct addr_req_opts
+ *
+ * May follow the header of an address request, covered by its total length
+ * field. A client that asks for more than one stream and gets a reply with
+ * streams set may open that many connections in all. From the reply on,
+ * every frame on the connection in either direction is preceded by a
+ * sequence number (see simplevpn-stripe.h). A client with networks behind
+ * it lists them after the options, and the server routes them to it.
+ */
+struct addr_req_opts
+{
+	unsigned short streams;	// Network byte order
+	unsigned short subnets;	// Network byte order
+};
+
+struct addr_subnet
+{
+	unsigned int net;	// Network byte order
+	unsigned char len;
+	unsigned char reserved[3];
+};
+
+// Most subnets one client may advertise.
+#define ADDR_MAX_SUBNETS 16
+
+/*
+ * A request may end with a 32-bit word of flags in network byte order after
+ * the subnets. If it does, the reply ends with one after its settings,
+ * saying which of the things asked for the server agreed to.
+ */
+#define ADDR_FLAG_COMPRESS 0x1	// Compress headers (see simplevpn-comp.h)
+
+#define ADDR_REQ_LEN (20 + sizeof(struct addr_req_opts))
+#define ADDR_REQ_MAX (ADDR_REQ_LEN + ADDR_MAX_SUBNETS * sizeof(struct addr_subnet) + 4)
+#define ADDR_REPLY_MAX (ADDR_REPLY_LEN + 4)
+
+/*
+ * struct pkt
+ *
+ * One tunneled packet, copied out of the receive buffer so it can sit in a
+ * queue until it is written to its destination. Packets live in the packet
+ * buffer arenas, and may be charged to the budget of the client that sent
+ * them until they are freed.
+ */
+struct pkt
+{
+	struct pkt *next;
+	int len;
+	int prio;
+	int flags;
+	unsigned int stamp;	// When it was queued, in microseconds (see txq_push())
+	struct mem_budget *budget;
+	unsigned int seq;	// Network byte order. Must stay right before data
+	char data[];
+};
+
+struct pkt *pkt_alloc(int len);
+void pkt_free(struct pkt *p);
+int pkt_charge(struct pkt *p, struct mem_budget *b);
+
+int frame_len(const char *buf, int avail);
+int pkt_classify(const char *buf, int len);
+unsigned int pkt_flow_hash(const char *buf, int len);
+int pkt_set_ce(char *buf, int len);
+int pkt_clamp_mss(char *buf, int len, int mtu);
+
+#endif
@@ -0,0 +1,152 @@
+/* simplevpn-pool.c -- VPN address pool */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "simplevpn-pool.h"
+
+static uint64_t free_map[POOL_WORDS];	// Bit set: address can be handed out
+static uint64_t pool_map[POOL_WORDS];	// Bit set: address belongs to the pool
+static unsigned int pool_net;		// Host byte order
+static unsigned int hint;		// Word the last grant came from
+
+/*
+ * pool_index
+ *
+ * Returns the bit number of ip (network byte order) in the bitmaps, or -1 if
+ * it is not in the pool's network.
+ */
+static int pool_index(unsigned int ip)
+{
+	ip = ntohl(ip);
+	if((ip & POOL_MASK) != pool_net)
+		return -1;
+	return ip & ~POOL_MASK;
+}
+
+void pool_init(unsigned int net)
+{
+	pool_net = net & POOL_MASK;
+	memset(free_map, 0, sizeof(free_map));
+	memset(pool_map, 0, sizeof(pool_map));
+	hint = POOL_WORDS - 1;
+}
+
+/*
+ * pool_add
+ *
+ * Adds ip (host byte order) to the pool as a free address. Only called while
+ * the pool is being set up.
+ */
+void pool_add(unsigned int ip)
+{
+	int i = pool_index(htonl(ip));
+
+	if(i < 0)
+		return;
+	pool_map[i / 64] |= 1ULL << (i % 64);
+	free_map[i / 64] |= 1ULL << (i % 64);
+}
+
+/*
+ * pool_grant
+ *
+ * Takes a free address out of the pool and returns it in network byte
+ * order, or 0 if the pool is empty. Addresses are handed out from the top
+ * of the range down. The search starts where the last one was found, so a
+ * storm of joins doesn't rescan the words that are already used up.
+ */
+unsigned int pool_grant(void)
+{
+	unsigned int start = __atomic_load_n(&hint, __ATOMIC_RELAXED);
+	int i;
+
+	for(i = 0; i < POOL_WORDS; i++)
+	{
+		unsigned int w = (start + POOL_WORDS - i) % POOL_WORDS;
+		uint64_t bits = __atomic_load_n(&free_map[w], __ATOMIC_ACQUIRE);
+
+		while(bits != 0)
+		{
+			int b = 63 - __builtin_clzll(bits);
+
+			if(__atomic_compare_exchange_n(&free_map[w], &bits, bits & ~(1ULL << b), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				__atomic_store_n(&hint, w, __ATOMIC_RELAXED);
+				return htonl(pool_net | (w * 64 + b));
+			}
+			// Lost a race with another thread. bits was
+			// reloaded by the compare and swap.
+		}
+	}
+	return 0;
+}
+
+/*
+ * pool_claim
+ *
+ * Takes the specific address ip (network byte order) out of the pool.
+ * Returns 1 if it was free.
+ */
+int pool_claim(unsigned int ip)
+{
+	int i = pool_index(ip);
+	uint64_t bit;
+
+	if(i < 0)
+		return 0;
+	bit = 1ULL << (i % 64);
+	return (__atomic_fetch_and(&free_map[i / 64], ~bit, __ATOMIC_ACQ_REL) & bit) != 0;
+}
+
+/*
+ * pool_release
+ *
+ * Puts ip (network byte order) back in the pool. Addresses that never
+ * belonged to the pool, such as ones from another cluster node's slice, are
+ * left alone. Returns 1 if the address went back into the pool.
+ */
+int pool_release(unsigned int ip)
+{
+	int i = pool_index(ip);
+	uint64_t bit;
+
+	if(i < 0)
+		return 0;
+	bit = 1ULL << (i % 64);
+	if((pool_map[i / 64] & bit) == 0)
+		return 0;
+	return (__atomic_fetch_or(&free_map[i / 64], bit, __ATOMIC_ACQ_REL) & bit) == 0;
+}
+
+/*
+ * pool_available
+ *
+ * Returns the number of free addresses. The count is only a snapshot.
+ */
+int pool_available(void)
+{
+	int i, n = 0;
+
+	for(i = 0; i < POOL_WORDS; i++)
+		n += __builtin_popcountll(__atomic_load_n(&free_map[i], __ATOMIC_RELAXED));
+	return n;
+}
@@ -0,0 +1,41 @@
+/* simplevpn-pool.h -- VPN address pool */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_POOL_H
+#define SIMPLEVPN_POOL_H
+
+// The pool covers one /16, or POOL_SIZE addresses if that is defined at
+// build time as another power of 2. Each address has a bit in a bitmap, so
+// handing out and taking back addresses is a single atomic operation and
+// never needs the core lock.
+#ifndef POOL_SIZE
+#define POOL_SIZE  65536
+#endif
+#define POOL_WORDS (POOL_SIZE / 64)
+#define POOL_MASK  ((unsigned int)~(POOL_SIZE - 1))	// Netmask of the pool, host byte order
+
+void pool_init(unsigned int net);
+void pool_add(unsigned int ip);
+unsigned int pool_grant(void);
+int pool_claim(unsigned int ip);
+int pool_release(unsigned int ip);
+int pool_available(void);
+
+#endif
@@ -0,0 +1,310 @@
+/* simplevpn-race.c -- Racing connections to every address of the servers */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "simplevpn-race.h"
+
+// Ranks for sorting addresses. Known addresses rank by their connect time
+// in milliseconds.
+#define RANK_UNKNOWN (1 << 20)
+#define RANK_DOWN    (1 << 24)
+
+#define RACE_MAX_CANDIDATES (RACE_MAX_SERVERS * RACE_MAX_ADDRS)
+
+static struct race_server servers[RACE_MAX_SERVERS];
+static int nservers = 0;
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * race_add_server
+ *
+ * Adds a server given as host or host:port. port is used if spec has
+ * none. Returns -1 if there are too many servers already.
+ */
+int race_add_server(const char *spec, unsigned short port)
+{
+	struct race_server *s;
+	char *colon;
+
+	if(nservers == RACE_MAX_SERVERS)
+		return -1;
+	s = &servers[nservers];
+	memset(s, 0, sizeof(*s));
+	s->host = strdup(spec);
+	if((colon = strrchr(s->host, ':')) != NULL)
+	{
+		*colon = '\0';
+		port = atoi(colon + 1);
+	}
+	if(port == 0 || s->host[0] == '\0')
+	{
+		free(s->host);
+		return -1;
+	}
+	snprintf(s->port, sizeof(s->port), "%d", port);
+	nservers++;
+	return 0;
+}
+
+/*
+ * resolve
+ *
+ * Looks up s's addresses if the ones we have are too old. Addresses we
+ * had before keep what we know about them. If the lookup fails, we carry
+ * on with the old ones.
+ */
+static void resolve(struct race_server *s, time_t now)
+{
+	struct addrinfo hints, *res, *ai;
+	struct race_addr old[RACE_MAX_ADDRS], *a;
+	int nold = s->naddrs, i, err;
+
+	if(s->resolved != 0 && now - s->resolved < RACE_CACHE_TTL)
+		return;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if((err = getaddrinfo(s->host, s->port, &hints, &res)) != 0)
+	{
+		fprintf(stderr, "Could not look up %s: %s\n", s->host, gai_strerror(err));
+		return;
+	}
+
+	memcpy(old, s->addrs, nold * sizeof(old[0]));
+	s->naddrs = 0;
+	for(ai = res; ai != NULL && s->naddrs < RACE_MAX_ADDRS; ai = ai->ai_next)
+	{
+		a = &s->addrs[s->naddrs];
+		memset(a, 0, sizeof(*a));
+		memcpy(&a->sa, ai->ai_addr, sizeof(a->sa));
+		a->srtt_ms = -1;
+		for(i = 0; i < s->naddrs; i++)
+			if(s->addrs[i].sa.sin_addr.s_addr == a->sa.sin_addr.s_addr)
+				break;
+		if(i < s->naddrs)
+			continue;
+		for(i = 0; i < nold; i++)
+			if(old[i].sa.sin_addr.s_addr == a->sa.sin_addr.s_addr && old[i].sa.sin_port == a->sa.sin_port)
+				*a = old[i];
+		s->naddrs++;
+	}
+	freeaddrinfo(res);
+	s->resolved = now;
+}
+
+static int rank(struct race_addr *a, time_t now)
+{
+	if(a->down_until > now)
+		return RANK_DOWN + (a->down_until - now);
+	if(a->srtt_ms < 0)
+		return RANK_UNKNOWN;
+	return a->srtt_ms;
+}
+
+/*
+ * candidates
+ *
+ * Fills cand with every address of every server, best first. Addresses
+ * of equal rank alternate between servers, so a server with many
+ * addresses that are all down can't hold up the others.
+ */
+static int candidates(struct race_addr **cand, time_t now)
+{
+	struct race_addr *a;
+	int n = 0, i, j, k, more = 1;
+
+	for(k = 0; more; k++)
+	{
+		more = 0;
+		for(i = 0; i < nservers; i++)
+			if(k < servers[i].naddrs)
+			{
+				cand[n++] = &servers[i].addrs[k];
+				more = 1;
+			}
+	}
+
+	// Insertion sort keeps that order among equals.
+	for(i = 1; i < n; i++)
+	{
+		a = cand[i];
+		for(j = i; j > 0 && rank(cand[j - 1], now) > rank(a, now); j--)
+			cand[j] = cand[j - 1];
+		cand[j] = a;
+	}
+	return n;
+}
+
+static void failed(struct race_addr *a, int err)
+{
+	int backoff;
+
+	a->fails++;
+	backoff = (a->fails < 7) ? (1 << (a->fails - 1)) : RACE_BACKOFF_MAX;
+	if(backoff > RACE_BACKOFF_MAX)
+		backoff = RACE_BACKOFF_MAX;
+	a->down_until = time(NULL) + backoff;
+	fprintf(stderr, "Could not connect to %s:%d: %s\n", inet_ntoa(a->sa.sin_addr), ntohs(a->sa.sin_port), strerror(err));
+}
+
+static void connected(struct race_addr *a, long ms)
+{
+	a->srtt_ms = (a->srtt_ms < 0) ? ms : (3 * a->srtt_ms + ms) / 4;
+	a->fails = 0;
+	a->down_until = 0;
+}
+
+/*
+ * race_connect
+ *
+ * Connects to one of the servers, racing their addresses as described in
+ * simplevpn-race.h. Returns the connected socket, in blocking mode, and
+ * puts the address it is connected to in remote. Returns -1 if nothing
+ * could be reached within RACE_TIMEOUT_MS; the names are looked up again
+ * on the next call.
+ */
+int race_connect(int socktype, struct sockaddr_in *remote)
+{
+	struct race_addr *cand[RACE_MAX_CANDIDATES], *pending[RACE_MAX_CANDIDATES];
+	struct pollfd pfd[RACE_MAX_CANDIDATES];
+	long started[RACE_MAX_CANDIDATES];
+	long start = now_ms(), next_start = start, t;
+	time_t now = time(NULL);
+	int ncand, next = 0, npending = 0, fd = -1, i, err;
+	socklen_t len;
+
+	for(i = 0; i < nservers; i++)
+		resolve(&servers[i], now);
+	ncand = candidates(cand, now);
+
+	while(fd < 0)
+	{
+		t = now_ms();
+		if(t - start >= RACE_TIMEOUT_MS)
+			break;
+
+		// Start the next attempt once the last one has had its head
+		// start, or straight away if nothing is in flight.
+		if(next < ncand && (npending == 0 || t >= next_start))
+		{
+			struct race_addr *a = cand[next++];
+
+			next_start = t + RACE_STAGGER_MS;
+			if((i = socket(AF_INET, socktype | SOCK_NONBLOCK, 0)) < 0)
+			{
+				perror("socket()");
+				break;
+			}
+			// A UDP socket is connected at once, so over UDP the first
+			// address in order wins.
+			if(connect(i, (struct sockaddr*)&a->sa, sizeof(a->sa)) == 0)
+			{
+				fd = i;
+				connected(a, 0);
+				*remote = a->sa;
+			}
+			else if(errno == EINPROGRESS)
+			{
+				pending[npending] = a;
+				started[npending] = t;
+				pfd[npending].fd = i;
+				pfd[npending].events = POLLOUT;
+				npending++;
+			}
+			else
+			{
+				failed(a, errno);
+				close(i);
+			}
+			continue;
+		}
+		if(npending == 0)
+			break;
+
+		t = ((next < ncand) ? next_start : start + RACE_TIMEOUT_MS) - t;
+		if(poll(pfd, npending, t > 0 ? t : 0) < 0 && errno != EINTR)
+		{
+			perror("poll()");
+			break;
+		}
+
+		for(i = 0; i < npending; i++)
+		{
+			if(pfd[i].revents == 0)
+				continue;
+			len = sizeof(err);
+			if(getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+				err = errno;
+			if(err == 0 && fd < 0)
+			{
+				fd = pfd[i].fd;
+				connected(pending[i], now_ms() - started[i]);
+				*remote = pending[i]->sa;
+			}
+			else if(err != 0)
+				failed(pending[i], err);
+			else
+				continue;
+
+			// Out of the running, one way or the other.
+			if(fd != pfd[i].fd)
+				close(pfd[i].fd);
+			npending--;
+			pending[i] = pending[npending];
+			started[i] = started[npending];
+			pfd[i] = pfd[npending];
+			i--;
+		}
+	}
+
+	// Attempts still going lost the race, or ran out of time.
+	for(i = 0; i < npending; i++)
+	{
+		if(fd < 0)
+			failed(pending[i], ETIMEDOUT);
+		close(pfd[i].fd);
+	}
+
+	if(fd < 0)
+	{
+		for(i = 0; i < nservers; i++)
+			servers[i].resolved = 0;
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	return fd;
+}
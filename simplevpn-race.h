@@ -0,0 +1,78 @@
+/* simplevpn-race.h -- Racing connections to every address of the servers */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_RACE_H
+#define SIMPLEVPN_RACE_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+#define RACE_MAX_SERVERS 8
+#define RACE_MAX_ADDRS   8	// Addresses kept for each server name
+
+// Head start each connection attempt gets before the next one is started,
+// and how long a round of attempts may take altogether.
+#define RACE_STAGGER_MS 250
+#define RACE_TIMEOUT_MS 5000
+
+// Seconds a name's addresses are used before it is looked up again.
+#define RACE_CACHE_TTL 300
+
+// Longest an address that failed is tried after the others, in seconds.
+#define RACE_BACKOFF_MAX 64
+
+/*
+ * race_connect() starts a connection to the most promising address of all
+ * the servers given, and another to the next one every RACE_STAGGER_MS
+ * until one of them is up, the way Happy Eyeballs (RFC 8305) does for a
+ * host's IPv4 and IPv6 addresses. An address that refuses straight away
+ * doesn't hold up the next. Addresses are tried fastest first, going by
+ * how long they took to connect before. Ones never tried come next and
+ * ones that failed recently come last, so a dead server costs nothing once
+ * it has been found out, and is tried again after it has been given time
+ * to come back.
+ */
+
+/*
+ * struct race_addr
+ *
+ * One address of a server and how connecting to it went.
+ */
+struct race_addr
+{
+	struct sockaddr_in sa;
+	int srtt_ms;		// Smoothed time to connect, -1 until it has been
+	int fails;		// Attempts in a row that failed
+	time_t down_until;	// Tried after the others until then
+};
+
+struct race_server
+{
+	char *host;
+	char port[8];
+	time_t resolved;	// 0 to look the name up before the next round
+	int naddrs;
+	struct race_addr addrs[RACE_MAX_ADDRS];
+};
+
+int race_add_server(const char *spec, unsigned short port);
+int race_connect(int socktype, struct sockaddr_in *remote);
+
+#endif
@@ -0,0 +1,627 @@
+/* simplevpn-replay.c -- Trace replay benchmark for simplevpn-srv */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replays a packet trace through a server. The trace is a pcap file of bare
+ * IP packets, such as one recorded with -C and exported with cap2pcap. Every
+ * address in the trace becomes an emulated client with a connection of its
+ * own, and each packet is sent on its source's connection at the time it was
+ * recorded, or sooner if the replay is sped up. Packets keep their recorded
+ * sizes and headers.
+ *
+ * A packet's position in the trace is written over its IP identification and
+ * header checksum, which the server never looks at, so whatever the packet's
+ * size the receiving client can tell which one it is and when it was sent.
+ * Reports how closely the replay kept to the recorded timing, forwarding
+ * throughput, the latency of packets through the server and drops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "simplevpn-pkt.h"
+#include "simplevpn-p2p.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW      101
+#define LINKTYPE_IPV4     228
+#define DLT_RAW           12	// LINKTYPE_RAW on some systems
+
+#define TRACE_HDR_MAX 64	// Bytes of each packet's headers kept from the trace
+#define OUT_BUF_SIZE  (256 * 1024)
+#define IN_BUF_SIZE   (2 * PKT_MAX_FRAME)
+#define KEEPALIVE_NS  (10 * 1000000000ULL)
+
+struct trace_pkt
+{
+	uint64_t t_ns;		// Since the first packet of the trace
+	uint32_t src, dst;	// Clients
+	uint32_t len;
+	uint32_t hlen;		// Bytes of hdr that came from the trace
+	unsigned char hdr[TRACE_HDR_MAX];
+};
+
+struct client
+{
+	int fd;
+	uint32_t trace_ip;	// Address in the trace
+	uint32_t vpn_ip;	// Address the server gave us, network byte order
+	int dirty;		// Has output waiting and is on the flush list
+	int outlen;
+	int inlen;
+	char *out;
+	char *in;
+};
+
+static struct trace_pkt *trace;
+static long ntrace, skipped;
+
+static struct client *clients;
+static int nclients, max_clients = 1024;
+static int *client_hash;
+static unsigned int hash_mask;
+
+static uint64_t *sent_ns;	// When each packet went out, 0 if it didn't
+static char *received;
+static double *lat;
+static long nlat, dups, rx_bytes;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+static void raise_fd_limit(int want)
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return;
+	if(rl.rlim_cur < (rlim_t)want)
+	{
+		rl.rlim_cur = (rl.rlim_max < (rlim_t)want) ? rl.rlim_max : (rlim_t)want;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+/*
+ * client_for
+ *
+ * Returns the client standing in for trace address ip, making a new one if
+ * there is room. Returns -1 once max_clients addresses have been seen.
+ */
+static int client_for(uint32_t ip)
+{
+	unsigned int h = (ip * 2654435761U) & hash_mask;
+
+	while(client_hash[h] >= 0)
+	{
+		if(clients[client_hash[h]].trace_ip == ip)
+			return client_hash[h];
+		h = (h + 1) & hash_mask;
+	}
+	if(nclients >= max_clients)
+		return -1;
+	clients[nclients].trace_ip = ip;
+	client_hash[h] = nclients;
+	return nclients++;
+}
+
+/*
+ * load_trace
+ *
+ * Reads the IPv4 packets out of a pcap file. Tunnel control messages and
+ * anything that isn't IPv4 are skipped.
+ */
+static int load_trace(const char *path)
+{
+	uint32_t fh[6], rh[4];
+	unsigned char *buf = malloc(262144);
+	long cap = 65536;
+	uint64_t first = 0, ts;
+	int nsec, linktype, skip;
+	FILE *f = fopen(path, "r");
+
+	if(f == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	if(fread(fh, sizeof(fh), 1, f) != 1 || (fh[0] != PCAP_MAGIC_US && fh[0] != PCAP_MAGIC_NS))
+	{
+		fprintf(stderr, "%s is not a pcap file written on this machine's byte order\n", path);
+		fclose(f);
+		return -1;
+	}
+	nsec = (fh[0] == PCAP_MAGIC_NS);
+	linktype = fh[5];
+	if(linktype == LINKTYPE_ETHERNET)
+		skip = 14;
+	else if(linktype == LINKTYPE_RAW || linktype == DLT_RAW || linktype == LINKTYPE_IPV4)
+		skip = 0;
+	else
+	{
+		fprintf(stderr, "%s has link type %d, only raw IP and ethernet are supported\n", path, linktype);
+		fclose(f);
+		return -1;
+	}
+
+	trace = malloc(cap * sizeof(struct trace_pkt));
+	while(fread(rh, sizeof(rh), 1, f) == 1)
+	{
+		unsigned char *ip = buf + skip;
+		struct trace_pkt *t;
+		uint32_t src, dst;
+		int s, d;
+
+		if(rh[2] > 262144 || fread(buf, 1, rh[2], f) != rh[2])
+			break;
+		ts = (uint64_t)rh[0] * 1000000000ULL + (nsec ? rh[1] : rh[1] * 1000ULL);
+
+		if(rh[2] < (uint32_t)skip + 20 || rh[3] < (uint32_t)skip + 20 || (ip[0] >> 4) != 4 ||
+		   (skip && (buf[12] != 0x08 || buf[13] != 0x00)))
+		{
+			skipped++;
+			continue;
+		}
+		memcpy(&src, ip + 12, 4);
+		memcpy(&dst, ip + 16, 4);
+		if(ip[9] == CTL_PROTO || (src == 0xffffffff && dst == 0xffffffff) || src == dst)
+		{
+			skipped++;
+			continue;
+		}
+		if((s = client_for(src)) < 0 || (d = client_for(dst)) < 0)
+		{
+			skipped++;
+			continue;
+		}
+
+		if(ntrace == cap)
+		{
+			cap *= 2;
+			trace = realloc(trace, cap * sizeof(struct trace_pkt));
+		}
+		if(ntrace == 0)
+			first = ts;
+		t = &trace[ntrace++];
+		t->t_ns = (ts > first) ? ts - first : 0;
+		t->src = s;
+		t->dst = d;
+		t->len = rh[3] - skip;
+		if(t->len > 65535)
+			t->len = 65535;
+		t->hlen = rh[2] - skip;
+		if(t->hlen > TRACE_HDR_MAX)
+			t->hlen = TRACE_HDR_MAX;
+		if(t->hlen > t->len)
+			t->hlen = t->len;
+		memcpy(t->hdr, ip, t->hlen);
+	}
+	fclose(f);
+	free(buf);
+	return 0;
+}
+
+static int read_full(int fd, char *buf, int len)
+{
+	int got = 0, n;
+
+	while(got < len)
+	{
+		n = recv(fd, buf + got, len - got, 0);
+		if(n <= 0)
+			return -1;
+		got += n;
+	}
+	return got;
+}
+
+/*
+ * client_join
+ *
+ * Connects a client to the server and asks for an address.
+ */
+static int client_join(struct client *c, struct sockaddr_in *server)
+{
+	char req[20], reply[256];
+	int len, one = 1;
+
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(c->fd < 0 || connect(c->fd, (struct sockaddr*)server, sizeof(*server)) < 0)
+		return -1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	memset(req, 0, sizeof(req));
+	req[0] = 0x45;
+	req[8] = 64;
+	if(send(c->fd, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+		return -1;
+	if(read_full(c->fd, reply, 4) < 0 || (len = frame_len(reply, 4)) < 20 || len > (int)sizeof(reply) ||
+	   read_full(c->fd, reply + 4, len - 4) < 0)
+		return -1;
+	memcpy(&c->vpn_ip, reply + 16, 4);
+
+	c->out = malloc(OUT_BUF_SIZE);
+	c->in = malloc(IN_BUF_SIZE);
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+/*
+ * client_flush
+ *
+ * Writes as much of a client's output as the socket takes. Returns 1 if
+ * some is left over.
+ */
+static int client_flush(struct client *c)
+{
+	int n = send(c->fd, c->out, c->outlen, MSG_NOSIGNAL);
+
+	if(n < 0)
+		return (errno == EAGAIN || errno == EINTR);
+	if(n < c->outlen)
+		memmove(c->out, c->out + n, c->outlen - n);
+	c->outlen -= n;
+	return c->outlen > 0;
+}
+
+/*
+ * client_read
+ *
+ * Reads what the server forwarded to a client and matches each packet to
+ * the time it was sent.
+ */
+static int client_read(struct client *c, uint64_t now)
+{
+	int n, len, off = 0;
+
+	n = recv(c->fd, c->in + c->inlen, IN_BUF_SIZE - c->inlen, 0);
+	if(n < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	if(n == 0)
+		return -1;
+	c->inlen += n;
+
+	while((len = frame_len(c->in + off, c->inlen - off)) > 0 && off + len <= c->inlen)
+	{
+		unsigned char *p = (unsigned char*)c->in + off;
+		uint32_t seq = ((uint32_t)p[4] << 24) | (p[5] << 16) | (p[10] << 8) | p[11];
+
+		off += len;
+		if((p[0] >> 4) != 4 || p[9] == CTL_PROTO || (p[12] & p[13] & p[14] & p[15]) == 0xff)
+			continue;	// Keepalives and control messages
+		if(seq >= ntrace || sent_ns[seq] == 0 || received[seq])
+		{
+			dups++;
+			continue;
+		}
+		received[seq] = 1;
+		rx_bytes += len;
+		lat[nlat++] = (now - sent_ns[seq]) / 1e9;
+	}
+	if(len < 0)
+		return -1;
+	if(off > 0)
+	{
+		memmove(c->in, c->in + off, c->inlen - off);
+		c->inlen -= off;
+	}
+	return 0;
+}
+
+static void watch(int ep, int idx, int out)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	ev.data.u32 = idx;
+	epoll_ctl(ep, EPOLL_CTL_MOD, clients[idx].fd, &ev);
+}
+
+static void percentiles(const char *what, double *v, long n, double scale, const char *unit)
+{
+	qsort(v, n, sizeof(double), cmp_double);
+	printf("%s p50 %.3f %s p90 %.3f %s p99 %.3f %s p99.9 %.3f %s max %.3f %s\n", what,
+		n ? v[n / 2] * scale : 0.0, unit,
+		n ? v[(long)(n * 0.9)] * scale : 0.0, unit,
+		n ? v[(long)(n * 0.99)] * scale : 0.0, unit,
+		n ? v[(long)(n * 0.999)] * scale : 0.0, unit,
+		n ? v[n - 1] * scale : 0.0, unit);
+}
+
+void usage(char *progname)
+{
+	printf("%s: replay a packet trace through simplevpn-srv\n\n", progname);
+	printf("usage: %s [options] <pcap file>\n\n", progname);
+	printf("\t-s <server ip>\tOptional. Server address. Default 127.0.0.1.\n");
+	printf("\t-p <port>\tOptional. Server port. Default 2002.\n");
+	printf("\t-x <speed>\tOptional. Replay this many times faster than recorded, 0 for as\n\t\t\tfast as possible. Default 1.\n");
+	printf("\t-n <clients>\tOptional. Most addresses from the trace to emulate. Default 1024.\n");
+	printf("\t-t <seconds>\tOptional. Wait this long for stragglers after the last packet.\n\t\t\tDefault 2.\n");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in server;
+	struct epoll_event events[256];
+	double speed = 1.0, *late, duration, elapsed;
+	uint64_t start, now, last_tx = 0, last_rx = 0, last_keepalive, tx_bytes = 0, trace_bytes = 0;
+	long next = 0, nsent = 0, nlate = 0, backlogged = 0, i;
+	int *flush_list, nflush = 0;
+	int drain = 2, ep, c, k;
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server.sin_port = htons(2002);
+
+	while ((c = getopt (argc, argv, "s:p:x:n:t:")) != -1)
+	{
+		switch (c)
+		{
+		case 's':
+			if(inet_aton(optarg, &server.sin_addr) == 0)
+			{
+				printf("Bad server address %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'p':
+			server.sin_port = htons(atoi(optarg));
+			break;
+		case 'x':
+			speed = atof(optarg);
+			break;
+		case 'n':
+			max_clients = atoi(optarg);
+			break;
+		case 't':
+			drain = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if(argc - optind != 1 || max_clients < 2 || speed < 0)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	for(hash_mask = 1; hash_mask < (unsigned int)max_clients * 2; hash_mask <<= 1)
+		;
+	client_hash = malloc(hash_mask * sizeof(int));
+	memset(client_hash, 0xff, hash_mask * sizeof(int));
+	hash_mask--;
+	clients = calloc(max_clients, sizeof(struct client));
+
+	if(load_trace(argv[optind]) < 0)
+		return 1;
+	if(ntrace == 0)
+	{
+		fprintf(stderr, "No IPv4 packets between two addresses in %s\n", argv[optind]);
+		return 1;
+	}
+	for(i = 0; i < ntrace; i++)
+		trace_bytes += trace[i].len;
+	duration = trace[ntrace - 1].t_ns / 1e9;
+	printf("trace: %ld packets, %.1f MB over %.3f s between %d addresses, %ld packets skipped\n",
+		ntrace, trace_bytes / 1e6, duration, nclients, skipped);
+
+	raise_fd_limit(nclients + 16);
+	ep = epoll_create1(0);
+	for(i = 0; i < nclients; i++)
+	{
+		struct epoll_event ev;
+
+		if(client_join(&clients[i], &server) < 0)
+		{
+			fprintf(stderr, "Client %ld of %d could not join: %s\n", i + 1, nclients, strerror(errno));
+			return 1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(ep, EPOLL_CTL_ADD, clients[i].fd, &ev);
+	}
+
+	sent_ns = calloc(ntrace, sizeof(uint64_t));
+	received = calloc(ntrace, 1);
+	lat = malloc(ntrace * sizeof(double));
+	late = malloc(ntrace * sizeof(double));
+	flush_list = malloc(nclients * sizeof(int));
+
+	start = now_ns();
+	last_keepalive = start;
+	for(;;)
+	{
+		int timeout = 0, batch = 0, stalled = 0;
+
+		now = now_ns();
+
+		// Queue everything that is due. When going flat out, queue a
+		// batch at a time so that reading keeps up.
+		while(next < ntrace)
+		{
+			struct trace_pkt *t = &trace[next];
+			struct client *src = &clients[t->src];
+			uint64_t due = (speed > 0) ? start + (uint64_t)(t->t_ns / speed) : now;
+			unsigned char *p;
+
+			if(due > now || (speed == 0 && batch++ >= 64))
+				break;
+
+			if(src->outlen + (int)t->len > OUT_BUF_SIZE)
+			{
+				if(speed == 0)
+				{
+					stalled = 1;
+					break;
+				}
+				// The server hasn't been reading from this
+				// client. Holding the packet would only skew the
+				// timing of everything behind it.
+				backlogged++;
+				next++;
+				continue;
+			}
+			p = (unsigned char*)src->out + src->outlen;
+			memcpy(p, t->hdr, t->hlen);
+			memset(p + t->hlen, 0, t->len - t->hlen);
+			if(t->hlen < 20)
+				p[0] = 0x45;
+			p[2] = t->len >> 8;
+			p[3] = t->len & 0xff;
+			p[4] = next >> 24;
+			p[5] = next >> 16;
+			p[10] = next >> 8;
+			p[11] = next & 0xff;
+			memcpy(p + 12, &src->vpn_ip, 4);
+			memcpy(p + 16, &clients[t->dst].vpn_ip, 4);
+			src->outlen += t->len;
+			if(!src->dirty)
+			{
+				src->dirty = 1;
+				flush_list[nflush++] = t->src;
+			}
+
+			sent_ns[next] = now;
+			if(speed > 0)
+				late[nlate++] = (now - due) / 1e9;
+			tx_bytes += t->len;
+			nsent++;
+			next++;
+			last_tx = now;
+		}
+
+		// Keep quiet clients from being timed out by the server.
+		if(now - last_keepalive >= KEEPALIVE_NS)
+		{
+			for(i = 0; i < nclients; i++)
+			{
+				struct client *cl = &clients[i];
+
+				if(cl->outlen + 20 > OUT_BUF_SIZE)
+					continue;
+				memset(cl->out + cl->outlen, 0, 20);
+				cl->out[cl->outlen] = 0x45;
+				memset(cl->out + cl->outlen + 12, 0xff, 8);
+				cl->outlen += 20;
+				if(!cl->dirty)
+				{
+					cl->dirty = 1;
+					flush_list[nflush++] = i;
+				}
+			}
+			last_keepalive = now;
+		}
+
+		for(i = 0; i < nflush; i++)
+		{
+			int idx = flush_list[i];
+
+			clients[idx].dirty = 0;
+			if(client_flush(&clients[idx]))
+				watch(ep, idx, 1);
+		}
+		nflush = 0;
+
+		if(next >= ntrace)
+		{
+			if(nlat == nsent || now - last_tx >= (uint64_t)drain * 1000000000ULL)
+				break;
+			timeout = 10;
+		}
+		else if(stalled)
+			timeout = 10;
+		else if(speed > 0)
+		{
+			uint64_t due = start + (uint64_t)(trace[next].t_ns / speed);
+
+			// Sleeping is too coarse to keep to the trace's timing, so
+			// spin for the last millisecond.
+			if(due > now + 2000000)
+				timeout = (due - now) / 1000000 - 1;
+		}
+
+		k = epoll_wait(ep, events, 256, timeout);
+		now = now_ns();
+		for(i = 0; i < k; i++)
+		{
+			int idx = events[i].data.u32;
+			struct client *cl = &clients[idx];
+
+			if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			{
+				long before = nlat;
+
+				if(client_read(cl, now) < 0)
+				{
+					fprintf(stderr, "Server closed the connection of client %s\n", inet_ntoa(*(struct in_addr*)&cl->vpn_ip));
+					return 1;
+				}
+				if(nlat > before)
+					last_rx = now;
+			}
+			if((events[i].events & EPOLLOUT) && !client_flush(cl))
+				watch(ep, idx, 0);
+		}
+	}
+
+	elapsed = (last_tx - start) / 1e9;
+	printf("sent %ld packets, %.1f MB in %.3f s", nsent, tx_bytes / 1e6, elapsed);
+	if(speed > 0)
+		printf(" at %gx (%.3f s scheduled)", speed, duration / speed);
+	printf(", %ld held back by a server that stopped reading\n", backlogged);
+	if(speed > 0)
+		percentiles("behind schedule", late, nlate, 1000, "ms");
+
+	elapsed = (last_rx > start) ? (last_rx - start) / 1e9 : 0;
+	printf("delivered %ld packets (%.2f%%), %ld dropped, %ld duplicate or unknown: %.1f Mbit/s, %.0f packets/s\n",
+		nlat, nsent ? 100.0 * nlat / nsent : 0.0, nsent - nlat, dups,
+		elapsed > 0 ? rx_bytes * 8 / elapsed / 1e6 : 0.0, elapsed > 0 ? nlat / elapsed : 0.0);
+	percentiles("latency", lat, nlat, 1000, "ms");
+	return 0;
+}
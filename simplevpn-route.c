@@ -0,0 +1,339 @@
+/* simplevpn-route.c -- Longest prefix match routing table */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "simplevpn-route.h"
+
+#define ROUTE_ROOT_SIZE  (1 << ROUTE_ROOT_BITS)
+#define ROUTE_CHUNK_SIZE (1 << ROUTE_CHUNK_BITS)
+
+// A slot holds nothing (0), a next hop, or a pointer to the next level
+// with this bit set. Next hops are pointers to objects that are at least
+// 2-byte aligned, so the bit is free.
+#define ROUTE_CHILD 1
+
+/*
+ * struct route_chunk
+ *
+ * One lower level of the trie, covering 256 addresses of a /16 or one
+ * address each of a /24. len is only used by updates.
+ */
+struct route_chunk
+{
+	uint64_t slot[ROUTE_CHUNK_SIZE];
+	unsigned char len[ROUTE_CHUNK_SIZE];	// Length of the prefix each slot came from
+};
+
+/*
+ * struct route
+ *
+ * A prefix in the table. Updates look these up to find what a removed
+ * prefix uncovers. Addresses are in host byte order.
+ */
+struct route
+{
+	unsigned int net;
+	int len;
+	void *hop;
+	int next;		// Next route in the same hash bucket, or -1
+};
+
+static uint64_t root[ROUTE_ROOT_SIZE];
+static unsigned char root_len[ROUTE_ROOT_SIZE];
+static struct route *routes;	// Protected by route_lock
+static int nroutes, routes_size;
+static int *buckets;		// First route in each bucket, routes_size of them
+static pthread_mutex_t route_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int prefix_mask(int len)
+{
+	return (len == 0) ? 0 : 0xffffffff << (32 - len);
+}
+
+/*
+ * route_overlaps
+ *
+ * Returns 1 if prefixes a/alen and b/blen (network byte order) have any
+ * address in common.
+ */
+int route_overlaps(unsigned int a, int alen, unsigned int b, int blen)
+{
+	return ((ntohl(a) ^ ntohl(b)) & prefix_mask(alen < blen ? alen : blen)) == 0;
+}
+
+/*
+ * route_lookup
+ *
+ * Returns the next hop of the longest prefix that covers ip (network byte
+ * order), or NULL. Takes no lock. Whatever the caller does to keep next
+ * hops from going away while they are in the table, such as holding the
+ * lock their updates are made under, it must do around using the result.
+ */
+void *route_lookup(unsigned int ip)
+{
+	uint64_t v;
+
+	ip = ntohl(ip);
+	v = __atomic_load_n(&root[ip >> 16], __ATOMIC_ACQUIRE);
+	if(v & ROUTE_CHILD)
+		v = __atomic_load_n(&((struct route_chunk*)(uintptr_t)(v ^ ROUTE_CHILD))->slot[(ip >> 8) & 0xff], __ATOMIC_ACQUIRE);
+	if(v & ROUTE_CHILD)
+		v = __atomic_load_n(&((struct route_chunk*)(uintptr_t)(v ^ ROUTE_CHILD))->slot[ip & 0xff], __ATOMIC_ACQUIRE);
+	return (void*)(uintptr_t)v;
+}
+
+/*
+ * fill
+ *
+ * Points the n slots from first on, and the slots of the levels below
+ * them, at hop for a prefix of length len, except where a longer prefix
+ * than below already has them.
+ */
+static void fill(uint64_t *slot, unsigned char *lens, int first, int n, int below, void *hop, int len)
+{
+	int i;
+
+	for(i = first; i < first + n; i++)
+	{
+		uint64_t v = slot[i];
+
+		if(v & ROUTE_CHILD)
+		{
+			struct route_chunk *c = (struct route_chunk*)(uintptr_t)(v ^ ROUTE_CHILD);
+
+			fill(c->slot, c->len, 0, ROUTE_CHUNK_SIZE, below, hop, len);
+		}
+		else if(lens[i] <= below)
+		{
+			lens[i] = len;
+			__atomic_store_n(&slot[i], (uint64_t)(uintptr_t)hop, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/*
+ * chunk
+ *
+ * Returns the level below slot, making it first if there isn't one. A new
+ * level starts out with whatever the slot held in all of its slots.
+ */
+static struct route_chunk *chunk(uint64_t *slot, unsigned char *len)
+{
+	struct route_chunk *c;
+	int i;
+
+	if(*slot & ROUTE_CHILD)
+		return (struct route_chunk*)(uintptr_t)(*slot ^ ROUTE_CHILD);
+	if((c = malloc(sizeof(*c))) == NULL)
+		return NULL;
+	for(i = 0; i < ROUTE_CHUNK_SIZE; i++)
+	{
+		c->slot[i] = *slot;
+		c->len[i] = *len;
+	}
+	__atomic_store_n(slot, (uint64_t)(uintptr_t)c | ROUTE_CHILD, __ATOMIC_RELEASE);
+	return c;
+}
+
+/*
+ * expand
+ *
+ * Writes hop, for a prefix of length len, to the slots that net/plen (host
+ * byte order) covers and that no prefix longer than below has. Returns -1 if
+ * we are out of memory.
+ */
+static int expand(unsigned int net, int plen, int below, void *hop, int len)
+{
+	struct route_chunk *c;
+
+	if(plen <= 16)
+	{
+		fill(root, root_len, net >> 16, 1 << (16 - plen), below, hop, len);
+		return 0;
+	}
+	if((c = chunk(&root[net >> 16], &root_len[net >> 16])) == NULL)
+		return -1;
+	if(plen <= 24)
+	{
+		fill(c->slot, c->len, (net >> 8) & 0xff, 1 << (24 - plen), below, hop, len);
+		return 0;
+	}
+	if((c = chunk(&c->slot[(net >> 8) & 0xff], &c->len[(net >> 8) & 0xff])) == NULL)
+		return -1;
+	fill(c->slot, c->len, net & 0xff, 1 << (32 - plen), below, hop, len);
+	return 0;
+}
+
+static int *bucket(unsigned int net, int len)
+{
+	return &buckets[((net ^ len) * 2654435761U) & (routes_size - 1)];
+}
+
+static int find(unsigned int net, int len)
+{
+	int i;
+
+	if(routes_size == 0)
+		return -1;
+	for(i = *bucket(net, len); i >= 0; i = routes[i].next)
+		if(routes[i].net == net && routes[i].len == len)
+			return i;
+	return -1;
+}
+
+static void link_route(int i)
+{
+	int *b = bucket(routes[i].net, routes[i].len);
+
+	routes[i].next = *b;
+	*b = i;
+}
+
+static void unlink_route(int i)
+{
+	int *p = bucket(routes[i].net, routes[i].len);
+
+	while(*p != i)
+		p = &routes[*p].next;
+	*p = routes[i].next;
+}
+
+/*
+ * grow
+ *
+ * Makes room for twice as many routes, with as many hash buckets. Returns -1
+ * if we are out of memory.
+ */
+static int grow(void)
+{
+	int size = routes_size ? routes_size * 2 : 64, i;
+	struct route *r = realloc(routes, size * sizeof(*r));
+	int *b;
+
+	if(r == NULL)
+		return -1;
+	routes = r;
+	if((b = malloc(size * sizeof(*b))) == NULL)
+		return -1;
+	free(buckets);
+	buckets = b;
+	routes_size = size;
+	for(i = 0; i < size; i++)
+		buckets[i] = -1;
+	for(i = 0; i < nroutes; i++)
+		link_route(i);
+	return 0;
+}
+
+/*
+ * route_add
+ *
+ * Routes net/len (network byte order) to hop, or moves it there if it
+ * already routes to the same hop. Returns -1 if the prefix belongs to
+ * another hop or we are out of memory.
+ */
+int route_add(unsigned int net, int len, void *hop)
+{
+	int i;
+
+	if(len < 0 || len > 32 || hop == NULL || ((uintptr_t)hop & ROUTE_CHILD))
+		return -1;
+	net = ntohl(net) & prefix_mask(len);
+
+	pthread_mutex_lock(&route_lock);
+	if((i = find(net, len)) >= 0)
+	{
+		i = (routes[i].hop == hop) ? 0 : -1;
+		pthread_mutex_unlock(&route_lock);
+		return i;
+	}
+	if((nroutes == routes_size && grow() < 0) || expand(net, len, len, hop, len) < 0)
+	{
+		pthread_mutex_unlock(&route_lock);
+		return -1;
+	}
+	routes[nroutes].net = net;
+	routes[nroutes].len = len;
+	routes[nroutes].hop = hop;
+	link_route(nroutes++);
+	pthread_mutex_unlock(&route_lock);
+	return 0;
+}
+
+/*
+ * route_del
+ *
+ * Takes net/len (network byte order) out of the table if it routes to hop.
+ * The addresses it covered go back to the longest prefix that is left
+ * covering them. Returns -1 if the prefix doesn't route to hop.
+ */
+int route_del(unsigned int net, int len, void *hop)
+{
+	struct route *best = NULL;
+	int i, l;
+
+	if(len < 0 || len > 32)
+		return -1;
+	net = ntohl(net) & prefix_mask(len);
+
+	pthread_mutex_lock(&route_lock);
+	if((i = find(net, len)) < 0 || routes[i].hop != hop)
+	{
+		pthread_mutex_unlock(&route_lock);
+		return -1;
+	}
+	unlink_route(i);
+	if(i != --nroutes)
+	{
+		unlink_route(nroutes);
+		routes[i] = routes[nroutes];
+		link_route(i);
+	}
+
+	// The longest prefix left that covers this one.
+	for(l = len - 1; l >= 0 && best == NULL; l--)
+		if((i = find(net & prefix_mask(l), l)) >= 0)
+			best = &routes[i];
+
+	// The levels the prefix ends on are already there, so this can't
+	// run out of memory.
+	expand(net, len, len, best ? best->hop : NULL, best ? best->len : 0);
+	pthread_mutex_unlock(&route_lock);
+	return 0;
+}
+
+/*
+ * route_count
+ *
+ * Returns the number of prefixes in the table.
+ */
+int route_count(void)
+{
+	int n;
+
+	pthread_mutex_lock(&route_lock);
+	n = nroutes;
+	pthread_mutex_unlock(&route_lock);
+	return n;
+}
@@ -0,0 +1,46 @@
+/* simplevpn-route.h -- Longest prefix match routing table */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_ROUTE_H
+#define SIMPLEVPN_ROUTE_H
+
+/*
+ * Routes from IPv4 prefixes to whatever the caller uses as a next hop, such
+ * as the client a packet is written to. The table is a multibit trie
+ * with strides of 16, 8 and 8 bits. Every prefix is expanded into the slots
+ * it covers at the level it ends on, so a lookup reads at most three slots
+ * and takes no lock. Updates are serialized among themselves, and each slot
+ * changes with a single atomic store, so a lookup that runs alongside one
+ * sees each slot as it was either before or after the update.
+ *
+ * Lower levels are never freed, because a lookup might still be reading
+ * them. They are only made for prefixes longer than /16, and a level left
+ * empty is reused by the next prefix that ends in the same place.
+ */
+#define ROUTE_ROOT_BITS  16
+#define ROUTE_CHUNK_BITS 8
+
+void *route_lookup(unsigned int ip);
+int route_add(unsigned int net, int len, void *hop);
+int route_del(unsigned int net, int len, void *hop);
+int route_count(void);
+int route_overlaps(unsigned int a, int alen, unsigned int b, int blen);
+
+#endif
@@ -0,0 +1,467 @@
+/* simplevpn-sched.c -- Fair scheduling of client traffic on the server */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Every client has a queue of packets that it has sent but that have not been
+ * forwarded yet. The forwarding thread pulls packets out of those queues in
+ * deficit round robin order, so a client that floods the server only gets its
+ * fair share of the forwarding path. Each queue can also carry a token bucket
+ * that caps the rate at which its packets are released. Rate caps are read
+ * from a limits file that maps VPN addresses or address ranges to a rate and
+ * burst size:
+ *
+ *   # address[/prefix]  kbit/s  burst bytes
+ *   default             0       0
+ *   10.0.1.0/24         2000    32000
+ *   10.0.0.5            500     0
+ *
+ * A rate of 0 means unlimited. A burst of 0 gives the bucket 100ms worth of
+ * traffic. When several entries match an address the longest prefix wins.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include "simplevpn-sched.h"
+#include "simplevpn-log.h"
+
+struct rate_rule
+{
+	struct rate_rule *next;
+	unsigned int net;	// Host byte order
+	unsigned int mask;
+	unsigned int rate;	// Bytes per second
+	unsigned int burst;
+	int prefix;
+};
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sched_queue *active_head = NULL;
+static struct sched_queue *active_tail = NULL;
+static int nactive = 0;
+static int sleeping = 0;
+static int wakeup_fd = -1;
+static struct rate_rule *rate_rules = NULL;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sched_init(void)
+{
+	wakeup_fd = eventfd(0, EFD_NONBLOCK);
+	if(wakeup_fd < 0)
+	{
+		perror("eventfd()");
+		exit(1);
+	}
+}
+
+/*
+ * sched_wakeup_fd
+ *
+ * Returns a file descriptor that becomes readable when packets are queued
+ * after sched_dequeue() has come up empty. The forwarding thread polls it
+ * while it is idle.
+ */
+int sched_wakeup_fd(void)
+{
+	return wakeup_fd;
+}
+
+/*
+ * sched_kick
+ *
+ * Wakes the forwarding thread up even if nothing has been queued.
+ */
+void sched_kick(void)
+{
+	uint64_t one = 1;
+
+	if(write(wakeup_fd, &one, sizeof(one)) < 0)
+		log_err("write(wakeup_fd): %m");
+}
+
+void sched_queue_init(struct sched_queue *q)
+{
+	memset(q, 0, sizeof(struct sched_queue));
+	pthread_cond_init(&q->space, NULL);
+	q->stamp = now_ns();
+}
+
+static void activate(struct sched_queue *q)
+{
+	q->next = NULL;
+	q->deficit = 0;
+	q->active = 1;
+	if(active_tail != NULL)
+		active_tail->next = q;
+	else
+		active_head = q;
+	active_tail = q;
+	nactive++;
+}
+
+static void deactivate_head(void)
+{
+	struct sched_queue *q = active_head;
+
+	active_head = q->next;
+	if(active_head == NULL)
+		active_tail = NULL;
+	q->next = NULL;
+	q->active = 0;
+	q->deficit = 0;
+	nactive--;
+}
+
+static struct pkt *queue_head(struct sched_queue *q)
+{
+	return (q->head[PKT_PRIO_INTERACTIVE] != NULL) ? q->head[PKT_PRIO_INTERACTIVE] : q->head[PKT_PRIO_BULK];
+}
+
+static void rotate(void)
+{
+	struct sched_queue *q = active_head;
+
+	if(q == active_tail)
+		return;
+	active_head = q->next;
+	q->next = NULL;
+	active_tail->next = q;
+	active_tail = q;
+}
+
+/*
+ * sched_queue_destroy
+ *
+ * Throws away anything still queued and takes q out of the active list. Must
+ * be called before the memory holding q is freed.
+ */
+void sched_queue_destroy(struct sched_queue *q)
+{
+	struct pkt *p;
+	int prio;
+
+	pthread_mutex_lock(&sched_lock);
+	if(q->active)
+	{
+		struct sched_queue *prev = NULL, *it = active_head;
+
+		while(it != q)
+		{
+			prev = it;
+			it = it->next;
+		}
+		if(prev == NULL)
+			active_head = q->next;
+		else
+			prev->next = q->next;
+		if(active_tail == q)
+			active_tail = prev;
+		nactive--;
+	}
+	for(prio = 0; prio < PKT_NPRIO; prio++)
+	{
+		while((p = q->head[prio]) != NULL)
+		{
+			q->head[prio] = p->next;
+			pkt_free(p);
+		}
+		q->tail[prio] = NULL;
+	}
+	q->bytes = 0;
+	q->active = 0;
+	pthread_mutex_unlock(&sched_lock);
+
+	pthread_cond_destroy(&q->space);
+}
+
+/*
+ * sched_enqueue
+ *
+ * Adds a packet to the end of a client's queue for its traffic class. Blocks
+ * while the queue is over SCHED_QUEUE_LIMIT so that a client sending faster
+ * than it is allowed to stops being read from instead of eating server
+ * memory.
+ */
+int sched_enqueue(struct sched_queue *q, struct pkt *p)
+{
+	pthread_mutex_lock(&sched_lock);
+	while(q->bytes >= SCHED_QUEUE_LIMIT)
+		pthread_cond_wait(&q->space, &sched_lock);
+
+	p->next = NULL;
+	if(q->tail[p->prio] != NULL)
+		q->tail[p->prio]->next = p;
+	else
+		q->head[p->prio] = p;
+	q->tail[p->prio] = p;
+	q->bytes += p->len;
+
+	if(!q->active)
+		activate(q);
+
+	if(sleeping)
+	{
+		uint64_t one = 1;
+
+		sleeping = 0;
+		if(write(wakeup_fd, &one, sizeof(one)) < 0)
+			log_err("write(wakeup_fd): %m");
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return 0;
+}
+
+static void refill(struct sched_queue *q, unsigned long long now)
+{
+	if(now > q->stamp)
+	{
+		q->tokens += (long long)((double)(now - q->stamp) * q->rate / 1e9);
+		q->stamp = now;
+	}
+	if(q->tokens > q->burst)
+		q->tokens = q->burst;
+}
+
+/*
+ * sched_dequeue
+ *
+ * Fills batch with up to max packets, taken from the active queues in
+ * deficit round robin order. Queues whose token bucket is empty are skipped.
+ * Returns the number of packets dequeued. If that is zero, *wait_ms is set to
+ * the time until a rate-limited queue can send again, or -1 if every queue is
+ * empty.
+ */
+int sched_dequeue(struct pkt **batch, int max, int *wait_ms)
+{
+	unsigned long long now = now_ns();
+	long long wait = -1;
+	int n = 0, blocked = 0;
+	struct sched_queue *q;
+
+	pthread_mutex_lock(&sched_lock);
+	while(n < max && (q = active_head) != NULL)
+	{
+		struct pkt *p = queue_head(q);
+
+		if(q->rate != 0)
+		{
+			refill(q, now);
+			if(q->tokens < p->len && q->tokens < q->burst)
+			{
+				long long need = ((p->len < q->burst) ? p->len : q->burst) - q->tokens;
+				long long t = need * 1000000000LL / q->rate;
+
+				if(wait < 0 || t < wait)
+					wait = t;
+				rotate();
+				if(++blocked >= nactive)
+					break;
+				continue;
+			}
+		}
+
+		if(q->deficit < p->len)
+		{
+			q->deficit += SCHED_QUANTUM;
+			rotate();
+			blocked = 0;
+			continue;
+		}
+
+		q->head[p->prio] = p->next;
+		if(q->head[p->prio] == NULL)
+			q->tail[p->prio] = NULL;
+		// The streams of a striped client share a queue, so more
+		// than one thread may be waiting for room in it.
+		if(q->bytes >= SCHED_QUEUE_LIMIT && q->bytes - p->len < SCHED_QUEUE_LIMIT)
+			pthread_cond_broadcast(&q->space);
+		q->bytes -= p->len;
+		q->deficit -= p->len;
+		if(q->rate != 0)
+			q->tokens -= p->len;
+		if(queue_head(q) == NULL)
+			deactivate_head();
+
+		p->next = NULL;
+		batch[n++] = p;
+		blocked = 0;
+	}
+	if(n == 0)
+		sleeping = 1;
+	pthread_mutex_unlock(&sched_lock);
+
+	*wait_ms = (wait < 0) ? -1 : (int)((wait + 999999) / 1000000);
+	return n;
+}
+
+static int parse_rule(char *line, struct rate_rule *rule)
+{
+	char addr[64];
+	char *slash;
+	unsigned int kbps, burst;
+	unsigned long long rate;
+	struct in_addr in;
+
+	if(sscanf(line, "%63s %u %u", addr, &kbps, &burst) != 3)
+		return -1;
+
+	rule->prefix = 32;
+	if(strcmp(addr, "default") == 0)
+	{
+		rule->prefix = 0;
+		in.s_addr = 0;
+	}
+	else
+	{
+		if((slash = strchr(addr, '/')) != NULL)
+		{
+			*slash = '\0';
+			rule->prefix = atoi(slash + 1);
+			if(rule->prefix < 0 || rule->prefix > 32)
+				return -1;
+		}
+		if(inet_aton(addr, &in) == 0)
+			return -1;
+	}
+
+	rule->mask = (rule->prefix == 0) ? 0 : 0xffffffff << (32 - rule->prefix);
+	rule->net = ntohl(in.s_addr) & rule->mask;
+
+	rate = (unsigned long long)kbps * 125;
+	if(rate > 0xffffffff)
+		rate = 0xffffffff;
+	rule->rate = rate;
+	rule->burst = burst;
+	if(rule->burst == 0)
+		rule->burst = rule->rate / 10;
+	if(rule->burst < SCHED_QUANTUM)
+		rule->burst = SCHED_QUANTUM;
+	return 0;
+}
+
+/*
+ * sched_load_limits
+ *
+ * Reads the limits file at path and replaces the current set of rate rules.
+ * Queues pick up the new rules the next time sched_apply_limits() is called
+ * on them. Returns the number of rules loaded, or -1 if the file could not be
+ * opened.
+ */
+int sched_load_limits(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	struct rate_rule *rules = NULL, *old;
+	char line[256];
+	int count = 0, lineno = 0;
+
+	if(f == NULL)
+	{
+		log_err("%s: %m", path);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		struct rate_rule *rule, **pos;
+		char *s = line;
+
+		lineno++;
+		while(*s == ' ' || *s == '\t')
+			s++;
+		if(*s == '#' || *s == '\n' || *s == '\0')
+			continue;
+
+		rule = malloc(sizeof(struct rate_rule));
+		if(rule == NULL || parse_rule(s, rule) < 0)
+		{
+			log_warn("[sched] Ignoring bad line %d in %s", lineno, path);
+			free(rule);
+			continue;
+		}
+
+		// Keep the list sorted longest prefix first so the first match
+		// is the most specific one.
+		pos = &rules;
+		while(*pos != NULL && (*pos)->prefix >= rule->prefix)
+			pos = &(*pos)->next;
+		rule->next = *pos;
+		*pos = rule;
+		count++;
+	}
+	fclose(f);
+
+	pthread_mutex_lock(&sched_lock);
+	old = rate_rules;
+	rate_rules = rules;
+	pthread_mutex_unlock(&sched_lock);
+
+	while(old != NULL)
+	{
+		struct rate_rule *next = old->next;
+		free(old);
+		old = next;
+	}
+
+	log_info("[sched] Loaded %d rate limits from %s", count, path);
+	return count;
+}
+
+/*
+ * sched_apply_limits
+ *
+ * Looks up the rate rule for VPN address ip (network byte order) and applies
+ * it to q. Called whenever a client's address changes and after the limits
+ * file is reloaded.
+ */
+void sched_apply_limits(struct sched_queue *q, unsigned int ip)
+{
+	unsigned int addr = ntohl(ip);
+	struct rate_rule *rule;
+
+	pthread_mutex_lock(&sched_lock);
+	for(rule = rate_rules; rule != NULL; rule = rule->next)
+		if((addr & rule->mask) == rule->net)
+			break;
+
+	if(rule == NULL || rule->rate == 0)
+	{
+		q->rate = 0;
+	}
+	else if(q->rate != rule->rate || q->burst != rule->burst)
+	{
+		q->rate = rule->rate;
+		q->burst = rule->burst;
+		q->tokens = rule->burst;
+		q->stamp = now_ns();
+	}
+	pthread_mutex_unlock(&sched_lock);
+}
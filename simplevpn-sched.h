@@ -0,0 +1,70 @@
+/* simplevpn-sched.h -- Fair scheduling of client traffic on the server */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_SCHED_H
+#define SIMPLEVPN_SCHED_H
+
+#include <pthread.h>
+#include "simplevpn-pkt.h"
+
+// Bytes a queue may send per deficit round robin visit.
+#define SCHED_QUANTUM 1514
+
+// Bytes a client may have waiting in its queue before we stop reading from
+// its socket. This pushes back on flooding clients through TCP flow control.
+#define SCHED_QUEUE_LIMIT (256 * 1024)
+
+/*
+ * struct sched_queue
+ *
+ * Packets received from one client that have not been forwarded yet, along
+ * with that client's deficit counter and token bucket. Interactive packets
+ * are kept on their own list and leave the queue before the client's bulk
+ * traffic. All fields are protected by the scheduler lock.
+ */
+struct sched_queue
+{
+	struct sched_queue *next;	// Link in the list of active queues
+	struct pkt *head[PKT_NPRIO];
+	struct pkt *tail[PKT_NPRIO];
+	int bytes;
+	int active;
+	int deficit;
+	unsigned int rate;		// Bytes per second, 0 means unlimited
+	unsigned int burst;		// Bucket depth in bytes
+	long long tokens;
+	unsigned long long stamp;	// Time of last refill (ns)
+	pthread_cond_t space;
+};
+
+void sched_init(void);
+int sched_wakeup_fd(void);
+void sched_kick(void);
+
+void sched_queue_init(struct sched_queue *q);
+void sched_queue_destroy(struct sched_queue *q);
+
+int sched_enqueue(struct sched_queue *q, struct pkt *p);
+int sched_dequeue(struct pkt **batch, int max, int *wait_ms);
+
+int sched_load_limits(const char *path);
+void sched_apply_limits(struct sched_queue *q, unsigned int ip);
+
+#endif
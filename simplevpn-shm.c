@@ -0,0 +1,518 @@
+/* simplevpn-shm.c -- Shared memory transport for clients on the server's host */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE	// memfd_create()
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "simplevpn-shm.h"
+
+#define ALIGN8(n) (((n) + 7) & ~7)
+
+static int shm_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr->sun_path))
+	{
+		fprintf(stderr, "Local socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/*
+ * shm_listen
+ *
+ * Creates the non-blocking local socket at path, replacing whatever was
+ * there. Returns the listening socket, or -1.
+ */
+int shm_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(shm_addr(path, &addr) < 0)
+		return -1;
+	if((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+	{
+		perror("socket(AF_UNIX)");
+		return -1;
+	}
+	unlink(path);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+	{
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * shm_connect
+ *
+ * Connects to the server's local socket at path. Returns -1 if no server
+ * is listening there.
+ */
+int shm_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(shm_addr(path, &addr) < 0)
+		return -1;
+	if((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void ring_init(struct shm_ring *r, struct shm_ring_ctl *ctl, char *data, uint32_t size, int data_fd, int space_fd, int writer)
+{
+	r->ctl = ctl;
+	r->data = data;
+	r->size = size;
+	r->pos = (writer ? ctl->head : ctl->tail) & ~7;
+	r->step = 0;
+	r->waiting = 1;		// Clears anything left on wait_fd by whoever had it before
+	r->data_fd = data_fd;
+	r->space_fd = space_fd;
+	r->wait_fd = writer ? space_fd : data_fd;
+}
+
+/*
+ * shm_attach
+ *
+ * Maps the region passed in fds, in the order they come with the hello,
+ * and sets up the rings for the server's side of the link if server is set
+ * and the client's otherwise. The descriptors belong to l from now on,
+ * even if this fails. Returns -1 if the region is no good.
+ */
+int shm_attach(struct shm_link *l, const int *fds, int server)
+{
+	struct shm_region *reg;
+	char *data;
+	uint32_t size;
+
+	memcpy(l->fds, fds, sizeof(l->fds));
+	l->region = NULL;
+	l->len = sizeof(struct shm_region) + 2 * SHM_RING_SIZE;
+	reg = mmap(NULL, l->len, PROT_READ | PROT_WRITE, MAP_SHARED, l->fds[SHM_FD_REGION], 0);
+	if(reg == MAP_FAILED)
+	{
+		perror("mmap(shm)");
+		shm_close(l);
+		return -1;
+	}
+	l->region = reg;
+	if(reg->magic != SHM_MAGIC || reg->version != SHM_VERSION || reg->ring_size != SHM_RING_SIZE)
+	{
+		fprintf(stderr, "Bad shared memory region\n");
+		shm_close(l);
+		return -1;
+	}
+
+	size = reg->ring_size;
+	data = (char*)(reg + 1);
+	if(server)
+	{
+		ring_init(&l->rx, &reg->up, data, size, fds[SHM_FD_UP_DATA], fds[SHM_FD_UP_SPACE], 0);
+		ring_init(&l->tx, &reg->down, data + size, size, fds[SHM_FD_DOWN_DATA], fds[SHM_FD_DOWN_SPACE], 1);
+	}
+	else
+	{
+		ring_init(&l->tx, &reg->up, data, size, fds[SHM_FD_UP_DATA], fds[SHM_FD_UP_SPACE], 1);
+		ring_init(&l->rx, &reg->down, data + size, size, fds[SHM_FD_DOWN_DATA], fds[SHM_FD_DOWN_SPACE], 0);
+	}
+	return 0;
+}
+
+/*
+ * shm_create
+ *
+ * Makes a new region and its eventfds, and attaches to it as the server.
+ * The region is sealed at its size, so a client can't shrink it under us.
+ * Returns -1 on failure.
+ */
+int shm_create(struct shm_link *l)
+{
+	struct shm_region *reg;
+	int fds[SHM_NFDS], i;
+	size_t len = sizeof(struct shm_region) + 2 * SHM_RING_SIZE;
+
+	for(i = 0; i < SHM_NFDS; i++)
+		fds[i] = -1;
+	if((fds[SHM_FD_REGION] = memfd_create("simplevpn", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ||
+	   ftruncate(fds[SHM_FD_REGION], len) < 0 ||
+	   fcntl(fds[SHM_FD_REGION], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		goto fail;
+	for(i = 1; i < SHM_NFDS; i++)
+		if((fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+			goto fail;
+
+	// The region starts out zeroed, which is two empty rings.
+	reg = mmap(NULL, sizeof(*reg), PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_REGION], 0);
+	if(reg == MAP_FAILED)
+		goto fail;
+	reg->magic = SHM_MAGIC;
+	reg->version = SHM_VERSION;
+	reg->ring_size = SHM_RING_SIZE;
+	munmap(reg, sizeof(*reg));
+	return shm_attach(l, fds, 1);
+
+fail:
+	perror("shm_create");
+	for(i = 0; i < SHM_NFDS; i++)
+		if(fds[i] >= 0)
+			close(fds[i]);
+	return -1;
+}
+
+void shm_close(struct shm_link *l)
+{
+	int i;
+
+	if(l->region != NULL)
+		munmap(l->region, l->len);
+	l->region = NULL;
+	for(i = 0; i < SHM_NFDS; i++)
+	{
+		if(l->fds[i] >= 0)
+			close(l->fds[i]);
+		l->fds[i] = -1;
+	}
+}
+
+/*
+ * shm_offer
+ *
+ * Sends the hello for link l, with its descriptors, to a client on sock.
+ * Returns -1 on failure.
+ */
+int shm_offer(int sock, struct shm_link *l)
+{
+	struct shm_hello hello = { SHM_MAGIC, SHM_VERSION, SHM_RING_SIZE };
+	char cbuf[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr mh;
+	struct cmsghdr *cm;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(cbuf, 0, sizeof(cbuf));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(SHM_NFDS * sizeof(int));
+	memcpy(CMSG_DATA(cm), l->fds, SHM_NFDS * sizeof(int));
+	return (sendmsg(sock, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(hello)) ? 0 : -1;
+}
+
+/*
+ * shm_take
+ *
+ * Waits for the server's hello on sock and attaches to the region that
+ * comes with it. Returns -1 on failure.
+ */
+int shm_take(int sock, struct shm_link *l)
+{
+	struct shm_hello hello;
+	char cbuf[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	int n;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	while((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	cm = CMSG_FIRSTHDR(&mh);
+	if(n != sizeof(hello) || cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+	   cm->cmsg_len != CMSG_LEN(SHM_NFDS * sizeof(int)))
+	{
+		fprintf(stderr, "No shared memory from the server\n");
+		return -1;
+	}
+	if(hello.magic != SHM_MAGIC || hello.version != SHM_VERSION)
+	{
+		fprintf(stderr, "Server speaks shared memory version %u\n", hello.version);
+		memcpy(l->fds, CMSG_DATA(cm), sizeof(l->fds));
+		l->region = NULL;
+		shm_close(l);
+		return -1;
+	}
+	return shm_attach(l, (int*)CMSG_DATA(cm), 0);
+}
+
+/*
+ * shm_reserve
+ *
+ * Returns where a record of up to len bytes can be written in r, or NULL if
+ * there isn't room for one. Nothing is written until shm_commit().
+ */
+char *shm_reserve(struct shm_ring *r, int len)
+{
+	uint32_t tail = __atomic_load_n(&r->ctl->tail, __ATOMIC_ACQUIRE);
+	uint32_t used = r->pos - tail, idx = r->pos & (r->size - 1);
+	uint32_t need = ALIGN8(SHM_REC_HDR + len), skip = 0;
+
+	// A reader that doesn't keep to the rules only hurts itself.
+	if(used > r->size)
+		return NULL;
+	if(r->size - idx < need)
+		skip = r->size - idx;
+	if(r->size - used < skip + need)
+		return NULL;
+	r->step = skip;
+	return r->data + ((idx + skip) & (r->size - 1)) + SHM_REC_HDR;
+}
+
+/*
+ * shm_commit
+ *
+ * Hands the record of len bytes reserved last over to the reader.
+ */
+void shm_commit(struct shm_ring *r, int len)
+{
+	uint32_t idx = r->pos & (r->size - 1);
+
+	if(r->step != 0)
+	{
+		*(uint32_t*)(r->data + idx) = SHM_WRAP;
+		r->pos += r->step;
+		idx = 0;
+	}
+	*(uint32_t*)(r->data + idx) = len;
+	r->pos += ALIGN8(SHM_REC_HDR + len);
+	__atomic_store_n(&r->ctl->head, r->pos, __ATOMIC_RELEASE);
+}
+
+/*
+ * shm_write
+ *
+ * Copies len bytes from buf into a record in r. Returns -1 if there isn't
+ * room.
+ */
+int shm_write(struct shm_ring *r, const char *buf, int len)
+{
+	char *p = shm_reserve(r, len);
+
+	if(p == NULL)
+		return -1;
+	memcpy(p, buf, len);
+	shm_commit(r, len);
+	return 0;
+}
+
+/*
+ * shm_peek
+ *
+ * Returns the oldest record in r and its length in len, or NULL if there
+ * is none. The record stays in the ring until shm_release(). len is set to
+ * -1 if the writer has broken the ring.
+ */
+char *shm_peek(struct shm_ring *r, int *len)
+{
+	uint32_t head = __atomic_load_n(&r->ctl->head, __ATOMIC_ACQUIRE);
+	uint32_t avail = head - r->pos, idx = r->pos & (r->size - 1), skip = 0, n;
+
+	*len = 0;
+	if(avail == 0)
+		return NULL;
+	*len = -1;
+	if(avail > r->size)
+		return NULL;
+
+	n = __atomic_load_n((uint32_t*)(r->data + idx), __ATOMIC_RELAXED);
+	if(n == SHM_WRAP)
+	{
+		skip = r->size - idx;
+		idx = 0;
+		if(avail <= skip)
+			return NULL;
+		n = __atomic_load_n((uint32_t*)r->data, __ATOMIC_RELAXED);
+	}
+	if(n > r->size || skip + ALIGN8(SHM_REC_HDR + n) > avail || ALIGN8(SHM_REC_HDR + n) > r->size - idx)
+		return NULL;
+
+	r->step = skip + ALIGN8(SHM_REC_HDR + n);
+	*len = n;
+	return r->data + idx + SHM_REC_HDR;
+}
+
+/*
+ * shm_release
+ *
+ * Gives the room taken by the record from the last shm_peek() back to the
+ * writer.
+ */
+void shm_release(struct shm_ring *r)
+{
+	r->pos += r->step;
+	r->step = 0;
+	__atomic_store_n(&r->ctl->tail, r->pos, __ATOMIC_RELEASE);
+}
+
+static void wake(uint32_t *flag, int fd)
+{
+	uint64_t one = 1;
+
+	// Pairs with the fence in shm_reader_sleep() and shm_writer_sleep(),
+	// so either they see what we did or we see their flag.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(flag, __ATOMIC_RELAXED) && __atomic_exchange_n(flag, 0, __ATOMIC_ACQ_REL))
+	{
+		if(write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("write(eventfd)");
+	}
+}
+
+/*
+ * shm_wake_reader
+ *
+ * Wakes r's reader if it went to sleep before the records written since.
+ */
+void shm_wake_reader(struct shm_ring *r)
+{
+	wake(&r->ctl->reader_waiting, r->data_fd);
+}
+
+/*
+ * shm_wake_writer
+ *
+ * Wakes r's writer if it is waiting for the room released since.
+ */
+void shm_wake_writer(struct shm_ring *r)
+{
+	wake(&r->ctl->writer_waiting, r->space_fd);
+}
+
+/*
+ * shm_reader_sleep
+ *
+ * Asks to be woken when a record is written to r. Returns 1 if the caller
+ * should wait on r->wait_fd, or 0 if a record came in the meantime.
+ */
+int shm_reader_sleep(struct shm_ring *r)
+{
+	__atomic_store_n(&r->ctl->reader_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&r->ctl->head, __ATOMIC_ACQUIRE) != r->pos)
+	{
+		__atomic_store_n(&r->ctl->reader_waiting, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	r->waiting = 1;
+	return 1;
+}
+
+/*
+ * shm_writer_sleep
+ *
+ * Asks to be woken when there is room in r for a record of len bytes.
+ * Returns 1 if the caller should wait on r->wait_fd, or 0 if there is room
+ * already.
+ */
+int shm_writer_sleep(struct shm_ring *r, int len)
+{
+	__atomic_store_n(&r->ctl->writer_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(shm_reserve(r, len) != NULL)
+	{
+		__atomic_store_n(&r->ctl->writer_waiting, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	r->waiting = 1;
+	return 1;
+}
+
+/*
+ * shm_woken
+ *
+ * Clears r->wait_fd after sleeping on it.
+ */
+void shm_woken(struct shm_ring *r)
+{
+	uint64_t count;
+
+	if(!r->waiting)
+		return;
+	r->waiting = 0;
+	if(read(r->wait_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("read(eventfd)");
+}
+
+/*
+ * shm_flush
+ *
+ * Moves as much of q into r as fits. Returns 0 once q is empty, or 1 if r
+ * filled up first, in which case r->wait_fd becomes readable when there
+ * is room again.
+ */
+int shm_flush(struct shm_ring *r, struct txq *q)
+{
+	int sent = 0, ret = 0;
+	char *buf;
+
+	shm_woken(r);
+	while(1)
+	{
+		if(q->cur == NULL && (q->cur = txq_pop(q)) == NULL)
+			break;
+		q->off = 0;
+		if((buf = shm_reserve(r, q->cur->len)) == NULL)
+		{
+			if(shm_writer_sleep(r, q->cur->len))
+			{
+				ret = 1;
+				break;
+			}
+			continue;
+		}
+		memcpy(buf, q->cur->data, q->cur->len);
+		shm_commit(r, q->cur->len);
+		sent++;
+		q->bytes -= q->cur->len;
+		pkt_free(q->cur);
+		q->cur = NULL;
+	}
+	if(sent > 0)
+		shm_wake_reader(r);
+	return ret;
+}
@@ -0,0 +1,155 @@
+/* simplevpn-shm.h -- Shared memory transport for clients on the server's host */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_SHM_H
+#define SIMPLEVPN_SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "simplevpn-txq.h"
+
+/*
+ * A client on the same host as the server can connect to the server's
+ * local socket instead of its TCP port. The server answers with a hello
+ * message carrying a shared memory region and the eventfds that go with
+ * it. Packets then go through two rings in the region, one in each
+ * direction, and the socket only stays open so each side notices when the
+ * other goes away. Frames on the rings are the same as on a TCP connection,
+ * so addresses are assigned and keepalives answered as usual.
+ *
+ * Each ring has a single writer and a single reader. Neither side makes a
+ * system call to pass packets while the other is busy. A side that runs out
+ * of things to do sets a flag in the ring and sleeps on an eventfd, and
+ * only then does the other side write to the eventfd to wake it.
+ */
+#define SHM_MAGIC   0x53564d52
+#define SHM_VERSION 1
+
+// Bytes of packets each ring holds. A power of two.
+#define SHM_RING_SIZE (1 << 20)
+
+// Every record in a ring starts with its length and is padded out to a
+// multiple of 8 bytes. A record that doesn't fit before the end of the ring
+// starts over at the beginning, and SHM_WRAP in place of a length says so.
+#define SHM_REC_HDR 8
+#define SHM_WRAP    0xffffffff
+
+/*
+ * struct shm_ring_ctl
+ *
+ * The shared part of a ring. Positions count bytes from when the ring was
+ * made and wrap around at 2^32. Each side only writes to its own cache
+ * line, except to wake the other up.
+ */
+struct shm_ring_ctl
+{
+	uint32_t head;			// Bytes written. Only the writer changes this
+	uint32_t writer_waiting;	// The writer is waiting for room
+	char pad0[56];
+	uint32_t tail;			// Bytes read. Only the reader changes this
+	uint32_t reader_waiting;	// The reader is waiting for a record
+	char pad1[56];
+};
+
+/*
+ * struct shm_region
+ *
+ * Start of the shared memory. The data of the client's ring, then of the
+ * server's, follow.
+ */
+struct shm_region
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;
+	char pad[52];
+	struct shm_ring_ctl up;		// Client to server
+	struct shm_ring_ctl down;	// Server to client
+};
+
+/*
+ * struct shm_ring
+ *
+ * One side's view of a ring.
+ */
+struct shm_ring
+{
+	struct shm_ring_ctl *ctl;
+	char *data;
+	uint32_t size;
+	uint32_t pos;		// Our own head or tail
+	uint32_t step;		// Bytes taken up by the record being written or read
+	int waiting;		// We went to sleep on wait_fd
+	int data_fd;		// Wakes the reader
+	int space_fd;		// Wakes the writer
+	int wait_fd;		// The one of those that wakes us
+};
+
+// Descriptors sent with the hello, in this order.
+#define SHM_FD_REGION     0
+#define SHM_FD_UP_DATA    1
+#define SHM_FD_UP_SPACE   2
+#define SHM_FD_DOWN_DATA  3
+#define SHM_FD_DOWN_SPACE 4
+#define SHM_NFDS          5
+
+/*
+ * struct shm_link
+ *
+ * Both rings, as seen from one side.
+ */
+struct shm_link
+{
+	struct shm_region *region;
+	size_t len;
+	int fds[SHM_NFDS];
+	struct shm_ring tx, rx;
+};
+
+struct shm_hello
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;
+};
+
+int shm_listen(const char *path);
+int shm_connect(const char *path);
+int shm_create(struct shm_link *l);
+int shm_attach(struct shm_link *l, const int *fds, int server);
+void shm_close(struct shm_link *l);
+int shm_offer(int sock, struct shm_link *l);
+int shm_take(int sock, struct shm_link *l);
+
+char *shm_reserve(struct shm_ring *r, int len);
+void shm_commit(struct shm_ring *r, int len);
+int shm_write(struct shm_ring *r, const char *buf, int len);
+char *shm_peek(struct shm_ring *r, int *len);
+void shm_release(struct shm_ring *r);
+
+void shm_wake_reader(struct shm_ring *r);
+void shm_wake_writer(struct shm_ring *r);
+int shm_reader_sleep(struct shm_ring *r);
+int shm_writer_sleep(struct shm_ring *r, int len);
+void shm_woken(struct shm_ring *r);
+
+int shm_flush(struct shm_ring *r, struct txq *q);
+
+#endif
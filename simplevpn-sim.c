@@ -0,0 +1,513 @@
+/* simplevpn-sim.c -- Deterministic simulation of a server with many clients */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs the server's core (simplevpn-core.c) over an in-memory transport with
+ * a virtual clock, so that the address pool, routing table, scheduler, txqs
+ * and idle timeouts can be driven by far more clients than a test machine
+ * has sockets for. It is built with a pool of POOL_SIZE addresses, more
+ * than the server's /16, so that it can go past 65536 clients. Every client
+ * joins at the start, or at the join rate, then sends packets to the others
+ * and keepalives when it has nothing to send.
+ * Clients drop out at the churn rate: half of them close their connection
+ * and half of them just go silent and are timed out, and all of them come
+ * back a little later on a new connection, as after an outage.
+ *
+ * Everything random comes from one seeded generator and the clock only
+ * moves when the simulation says so, so a run with the same options does
+ * exactly the same thing every time. The digest printed at the end covers
+ * every frame the core sent, which makes that easy to check. Wall clock
+ * time per virtual interval shows what the core costs at that scale.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "simplevpn-core.h"
+#include "simplevpn-sched.h"
+#include "simplevpn-route.h"
+#include "simplevpn-pool.h"
+#include "simplevpn-mem.h"
+#include "simplevpn-log.h"
+
+#define CLIENT_DOWN    0	// Waiting to connect
+#define CLIENT_JOINING 1	// Connected, no address yet
+#define CLIENT_UP      2
+
+// Packets put through the core between calls to core_forward().
+#define SIM_BATCH 256
+
+// Seconds a client that was refused an address waits before trying again,
+// and the most a client that dropped out stays away.
+#define SIM_RETRY   30
+#define SIM_AWAY    30
+
+// Bytes that may wait to be written to a client, as with the server's
+// default budget.
+#define SIM_TXQ_LIMIT (512 * 1024)
+
+// Addresses handed out, host byte order.
+#define SIM_NET 0x0a000000
+
+struct sim_client;
+
+/*
+ * struct sim_conn
+ *
+ * One connection as the core sees it. A connection outlives its client if
+ * the client went silent, until the core times it out.
+ */
+struct sim_conn
+{
+	struct core_peer peer;
+	struct sim_client *client;	// NULL once the client has gone
+	struct sim_conn *next_free;	// On the free list, or timed out by the core
+};
+
+struct sim_client
+{
+	int state;
+	int up_index;		// Position in up[] while CLIENT_UP
+	unsigned int ip;	// Address on the VPN, network byte order
+	unsigned int want;	// Static address it asks for, or 0
+	unsigned int inet_ip;
+	struct sim_conn *conn;
+	time_t connect_at;	// When a CLIENT_DOWN client connects again
+	time_t last_tx;
+};
+
+static struct sim_client *clients;
+static struct sim_client **up;
+static int nclients, nup;
+static struct sim_conn *free_conns;
+static struct sim_conn *expired;	// Timed out, not yet closed
+static long conns_live, zombies;
+static time_t now;
+static uint64_t rng_state;
+static uint64_t digest = 0xcbf29ce484222325ULL;
+
+// Counts kept by the simulated clients.
+static long refused, dropped, silenced, delivered, to_dead, held;
+
+static uint64_t rng(void)
+{
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void hash(const void *buf, int len)
+{
+	const unsigned char *p = buf;
+	int i;
+
+	for(i = 0; i < len; i++)
+		digest = (digest ^ p[i]) * 0x100000001b3ULL;
+}
+
+static struct sim_conn *conn_alloc(void)
+{
+	struct sim_conn *c = free_conns;
+
+	if(c != NULL)
+		free_conns = c->next_free;
+	else if((c = malloc(sizeof(*c))) == NULL)
+	{
+		printf("Out of memory\n");
+		exit(1);
+	}
+	conns_live++;
+	return c;
+}
+
+static void conn_free(struct sim_conn *c)
+{
+	c->next_free = free_conns;
+	free_conns = c;
+	conns_live--;
+}
+
+static void set_up(struct sim_client *cli)
+{
+	cli->state = CLIENT_UP;
+	cli->up_index = nup;
+	up[nup++] = cli;
+}
+
+/*
+ * set_down
+ *
+ * Takes cli out of the running until time when. Its connection is left to
+ * whoever called us.
+ */
+static void set_down(struct sim_client *cli, time_t when)
+{
+	if(cli->state == CLIENT_UP)
+	{
+		up[cli->up_index] = up[--nup];
+		up[cli->up_index]->up_index = cli->up_index;
+	}
+	cli->state = CLIENT_DOWN;
+	cli->conn = NULL;
+	cli->connect_at = when;
+}
+
+/*
+ * sim_flush
+ *
+ * The core's way of writing to a client. Everything in the txq goes at
+ * once. The first thing a joining client gets back is the answer to its
+ * address request.
+ */
+static int sim_flush(struct core_peer *peer)
+{
+	struct sim_conn *c = peer->conn;
+	struct sim_client *cli = c->client;
+	struct pkt *p;
+
+	while((p = txq_pop(&peer->txq)) != NULL)
+	{
+		peer->txq.bytes -= p->len;
+		hash(&now, sizeof(now));
+		hash(p->data, (p->len < 28) ? p->len : 28);
+		if(cli == NULL)
+			to_dead++;
+		else if(cli->state == CLIENT_JOINING)
+		{
+			cli->ip = ((unsigned int*)p->data)[4];
+			set_up(cli);
+		}
+		else
+			delivered++;
+		pkt_free(p);
+	}
+	return 0;
+}
+
+/*
+ * sim_drop
+ *
+ * The core timed out a connection. It is closed once core_expire() has
+ * returned, since the core can't be called back from here.
+ */
+static void sim_drop(struct core_peer *peer)
+{
+	struct sim_conn *c = peer->conn;
+
+	c->next_free = expired;
+	expired = c;
+}
+
+static const struct core_io sim_io = { sim_flush, sim_drop };
+
+/*
+ * close_expired
+ *
+ * Closes the connections the core timed out. A client that was still
+ * there comes back a little later.
+ */
+static void close_expired(void)
+{
+	struct sim_conn *c;
+
+	while((c = expired) != NULL)
+	{
+		expired = c->next_free;
+		core_peer_gone(&c->peer);
+		if(c->client != NULL)
+			set_down(c->client, now + 1 + rng() % SIM_AWAY);
+		else
+			zombies--;
+		conn_free(c);
+	}
+}
+
+/*
+ * disconnect
+ *
+ * Closes cli's connection, as when the server drops it or the client goes
+ * away cleanly.
+ */
+static void disconnect(struct sim_client *cli, time_t when)
+{
+	struct sim_conn *c = cli->conn;
+
+	core_peer_gone(&c->peer);
+	conn_free(c);
+	set_down(cli, when);
+}
+
+static void build(char *buf, int len, unsigned int src, unsigned int dst)
+{
+	memset(buf, 0, 20);
+	buf[0] = 0x45;
+	*(unsigned short*)(buf + 2) = htons(len);
+	buf[8] = 64;
+	buf[9] = 17;
+	*(unsigned int*)(buf + 12) = src;
+	*(unsigned int*)(buf + 16) = dst;
+}
+
+/*
+ * input
+ *
+ * Hands a frame from cli to the core, and disconnects cli if the core says
+ * so.
+ */
+static void input(struct sim_client *cli, char *buf, int len)
+{
+	if(core_input(&cli->conn->peer, buf, len, now) < 0)
+	{
+		if(cli->state == CLIENT_JOINING)
+			refused++;
+		disconnect(cli, now + SIM_RETRY);
+	}
+}
+
+static void join(struct sim_client *cli)
+{
+	char req[20];
+	struct sim_conn *c = conn_alloc();
+
+	c->client = cli;
+	cli->conn = c;
+	cli->state = CLIENT_JOINING;
+	cli->last_tx = now;
+	core_peer_init(&c->peer, c, cli->inet_ip, NULL, SIM_TXQ_LIMIT, now);
+	build(req, 20, cli->want, 0);
+	input(cli, req, 20);
+}
+
+void usage(char *progname)
+{
+	printf("%s: simulates a simplevpn server with many clients\n\n", progname);
+	printf("\t-n <clients>\tOptional. Number of clients. Default 50000.\n");
+	printf("\t-t <seconds>\tOptional. Virtual seconds to run for. Default 600.\n");
+	printf("\t-j <rate>\tOptional. Clients that may join per virtual second, 0 for all at once. Default 0.\n");
+	printf("\t-p <rate>\tOptional. Packets per virtual second, over all clients. Default 100000.\n");
+	printf("\t-c <percent>\tOptional. Clients that drop out per virtual minute. Default 1.\n");
+	printf("\t-a <percent>\tOptional. Clients that ask for a static address. Default 0.\n");
+	printf("\t-i <seconds>\tOptional. Virtual seconds between reports. Default 60.\n");
+	printf("\t-s <seed>\tOptional. Seed for everything random. Default 1.\n");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	int duration = 600, join_rate = 0, pps = 100000, interval = 60;
+	double churn = 1, statics = 0;
+	uint64_t seed = 1;
+	double start, mark;
+	char buf[1500];
+	int c, i, n;
+
+	while ((c = getopt (argc, argv, "n:t:j:p:c:a:i:s:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n':
+			nclients = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'j':
+			join_rate = atoi(optarg);
+			break;
+		case 'p':
+			pps = atoi(optarg);
+			break;
+		case 'c':
+			churn = atof(optarg);
+			break;
+		case 'a':
+			statics = atof(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if(nclients == 0)
+		nclients = 50000;
+	if(nclients < 1 || duration < 1 || interval < 1)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	// The core logs every join and timeout, which would bury the report.
+	log_level = LOG_ERROR - 1;
+
+	rng_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+	mem_init(0, 0);
+	sched_init();
+	core_pool_init(SIM_NET + 1, SIM_NET + POOL_SIZE - 1, 0xfffff000);
+	core_init(&sim_io, POOL_MASK, DEFAULT_TUN_MTU);
+
+	clients = calloc(nclients, sizeof(struct sim_client));
+	up = calloc(nclients, sizeof(struct sim_client*));
+	if(clients == NULL || up == NULL)
+	{
+		printf("Could not allocate %d clients\n", nclients);
+		return 1;
+	}
+	for(i = 0; i < nclients; i++)
+	{
+		clients[i].inet_ip = htonl(0x64400000 + i);
+		if(rng() % 10000 < statics * 100)
+			clients[i].want = htonl(SIM_NET + 1 + rng() % (POOL_SIZE - 2));
+		clients[i].connect_at = 0;
+	}
+
+	printf("%d clients, %d virtual seconds, %d packets/s, %.2f%% churn/min, seed %llu\n",
+		nclients, duration, pps, churn, (unsigned long long)seed);
+	printf("%6s %7s %7s %8s %8s %8s %10s %10s %7s %9s %8s\n",
+		"time", "up", "zombies", "joins", "refused", "timeouts", "forwarded", "unroutable", "pool", "mem(MB)", "wall(ms)");
+
+	start = mark = now_sec();
+	for(now = 0; now < duration; now++)
+	{
+		const struct core_stats *st = core_stats();
+		int joins = 0, sent = 0, quota;
+
+		// Connections that nobody has heard from in too long.
+		core_expire(now);
+		close_expired();
+
+		// Clients coming (back) up, as fast as they are let in.
+		for(i = 0; i < nclients && (join_rate == 0 || joins < join_rate); i++)
+		{
+			if(clients[i].state != CLIENT_DOWN || clients[i].connect_at > now)
+				continue;
+			join(&clients[i]);
+			joins++;
+		}
+
+		// Drop-outs. Half of them just stop talking, leaving their
+		// connection for the core to time out.
+		n = (int)(nup * churn / 100 / 60);
+		if(rng() % 1000000 < (uint64_t)((nup * churn / 100 / 60 - n) * 1000000))
+			n++;
+		for(i = 0; i < n && nup > 0; i++)
+		{
+			struct sim_client *cli = up[rng() % nup];
+
+			if(rng() & 1)
+			{
+				cli->conn->client = NULL;
+				zombies++;
+				silenced++;
+				set_down(cli, now + 1 + rng() % SIM_AWAY);
+			}
+			else
+			{
+				dropped++;
+				disconnect(cli, now + 1 + rng() % SIM_AWAY);
+			}
+		}
+
+		// Traffic between random pairs of clients, spread over the
+		// second in batches the forwarding step drains in between.
+		for(quota = pps; quota > 0 && nup > 0; quota -= sent)
+		{
+			for(sent = 0; sent < SIM_BATCH && sent < quota && nup > 0; sent++)
+			{
+				struct sim_client *src = up[rng() % nup];
+				struct sim_client *dst = up[rng() % nup];
+				int len = 40 + rng() % (sizeof(buf) - 100);
+
+				// The transport stops reading from a client
+				// that has too much queued.
+				if(core_backlogged(&src->conn->peer))
+				{
+					held++;
+					continue;
+				}
+				build(buf, len, src->ip, dst->ip);
+				src->last_tx = now;
+				input(src, buf, len);
+			}
+			core_forward(SIM_BATCH * 2, NULL);
+		}
+		core_forward(1 << 30, NULL);
+
+		// Keepalives from clients that had nothing else to send.
+		for(i = 0; i < nup; i++)
+		{
+			struct sim_client *cli = up[i];
+
+			if(now - cli->last_tx < SOCK_TIMEOUT / 4)
+				continue;
+			build(buf, 20, -1, -1);
+			cli->last_tx = now;
+			input(cli, buf, 20);
+			// A client that was disconnected took the last
+			// place in up[].
+			if(cli->state != CLIENT_UP)
+				i--;
+		}
+		core_forward(1 << 30, NULL);
+
+		if((now + 1) % interval == 0 || now + 1 == duration)
+		{
+			double t = now_sec();
+
+			printf("%6ld %7d %7ld %8ld %8ld %8ld %10ld %10ld %7d %9.1f %8.1f\n",
+				(long)now + 1, nup, zombies, st->joins, refused, st->timeouts, st->forwarded, st->unroutable,
+				pool_available(), mem_total() / 1048576.0, (t - mark) * 1000);
+			mark = t;
+		}
+	}
+
+	{
+		const struct core_stats *st = core_stats();
+		double t = now_sec() - start;
+
+		printf("\n%ld addresses handed out, %ld refused, %ld clean disconnects, %ld went silent, %ld timed out\n",
+			st->joins, refused, dropped, silenced, st->timeouts);
+		printf("%ld packets forwarded, %ld to nobody, %ld to dead connections, %ld held back, %ld keepalives\n",
+			st->forwarded, st->unroutable, to_dead, held, st->keepalives);
+		printf("%ld connections open, %d routes, %.3f s wall clock for %d virtual seconds\n",
+			conns_live, route_count(), t, duration);
+		printf("digest %016llx\n", (unsigned long long)digest);
+	}
+	return 0;
+}
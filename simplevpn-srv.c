@@ -18,6 +18,7 @@
    along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE	// accept4()
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,29 +29,110 @@
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <stdarg.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include "simplevpn-pkt.h"
+#include "simplevpn-sched.h"
+#include "simplevpn-txq.h"
+#include "simplevpn-cluster.h"
+#include "simplevpn-p2p.h"
+#include "simplevpn-pool.h"
+#include "simplevpn-cap.h"
+#include "simplevpn-lease.h"
+#include "simplevpn-upgrade.h"
+#include "simplevpn-tune.h"
+#include "simplevpn-stripe.h"
+#include "simplevpn-route.h"
+#include "simplevpn-shm.h"
+#include "simplevpn-core.h"
+#include "simplevpn-dgram.h"
+#include "simplevpn-log.h"
+#include "simplevpn-comp.h"
 
 // Hard-coded (for now) IP address range+mask to be sure we're handing out valid addresses.
 #define IP_MASK  0xffff0000
 #define IP_RANGE 0x0a000000
 
+// Bytes each client may tie up on the server by default. This covers its
+// receive buffer and every packet it sent that hasn't been written to its
+// destination yet. Half as much again may be waiting to be written to it
+// before we start dropping packets addressed to it.
+#define CLIENT_BUDGET (1024 * 1024)
+
+// Receive buffers start out this big, which holds a few full size packets,
+// and only grow while a bigger frame is coming in.
+#define RX_BUF_SIZE (8192 - 64)
+
+// Packets the forwarding thread takes from the scheduler at a time.
+#define FWD_BATCH 32
+
+// Packets a client thread takes from a local client's ring at a time.
+#define LOCAL_BATCH 64
+
+// Admission control. A reconnect storm waits in the listen backlog instead
+// of being refused, so the backlog is large, and no more than
+// MAX_PENDING_JOINS clients may be between accept() and getting an address.
+#define LISTEN_BACKLOG    4096
+#define ACCEPT_THREADS    4
+#define MAX_PENDING_JOINS 1024
+#define CLIENT_STACK_SIZE (256 * 1024)	// Receive buffers are on the heap
+
+// Buckets in the table of clients on the UDP socket, by source address.
+#define DGRAM_TABLE_SIZE 65536
+
 
 struct client
 {
-	struct client *next;
+	struct client *next;	// First, so &client_list can stand in for a client
 	struct client *prev;
+	struct core_peer peer;	// Addresses, queues and idle timer, kept by the core
 	int sockfd;
-	int ip;      // IP Addr on the VPN
-	int inet_ip; // IP Addr on the internet
+	unsigned int cookie;	// Proves a rendezvous registration came from this client
+	struct sockaddr_in udp_addr;	// Public UDP endpoint, if registered
+	int udp_registered;
+	int joining;		// Counted in joins_pending until it has an address
+	char *rxbuf;		// Bytes read from the client that aren't a whole packet yet
+	int rxlen;
+	unsigned int rx_seq;	// Sequence number of the frame being handled, or 0
+	struct tune tune;	// Socket settings for the path to this client
+	struct group *group;	// Streams this one is striped with, or NULL
+	struct addr_subnet subnets[ADDR_MAX_SUBNETS];	// Networks routed to this client
+	int nsubnets;
+	struct shm_link *shm;	// Rings of a client on this host, or NULL
+	int dgram;		// Tunnels over the server's UDP socket, from dgram_addr
+	struct sockaddr_in dgram_addr;
+	struct client *dgram_next;	// In the datagram thread's table
+	struct client *reap_next;	// Waiting for the datagram thread to free it
+	int reaping;
+	struct comp *comp;	// Header compression state, if the client asked for it
 };
 
-struct free_ip_addr
+/*
+ * struct group
+ *
+ * The streams of a client that stripes its tunnel over several connections.
+ * Each stream is a client of its own, with its own socket, thread and txq,
+ * but only the first one has an address. Packets from every stream go
+ * through one reorder buffer into one queue. members, streams and tx_seq
+ * are protected by the core lock and rx by lock. The group goes away
+ * with the last stream that refers to it.
+ */
+struct group
 {
-	struct free_ip_addr *next;
-	struct free_ip_addr *prev;
-	int address;
+	struct client *members[STRIPE_MAX_STREAMS];	// By stream index, 0 is the first
+	int streams;		// Streams the client may have
+	unsigned int ip;	// The first stream's address
+	unsigned int tx_seq;	// Last sequence number sent, host byte order
+	int turn;		// Stream that wins the next tie
+	int refs;
+	pthread_mutex_t lock;
+	struct reorder rx;
+	struct sched_queue rxq;	// Packets from the client waiting to be forwarded
 };
 
 struct ip_header
@@ -67,9 +149,40 @@ struct ip_header
 	int dest_ip;
 };
 
-struct client *client_list = NULL;
-struct free_ip_addr *free_ip_addr_list = NULL;
-pthread_mutex_t client_list_mutex;
+struct client *client_list = NULL;	// Protected by the core lock
+char *limits_file = NULL;
+int tun_mtu = DEFAULT_TUN_MTU;			// Pushed to clients
+unsigned int tun_netmask = DEFAULT_TUN_NETMASK;	// Pushed to clients, host byte order
+unsigned int p2p_threshold = P2P_DEFAULT_THRESHOLD;	// 0 disables direct paths
+int rendezvous_fd = -1;		// The server's UDP socket
+unsigned short rendezvous_port;
+struct dgram udp;		// Moves datagrams through rendezvous_fd
+int udp_tunnels = 0;		// New clients may tunnel over UDP
+struct client **dgram_table;	// Clients on the UDP socket, only for the datagram thread
+struct client *dgram_reap = NULL;	// Protected by the core lock
+pthread_mutex_t admit_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t admit_cond = PTHREAD_COND_INITIALIZER;
+int joins_pending = 0;
+unsigned int join_rate = 0;	// New clients per second, 0 for unlimited
+struct mem_cache *client_cache;
+struct mem_cache *group_cache;
+int stripe_max = STRIPE_MAX_STREAMS;	// Streams a client may stripe over
+long client_budget = CLIENT_BUDGET;
+int capturing = 0;		// Capture file is open
+int *listen_fds;
+int nlisten;
+int local_fd = -1;		// Local socket for clients on this host
+pthread_attr_t client_attr;	// Detached, small stack
+
+// Client and accept threads hold this for reading while they read from a
+// client or accept one. A handover to a new server holds it for writing, so
+// that nothing changes while the clients' state is sent over. Waiting
+// writers keep new readers out.
+pthread_rwlock_t upgrade_lock;
+pthread_mutex_t fwd_pause_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fwd_pause_cond = PTHREAD_COND_INITIALIZER;
+int fwd_pause = 0;		// Forwarding thread should stop
+int fwd_paused = 0;		// Forwarding thread has stopped
 
 /* tun_alloc
  *
@@ -113,7 +226,7 @@ int cread(int fd, char *buf, int n){
   int nread;
 
   if((nread=read(fd, buf, n))<0){
-    perror("Reading data");
+    log_err("Reading data: %m");
     pthread_exit((void*)1);
   }
   return nread;
@@ -128,7 +241,7 @@ int cwrite(int fd, char *buf, int n){
   int nwrite;
 
   if((nwrite=write(fd, buf, n))<0){
-    perror("Writing data");
+    log_err("Writing data: %m");
     pthread_exit((void*)1);
   }
   return nwrite;
@@ -155,475 +268,2433 @@ int read_n(int fd, char *buf, int n) {
 
 
 /*
- * generateFreeIPAddressList
- *
+ * flushClient
  *
+ * Writes as much of cli's txq to its socket, its ring if it is on this host
+ * or the UDP socket if it tunnels over UDP, as will go without blocking,
+ * and returns what txq_flush() does.
+ * Whatever doesn't fit goes out once poll() says there is room again. The
+ * core calls this with its lock held.
  */
-unsigned int ip_range_low, ip_range_high, ip_mask;
-void generateFreeIPAddressList(int start_addr, int end_addr, int mask)
+int flushClient(struct core_peer *peer)
 {
-	// Remember allowable IP range. This will be needed later.
-	ip_range_low = htonl(start_addr);
-	ip_range_high = htonl(end_addr);
-	ip_mask = htonl(mask);
-	
-	while(start_addr <= end_addr)
-	{
-		struct free_ip_addr *new_ip_addr = malloc(sizeof(struct free_ip_addr));
-
-		if(new_ip_addr == NULL)
-		{
-			printf("Could not allocate memory in generateFreeIPAddressList\n") ;
-			exit(1);
-		}
+	struct client *cli = peer->conn;
 
-		new_ip_addr->address = htonl(start_addr++);
-
-		while((start_addr & mask) == start_addr)
-			start_addr++;
-
-		// Low-order byte of the address can't be 255
-		if((start_addr & 0xff) == 0xff || (start_addr & 0xff) == 0)
-			start_addr++;
-		if((start_addr & 0xff00) == 0xff00 || (start_addr & 0xff00) == 0)
-			start_addr += 0x0100 ;
-
-		new_ip_addr->next = free_ip_addr_list;
-		free_ip_addr_list = new_ip_addr;
-		new_ip_addr->prev = (struct free_ip_addr*)&free_ip_addr_list;
-		if(new_ip_addr->next != NULL)
-			new_ip_addr->next->prev = new_ip_addr;
+	if(cli->shm != NULL)
+		return shm_flush(&cli->shm->tx, &peer->txq);
+	if(cli->dgram)
+		return dgram_flush(&udp, &peer->txq, &cli->dgram_addr);
+	return txq_flush(&peer->txq, cli->sockfd);
+}
 
+/*
+ * clientPollFd
+ *
+ * Returns the descriptor that poll() says cli has room for more on, and
+ * sets events to what to wait for.
+ */
+int clientPollFd(struct client *cli, short *events)
+{
+	if(cli->shm != NULL)
+	{
+		*events = POLLIN;
+		return cli->shm->tx.wait_fd;
 	}
+	*events = POLLOUT;
+	return cli->dgram ? udp.fd : cli->sockfd;
 }
 
-
-struct free_ip_addr *findFreeAddr(unsigned int ip_address)
+/*
+ * freeLocal
+ *
+ * Lets go of the rings of a client on this host.
+ */
+void freeLocal(struct client *cli)
 {
-	struct free_ip_addr *addr = free_ip_addr_list;
-	while((addr != NULL) && (addr->address != ip_address))
-		addr = addr->next ;
-
-	return addr ;
+	if(cli->shm == NULL)
+		return;
+	shm_close(cli->shm);
+	free(cli->shm);
+	cli->shm = NULL;
 }
 
 /*
- * claimIPAddress
- *
- * Deletes an IP address from the free list and returns it. If addr = NULL on
- * entry, claimIPAddress will retrun the first address in the list it finds.
- * This is useful for dynamically allocating addresses to newly connected
- * clients. If addr is non-NULL on entry, claimIPAddress will delete addr from
- * the list of free IP addresses and return addr->address;
+ * startCompressing
  *
+ * Sets cli up to compress the headers of packets in both directions,
+ * starting with empty slots unless state is given. The state is charged
+ * to cli's budget. Returns -1 if we are out of memory.
  */
-unsigned int claimIPAddress(struct free_ip_addr *addr)
+int startCompressing(struct client *cli, const struct comp *state)
 {
-	unsigned int claimed_address = 0;
-	
-	do{
-		// Unlink the ip address from the free list.
-		if(addr == NULL)
-			addr = free_ip_addr_list->next;
-		
-		addr->prev->next = addr->next;
-		if(addr->next != NULL)
-			addr->next->prev = addr->prev ;
+	struct comp *c = cli->comp;
 
-		claimed_address = addr->address;
+	if(c == NULL && (c = mem_alloc(sizeof(struct comp))) == NULL)
+		return -1;
+	if(cli->comp == NULL)
+		mem_budget_charge(cli->peer.budget, mem_usable(c));
+	if(state != NULL)
+		memcpy(c, state, sizeof(*c));
+	else if(cli->comp == NULL)
+		comp_init(c);
+	cli->comp = c;
+	cli->peer.txq.comp = c;
+	return 0;
+}
 
-		free(addr);
-	}while((claimed_address & IP_MASK) != IP_RANGE);
+void freeComp(struct client *cli)
+{
+	if(cli->comp == NULL)
+		return;
+	cli->peer.txq.comp = NULL;
+	mem_budget_uncharge(cli->peer.budget, mem_usable(cli->comp));
+	mem_free(cli->comp);
+	cli->comp = NULL;
+}
 
-	return claimed_address;
+/*
+ * isExtraStream
+ *
+ * Returns 1 if cli is one of the streams a striped client opened after its
+ * first. Those don't have an address of their own.
+ */
+int isExtraStream(struct client *cli)
+{
+	return cli->group != NULL && cli->peer.ip == -1;
+}
 
+/*
+ * clientQueue
+ *
+ * Returns the queue for packets from cli. The streams of a striped client
+ * share their group's.
+ */
+struct sched_queue *clientQueue(struct client *cli)
+{
+	return (cli->group != NULL) ? &cli->group->rxq : &cli->peer.rxq;
 }
 
-void cleanup(struct client *cli)
+/*
+ * findClient
+ *
+ * Returns the connected client with VPN address ip, or NULL. Must be called
+ * with the core lock held, which keeps the client from going away.
+ */
+struct client *findClient(unsigned int ip)
 {
-	pthread_mutex_lock(&client_list_mutex);
-	
-	// Check to see if this address is already in the free list. We don't
-	// want to add duplicate copies of an IP to the free list.
-	struct free_ip_addr *addr = findFreeAddr(cli->ip);
-	struct free_ip_addr *addr_iterator;
+	struct core_peer *peer = core_find(ip);
 
-	// Make sure the address is sane before we re-insert it into the free
-	// list. This is kind of a hack. We should probably have a function that
-	// checks that the address is within some acceptable range as defined by
-	// the address and bitmask since we do this in many places.
-	if((addr == NULL) && ((ntohl(cli->ip) & IP_MASK) == IP_RANGE))
-	{
-		fprintf(stderr, "[cleanup] Reclaiming IP\n");
-		// Put the client's address back into the list of free addresses.
-		addr = malloc(sizeof(struct free_ip_addr));
-		addr_iterator = free_ip_addr_list;
-		addr->address = cli->ip;
+	return (peer != NULL) ? peer->conn : NULL;
+}
 
-		while(addr_iterator->next != NULL && ntohl(addr_iterator->next->address) > ntohl(cli->ip))
-			addr_iterator = addr_iterator->next;
+/*
+ * dropSubnets
+ *
+ * Stops routing the subnets cli advertised to it. Must be called with the
+ * core lock held.
+ */
+void dropSubnets(struct client *cli)
+{
+	int i;
 
+	for(i = 0; i < cli->nsubnets; i++)
+		route_del(cli->subnets[i].net, cli->subnets[i].len, &cli->peer);
+	cli->nsubnets = 0;
+}
 
-		// Link the reclaimed address into the list of free addresses.
-		addr->next = addr_iterator->next;
-		if(addr_iterator->next != NULL)
-		{
-			addr_iterator->next->prev = addr;
-		}
-		addr_iterator->next = addr ;
-		addr->prev = addr_iterator;
+/*
+ * addSubnet
+ *
+ * Routes net/len (network byte order) to cli. Subnets that overlap the
+ * VPN's own addresses, and ones another client already has, are refused.
+ * Returns -1 if the subnet was refused. Must be called with the core lock
+ * held.
+ */
+int addSubnet(struct client *cli, unsigned int net, int len)
+{
+	struct addr_subnet *sn;
 
-		printf("[cleanup] Old addr linked back into free list after %08x\n", ntohl(addr->prev->address));
-	}
-	else
+	if(len < 1 || len > 32 || cli->nsubnets == ADDR_MAX_SUBNETS)
+		return -1;
+	net &= htonl(0xffffffff << (32 - len));
+	if(route_overlaps(net, len, htonl(IP_RANGE), 32 - __builtin_ctz(IP_MASK)) || route_add(net, len, &cli->peer) < 0)
+		return -1;
+	sn = &cli->subnets[cli->nsubnets++];
+	memset(sn, 0, sizeof(*sn));
+	sn->net = net;
+	sn->len = len;
+	return 0;
+}
+
+/*
+ * advertiseSubnets
+ *
+ * Routes the subnets listed in the address request in buffer to cli, in
+ * place of any it advertised before. Must be called with the core lock
+ * held.
+ */
+void advertiseSubnets(struct client *cli, const char *buffer, int len)
+{
+	const struct addr_subnet *sn = (const struct addr_subnet*)(buffer + ADDR_REQ_LEN);
+	int i, n;
+
+	dropSubnets(cli);
+	if(len < (int)ADDR_REQ_LEN)
+		return;
+	n = ntohs(((const struct addr_req_opts*)(buffer + 20))->subnets);
+	for(i = 0; i < n && (const char*)(sn + 1) <= buffer + len; i++, sn++)
 	{
-		fprintf(stderr,"[cleanup] Problem reclaiming IP address %08x\n", ntohl(cli->ip));
+		if(addSubnet(cli, sn->net, sn->len) < 0)
+			log_warn("Refused subnet %s/%d from %08x", inet_ntoa(*(const struct in_addr*)&sn->net), sn->len, ntohl(cli->peer.ip));
+		else
+			log_info("Routing %s/%d to %08x", inet_ntoa(*(const struct in_addr*)&sn->net), sn->len, ntohl(cli->peer.ip));
 	}
-
-	if(cli->next != NULL)
-		cli->next->prev = cli->prev;
-	cli->prev->next = cli->next;
-	pthread_mutex_unlock(&client_list_mutex);
 }
 
 /*
- * handleConnectionThread
+ * newGroup
  *
- * This is the main thread that handles connections from clients. This just
- * runs in a loop, listening for a packet from a client, and then sends the
- * packet to its destination.
- * 
- * IP addresses are stored in data structures in network byte order to reduce
- * the number of calls to htonl() and ntohl() etc. The only time they need to
- * be converted to host byte order is if two addresses are being compared for
- * greater than/less than. Equality comparisons don't need to convert addresses
- * from network order to host order.
+ * Makes cli the first stream of a striped client that may have streams
+ * streams. Returns NULL if we are out of memory.
  */
-void *handleConnectionThread(void *c)
+struct group *newGroup(struct client *cli, int streams)
 {
-	int n;
-	struct client *cli = (struct client*)c;
-	int net_fd = cli->sockfd;
-	char *buffer ;
-	unsigned short nread;
-	struct timeval timeout;
-
-
-	timeout.tv_sec = SOCK_TIMEOUT/2;
-	timeout.tv_usec = 0;
+	struct group *g = mem_cache_alloc(group_cache);
+
+	if(g == NULL)
+		return NULL;
+	memset(g->members, 0, sizeof(g->members));
+	g->members[0] = cli;
+	g->streams = streams;
+	g->ip = cli->peer.ip;
+	g->tx_seq = 0;
+	g->turn = 0;
+	g->refs = 1;
+	pthread_mutex_init(&g->lock, NULL);
+	reorder_init(&g->rx, 1);
+	sched_queue_init(&g->rxq);
+	sched_apply_limits(&g->rxq, cli->peer.ip);
+	return g;
+}
 
-	if (setsockopt (net_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,sizeof(timeout)) < 0)
+/*
+ * replyWithAddress
+ *
+ * Answers the address request in buffer with cli's address and the
+ * interface settings the client should use. If the client asked for streams streams
+ * it may stripe its tunnel over that many, or as many as we allow, and
+ * every frame after the reply carries a sequence number. Headers are
+ * compressed from the reply on if the request's flags ask for it and
+ * the client is on a TCP connection. Must be called with the core lock
+ * held.
+ */
+void replyWithAddress(struct client *cli, const char *buffer, int len, int streams)
+{
+	char reply[ADDR_REPLY_MAX], buf[CTL_MSG_LEN];
+	struct ctl_msg msg;
+	struct group *g = cli->group;
+	int flags = core_addr_flags(buffer, len);
+
+	if(streams > stripe_max)
+		streams = stripe_max;
+	if(g == NULL && streams > 1)
+		g = newGroup(cli, streams);
+	if(flags > 0)
+		flags &= ADDR_FLAG_COMPRESS;
+	if(flags > 0 && (cli->shm != NULL || cli->dgram || startCompressing(cli, NULL) < 0))
+		flags &= ~ADDR_FLAG_COMPRESS;
+
+	core_reply(&cli->peer, reply, core_addr_reply(reply, buffer, cli->peer.ip, tun_netmask, tun_mtu, (g != NULL) ? g->streams : 0, flags));
+
+	// The reply itself goes out without a sequence number.
+	if(g != NULL && cli->group == NULL)
 	{
-		perror("setsockopt()");
-		exit(1) ;
+		cli->group = g;
+		cli->peer.striped = 1;
 	}
 
-	if (setsockopt (net_fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,sizeof(timeout)) < 0)
+	// Let the client register for direct paths to other clients.
+	if(p2p_threshold != 0 && rendezvous_fd >= 0)
 	{
-		perror("setsockopt()");
+		memset(&msg, 0, sizeof(msg));
+		msg.type = CTL_UDP_COOKIE;
+		msg.port = htons(rendezvous_port);
+		msg.vpn_ip = cli->peer.ip;
+		msg.id = cli->cookie;
+		core_reply(&cli->peer, buf, ctl_build(buf, &msg));
 	}
 
-	int maxfd = net_fd;	
-	while(1)
+	if(g != NULL)
 	{
-		fd_set rd_set ;
-
-		FD_ZERO(&rd_set) ;
-		FD_SET(net_fd,&rd_set);
+		memset(&msg, 0, sizeof(msg));
+		msg.type = CTL_STRIPE;
+		msg.port = htons(g->streams);
+		msg.vpn_ip = cli->peer.ip;
+		msg.id = cli->cookie;
+		core_reply(&cli->peer, buf, ctl_build(buf, &msg));
+	}
+}
 
-		timeout.tv_sec = 60;
-		timeout.tv_usec = 0;
+/*
+ * answerClient
+ *
+ * Answers the address request req from a client that has its address now,
+ * and routes the subnets it lists to it. A client that wants to stripe its
+ * tunnel says how many streams it would like after the request's header.
+ * A tunnel over UDP has no stream to stripe. The core calls this with its
+ * lock held.
+ */
+void answerClient(struct core_peer *peer, const char *req, int len)
+{
+	struct client *cli = peer->conn;
 
-		int ret = select(maxfd + 1, &rd_set, NULL, NULL, &timeout);
+	advertiseSubnets(cli, req, len);
+	replyWithAddress(cli, req, len, cli->dgram ? 0 : core_addr_streams(req, len));
+}
 
-		if (ret < 0 && errno == EINTR)
-			continue;
+/*
+ * stripeToClient
+ *
+ * Queues p for dest, a striped client. Interactive packets go on the first
+ * stream unnumbered, so they never wait behind bulk traffic. Bulk packets go
+ * on whichever stream has the least waiting, numbered so the client can put
+ * them back in order. Returns the stream p was queued to, or NULL if it was
+ * dropped. Must be called with the core lock held.
+ */
+struct client *stripeToClient(struct client *dest, struct pkt *p)
+{
+	struct group *g = dest->group;
+	struct client *best = dest, *cli;
+	int i;
 
-		if (ret < 0)
+	if(p->prio == PKT_PRIO_BULK)
+	{
+		// Streams that keep up all have empty queues, so ties go
+		// round them in turn.
+		g->turn = (g->turn + 1) % g->streams;
+		best = NULL;
+		for(i = 0; i < g->streams; i++)
 		{
-			perror("select()");
-			exit(1);
+			cli = g->members[(g->turn + i) % g->streams];
+			if(cli != NULL && (best == NULL || cli->peer.txq.bytes < best->peer.txq.bytes))
+				best = cli;
 		}
 
-		if(ret == 0)
+		// A packet dropped here must not use up a sequence number, or
+		// the client would wait for it.
+		if(txq_full(&best->peer.txq, p))
 		{
-			// Select timeout.
-			printf("Select timeout. Removing address %08x\n", ntohl(cli->ip));
-			cleanup(cli);
-			free(cli);
-			close(net_fd);
-			pthread_exit(0);
+			best->peer.txq.drops++;
+			pkt_free(p);
+			return NULL;
 		}
+		g->tx_seq = stripe_seq_next(g->tx_seq);
+		p->seq = htonl(g->tx_seq);
+	}
+	core_queue(&best->peer, p);
+	return best;
+}
 
-		if(FD_ISSET(net_fd, &rd_set))
-		{
-			// Find out how many bytes are available to read from the
-			// network fd.
-			ioctl(net_fd, FIONREAD,&n);
-
-			buffer = malloc(n+4);
-
-			if(n == 0)
-			{
-				// Connection closed by remote host.
-				printf("Disconnect from %s (%08x)\n",inet_ntoa(*(struct in_addr*)&cli->inet_ip), ntohl(cli->ip));
-				cleanup(cli);
-				free(cli);
-				close(net_fd);
-				pthread_exit(0);
-			}
-
-			// read packet, four bytes in to buffer to account for packet
-			// information header that gets prepended to every tun packet.
-			nread = read(net_fd, buffer, n);
-
-			// When we get a packet from one of the associated VPN
-			// clients, check out list of associated devices to see
-			// if one of them has an IP address that matches the
-			// destination IP of the packet we just received. If we
-			// find one, forward the packet to that client.
-			// Otherwise, send the packet to the tun interface and
-			// let linux deal with it.
-			pthread_mutex_lock(&client_list_mutex);
-
-			struct ip_header *iphdr = (struct ip_header*)(buffer);
-			struct client *iterator = (struct client*)&client_list;
-
-			// If the client has a self-assigned IP in the correct
-			// range, then record it.
-			if((ntohl(iphdr->source_ip) >= ip_range_low) && (ntohl(iphdr->source_ip) <= ip_range_high) && iphdr->dest_ip != 0 && iphdr->dest_ip != -1)
-			{
-				struct free_ip_addr *addr = findFreeAddr(iphdr->source_ip);
-				cli->ip = iphdr->source_ip; // Set address.
-				if(addr != NULL)
-				{
-					printf("Client has self-assigned IP that is in free list: %08x...\n", ntohl(iphdr->source_ip));
-					claimIPAddress(addr);
-				}
-
-			}
-			if((ntohl(iphdr->source_ip) == 0) && (ntohl(iphdr->dest_ip) == 0))
-			{
-				// Address request.
-				// If the client does not already have an
-				// address, assign it one.
-				if(cli->ip == -1)
-				{
-					// Unlink the ip address from the free list.
-					struct free_ip_addr *addr = free_ip_addr_list;
-					free_ip_addr_list = free_ip_addr_list->next ;
-					if(free_ip_addr_list != NULL)
-						free_ip_addr_list->prev = (struct free_ip_addr*)&free_ip_addr_list;
-					
-					cli->ip = addr->address; // Set address.
-					free(addr);
-				}
-				// Otherwise, just respond with the IP it is
-				// already assigned.
-				iphdr->dest_ip = cli->ip ;
-
-				printf("Got address request. Assigning 0x%08x\n", ntohl(cli->ip));
-				int err = write(cli->sockfd, buffer, nread);
-				if(err <= 0)
-					printf("nothing written to cli sockfd\n");
-
-			}
-			else if((ntohl(iphdr->source_ip) != 0) && (ntohl(iphdr->dest_ip) == 0))
-			{
-				// Static address request.
-				// Find the requested IP address in the list.
-
-				struct free_ip_addr *addr = findFreeAddr(iphdr->source_ip);
-				if((addr != NULL) && (addr->address == iphdr->source_ip))
-				{
-					// Unlink the address from the list.
-					addr->prev->next = addr->next;
-					if(addr->next != NULL)
-						addr->next->prev = addr->prev;
-					
-					free(addr) ;
-					// Static IP on client side.
-					iphdr->dest_ip = iphdr->source_ip ;
-					iphdr->source_ip = 0 ;
-
-					// Record the client's IP in the cli struct
-					cli->ip = iphdr->dest_ip;
-				}
-				else
-				{
-					// Address in use
-					fprintf(stderr,"ERROR: Client requested a static address that is already in use: %08x\n", ntohl(iphdr->source_ip));
-					iphdr->dest_ip = 0 ; // Indicate error
-					iphdr->source_ip = 0 ;
+/*
+ * introduceClients
+ *
+ * Tells two clients that exchange a lot of traffic through us how to reach
+ * each other directly. Both must have registered with the rendezvous socket.
+ * Must be called with the core lock held.
+ */
+void introduceClients(struct client *a, struct client *b)
+{
+	char buf[CTL_MSG_LEN];
+	struct ctl_msg msg;
+	unsigned int session = random() | 1;
+
+	if(!a->udp_registered || !b->udp_registered)
+		return;
+
+	log_info("Introducing %08x and %08x for a direct path", ntohl(a->peer.ip), ntohl(b->peer.ip));
+	memset(&msg, 0, sizeof(msg));
+	msg.type = CTL_PEER;
+	msg.id = session;
+
+	msg.addr = b->udp_addr.sin_addr.s_addr;
+	msg.port = b->udp_addr.sin_port;
+	msg.vpn_ip = b->peer.ip;
+	core_reply(&a->peer, buf, ctl_build(buf, &msg));
+
+	msg.addr = a->udp_addr.sin_addr.s_addr;
+	msg.port = a->udp_addr.sin_port;
+	msg.vpn_ip = a->peer.ip;
+	core_reply(&b->peer, buf, ctl_build(buf, &msg));
+}
 
-					pthread_mutex_unlock(&client_list_mutex);
+/*
+ * admitToken
+ *
+ * Takes a token from the bucket that keeps clients from joining faster than
+ * join_rate per second. The bucket holds a tenth of a second of joins so
+ * admissions are spread out evenly. Returns 0 if there was a token, or how
+ * many microseconds until the next one. Must be called with admit_mutex
+ * held.
+ */
+long admitToken(void)
+{
+	static double tokens = 0;
+	static struct timespec stamp;
+	struct timespec now;
+	double burst = join_rate / 10.0 + 1;
+
+	if(join_rate == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	tokens += join_rate * ((now.tv_sec - stamp.tv_sec) + (now.tv_nsec - stamp.tv_nsec) / 1e9);
+	if(tokens > burst)
+		tokens = burst;
+	stamp = now;
+	if(tokens >= 1)
+	{
+		tokens -= 1;
+		return 0;
+	}
+	return (1 - tokens) * 1000000 / join_rate + 1;
+}
 
-					cli->ip = -1;
-					fprintf(stderr, "[handleConnectionThread] Calling cleanup()\n");
-					cleanup(cli);
-					fprintf(stderr, "[handleConnectionThread] Returned from cleanup()\n");
-					free(cli);
-					close(net_fd);
+/*
+ * admitWait
+ *
+ * Called by the accept threads before taking a connection off the backlog.
+ * Waits while too many clients are in the middle of their handshake, or
+ * while clients are joining too fast.
+ */
+void admitWait(void)
+{
+	long wait;
 
+	pthread_mutex_lock(&admit_mutex);
+	while(joins_pending >= MAX_PENDING_JOINS)
+		pthread_cond_wait(&admit_cond, &admit_mutex);
 
-					fprintf(stderr, "[handleConnectionThread] Unlocking client_list_mutex\n");
+	// Sleep until the next token, leaving the lock to other accept
+	// threads, which will find the bucket empty as well.
+	while((wait = admitToken()) > 0)
+	{
+		pthread_mutex_unlock(&admit_mutex);
+		usleep(wait);
+		pthread_mutex_lock(&admit_mutex);
+	}
+	joins_pending++;
+	pthread_mutex_unlock(&admit_mutex);
+}
 
-					pthread_exit((void*)1);
-				}
+/*
+ * admitTry
+ *
+ * admitWait() for the datagram thread, which can't wait. A client on the
+ * UDP socket that would have to is dropped, and tries again. Returns -1 if
+ * it may not join now.
+ */
+int admitTry(void)
+{
+	int ret = -1;
 
+	pthread_mutex_lock(&admit_mutex);
+	if(joins_pending < MAX_PENDING_JOINS && admitToken() == 0)
+	{
+		joins_pending++;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&admit_mutex);
+	return ret;
+}
 
-				// Acknowledge static IP assignment
-				int err = write(cli->sockfd, buffer, nread);
-				if(err <= 0)
-					fprintf(stderr,"nothing written to cli sockfd\n");
+void admitRelease(void)
+{
+	pthread_mutex_lock(&admit_mutex);
+	joins_pending--;
+	pthread_cond_signal(&admit_cond);
+	pthread_mutex_unlock(&admit_mutex);
+}
 
-			}
-			else if((ntohl(iphdr->source_ip) == -1) && (ntohl(iphdr->dest_ip) == -1))
-			{
-				// Keepalive
-				int err = write(cli->sockfd, buffer, nread) ;
-				if(err < 0)
-					printf("Write error\n") ;
-			}
-			// Look thru the list of connected clients and see if
-			// there is an IP address match. If so, send the packet
-			// to the intended client.
-			while(iterator->next != NULL)
-			{
-				if(iterator->next->ip == iphdr->dest_ip)
-				{
-					// Found the correct device in the list
-					int err = write(iterator->next->sockfd, buffer, nread);
-					if(err <= 0)
-						printf("nothing written to cli sockfd\n");
+/*
+ * admitDone
+ *
+ * Takes cli out of the count of clients in their handshake once it has an
+ * address or has gone away. Only cli's own thread calls this.
+ */
+void admitDone(struct client *cli)
+{
+	if(!cli->joining)
+		return;
+	cli->joining = 0;
+	admitRelease();
+}
 
+/*
+ * joinGroup
+ *
+ * Makes cli, a connection whose first frame was the CTL_STRIPE_JOIN msg in
+ * buf, one of the streams of the client it names. Returns -1 if the client
+ * isn't striped, the cookie is wrong, the stream is taken or cli isn't a
+ * connection at all. The core calls
+ * this with its lock held.
+ */
+int joinGroup(struct core_peer *peer, const char *buf, int len)
+{
+	struct client *cli = peer->conn, *first;
+	const struct ctl_msg *msg = (const struct ctl_msg*)(buf + 20);
+	struct group *g;
+	int index = ntohs(msg->port);
 
-					break;
-				}
+	if(cli->group != NULL || cli->dgram)
+		return -1;
 
-				// If we haven't found it yet, keep looking.
-				iterator = iterator->next;
-			}
-			pthread_mutex_unlock(&client_list_mutex);
-			free(buffer);
-		}
+	first = findClient(msg->vpn_ip);
+	if(first == NULL || (g = first->group) == NULL || g->members[0] != first || first->cookie != msg->id ||
+	   index < 1 || index >= g->streams || g->members[index] != NULL)
+	{
+		log_warn("Bad stream join from %s for %08x", inet_ntoa(*(struct in_addr*)&cli->peer.inet_ip), ntohl(msg->vpn_ip));
+		return -1;
 	}
+	// Every stream compresses if the first one does, each with slots
+	// of its own.
+	if(first->comp != NULL && startCompressing(cli, NULL) < 0)
+		return -1;
+	g->members[index] = cli;
+	g->refs++;
+	cli->group = g;
+	cli->cookie = first->cookie;	// Identifies the group in a handover
+	return 0;
 }
 
-
-void usage(char *progname)
+/*
+ * stripeReceive
+ *
+ * Takes packet p, numbered seq (host byte order), from one of the streams of
+ * group g, and queues whatever can be forwarded in order now.
+ */
+void stripeReceive(struct group *g, struct pkt *p, unsigned int seq)
 {
-	printf("%s: simpleVPN client application\n\n", progname);
-	printf("\t-u\t\tOptional. Use UDP instead of TCP. Not implemented\n");
-	printf("\t-p <port>\tOptional. Set the local port to listen on.\n");
-	printf("\n");
-}
-
-
+	struct pkt *next;
 
+	pthread_mutex_lock(&g->lock);
+	for(p = reorder_push(&g->rx, p, seq); p != NULL; p = next)
+	{
+		next = p->next;
+		sched_enqueue(&g->rxq, p);
+	}
+	pthread_mutex_unlock(&g->lock);
+}
 
-int main(int argc, char ** argv)
+/*
+ * stripeExpire
+ *
+ * Stops waiting for packets that haven't arrived in time on any of g's
+ * streams. Returns how long until the next packet held back times out, or
+ * -1 if none is.
+ */
+int stripeExpire(struct group *g)
 {
-	char *devname = malloc(50) ;
-	char *str = malloc(50) ;
-	int net_fd = 0, sock_fd = 0, optval = 1 ;
-	struct sockaddr_in local, remote;
-	socklen_t remotelen;
-	unsigned short port = 2002;
-	unsigned int socktype = SOCK_STREAM;
-	int c;
+	struct pkt *p, *next;
+	int wait;
 
-	generateFreeIPAddressList(0x0a000001, 0x0a00ffff, 0xfffff000);
-	
-	pthread_mutex_init(&client_list_mutex, NULL);
+	if(__atomic_load_n(&g->rx.held, __ATOMIC_RELAXED) == 0)
+		return -1;
 
-	while ((c = getopt (argc, argv, "up:")) != -1)
+	pthread_mutex_lock(&g->lock);
+	if((wait = reorder_wait_ms(&g->rx)) == 0)
 	{
-		switch (c)
+		for(p = reorder_flush(&g->rx); p != NULL; p = next)
 		{
-		case 'u':
-			printf("Connecting to server using UDP\n");
-			socktype = SOCK_DGRAM;
-			break;
-		case 'p':
-			port = atoi(optarg);
-			break;
-		default:
-			usage(argv[0]);
-			printf("Unrecognized option %c\n", c);
-			return -1;
+			next = p->next;
+			sched_enqueue(&g->rxq, p);
 		}
+		wait = -1;
 	}
+	pthread_mutex_unlock(&g->lock);
+	return wait;
+}
 
-	// Set up socket to listen on
-	if ( (sock_fd = socket(AF_INET, socktype, 0)) < 0)
-	{
-		perror("socket()");
-		exit(1);
-	}
-	
-	// avoid EADDRINUSE error on bind()
-	if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&optval, sizeof(optval)) < 0)
-	{
-		perror("setsockopt()");
-		exit(1);
-	}
+/*
+ * leaveGroup
+ *
+ * Drops cli's reference to its group, once it has been taken out of the
+ * group's members. A stream that went down may have taken packets with it,
+ * so there is no point waiting for them. The last stream frees the group.
+ */
+void leaveGroup(struct client *cli)
+{
+	struct group *g = cli->group;
+	struct pkt *p, *next;
 
-	memset(&local, 0, sizeof(local));
-	local.sin_family = AF_INET;
-	local.sin_addr.s_addr = htonl(INADDR_ANY);
-	local.sin_port = htons(port);
-	if (bind(sock_fd, (struct sockaddr*) &local, sizeof(local)) < 0)
+	if(__atomic_sub_fetch(&g->refs, 1, __ATOMIC_ACQ_REL) > 0)
 	{
-		perror("bind()");
-		exit(1);
+		pthread_mutex_lock(&g->lock);
+		for(p = reorder_flush(&g->rx); p != NULL; p = next)
+		{
+			next = p->next;
+			sched_enqueue(&g->rxq, p);
+		}
+		pthread_mutex_unlock(&g->lock);
+		return;
 	}
 
-	if(socktype == SOCK_DGRAM)
+	for(p = reorder_flush(&g->rx); p != NULL; p = next)
 	{
-		//UDP socket
+		next = p->next;
+		pkt_free(p);
 	}
+	sched_queue_destroy(&g->rxq);
+	pthread_mutex_destroy(&g->lock);
+	mem_cache_free(group_cache, g);
+}
+
+void cleanup(struct client *cli)
+{
+	struct group *g = cli->group;
+	int i;
+
+	core_lock();
+	if(cli->next != NULL)
+		cli->next->prev = cli->prev;
+	cli->prev->next = cli->next;
+	dropSubnets(cli);
 
-	if (listen(sock_fd, 5) < 0)
+	// The other streams of a striped client go down with its first one.
+	if(g != NULL)
 	{
-		perror("listen()");
-		exit(1);
+		for(i = 0; i < STRIPE_MAX_STREAMS; i++)
+		{
+			if(g->members[i] == cli)
+				g->members[i] = NULL;
+			else if(g->members[i] != NULL && g->members[0] == NULL)
+				shutdown(g->members[i]->sockfd, SHUT_RDWR);
+		}
 	}
+	core_unlock();
+
+	core_peer_gone(&cli->peer);
+	if(g != NULL)
+		leaveGroup(cli);
+	admitDone(cli);
+}
+
+/*
+ * receiveFromClient
+ *
+ * Puts a packet from cli on its queue for the forwarding thread, through
+ * its group's reorder buffer if it came numbered on a striped stream. This
+ * blocks if the client has more queued than it is allowed, so the datagram
+ * thread doesn't hand over packets from a client that does.
+ */
+void receiveFromClient(struct core_peer *peer, struct pkt *p)
+{
+	struct client *cli = peer->conn;
+
+	if(cli->rx_seq != 0)
+		stripeReceive(cli->group, p, cli->rx_seq);
+	else
+		sched_enqueue(clientQueue(cli), p);
+}
+
+/*
+ * handlePacket
+ *
+ * Hands one packet received from cli to the core, which answers address
+ * requests and keepalives right away and queues everything else for the
+ * forwarding thread. seq is the packet's sequence number if it came
+ * numbered on a striped stream, and 0 otherwise. Returns -1 if the client
+ * should be disconnected.
+ */
+int handlePacket(struct client *cli, char *buffer, int nread, unsigned int seq)
+{
+	cli->rx_seq = seq;
+	if(core_input(&cli->peer, buffer, nread, time(NULL)) < 0)
+		return -1;
+
+	// The handshake is over once the client has an address, or has
+	// joined the client it is a stream of.
+	if(cli->joining && (cli->peer.ip != -1 || cli->peer.striped))
+		admitDone(cli);
+	return 0;
+}
+
+void freeRxBuffer(struct client *cli, char *buffer)
+{
+	if(buffer == NULL)
+		return;
+	mem_budget_uncharge(cli->peer.budget, mem_usable(buffer));
+	mem_free(buffer);
+}
+
+/*
+ * resizeRxBuffer
+ *
+ * Replaces cli's receive buffer with one of at least size bytes, keeping the
+ * first rxlen bytes. Receive buffers are charged to the client's budget.
+ * Returns -1 if we are out of memory.
+ */
+int resizeRxBuffer(struct client *cli, char **buffer, int rxlen, int size)
+{
+	char *nbuf = mem_alloc(size);
+
+	if(nbuf == NULL)
+		return -1;
+	mem_budget_charge(cli->peer.budget, mem_usable(nbuf));
+	if(*buffer != NULL)
+	{
+		memcpy(nbuf, *buffer, rxlen);
+		freeRxBuffer(cli, *buffer);
+	}
+	*buffer = nbuf;
+	return 0;
+}
+
+/*
+ * readClient
+ *
+ * Reads what cli has sent and handles every whole packet. Whatever is left
+ * of a packet that hasn't all arrived stays in cli's receive buffer. Frames
+ * on a striped stream start with a sequence number. Returns -1 if the
+ * client should be disconnected.
+ */
+int readClient(struct client *cli)
+{
+	int n, len, hdr, off = 0;
+	unsigned int seq;
+	char scratch[COMP_MAX_LEN + COMP_GROWTH], *frame;
+
+	n = read(cli->sockfd, cli->rxbuf + cli->rxlen, mem_usable(cli->rxbuf) - cli->rxlen);
+	if(n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+
+	if(n <= 0)
+	{
+		// Connection closed by remote host.
+		log_info("Disconnect from %s (%08x)",inet_ntoa(*(struct in_addr*)&cli->peer.inet_ip), ntohl(cli->peer.ip));
+		return -1;
+	}
+	cli->rxlen += n;
+
+	while(1)
+	{
+		// A stream joins a group part way through a read, so this is
+		// checked for every frame.
+		hdr = (cli->group != NULL) ? STRIPE_HDR_LEN : 0;
+		if(cli->comp != NULL)
+			len = comp_frame_len(cli->rxbuf + off, cli->rxlen - off, hdr);
+		else if(hdr != 0)
+			len = stripe_frame_len(cli->rxbuf + off, cli->rxlen - off);
+		else
+			len = frame_len(cli->rxbuf + off, cli->rxlen - off);
+		if(len <= 0 || len > cli->rxlen - off)
+			break;
+
+		seq = 0;
+		if(hdr != 0)
+		{
+			memcpy(&seq, cli->rxbuf + off, sizeof(seq));
+			seq = ntohl(seq);
+		}
+		frame = cli->rxbuf + off + hdr;
+		n = len - hdr;
+		if(cli->comp != NULL && (n = comp_expand(cli->comp, frame, n, &frame, scratch)) < 0)
+		{
+			len = -1;
+			break;
+		}
+		if(handlePacket(cli, frame, n, seq) < 0)
+			return -1;
+		off += len;
+	}
+
+	if(len < 0)
+	{
+		log_warn("Garbage on stream from %s (%08x)",inet_ntoa(*(struct in_addr*)&cli->peer.inet_ip), ntohl(cli->peer.ip));
+		return -1;
+	}
+
+	// Keep any partial packet for the next read. A frame that doesn't
+	// fit needs a bigger buffer, and once it has gone through we drop
+	// back to a small one.
+	memmove(cli->rxbuf, cli->rxbuf + off, cli->rxlen - off);
+	cli->rxlen -= off;
+	if((len > (int)mem_usable(cli->rxbuf) && resizeRxBuffer(cli, &cli->rxbuf, cli->rxlen, len) < 0) ||
+	   (cli->rxlen == 0 && mem_usable(cli->rxbuf) >= 2 * RX_BUF_SIZE && resizeRxBuffer(cli, &cli->rxbuf, 0, RX_BUF_SIZE) < 0))
+	{
+		log_err("Could not allocate receive buffer for %08x", ntohl(cli->peer.ip));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * readLocal
+ *
+ * Handles up to LOCAL_BATCH packets from the ring of cli, a client on this
+ * host. Each one is copied straight out of the ring. Returns the number
+ * handled, or -1 if the client should be disconnected.
+ */
+int readLocal(struct client *cli)
+{
+	struct shm_ring *r = &cli->shm->rx;
+	char *frame;
+	int n, len;
+
+	for(n = 0; n < LOCAL_BATCH; n++)
+	{
+		if((frame = shm_peek(r, &len)) == NULL)
+			break;
+		if(frame_len(frame, len) != len)
+		{
+			log_warn("Garbage on ring from local client (%08x)", ntohl(cli->peer.ip));
+			return -1;
+		}
+		if(handlePacket(cli, frame, len, 0) < 0)
+			return -1;
+		shm_release(r);
+	}
+	if(frame == NULL && len < 0)
+	{
+		log_warn("Broken ring from local client (%08x)", ntohl(cli->peer.ip));
+		return -1;
+	}
+	if(n > 0)
+		shm_wake_writer(r);
+	return n;
+}
+
+/*
+ * handleConnectionThread
+ *
+ * This is the main thread that handles connections from clients. This just
+ * runs in a loop, listening for a packet from a client, and then sends the
+ * packet to its destination.
+ * 
+ * IP addresses are stored in data structures in network byte order to reduce
+ * the number of calls to htonl() and ntohl() etc. The only time they need to
+ * be converted to host byte order is if two addresses are being compared for
+ * greater than/less than. Equality comparisons don't need to convert addresses
+ * from network order to host order.
+ *
+ * Packets arrive back to back on the TCP stream, so they are collected in a
+ * receive buffer and split apart using the lengths in their IP headers.
+ */
+void *handleConnectionThread(void *c)
+{
+	struct client *cli = (struct client*)c;
+	int net_fd = cli->sockfd;
+
+	if(cli->rxbuf == NULL && resizeRxBuffer(cli, &cli->rxbuf, 0, RX_BUF_SIZE) < 0)
+	{
+		log_err("Could not allocate receive buffer for %08x", ntohl(cli->peer.ip));
+		goto disconnect;
+	}
+
+	// The socket is non-blocking. poll() has no limit on descriptor
+	// numbers, unlike select(), which matters with thousands of clients.
+	while(1)
+	{
+		struct pollfd pfd[2];
+		int hold = -1, nfds = 1, ret;
+
+		// Stop reading while this client holds more than its share of
+		// memory. TCP flow control pushes back on it until packets
+		// it sent have been delivered. A striped stream keeps reading
+		// while its group holds packets back, as the one they wait
+		// for may be on this socket, and they only go once it comes
+		// or they time out.
+		if(cli->group == NULL || __atomic_load_n(&cli->group->rx.held, __ATOMIC_RELAXED) == 0)
+			mem_budget_wait(cli->peer.budget);
+
+		pfd[0].fd = net_fd;
+		pfd[0].events = POLLIN;
+
+		// A client on this host sends on its ring, and its socket only
+		// tells us when it goes away. We only sleep once the ring is
+		// empty.
+		if(cli->shm != NULL)
+		{
+			pthread_rwlock_rdlock(&upgrade_lock);
+			ret = readLocal(cli);
+			pthread_rwlock_unlock(&upgrade_lock);
+			if(ret < 0)
+				goto disconnect;
+			if(ret > 0 || !shm_reader_sleep(&cli->shm->rx))
+				continue;
+			pfd[1].fd = cli->shm->rx.wait_fd;
+			pfd[1].events = POLLIN;
+			nfds = 2;
+		}
+
+		// Whichever stream of a striped client wakes up first stops
+		// waiting for packets that are overdue. Clients that go quiet
+		// are timed out by the control thread, which shuts down their
+		// socket.
+		if(cli->group != NULL)
+		{
+			pthread_rwlock_rdlock(&upgrade_lock);
+			hold = stripeExpire(cli->group);
+			pthread_rwlock_unlock(&upgrade_lock);
+		}
+
+		// The socket is retuned here, where no lock is held, so this
+		// thread wakes at least every TUNE_INTERVAL to look at it.
+		if(cli->shm == NULL)
+		{
+			if(tune_update(&cli->tune, net_fd, time(NULL)))
+				log_info("Path to %08x is losing %u%% of what is sent, switching to %s", ntohl(cli->peer.ip), cli->tune.loss, TUNE_CC);
+			if(hold < 0 || hold > TUNE_INTERVAL * 1000)
+				hold = TUNE_INTERVAL * 1000;
+		}
+
+		ret = poll(pfd, nfds, hold);
+		if(cli->shm != NULL)
+			shm_woken(&cli->shm->rx);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+		{
+			log_err("poll(): %m");
+			exit(1);
+		}
+
+		if(ret == 0)
+			continue;
+
+		if(pfd[0].revents && cli->shm != NULL)
+		{
+			log_info("Disconnect from local client (%08x)", ntohl(cli->peer.ip));
+			goto disconnect;
+		}
+
+		if(pfd[0].revents)
+		{
+			pthread_rwlock_rdlock(&upgrade_lock);
+			ret = readClient(cli);
+			pthread_rwlock_unlock(&upgrade_lock);
+			if(ret < 0)
+				goto disconnect;
+		}
+	}
+
+disconnect:
+	// A client that goes away during a handover is left to the new
+	// server.
+	pthread_rwlock_rdlock(&upgrade_lock);
+	cleanup(cli);
+	freeRxBuffer(cli, cli->rxbuf);
+	freeLocal(cli);
+	freeComp(cli);
+	mem_budget_release(cli->peer.budget);
+	mem_cache_free(client_cache, cli);
+	close(net_fd);
+	pthread_rwlock_unlock(&upgrade_lock);
+	pthread_exit(0);
+}
+
+/*
+ * reapLater
+ *
+ * Hands cli, a client on the UDP socket, to the datagram thread to free.
+ * It has no thread of its own that would notice it has gone. Must be
+ * called with the core lock held.
+ */
+void reapLater(struct client *cli)
+{
+	if(cli->reaping)
+		return;
+	__atomic_store_n(&cli->reaping, 1, __ATOMIC_RELAXED);
+	cli->reap_next = dgram_reap;
+	dgram_reap = cli;
+}
+
+/*
+ * dropClient
+ *
+ * Shuts down the socket of cli, which the core has timed out. Its thread
+ * wakes up and cleans up after it. The core calls this with its lock held.
+ */
+void dropClient(struct core_peer *peer)
+{
+	struct client *cli = peer->conn;
+
+	log_info("Timeout. Removing address %08x", ntohl(peer->ip));
+	if(cli->dgram)
+		reapLater(cli);
+	else
+		shutdown(cli->sockfd, SHUT_RDWR);
+}
+
+/*
+ * deliverToClient
+ *
+ * Queues p for dest, the client it is routed to, and returns the client it
+ * was queued to, one of dest's streams if it is striped, or NULL if it was
+ * dropped. The core calls this with its lock held.
+ */
+struct core_peer *deliverToClient(struct core_peer *peer, struct pkt *p)
+{
+	struct ip_header *iphdr = (struct ip_header*)p->data;
+	struct client *dest = peer->conn, *best;
+
+	// Clients that send each other a lot through us may be able to talk
+	// directly. Direct paths only carry traffic between the clients' own
+	// addresses.
+	if(p2p_threshold != 0 && dest->udp_registered && dest->peer.ip == iphdr->dest_ip && !(p->flags & PKT_FROM_PEER) && p2p_account(iphdr->source_ip, iphdr->dest_ip, p->len, time(NULL), p2p_threshold))
+	{
+		struct client *src = findClient(iphdr->source_ip);
+
+		if(src != NULL)
+			introduceClients(src, dest);
+	}
+
+	if(dest->group == NULL)
+	{
+		core_queue(peer, p);
+		return peer;
+	}
+	best = stripeToClient(dest, p);
+	return (best != NULL) ? &best->peer : NULL;
+}
+
+// How the core reaches the server's clients.
+const struct core_io srv_io = { flushClient, dropClient, answerClient, joinGroup, receiveFromClient, deliverToClient };
+
+/*
+ * forwardThread
+ *
+ * Has the core take packets from the clients' queues in the order picked by
+ * the scheduler and write them to their destinations. All writes to client
+ * sockets are non-blocking. When a socket is full the rest stays on that
+ * client's txq and goes out once poll() says the socket is writable again.
+ */
+void *forwardThread(void *arg)
+{
+	struct pollfd *fds = NULL;
+	int nfds_max = 0;
+
+	while(1)
+	{
+		int wait_ms, nfds = 1, n;
+
+		if(__atomic_load_n(&fwd_pause, __ATOMIC_ACQUIRE))
+		{
+			pthread_mutex_lock(&fwd_pause_mutex);
+			fwd_paused = 1;
+			pthread_cond_broadcast(&fwd_pause_cond);
+			while(fwd_pause)
+				pthread_cond_wait(&fwd_pause_cond, &fwd_pause_mutex);
+			fwd_paused = 0;
+			pthread_mutex_unlock(&fwd_pause_mutex);
+		}
+
+		n = core_forward(FWD_BATCH, &wait_ms);
+
+		core_lock();
+		if(core_tx_pending() + 1 > nfds_max)
+		{
+			nfds_max = 2 * (core_tx_pending() + 1);
+			fds = realloc(fds, nfds_max * sizeof(struct pollfd));
+			if(fds == NULL)
+			{
+				log_err("Could not allocate memory in forwardThread");
+				exit(1);
+			}
+		}
+
+		fds[0].fd = sched_wakeup_fd();
+		fds[0].events = POLLIN;
+		if(core_tx_pending() > 0)
+		{
+			struct client *iterator;
+
+			for(iterator = client_list; iterator != NULL; iterator = iterator->next)
+			{
+				if(txq_empty(&iterator->peer.txq))
+					continue;
+				fds[nfds].fd = clientPollFd(iterator, &fds[nfds].events);
+				nfds++;
+			}
+		}
+		core_unlock();
+
+		// Nothing to wait for if the scheduler still has packets ready.
+		if(n > 0 && nfds == 1)
+			continue;
+
+		if(poll(fds, nfds, (n > 0) ? 0 : wait_ms) < 0 && errno != EINTR)
+		{
+			log_err("poll(): %m");
+			exit(1);
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			uint64_t count;
+
+			if(read(fds[0].fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				log_err("read(wakeup_fd): %m");
+		}
+
+		if(nfds > 1)
+		{
+			struct client *iterator;
+
+			core_lock();
+			for(iterator = client_list; iterator != NULL; iterator = iterator->next)
+				core_flush(&iterator->peer);
+			core_unlock();
+		}
+	}
+	return NULL;
+}
+
+/*
+ * pauseForwarding
+ *
+ * Stops the forwarding thread between batches, so that no packet is on its
+ * way from one queue to another, and waits until it has stopped.
+ */
+void pauseForwarding(void)
+{
+	pthread_mutex_lock(&fwd_pause_mutex);
+	__atomic_store_n(&fwd_pause, 1, __ATOMIC_RELEASE);
+	sched_kick();
+	while(!fwd_paused)
+		pthread_cond_wait(&fwd_pause_cond, &fwd_pause_mutex);
+	pthread_mutex_unlock(&fwd_pause_mutex);
+}
+
+void resumeForwarding(void)
+{
+	pthread_mutex_lock(&fwd_pause_mutex);
+	__atomic_store_n(&fwd_pause, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&fwd_pause_cond);
+	pthread_mutex_unlock(&fwd_pause_mutex);
+}
+
+/*
+ * reportMemory
+ *
+ * Prints the server's memory use, and how much of it the clients are
+ * holding against their budgets.
+ */
+void reportMemory(void)
+{
+	struct client *iterator;
+	long clients = 0, charged = 0, queued = 0;
+	unsigned long drops = 0, marks = 0;
+
+	core_lock();
+	for(iterator = client_list; iterator != NULL; iterator = iterator->next)
+	{
+		clients++;
+		charged += __atomic_load_n(&iterator->peer.budget->used, __ATOMIC_RELAXED);
+		queued += iterator->peer.txq.bytes;
+		drops += iterator->peer.txq.drops;
+		marks += iterator->peer.txq.marks;
+	}
+	core_unlock();
+
+	mem_report(stdout);
+	printf("  %ld clients holding %ld KB of %ld KB budgets, %ld KB waiting to be written to them\n", clients, charged / 1024, clients * client_budget / 1024, queued / 1024);
+	printf("  %lu packets to them dropped, %lu marked Congestion Experienced\n", drops, marks);
+	fflush(stdout);
+}
+
+/*
+ * controlThread
+ *
+ * Waits for SIGHUP and reloads the rate limits file when it arrives, so
+ * limits can be changed without restarting the server. SIGUSR1 prints a
+ * memory report and SIGUSR2 pauses and resumes packet capture. Once a
+ * second it hands addresses set aside after a restart back to the pool if
+ * their clients haven't come back, and drops clients that have gone quiet.
+ * Each client's thread retunes its own socket.
+ */
+void *controlThread(void *arg)
+{
+	sigset_t *sigs = (sigset_t*)arg;
+	struct timespec tick = { 1, 0 };
+	int sig;
+
+	while(1)
+	{
+		if((sig = sigtimedwait(sigs, NULL, &tick)) < 0)
+		{
+			lease_expire(time(NULL));
+			core_expire(time(NULL));
+			continue;
+		}
+
+		if(sig == SIGUSR1)
+		{
+			reportMemory();
+			continue;
+		}
+
+		if(sig == SIGUSR2)
+		{
+			if(capturing)
+			{
+				cap_enabled = !cap_enabled;
+				log_info("Packet capture %s", cap_enabled ? "on" : "off");
+			}
+			continue;
+		}
+
+		if(sig != SIGHUP || limits_file == NULL)
+			continue;
+
+		if(sched_load_limits(limits_file) >= 0)
+		{
+			struct client *iterator;
+
+			core_lock();
+			for(iterator = client_list; iterator != NULL; iterator = iterator->next)
+				if(!isExtraStream(iterator))
+					sched_apply_limits(clientQueue(iterator), iterator->peer.ip);
+			core_unlock();
+		}
+	}
+	return NULL;
+}
+
+/*
+ * newClient
+ *
+ * Sets up a client for the connection net_fd from inet_ip and links it into
+ * the client list. net_fd is -1 for a client on the UDP socket. Returns
+ * NULL if we are out of memory.
+ */
+struct client *newClient(int net_fd, unsigned int inet_ip)
+{
+	struct client *newclient = mem_cache_alloc(client_cache);
+	struct mem_budget *budget;
+
+	if(newclient == NULL || (budget = mem_budget_create(client_budget)) == NULL)
+	{
+		if(newclient != NULL)
+			mem_cache_free(client_cache, newclient);
+		return NULL;
+	}
+	newclient->sockfd = net_fd;
+	newclient->cookie = random();
+	newclient->udp_registered = 0;
+	newclient->joining = 1;
+	newclient->rxbuf = NULL;
+	newclient->rxlen = 0;
+	if(net_fd >= 0)
+		tune_init(&newclient->tune, net_fd);
+	newclient->group = NULL;
+	newclient->nsubnets = 0;
+	newclient->shm = NULL;
+	newclient->dgram = 0;
+	newclient->reaping = 0;
+	newclient->comp = NULL;
+	newclient->rx_seq = 0;
+	core_peer_init(&newclient->peer, newclient, inet_ip, budget, client_budget / 2, time(NULL));
+
+	// Link newclient into list of assoc'd clients.
+	core_lock();
+	newclient->next = client_list;
+	client_list = newclient;
+	newclient->prev = (struct client*)&client_list;
+	if(newclient->next != NULL)
+		newclient->next->prev = newclient;
+	core_unlock();
+	return newclient;
+}
+
+/*
+ * startClient
+ *
+ * Starts the thread that reads from cli. Returns -1 if it couldn't be
+ * started, in which case cli is gone.
+ */
+int startClient(struct client *cli)
+{
+	pthread_t th;
+
+	if(pthread_create(&th, &client_attr, handleConnectionThread, (void*)cli) != 0)
+	{
+		log_err("pthread_create(): %m");
+		cleanup(cli);
+		freeRxBuffer(cli, cli->rxbuf);
+		close(cli->sockfd);
+		freeLocal(cli);
+		freeComp(cli);
+		mem_budget_release(cli->peer.budget);
+		mem_cache_free(client_cache, cli);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * registerClient
+ *
+ * Records the public endpoint a client's rendezvous registration in m came
+ * from.
+ */
+void registerClient(struct dgram_msg *m)
+{
+	struct p2p_hdr *hdr = (struct p2p_hdr*)m->data;
+	struct client *cli;
+
+	if(m->len < (int)sizeof(struct p2p_hdr) || hdr->type != P2P_REGISTER)
+		return;
+
+	core_lock();
+	cli = findClient(hdr->vpn_ip);
+	if(cli != NULL && cli->cookie == hdr->id)
+	{
+		if(!cli->udp_registered)
+			log_info("Client %08x registered for direct paths from %s:%d", ntohl(cli->peer.ip), inet_ntoa(m->addr.sin_addr), ntohs(m->addr.sin_port));
+		memcpy(&cli->udp_addr, &m->addr, sizeof(m->addr));
+		cli->udp_registered = 1;
+	}
+	core_unlock();
+}
+
+static unsigned int dgramHash(const struct sockaddr_in *addr)
+{
+	return ((ntohl(addr->sin_addr.s_addr) * 2654435761u) ^ ntohs(addr->sin_port)) & (DGRAM_TABLE_SIZE - 1);
+}
+
+/*
+ * findDatagramClient
+ *
+ * Returns the client on the UDP socket whose datagrams come from addr, or
+ * NULL.
+ */
+struct client *findDatagramClient(const struct sockaddr_in *addr)
+{
+	struct client *cli;
+
+	if(dgram_table == NULL)
+		return NULL;
+	for(cli = dgram_table[dgramHash(addr)]; cli != NULL; cli = cli->dgram_next)
+		if(cli->dgram_addr.sin_addr.s_addr == addr->sin_addr.s_addr && cli->dgram_addr.sin_port == addr->sin_port)
+			return cli;
+	return NULL;
+}
+
+/*
+ * hashDatagramClient
+ *
+ * Makes cli, which tunnels over the UDP socket from addr, one that its
+ * datagrams are handed to. Returns -1 if we are out of memory.
+ */
+int hashDatagramClient(struct client *cli, const struct sockaddr_in *addr)
+{
+	unsigned int h = dgramHash(addr);
+
+	if(dgram_table == NULL && (dgram_table = calloc(DGRAM_TABLE_SIZE, sizeof(struct client*))) == NULL)
+		return -1;
+	cli->dgram = 1;
+	cli->dgram_addr = *addr;
+	cli->dgram_next = dgram_table[h];
+	dgram_table[h] = cli;
+	return 0;
+}
+
+/*
+ * reapDatagramClients
+ *
+ * Frees the clients on the UDP socket that have gone, which only the
+ * datagram thread may do.
+ */
+void reapDatagramClients(void)
+{
+	struct client *cli, *next, **pp;
+
+	core_lock();
+	cli = dgram_reap;
+	dgram_reap = NULL;
+	core_unlock();
+
+	for(; cli != NULL; cli = next)
+	{
+		next = cli->reap_next;
+		for(pp = &dgram_table[dgramHash(&cli->dgram_addr)]; *pp != cli; pp = &(*pp)->dgram_next)
+			;
+		*pp = cli->dgram_next;
+		cleanup(cli);
+		mem_budget_release(cli->peer.budget);
+		mem_cache_free(client_cache, cli);
+	}
+}
+
+/*
+ * receiveDatagram
+ *
+ * Hands the frame in m, which came in on the UDP socket, to the client it
+ * came from. Each datagram is one frame. Only a frame that asks for an
+ * address, or carries traffic from one the client had before, starts a new
+ * client. The datagram thread must not wait for any one client, so traffic
+ * from a client with more queued than it is allowed is dropped, where a TCP
+ * client would stop being read from.
+ */
+void receiveDatagram(struct dgram_msg *m)
+{
+	struct client *cli = findDatagramClient(&m->addr);
+	int kind = core_frame_kind(m->data, m->len);
+
+	if(m->len < 20 || frame_len(m->data, m->len) != m->len)
+		return;
+
+	if(cli == NULL)
+	{
+		if(!udp_tunnels || (kind != CORE_ADDR_REQ && kind != CORE_STATIC_REQ && kind != CORE_DATA) || admitTry() < 0)
+			return;
+		if((cli = newClient(-1, m->addr.sin_addr.s_addr)) == NULL || hashDatagramClient(cli, &m->addr) < 0)
+		{
+			log_warn("Out of memory, dropping client from %s", inet_ntoa(m->addr.sin_addr));
+			if(cli != NULL)
+			{
+				cleanup(cli);
+				mem_budget_release(cli->peer.budget);
+				mem_cache_free(client_cache, cli);
+			}
+			else
+				admitRelease();
+			return;
+		}
+		log_info("SERVER: Client on UDP from %s:%d", inet_ntoa(m->addr.sin_addr), ntohs(m->addr.sin_port));
+	}
+
+	if(__atomic_load_n(&cli->reaping, __ATOMIC_RELAXED))
+		return;
+	if(kind == CORE_DATA && (core_backlogged(&cli->peer) || __atomic_load_n(&cli->peer.budget->used, __ATOMIC_RELAXED) > cli->peer.budget->limit))
+		return;
+	if(handlePacket(cli, m->data, m->len, 0) < 0)
+	{
+		core_lock();
+		reapLater(cli);
+		core_unlock();
+	}
+}
+
+/*
+ * datagramThread
+ *
+ * Reads the server's UDP socket. Rendezvous registrations start with
+ * P2P_MAGIC, which no IP packet does, and everything else is a frame from a
+ * client that tunnels over UDP. Clients on the socket that have gone are
+ * freed here too, at least once a second.
+ */
+void *datagramThread(void *arg)
+{
+	struct pollfd pfd;
+
+	while(1)
+	{
+		int i, n;
+
+		pfd.fd = udp.fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+		{
+			log_err("poll(): %m");
+			exit(1);
+		}
+
+		pthread_rwlock_rdlock(&upgrade_lock);
+		if((n = dgram_recv(&udp)) < 0)
+			log_err("dgram_recv(): %m");
+		for(i = 0; i < n; i++)
+		{
+			struct dgram_msg *m = &udp.rx[i];
+
+			if(m->len >= (int)sizeof(struct p2p_hdr) && ntohl(((struct p2p_hdr*)m->data)->magic) == P2P_MAGIC)
+				registerClient(m);
+			else
+				receiveDatagram(m);
+		}
+		reapDatagramClients();
+		pthread_rwlock_unlock(&upgrade_lock);
+	}
+	return NULL;
+}
+
+/*
+ * openDatagram
+ *
+ * Sets up fd as the server's UDP socket, which every client tunneling over
+ * UDP shares. Returns -1 if there is no backend for it.
+ */
+int openDatagram(int fd)
+{
+	int size = DGRAM_SOCK_BUF;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	if(dgram_open(&udp, fd) < 0)
+	{
+		log_err("No datagram backend for the UDP socket");
+		return -1;
+	}
+	rendezvous_fd = fd;
+	log_info("UDP socket using %s", udp.ops->name);
+	return 0;
+}
+
+/*
+ * acceptThread
+ *
+ * Takes new connections off the listening socket sock_fd and starts a
+ * thread for each one. Several of these run at once, each with its own
+ * SO_REUSEPORT socket, so the kernel spreads a reconnect storm across them.
+ * When we are short of descriptors, memory or threads, connections are left
+ * in the backlog for a while rather than refused. During a handover they
+ * stay in the backlog for the new server.
+ */
+void *acceptThread(void *arg)
+{
+	int sock_fd = (intptr_t)arg;
+
+	while(1)
+	{
+		struct sockaddr_in remote;
+		socklen_t remotelen = sizeof(remote);
+		struct client *newclient;
+		struct pollfd pfd;
+		int net_fd;
+
+		admitWait();
+
+		// The listening socket is non-blocking, so that a connection
+		// is only taken once we know no handover is going on.
+		pfd.fd = sock_fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		{
+			log_err("poll(): %m");
+			exit(1);
+		}
+		pthread_rwlock_rdlock(&upgrade_lock);
+		if ((net_fd = accept4(sock_fd, (struct sockaddr*)&remote, &remotelen, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		{
+			pthread_rwlock_unlock(&upgrade_lock);
+			admitRelease();
+			if(errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+				continue;
+			log_err("accept4(): %m");
+			if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+			{
+				usleep(100000);
+				continue;
+			}
+			exit(1);
+		}
+
+		log_info("SERVER: Client connected from %s", inet_ntoa(remote.sin_addr));
+
+		if((newclient = newClient(net_fd, remote.sin_addr.s_addr)) == NULL)
+		{
+			log_err("Out of memory, dropping client from %s", inet_ntoa(remote.sin_addr));
+			pthread_rwlock_unlock(&upgrade_lock);
+			close(net_fd);
+			admitRelease();
+			usleep(100000);
+			continue;
+		}
+
+		if(startClient(newclient) < 0)
+		{
+			pthread_rwlock_unlock(&upgrade_lock);
+			usleep(100000);
+			continue;
+		}
+		pthread_rwlock_unlock(&upgrade_lock);
+	}
+	return NULL;
+}
+
+/*
+ * localThread
+ *
+ * Takes connections from clients on this host off the local socket. Each
+ * one gets a shared memory region with its rings and is handled like any
+ * other client from then on.
+ */
+void *localThread(void *arg)
+{
+	while(1)
+	{
+		struct client *newclient = NULL;
+		struct shm_link *link;
+		struct pollfd pfd;
+		int net_fd;
+
+		admitWait();
+		pfd.fd = local_fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		{
+			log_err("poll(): %m");
+			exit(1);
+		}
+		pthread_rwlock_rdlock(&upgrade_lock);
+		if((net_fd = accept4(local_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		{
+			pthread_rwlock_unlock(&upgrade_lock);
+			admitRelease();
+			if(errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+			{
+				log_err("accept4(local): %m");
+				usleep(100000);
+			}
+			continue;
+		}
+
+		if((link = malloc(sizeof(*link))) == NULL || shm_create(link) < 0)
+		{
+			free(link);
+			link = NULL;
+		}
+		else if(shm_offer(net_fd, link) < 0 || (newclient = newClient(net_fd, htonl(INADDR_LOOPBACK))) == NULL)
+		{
+			shm_close(link);
+			free(link);
+		}
+		if(newclient == NULL)
+		{
+			log_err("Could not set up local client");
+			pthread_rwlock_unlock(&upgrade_lock);
+			close(net_fd);
+			admitRelease();
+			usleep(100000);
+			continue;
+		}
+
+		log_info("SERVER: Local client connected");
+		newclient->shm = link;
+		startClient(newclient);
+		pthread_rwlock_unlock(&upgrade_lock);
+	}
+	return NULL;
+}
+
+/*
+ * sendQueue
+ *
+ * Sends every packet on the list starting at p to the new server.
+ */
+int sendQueue(int fd, struct pkt *p, int queue, int prio)
+{
+	struct upg_pkt m;
+
+	for(; p != NULL; p = p->next)
+	{
+		memset(&m, 0, sizeof(m));
+		m.type = UPG_PKT;
+		m.queue = queue;
+		m.prio = prio;
+		m.len = p->len;
+		m.seq = p->seq;
+		if(upgrade_send(fd, &m, sizeof(m), p->data, p->len, NULL, 0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * sendHeld
+ *
+ * Sends the packets a striped client's first stream is holding back,
+ * waiting for earlier ones, to the new server.
+ */
+int sendHeld(int fd, struct reorder *r)
+{
+	struct upg_pkt m;
+	unsigned int seq = r->next;
+	int i, n = 0;
+
+	for(i = 0; i < STRIPE_WINDOW && n < r->held; i++, seq = stripe_seq_next(seq))
+	{
+		struct pkt *p = r->slot[seq % STRIPE_WINDOW];
+
+		if(p == NULL)
+			continue;
+		memset(&m, 0, sizeof(m));
+		m.type = UPG_PKT;
+		m.queue = UPG_REORDER;
+		m.prio = p->prio;
+		m.len = p->len;
+		m.seq = htonl(seq);
+		if(upgrade_send(fd, &m, sizeof(m), p->data, p->len, NULL, 0) < 0)
+			return -1;
+		n++;
+	}
+	return 0;
+}
+
+/*
+ * sendClient
+ *
+ * Sends cli's socket, its state and everything queued for or from it to the
+ * new server. A client on the UDP socket has no socket of its own, and is
+ * known by the address its datagrams come from. Returns -1 on failure.
+ */
+int sendClient(int fd, struct client *cli)
+{
+	struct upg_session sess;
+	struct group *g = cli->group;
+	int fds[1 + SHM_NFDS], nfds = 1, prio, i;
+
+	memset(&sess, 0, sizeof(sess));
+	sess.type = UPG_SESSION;
+	sess.ip = cli->peer.ip;
+	sess.inet_ip = cli->peer.inet_ip;
+	sess.cookie = cli->cookie;
+	sess.udp_registered = cli->udp_registered;
+	sess.joining = cli->joining;
+	sess.udp_addr = cli->udp_addr;
+	if(g != NULL)
+	{
+		sess.group_ip = g->ip;
+		while(sess.stream < STRIPE_MAX_STREAMS - 1 && g->members[sess.stream] != cli)
+			sess.stream++;
+		sess.streams = g->streams;
+		sess.tx_seq = g->tx_seq;
+		sess.rx_next = g->rx.next;
+	}
+	sess.nsubnets = cli->nsubnets;
+	memcpy(sess.subnets, cli->subnets, sizeof(sess.subnets));
+	if(cli->comp != NULL)
+	{
+		sess.compress = 1;
+		sess.comp = *cli->comp;
+	}
+	sess.rxlen = cli->rxlen;
+	fds[0] = cli->sockfd;
+	if(cli->dgram)
+	{
+		sess.dgram = 1;
+		sess.dgram_addr = cli->dgram_addr;
+		nfds = 0;
+	}
+	if(cli->shm != NULL)
+	{
+		sess.local = 1;
+		memcpy(fds + 1, cli->shm->fds, sizeof(cli->shm->fds));
+		nfds += SHM_NFDS;
+	}
+	if(upgrade_send(fd, &sess, sizeof(sess), cli->rxbuf, cli->rxlen, fds, nfds) < 0)
+		return -1;
+
+	// The client has already seen the start of the packet we were in the
+	// middle of writing, so the rest of it has to go first.
+	if(cli->peer.txq.cur != NULL)
+	{
+		struct upg_pkt m;
+		int hdr = (cli->peer.txq.cur->flags & PKT_SEQ) ? STRIPE_HDR_LEN : 0;
+
+		memset(&m, 0, sizeof(m));
+		m.type = UPG_PKT;
+		m.queue = UPG_TXQ;
+		m.prio = cli->peer.txq.cur->prio;
+		m.partial = 1;
+		m.len = cli->peer.txq.cur->len + hdr - cli->peer.txq.off;
+		if(upgrade_send(fd, &m, sizeof(m), cli->peer.txq.cur->data - hdr + cli->peer.txq.off, m.len, NULL, 0) < 0)
+			return -1;
+	}
+	if(sendQueue(fd, cli->peer.txq.head, UPG_TXQ, PKT_PRIO_INTERACTIVE) < 0)
+		return -1;
+	for(i = 0; cli->peer.txq.fq != NULL && i < TXQ_FLOWS; i++)
+		if(sendQueue(fd, cli->peer.txq.fq->flows[i].head, UPG_TXQ, PKT_PRIO_BULK) < 0)
+			return -1;
+
+	// The streams of a striped client share their first stream's queue.
+	if(isExtraStream(cli))
+		return 0;
+	for(prio = 0; prio < PKT_NPRIO; prio++)
+		if(sendQueue(fd, clientQueue(cli)->head[prio], UPG_RXQ, prio) < 0)
+			return -1;
+	if(g != NULL && sendHeld(fd, &g->rx) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * handOver
+ *
+ * Hands the listening sockets and every client over to a new server that
+ * connected to the upgrade socket on fd, then exits. Client, accept and
+ * forwarding threads are stopped first so that nothing changes while the
+ * state is sent over. If the new server doesn't take over, we carry on.
+ */
+void handOver(int fd)
+{
+	struct timeval tv = { UPGRADE_TIMEOUT, 0 };
+	struct upg_hello hello;
+	struct upg_listen l;
+	struct upg_end end;
+	struct client *cli;
+	int fds[UPGRADE_MAX_FDS], nfds, i, pass, sessions = 0;
+	uint32_t ready;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if(upgrade_recv(fd, &hello, sizeof(hello), fds, &nfds) != sizeof(hello) || hello.type != UPG_HELLO || hello.magic != UPGRADE_MAGIC || hello.version != UPGRADE_VERSION)
+	{
+		log_warn("Bad upgrade request");
+		return;
+	}
+
+	log_info("Handing over to a new server");
+	pthread_rwlock_wrlock(&upgrade_lock);
+	pauseForwarding();
+	core_lock();
+
+	memset(&l, 0, sizeof(l));
+	l.type = UPG_LISTEN;
+	l.nlisten = nlisten;
+	l.rendezvous = (rendezvous_fd >= 0);
+	l.local = (local_fd >= 0);
+	for(nfds = 0; nfds < nlisten; nfds++)
+		fds[nfds] = listen_fds[nfds];
+	if(rendezvous_fd >= 0)
+		fds[nfds++] = rendezvous_fd;
+	if(local_fd >= 0)
+		fds[nfds++] = local_fd;
+	if(upgrade_send(fd, &l, sizeof(l), NULL, 0, fds, nfds) < 0)
+		goto fail;
+
+	// The first stream of a striped client has to be there before the
+	// others can join it.
+	for(pass = 0; pass < 2; pass++)
+	{
+		for(cli = client_list; cli != NULL; cli = cli->next)
+		{
+			if(isExtraStream(cli) != pass)
+				continue;
+			if(sendClient(fd, cli) < 0)
+				goto fail;
+			sessions++;
+		}
+	}
+
+	end.type = UPG_END;
+	end.sessions = sessions;
+	if(upgrade_send(fd, &end, sizeof(end), NULL, 0, NULL, 0) < 0)
+		goto fail;
+
+	if(upgrade_recv(fd, &ready, sizeof(ready), fds, &i) == sizeof(ready) && ready == UPG_READY)
+	{
+		// Leave the clients' sockets and leases alone. They belong to
+		// the new server now.
+		log_info("Handed %d clients over to the new server, exiting", sessions);
+		log_flush();
+		_exit(0);
+	}
+
+fail:
+	log_info("New server did not take over, carrying on");
+	core_unlock();
+	resumeForwarding();
+	pthread_rwlock_unlock(&upgrade_lock);
+}
+
+/*
+ * adoptClient
+ *
+ * Sets up a client handed over by the old server from the SESSION message
+ * sess and the descriptors that came with it, its socket first. Returns
+ * NULL on failure.
+ */
+struct client *adoptClient(struct upg_session *sess, int *fds)
+{
+	int net_fd = sess->dgram ? -1 : fds[0];
+	struct client *cli = newClient(net_fd, sess->inet_ip);
+
+	if(cli == NULL)
+		return NULL;
+	if(sess->dgram && hashDatagramClient(cli, &sess->dgram_addr) < 0)
+		return NULL;
+	if(sess->local)
+	{
+		struct shm_link *link = malloc(sizeof(*link));
+
+		if(link == NULL || shm_attach(link, fds + 1, 1) < 0)
+		{
+			free(link);
+			return NULL;
+		}
+		cli->shm = link;
+	}
+	cli->cookie = sess->cookie;
+	cli->udp_registered = sess->udp_registered;
+	cli->udp_addr = sess->udp_addr;
+	cli->joining = sess->joining;
+	if(cli->joining)
+	{
+		pthread_mutex_lock(&admit_mutex);
+		joins_pending++;
+		pthread_mutex_unlock(&admit_mutex);
+	}
+
+	if(!sess->dgram)
+	{
+		if(resizeRxBuffer(cli, &cli->rxbuf, 0, sess->rxlen > RX_BUF_SIZE ? sess->rxlen : RX_BUF_SIZE) < 0)
+			return NULL;
+		memcpy(cli->rxbuf, sess + 1, sess->rxlen);
+		cli->rxlen = sess->rxlen;
+	}
+	if(sess->compress && startCompressing(cli, &sess->comp) < 0)
+		return NULL;
+
+	if(sess->ip != -1)
+	{
+		int i;
+
+		pool_claim(sess->ip);
+		lease_grant(sess->ip, cli->peer.inet_ip);
+		core_lock();
+		core_assign(&cli->peer, sess->ip);
+		for(i = 0; i < sess->nsubnets && i < ADDR_MAX_SUBNETS; i++)
+			addSubnet(cli, sess->subnets[i].net, sess->subnets[i].len);
+		core_unlock();
+	}
+
+	if(sess->group_ip != 0 && sess->stream == 0)
+	{
+		struct group *g = newGroup(cli, sess->streams);
+
+		if(g == NULL)
+			return NULL;
+		g->tx_seq = sess->tx_seq;
+		g->rx.next = sess->rx_next;
+		core_lock();
+		cli->group = g;
+		cli->peer.striped = 1;
+		core_unlock();
+	}
+	else if(sess->group_ip != 0)
+	{
+		struct client *first;
+
+		// The stream's first stream may have gone already, in which
+		// case this one goes too.
+		core_lock();
+		first = findClient(sess->group_ip);
+		if(first != NULL && first->group != NULL && first->cookie == sess->cookie && sess->stream < STRIPE_MAX_STREAMS && first->group->members[sess->stream] == NULL)
+		{
+			cli->group = first->group;
+			cli->peer.striped = 1;
+			cli->group->members[sess->stream] = cli;
+			cli->group->refs++;
+		}
+		else
+			shutdown(net_fd, SHUT_RDWR);
+		core_unlock();
+	}
+	return cli;
+}
+
+/*
+ * adoptPacket
+ *
+ * Puts a packet handed over by the old server back on cli's queue.
+ */
+int adoptPacket(struct client *cli, struct upg_pkt *m)
+{
+	struct pkt *p;
+
+	if(cli == NULL || m->prio >= PKT_NPRIO || (p = pkt_alloc(m->len)) == NULL)
+		return -1;
+	memcpy(p->data, m + 1, m->len);
+	p->prio = m->prio;
+	p->seq = m->seq;
+
+	if(m->queue == UPG_RXQ)
+	{
+		pkt_charge(p, cli->peer.budget);
+		return sched_enqueue(clientQueue(cli), p);
+	}
+	if(m->queue == UPG_REORDER)
+	{
+		if(cli->group == NULL)
+		{
+			pkt_free(p);
+			return -1;
+		}
+		p->seq = 0;
+		pkt_charge(p, cli->peer.budget);
+		stripeReceive(cli->group, p, ntohl(m->seq));
+		return 0;
+	}
+
+	core_lock();
+	if(m->partial)
+		core_queue_partial(&cli->peer, p);
+	else
+		core_queue(&cli->peer, p);
+	core_unlock();
+	return 0;
+}
+
+/*
+ * adoptServer
+ *
+ * Takes over the listening sockets and clients of the running server at the
+ * other end of the upgrade socket fd. If this fails part way we exit, and
+ * the old server carries on by itself.
+ */
+void adoptServer(int fd)
+{
+	struct timeval tv = { UPGRADE_TIMEOUT, 0 };
+	struct upg_hello hello = { UPG_HELLO, UPGRADE_MAGIC, UPGRADE_VERSION };
+	struct upg_listen *l;
+	struct client *cli = NULL, *next;
+	char *buf = malloc(UPGRADE_MSG_MAX);
+	int fds[UPGRADE_MAX_FDS], nfds, n, sessions = 0;
+	uint32_t ready = UPG_READY;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	l = (struct upg_listen*)buf;
+	if(upgrade_send(fd, &hello, sizeof(hello), NULL, 0, NULL, 0) < 0 ||
+	   upgrade_recv(fd, buf, UPGRADE_MSG_MAX, fds, &nfds) != sizeof(*l) ||
+	   l->type != UPG_LISTEN || l->nlisten < 1 || nfds != l->nlisten + l->rendezvous + l->local)
+		goto fail;
+	nlisten = l->nlisten;
+	listen_fds = malloc(nlisten * sizeof(int));
+	memcpy(listen_fds, fds, nlisten * sizeof(int));
+	if(l->rendezvous && openDatagram(fds[nlisten]) < 0)
+		goto fail;
+	if(l->local)
+		local_fd = fds[nlisten + l->rendezvous];
+
+	// Packets taken over from the old server's queues must not be
+	// forwarded before every client they might be going to is here.
+	pauseForwarding();
+	while(1)
+	{
+		uint32_t type;
+
+		if((n = upgrade_recv(fd, buf, UPGRADE_MSG_MAX, fds, &nfds)) < (int)sizeof(type))
+			goto fail;
+		type = *(uint32_t*)buf;
+
+		if(type == UPG_SESSION)
+		{
+			struct upg_session *sess = (struct upg_session*)buf;
+
+			if(n < (int)sizeof(*sess) || nfds != (sess->dgram ? 0 : 1 + (sess->local ? SHM_NFDS : 0)) || n != sizeof(*sess) + sess->rxlen || (cli = adoptClient(sess, fds)) == NULL)
+				goto fail;
+			sessions++;
+		}
+		else if(type == UPG_PKT)
+		{
+			struct upg_pkt *m = (struct upg_pkt*)buf;
+
+			if(n < (int)sizeof(*m) || n != sizeof(*m) + m->len || adoptPacket(cli, m) < 0)
+				goto fail;
+		}
+		else if(type == UPG_END)
+			break;
+		else
+			goto fail;
+	}
+	resumeForwarding();
+
+	// Once the old server has gone, which closes its end of the upgrade
+	// socket, we are the only one reading from the clients.
+	if(upgrade_send(fd, &ready, sizeof(ready), NULL, 0, NULL, 0) < 0)
+		goto fail;
+	while(upgrade_recv(fd, buf, UPGRADE_MSG_MAX, fds, &nfds) > 0)
+		;
+	close(fd);
+	free(buf);
+
+	// Clients on the UDP socket are read by the datagram thread.
+	for(cli = client_list; cli != NULL; cli = next)
+	{
+		next = cli->next;
+		if(!cli->dgram)
+			startClient(cli);
+	}
+	log_info("Took over %d clients from the old server", sessions);
+	return;
+
+fail:
+	log_err("Handover from the running server failed");
+	exit(1);
+}
+
+/*
+ * upgradeThread
+ *
+ * Waits for a new server to connect to the upgrade socket and hands over
+ * to it.
+ */
+void *upgradeThread(void *arg)
+{
+	int sock_fd = (intptr_t)arg;
+
 	while(1)
 	{
-		// wait for connection request
-		remotelen = sizeof(remote);
-		memset(&remote, 0, remotelen);
-		if ((net_fd = accept(sock_fd, (struct sockaddr*)&remote, &remotelen)) < 0)
+		int fd = accept4(sock_fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if(fd < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			log_err("accept4(upgrade): %m");
+			return NULL;
+		}
+		handOver(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+void usage(char *progname)
+{
+	printf("%s: simpleVPN client application\n\n", progname);
+	printf("\t-u\t\tOptional. Let clients tunnel over UDP on the same port as well.\n");
+	printf("\t-p <port>\tOptional. Set the local port to listen on.\n");
+	printf("\t-l <file>\tOptional. Per-client rate limits. Reloaded on SIGHUP.\n");
+	printf("\t-m <mtu>\tOptional. Tunnel MTU pushed to clients. Default %d.\n", DEFAULT_TUN_MTU);
+	printf("\t-n <netmask>\tOptional. Netmask pushed to clients. Default 255.255.0.0.\n");
+	printf("\t-D <kbytes>\tOptional. Introduce clients that exchange this much in %d\n\t\t\tseconds for a direct path. 0 disables. Default %d.\n", P2P_WINDOW, P2P_DEFAULT_THRESHOLD / 1024);
+	printf("\t-N <i>/<n>\tOptional. Run as node i of an n node cluster.\n");
+	printf("\t-c <port>\tOptional. Port to accept cluster trunks on. Default 2003.\n");
+	printf("\t-P <host:port>\tOptional. Cluster peer. Repeat for each peer.\n");
+	printf("\t-b <backlog>\tOptional. Listen backlog. Default %d.\n", LISTEN_BACKLOG);
+	printf("\t-A <threads>\tOptional. Accept threads. Default %d.\n", ACCEPT_THREADS);
+	printf("\t-J <joins>\tOptional. Most new clients to admit per second. Default unlimited.\n");
+	printf("\t-M <kbytes>\tOptional. Memory each client may tie up. Default %d.\n", CLIENT_BUDGET / 1024);
+	printf("\t-G <mbytes>\tOptional. Limit on packet and session memory. Default unlimited.\n");
+	printf("\t-H\t\tOptional. Back packet and session memory with huge pages.\n");
+	printf("\t-C <file>\tOptional. Capture forwarded packets to file. SIGUSR2 pauses.\n");
+	printf("\t-F <filter>\tOptional. Only capture packets matching \"host <ip> proto <p>\".\n");
+	printf("\t-S <bytes>\tOptional. Bytes of each packet to capture. Default %d.\n", CAP_DEFAULT_SNAPLEN);
+	printf("\t-U <path>\tOptional. Upgrade socket. Take over from a server running with it.\n");
+	printf("\t-L <file>\tOptional. Keep address leases in file across restarts.\n");
+	printf("\t-k <streams>\tOptional. Most connections a client may stripe over. Default %d.\n", STRIPE_MAX_STREAMS);
+	printf("\t-T <path>\tOptional. Local socket for clients on this host to connect to.\n");
+	printf("\t-v <level>\tOptional. Log errors (0), warnings (1), events (2) or everything (3). Default %d.\n", LOG_INFO);
+	printf("\n");
+}
+
+
+
+
+int main(int argc, char ** argv)
+{
+	char *devname = malloc(50) ;
+	char *str = malloc(50) ;
+	int optval = 1 ;
+	struct sockaddr_in local;
+	unsigned short port = 2002;
+	int c;
+	pthread_t fwd_thread, ctl_thread, dgram_thread;
+	sigset_t sigs;
+	int node = -1, nodes = 0;
+	unsigned short cluster_port = 2003;
+	unsigned int pool_start = 0x0a000001, pool_end = 0x0a00ffff;
+	int backlog = LISTEN_BACKLOG, accept_threads = ACCEPT_THREADS;
+	int reuseport, i;
+	int hugepages = 0;
+	size_t mem_limit = 0;
+	char *cap_file = NULL;
+	int snaplen = CAP_DEFAULT_SNAPLEN;
+	char *upgrade_path = NULL, *lease_file = NULL, *local_path = NULL;
+	int upgrade_fd = -1;
+	int level = LOG_INFO;
+	pthread_rwlockattr_t rwattr;
+
+	pthread_rwlockattr_init(&rwattr);
+	pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&upgrade_lock, &rwattr);
+	pthread_attr_init(&client_attr);
+	pthread_attr_setdetachstate(&client_attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&client_attr, CLIENT_STACK_SIZE);
+
+	while ((c = getopt (argc, argv, "up:l:m:n:D:N:c:P:b:A:J:M:G:HC:F:S:U:L:k:T:v:")) != -1)
+	{
+		switch (c)
+		{
+		case 'u':
+			udp_tunnels = 1;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'l':
+			limits_file = optarg;
+			break;
+		case 'm':
+			tun_mtu = atoi(optarg);
+			if(tun_mtu < 576 || tun_mtu > 65535)
+			{
+				printf("MTU must be between 576 and 65535\n");
+				return -1;
+			}
+			break;
+		case 'n':
+			tun_netmask = ntohl(inet_addr(optarg));
+			break;
+		case 'D':
+			p2p_threshold = atoi(optarg) * 1024;
+			break;
+		case 'N':
+			if(sscanf(optarg, "%d/%d", &node, &nodes) != 2 || nodes < 1 || nodes > CLUSTER_MAX_NODES || node < 0 || node >= nodes)
+			{
+				printf("Cluster node must be given as <index>/<count> with at most %d nodes\n", CLUSTER_MAX_NODES);
+				return -1;
+			}
+			break;
+		case 'c':
+			cluster_port = atoi(optarg);
+			break;
+		case 'P':
+			if(cluster_add_peer(optarg) < 0)
+			{
+				printf("Bad cluster peer %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'b':
+			backlog = atoi(optarg);
+			break;
+		case 'A':
+			accept_threads = atoi(optarg);
+			if(accept_threads < 1 || accept_threads > 64)
+			{
+				printf("Accept threads must be between 1 and 64\n");
+				return -1;
+			}
+			break;
+		case 'J':
+			join_rate = atoi(optarg);
+			break;
+		case 'M':
+			client_budget = atol(optarg) * 1024;
+			if(client_budget < 2 * PKT_MAX_FRAME)
+			{
+				printf("Client budget must be at least %d KB\n", 2 * PKT_MAX_FRAME / 1024 + 1);
+				return -1;
+			}
+			break;
+		case 'G':
+			mem_limit = (size_t)atol(optarg) * 1024 * 1024;
+			break;
+		case 'H':
+			hugepages = 1;
+			break;
+		case 'C':
+			cap_file = optarg;
+			break;
+		case 'F':
+			if(cap_set_filter(optarg) < 0)
+			{
+				printf("Bad capture filter %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'S':
+			snaplen = atoi(optarg);
+			break;
+		case 'U':
+			upgrade_path = optarg;
+			break;
+		case 'L':
+			lease_file = optarg;
+			break;
+		case 'T':
+			local_path = optarg;
+			break;
+		case 'v':
+			level = atoi(optarg);
+			if(level < LOG_ERROR || level > LOG_DEBUG)
+			{
+				printf("Log level must be between %d and %d\n", LOG_ERROR, LOG_DEBUG);
+				return -1;
+			}
+			break;
+		case 'k':
+			stripe_max = atoi(optarg);
+			if(stripe_max < 1 || stripe_max > STRIPE_MAX_STREAMS)
+			{
+				printf("Streams must be between 1 and %d\n", STRIPE_MAX_STREAMS);
+				return -1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			printf("Unrecognized option %c\n", c);
+			return -1;
+		}
+	}
+
+	if(limits_file != NULL && sched_load_limits(limits_file) < 0)
+		exit(1);
+
+	// Writes to dead clients must not kill the server.
+	signal(SIGPIPE, SIG_IGN);
+
+	// SIGHUP is handled by the control thread. Block it here so every
+	// thread we create inherits the mask.
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	log_init(level);
+
+	if(cap_file != NULL)
+	{
+		if(cap_open(cap_file, CAP_DEFAULT_RINGS, CAP_DEFAULT_SLOTS, snaplen) < 0)
+			exit(1);
+		capturing = 1;
+		cap_enabled = 1;
+	}
+
+	mem_init(hugepages, mem_limit);
+	client_cache = mem_cache_create("client", sizeof(struct client));
+	group_cache = mem_cache_create("group", sizeof(struct group));
+
+	sched_init();
+	core_init(&srv_io, tun_netmask, tun_mtu);
+	pthread_create(&fwd_thread, NULL, forwardThread, NULL);
+	pthread_create(&ctl_thread, NULL, controlThread, &sigs);
+
+	// In a cluster, this node only hands out addresses from its own
+	// slice of the pool.
+	if(node >= 0)
+	{
+		cluster_init(node, nodes, IP_RANGE, cluster_port);
+		cluster_partition(&pool_start, &pool_end);
+	}
+	core_pool_init(pool_start, pool_end, 0xfffff000);
+
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = htons(port);
+
+	if(lease_file != NULL && lease_open(lease_file, IP_RANGE) < 0)
+		exit(1);
+
+	// If a server is already running with our upgrade socket, we take
+	// over its sockets and clients. Otherwise we start from scratch.
+	if(upgrade_path != NULL && (upgrade_fd = upgrade_connect(upgrade_path)) >= 0)
+		adoptServer(upgrade_fd);
+	else
+	{
+		// Set up sockets to listen on. Each accept thread gets its own where
+		// the kernel supports SO_REUSEPORT, and they share one otherwise.
+		listen_fds = malloc(accept_threads * sizeof(int));
+		reuseport = (accept_threads > 1);
+		for(i = 0; i < accept_threads; i++)
+		{
+			if(i > 0 && !reuseport)
+			{
+				listen_fds[i] = listen_fds[0];
+				continue;
+			}
+
+			if ( (listen_fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+			{
+				perror("socket()");
+				exit(1);
+			}
+	
+			// avoid EADDRINUSE error on bind()
+			if(setsockopt(listen_fds[i], SOL_SOCKET, SO_REUSEADDR, (char *)&optval, sizeof(optval)) < 0)
+			{
+				perror("setsockopt()");
+				exit(1);
+			}
+
+			if(reuseport && setsockopt(listen_fds[i], SOL_SOCKET, SO_REUSEPORT, (char *)&optval, sizeof(optval)) < 0)
+			{
+				if(i > 0)
+				{
+					perror("setsockopt(SO_REUSEPORT)");
+					exit(1);
+				}
+				reuseport = 0;
+			}
+
+			if (bind(listen_fds[i], (struct sockaddr*) &local, sizeof(local)) < 0)
+			{
+				perror("bind()");
+				exit(1);
+			}
+
+			if (listen(listen_fds[i], backlog) < 0)
+			{
+				perror("listen()");
+				exit(1);
+			}
+		}
+
+		nlisten = reuseport ? accept_threads : 1;
+
+		// Addresses held when we last ran are kept for their clients
+		// for a while.
+		if((i = lease_restore(LEASE_GRACE)) > 0)
+			printf("Holding %d addresses for clients from before the restart\n", i);
+	}
+
+	// Clients register their public UDP endpoints on the same port number
+	// so we can set up direct paths between them, and with -u they may
+	// tunnel over it. A socket taken over from the old server may have
+	// clients on it already.
+	srandom(time(NULL) ^ getpid());
+	rendezvous_port = port;
+	if(rendezvous_fd < 0 && (p2p_threshold != 0 || udp_tunnels))
+	{
+		int fd;
+
+		if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || bind(fd, (struct sockaddr*) &local, sizeof(local)) < 0)
 		{
-			perror("accept()");
+			perror("rendezvous socket");
 			exit(1);
 		}
+		if(openDatagram(fd) < 0)
+			exit(1);
+	}
+	if(rendezvous_fd >= 0)
+		pthread_create(&dgram_thread, NULL, datagramThread, NULL);
+
+	// Clients on this host can skip TCP and use shared memory. A local
+	// socket taken over from the old server is already listening.
+	if(local_path != NULL && local_fd < 0 && (local_fd = shm_listen(local_path)) < 0)
+		exit(1);
+	if(local_fd >= 0)
+	{
+		pthread_t local_thread;
 
-		printf("SERVER: Client connected from %s\n", inet_ntoa(remote.sin_addr));
-		
-		// Spawn a new thread to handle the connection.
-		pthread_t *th = malloc(sizeof(pthread_t)) ;
+		pthread_create(&local_thread, NULL, localThread, NULL);
+	}
 
+	// Wait for the next version of the server to take over from us.
+	if(upgrade_path != NULL)
+	{
+		pthread_t upg_thread;
 
-		struct client *newclient = malloc(sizeof(struct client));
-		newclient->sockfd = net_fd;
-		newclient->ip = 0x0a000002; // Dummy IP address.
-		newclient->inet_ip = remote.sin_addr.s_addr;
-		
-		// Link newclient into list of assoc'd clients.
-		pthread_mutex_lock(&client_list_mutex);
-		newclient->next = client_list;
-		client_list = newclient;
-		newclient->prev = (struct client*)&client_list;
-		if(newclient->next != NULL)
-			newclient->next->prev = newclient;
+		if((upgrade_fd = upgrade_listen(upgrade_path)) < 0)
+			exit(1);
+		pthread_create(&upg_thread, NULL, upgradeThread, (void*)(intptr_t)upgrade_fd);
+	}
 
-		newclient->ip = -1;
-		pthread_mutex_unlock(&client_list_mutex);
+	// The main thread becomes the first accept thread.
+	for(i = 1; i < accept_threads; i++)
+	{
+		pthread_t th;
 
-		pthread_create(th, NULL, handleConnectionThread, (void*)newclient) ;
+		pthread_create(&th, NULL, acceptThread, (void*)(intptr_t)listen_fds[i % nlisten]);
 	}
+	acceptThread((void*)(intptr_t)listen_fds[0]);
+
 	// Clean up
 	free(devname) ;
 	free(str);
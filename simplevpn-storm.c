@@ -0,0 +1,329 @@
+/* simplevpn-storm.c -- Reconnect storm benchmark for simplevpn-srv */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Opens a large number of connections to a server at once, the way a fleet
+ * of clients does after an outage, and has each of them ask for an address.
+ * Reports how fast the server admits them and how long each one waited.
+ * All connections are then reset at once and the storm is repeated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "simplevpn-pkt.h"
+
+#define STATE_CONNECTING 0
+#define STATE_WAITING    1	// Address request sent
+#define STATE_JOINED     2
+#define STATE_FAILED     3
+
+struct conn
+{
+	int fd;
+	int state;
+	int rxlen;
+	unsigned char rx[32];
+	double start;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+static void raise_fd_limit(int want)
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return;
+	if(rl.rlim_cur < (rlim_t)want)
+	{
+		rl.rlim_cur = (rl.rlim_max < (rlim_t)want) ? rl.rlim_max : (rlim_t)want;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+/*
+ * conn_fail
+ *
+ * Gives up on a connection that was refused or reset before it got an
+ * address.
+ */
+static void conn_fail(int ep, struct conn *c)
+{
+	epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->state = STATE_FAILED;
+}
+
+/*
+ * conn_event
+ *
+ * Moves a connection along when its socket is ready. Returns 1 when the
+ * connection has just received its address.
+ */
+static int conn_event(int ep, struct conn *c, unsigned int events)
+{
+	char req[20];
+	int err = 0, len, n;
+	socklen_t errlen = sizeof(err);
+	struct epoll_event ev;
+
+	if(c->state == STATE_CONNECTING)
+	{
+		if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0)
+		{
+			conn_fail(ep, c);
+			return 0;
+		}
+		if(!(events & EPOLLOUT))
+			return 0;
+
+		// A dynamic address request is a bare IPv4 header with
+		// zero addresses.
+		memset(req, 0, sizeof(req));
+		req[0] = 0x45;
+		req[8] = 64;
+		if(send(c->fd, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+		{
+			conn_fail(ep, c);
+			return 0;
+		}
+		c->state = STATE_WAITING;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+		return 0;
+	}
+
+	if(c->state != STATE_WAITING)
+		return 0;
+
+	n = recv(c->fd, c->rx + c->rxlen, sizeof(c->rx) - c->rxlen, 0);
+	if(n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if(n <= 0)
+	{
+		conn_fail(ep, c);
+		return 0;
+	}
+	c->rxlen += n;
+
+	len = frame_len((char*)c->rx, c->rxlen);
+	if(len <= 0 || c->rxlen < len)
+		return 0;
+
+	// Anything after the reply (a direct path cookie, say) is of no
+	// interest, so stop reading.
+	c->state = STATE_JOINED;
+	epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+	return 1;
+}
+
+/*
+ * storm
+ *
+ * Runs one round: n connections at once, each asking for an address.
+ */
+static void storm(int round, struct sockaddr_in *server, struct conn *conns, int n, int timeout)
+{
+	struct epoll_event *events = malloc(1024 * sizeof(struct epoll_event));
+	double *lat = malloc(n * sizeof(double));
+	double t0, tend, deadline;
+	int ep = epoll_create1(0);
+	int i, joined = 0, failed = 0, open_fail = 0, pending = n;
+	struct linger lg = { 1, 0 };
+
+	t0 = now_sec();
+	tend = t0;
+	deadline = t0 + timeout;
+	for(i = 0; i < n; i++)
+	{
+		struct conn *c = &conns[i];
+		struct epoll_event ev;
+
+		memset(c, 0, sizeof(struct conn));
+		c->start = now_sec();
+		c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if(c->fd < 0 || (connect(c->fd, (struct sockaddr*)server, sizeof(*server)) < 0 && errno != EINPROGRESS))
+		{
+			if(c->fd >= 0)
+				close(c->fd);
+			c->fd = -1;
+			c->state = STATE_FAILED;
+			open_fail++;
+			pending--;
+			continue;
+		}
+		ev.events = EPOLLOUT | EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+	}
+
+	while(pending > 0)
+	{
+		double now = now_sec();
+		int k;
+
+		if(now >= deadline)
+			break;
+		k = epoll_wait(ep, events, 1024, (int)((deadline - now) * 1000) + 1);
+		for(i = 0; i < k; i++)
+		{
+			struct conn *c = events[i].data.ptr;
+
+			if(conn_event(ep, c, events[i].events))
+			{
+				tend = now_sec();
+				lat[joined++] = tend - c->start;
+				pending--;
+			}
+			else if(c->state == STATE_FAILED)
+			{
+				failed++;
+				pending--;
+			}
+		}
+	}
+
+	qsort(lat, joined, sizeof(double), cmp_double);
+	printf("round %d: %d/%d joined in %.3f s (%.0f joins/s), latency p50 %.1f ms p99 %.1f ms max %.1f ms, %d failed, %d timed out\n",
+		round, joined, n, tend - t0, (tend > t0) ? joined / (tend - t0) : 0.0,
+		joined ? lat[joined / 2] * 1000 : 0.0,
+		joined ? lat[(int)(joined * 0.99)] * 1000 : 0.0,
+		joined ? lat[joined - 1] * 1000 : 0.0,
+		failed + open_fail, pending);
+	fflush(stdout);
+
+	// Drop every connection at once, the way an outage does. Resetting
+	// them leaves no TIME_WAIT sockets behind to use up local ports.
+	for(i = 0; i < n; i++)
+	{
+		if(conns[i].fd < 0)
+			continue;
+		setsockopt(conns[i].fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+		close(conns[i].fd);
+	}
+	close(ep);
+	free(lat);
+	free(events);
+}
+
+void usage(char *progname)
+{
+	printf("%s: reconnect storm benchmark for simplevpn-srv\n\n", progname);
+	printf("\t-s <server ip>\tOptional. Server address. Default 127.0.0.1.\n");
+	printf("\t-p <port>\tOptional. Server port. Default 2002.\n");
+	printf("\t-n <clients>\tOptional. Connections per storm. Default 10000.\n");
+	printf("\t-r <rounds>\tOptional. Number of storms. Default 3.\n");
+	printf("\t-w <ms>\t\tOptional. Pause between storms. Default 2000.\n");
+	printf("\t-t <seconds>\tOptional. Give up on a storm after this long. Default 30.\n");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in server;
+	struct conn *conns;
+	int n = 10000, rounds = 3, pause_ms = 2000, timeout = 30;
+	int c, i;
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server.sin_port = htons(2002);
+
+	while ((c = getopt (argc, argv, "s:p:n:r:w:t:")) != -1)
+	{
+		switch (c)
+		{
+		case 's':
+			if(inet_aton(optarg, &server.sin_addr) == 0)
+			{
+				printf("Bad server address %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'p':
+			server.sin_port = htons(atoi(optarg));
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'w':
+			pause_ms = atoi(optarg);
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if(n < 1)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	raise_fd_limit(n + 16);
+	conns = malloc(n * sizeof(struct conn));
+	if(conns == NULL)
+	{
+		printf("Could not allocate %d connections\n", n);
+		return 1;
+	}
+
+	for(i = 1; i <= rounds; i++)
+	{
+		storm(i, &server, conns, n, timeout);
+		if(i < rounds)
+			usleep(pause_ms * 1000);
+	}
+	free(conns);
+	return 0;
+}
@@ -0,0 +1,168 @@
+/* simplevpn-stripe.c -- Striping a tunnel over several connections */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A single TCP connection can only carry as much as one congestion window
+ * lets it, and a loss stalls everything behind it. A client may open
+ * several connections to the server and spread its bulk traffic over them.
+ * Each TCP connection delivers in order, but packets sent on different ones
+ * overtake each other, so both ends number them and the receiving end holds
+ * early ones back here until the packets before them have arrived.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "simplevpn-stripe.h"
+
+unsigned int stripe_seq_next(unsigned int seq)
+{
+	return (seq + 1 != 0) ? seq + 1 : 1;
+}
+
+/*
+ * stripe_frame_len
+ *
+ * Like frame_len(), for a frame with a sequence number in front.
+ */
+int stripe_frame_len(const char *buf, int avail)
+{
+	int len;
+
+	if(avail <= STRIPE_HDR_LEN)
+		return 0;
+	if((len = frame_len(buf + STRIPE_HDR_LEN, avail - STRIPE_HDR_LEN)) <= 0)
+		return len;
+	return len + STRIPE_HDR_LEN;
+}
+
+unsigned long long stripe_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void reorder_init(struct reorder *r, unsigned int next)
+{
+	memset(r, 0, sizeof(struct reorder));
+	r->next = next;
+}
+
+/*
+ * take
+ *
+ * Moves the packet in the next slot, if there is one, to the end of the
+ * list at *tail and steps past the slot.
+ */
+static void take(struct reorder *r, struct pkt ***tail)
+{
+	struct pkt **slot = &r->slot[r->next % STRIPE_WINDOW];
+
+	if(*slot != NULL)
+	{
+		(*slot)->next = NULL;
+		**tail = *slot;
+		*tail = &(*slot)->next;
+		*slot = NULL;
+		r->held--;
+	}
+	r->next = stripe_seq_next(r->next);
+}
+
+/*
+ * reorder_push
+ *
+ * Takes packet p with sequence number seq (host byte order). Returns the
+ * packets that can be delivered now, in order, linked through their next
+ * pointers.
+ */
+struct pkt *reorder_push(struct reorder *r, struct pkt *p, unsigned int seq)
+{
+	struct pkt *ready = NULL, **tail = &ready;
+	int ahead = (int)(seq - r->next);
+
+	// Late, after we stopped waiting for it. Better late than never.
+	if(ahead < 0 || r->slot[seq % STRIPE_WINDOW] != NULL)
+	{
+		p->next = NULL;
+		return p;
+	}
+
+	// Too far ahead to hold. Give up on the oldest missing packets.
+	for(; ahead >= STRIPE_WINDOW; ahead--)
+		take(r, &tail);
+
+	r->slot[seq % STRIPE_WINDOW] = p;
+	r->held++;
+	while(r->slot[r->next % STRIPE_WINDOW] != NULL)
+		take(r, &tail);
+
+	// The hold time counts from when delivery last made progress.
+	if(r->held > 0 && (ready != NULL || r->held == 1))
+		r->since = stripe_now_ms();
+	return ready;
+}
+
+/*
+ * reorder_in_order
+ *
+ * Returns 1, and steps past seq, if the packet numbered seq is the next one
+ * and nothing is held, so it can be delivered without being copied into the
+ * buffer.
+ */
+int reorder_in_order(struct reorder *r, unsigned int seq)
+{
+	if(seq != r->next || r->held != 0)
+		return 0;
+	r->next = stripe_seq_next(r->next);
+	return 1;
+}
+
+/*
+ * reorder_flush
+ *
+ * Gives up on every missing packet. Returns everything held, in order.
+ */
+struct pkt *reorder_flush(struct reorder *r)
+{
+	struct pkt *ready = NULL, **tail = &ready;
+
+	while(r->held > 0)
+		take(r, &tail);
+	return ready;
+}
+
+/*
+ * reorder_wait_ms
+ *
+ * Returns how long until held packets should be flushed, 0 if they should be
+ * flushed now, or -1 if nothing is held.
+ */
+int reorder_wait_ms(struct reorder *r)
+{
+	unsigned long long now = stripe_now_ms();
+
+	if(r->held == 0)
+		return -1;
+	if(now >= r->since + STRIPE_HOLD_MS)
+		return 0;
+	return r->since + STRIPE_HOLD_MS - now;
+}
@@ -0,0 +1,70 @@
+/* simplevpn-stripe.h -- Striping a tunnel over several connections */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_STRIPE_H
+#define SIMPLEVPN_STRIPE_H
+
+#include "simplevpn-pkt.h"
+
+// Most connections one client may stripe its tunnel over.
+#define STRIPE_MAX_STREAMS 8
+
+/*
+ * On a striped connection every frame is preceded by a 4-byte sequence
+ * number in network byte order. Bulk packets are spread over all of a
+ * client's streams and numbered from 1 up, skipping 0, so the other end can
+ * put them back in order. Sequence number 0 marks a frame that is delivered
+ * as soon as it arrives: keepalives, control messages and interactive
+ * packets, which always go on the first stream so they stay in order among
+ * themselves and never wait behind bulk traffic.
+ */
+#define STRIPE_HDR_LEN 4
+
+// Packets held back waiting for an earlier one. When a packet arrives
+// further ahead than this, or one has been waiting STRIPE_HOLD_MS, the
+// packets that haven't arrived are given up on. They can only be missing if
+// a stream went down with them.
+#define STRIPE_WINDOW  4096
+#define STRIPE_HOLD_MS 200
+
+/*
+ * struct reorder
+ *
+ * Packets that arrived ahead of their turn, indexed by sequence number.
+ */
+struct reorder
+{
+	unsigned int next;		// Next sequence number to deliver
+	int held;
+	unsigned long long since;	// When delivery last stalled (ms)
+	struct pkt *slot[STRIPE_WINDOW];
+};
+
+unsigned int stripe_seq_next(unsigned int seq);
+int stripe_frame_len(const char *buf, int avail);
+unsigned long long stripe_now_ms(void);
+
+void reorder_init(struct reorder *r, unsigned int next);
+struct pkt *reorder_push(struct reorder *r, struct pkt *p, unsigned int seq);
+int reorder_in_order(struct reorder *r, unsigned int seq);
+struct pkt *reorder_flush(struct reorder *r);
+int reorder_wait_ms(struct reorder *r);
+
+#endif
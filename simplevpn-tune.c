@@ -0,0 +1,192 @@
+/* simplevpn-tune.c -- Tuning tunnel sockets to the path they run over */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Every tunnel connection carries both bulk transfers, which want a full
+ * pipe, and interactive traffic, which wants nothing queued in front of it.
+ * Since the tunnel runs over TCP, the kernel's view of the path (TCP_INFO)
+ * tells us what the path can do. Once a second we look at it and:
+ *
+ *  - size TCP_NOTSENT_LOWAT to about a millisecond at the rate the path
+ *    delivers, so a fast path is kept busy and a slow one doesn't build a
+ *    queue that interactive packets wait behind,
+ *  - grow the send buffer past the kernel's autotuning limit when the path
+ *    holds more than that in flight,
+ *  - move a lossy connection to BBR, which doesn't back off on every lost
+ *    packet the way loss-based congestion control does. Every tunneled
+ *    flow would stall behind those back-offs.
+ *
+ * The receive buffer is left to the kernel, which grows it as far as it
+ * needs to as long as nobody sets it by hand.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include "simplevpn-tune.h"
+#include "simplevpn-txq.h"
+
+// From the kernel's tcp_states.h, which isn't exported.
+#define TCP_ESTABLISHED 1
+
+/*
+ * autotune_limit
+ *
+ * Returns the largest send buffer the kernel will size a socket to by
+ * itself.
+ */
+static int autotune_limit(void)
+{
+	static int limit = 0;
+	FILE *f;
+
+	if(limit != 0)
+		return limit;
+	limit = 4 * 1024 * 1024;
+	if((f = fopen("/proc/sys/net/ipv4/tcp_wmem", "r")) != NULL)
+	{
+		int lo, def, hi;
+
+		if(fscanf(f, "%d %d %d", &lo, &def, &hi) == 3)
+			limit = hi;
+		fclose(f);
+	}
+	return limit;
+}
+
+/*
+ * tune_init
+ *
+ * Sets up a newly connected tunnel socket. Tunneled packets are written
+ * whole, so Nagle would only hold back small interactive ones. Writes of a
+ * backlog are coalesced by txq_flush() instead.
+ */
+void tune_init(struct tune *t, int fd)
+{
+	int one = 1;
+
+	memset(t, 0, sizeof(struct tune));
+	t->stamp = time(NULL);
+	t->lowat = TXQ_NOTSENT_LOWAT;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	txq_set_lowat(fd);
+}
+
+static void tune_lowat(struct tune *t, int fd)
+{
+	long long lowat = t->rate * TUNE_LOWAT_USEC / 1000000;
+
+	if(lowat < TXQ_NOTSENT_LOWAT)
+		lowat = TXQ_NOTSENT_LOWAT;
+	if(lowat > TUNE_LOWAT_MAX)
+		lowat = TUNE_LOWAT_MAX;
+
+	// Don't bother with small changes.
+	if(lowat * 4 > t->lowat * 5 || lowat * 4 < t->lowat * 3)
+	{
+		int val = lowat;
+
+		if(setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val, sizeof(val)) == 0)
+			t->lowat = val;
+	}
+}
+
+static void tune_sndbuf(struct tune *t, int fd)
+{
+	long long need = 2 * (t->rate * t->rtt / 1000000) + 2 * t->lowat;
+	socklen_t len = sizeof(int);
+	int cur, val;
+
+	if(getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &cur, &len) < 0 || need <= cur)
+		return;
+
+	// Until the kernel's own sizing has reached its limit it is doing
+	// better than we would, since setting the size by hand stops it.
+	if(t->sndbuf == 0 && cur < autotune_limit())
+		return;
+
+	if(need > TUNE_SNDBUF_MAX)
+		need = TUNE_SNDBUF_MAX;
+	if(need <= cur)
+		return;
+
+	// The kernel doubles what it is given to allow for its overhead.
+	// Only root may go past net.core.wmem_max.
+	val = need / 2;
+	if(setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &val, sizeof(val)) < 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)) < 0)
+		return;
+	t->sndbuf = need;
+}
+
+static int tune_cc(struct tune *t, int fd, struct tcp_info *ti)
+{
+	unsigned long long sent = ti->tcpi_bytes_sent - t->bytes_sent;
+	unsigned long long retrans = ti->tcpi_bytes_retrans - t->bytes_retrans;
+
+	t->bytes_sent = ti->tcpi_bytes_sent;
+	t->bytes_retrans = ti->tcpi_bytes_retrans;
+	if(t->cc != 0 || sent < TUNE_CC_MIN_BYTES || retrans * 100 < sent * TUNE_CC_LOSS_PCT)
+		return 0;
+
+	if(setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, TUNE_CC, strlen(TUNE_CC)) < 0)
+	{
+		t->cc = -1;
+		return 0;
+	}
+	t->cc = 1;
+	t->loss = retrans * 100 / sent;
+	return 1;
+}
+
+/*
+ * tune_update
+ *
+ * Looks at the connection on fd again if it has been TUNE_INTERVAL since
+ * the last look, and adjusts it to what the path is doing now. Returns 1
+ * if it has just switched to TUNE_CC because the path is losing t->loss
+ * percent of what is sent, which the caller may want to log, or 0.
+ * Nothing is printed here, as the server calls this from threads that
+ * must not block on stdio.
+ */
+int tune_update(struct tune *t, int fd, time_t now)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	if(now - t->stamp < TUNE_INTERVAL)
+		return 0;
+	t->stamp = now;
+
+	// Older kernels fill in less. What they leave out stays zero.
+	memset(&ti, 0, sizeof(ti));
+	if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0 || ti.tcpi_state != TCP_ESTABLISHED)
+		return 0;
+
+	t->rtt = (ti.tcpi_min_rtt != 0) ? ti.tcpi_min_rtt : ti.tcpi_rtt;
+	t->rate = ti.tcpi_delivery_rate;
+	if(t->rate == 0 && t->rtt != 0)
+		t->rate = (unsigned long long)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss * 1000000 / t->rtt;
+
+	tune_lowat(t, fd);
+	tune_sndbuf(t, fd);
+	return tune_cc(t, fd, &ti);
+}
@@ -0,0 +1,66 @@
+/* simplevpn-tune.h -- Tuning tunnel sockets to the path they run over */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_TUNE_H
+#define SIMPLEVPN_TUNE_H
+
+#include <time.h>
+
+// Seconds between looks at a connection.
+#define TUNE_INTERVAL 1
+
+// Unsent data the kernel may hold, in microseconds at the rate the path
+// delivers. Enough to keep the pipe busy until we are woken to write more,
+// little enough that an interactive packet doesn't wait long behind it.
+#define TUNE_LOWAT_USEC 1000
+#define TUNE_LOWAT_MAX  (1024 * 1024)
+
+// Largest send buffer we will ask for once the kernel's own sizing tops out.
+#define TUNE_SNDBUF_MAX (64 * 1024 * 1024)
+
+// Congestion control used once the path turns out to be lossy, and how
+// lossy that is: percent of bytes retransmitted over an interval in which
+// at least TUNE_CC_MIN_BYTES were sent.
+#define TUNE_CC           "bbr"
+#define TUNE_CC_LOSS_PCT  1
+#define TUNE_CC_MIN_BYTES (256 * 1024)
+
+/*
+ * struct tune
+ *
+ * What was last seen of one connection and what has been set on it.
+ */
+struct tune
+{
+	time_t stamp;			// Last look
+	int lowat;			// TCP_NOTSENT_LOWAT in use
+	int sndbuf;			// SO_SNDBUF we set, 0 while the kernel sizes it
+	int cc;				// 1 once switched to TUNE_CC, -1 if that failed
+	unsigned long long bytes_sent;
+	unsigned long long bytes_retrans;
+	unsigned int rtt;		// Microseconds
+	unsigned long long rate;	// Bytes per second
+	unsigned int loss;		// Percent retransmitted when cc was switched
+};
+
+void tune_init(struct tune *t, int fd);
+int tune_update(struct tune *t, int fd, time_t now);
+
+#endif
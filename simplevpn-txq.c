@@ -0,0 +1,547 @@
+/* simplevpn-txq.c -- Prioritized transmit queue in front of a socket */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "simplevpn-mem.h"
+#include "simplevpn-txq.h"
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+// A striped stream's packets are numbered before they are queued, and the
+// other end waits for every number, so these are marked but never dropped.
+#define NUMBERED(p) ((p)->seq != 0)
+
+static unsigned int now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+void txq_init(struct txq *q, int limit)
+{
+	memset(q, 0, sizeof(struct txq));
+	q->limit = limit;
+}
+
+int txq_empty(struct txq *q)
+{
+	return q->cur == NULL && q->head == NULL && (q->fq == NULL || q->fq->packets == 0);
+}
+
+/*
+ * txq_full
+ *
+ * Returns 1 if q has no room for p.
+ */
+int txq_full(struct txq *q, struct pkt *p)
+{
+	int limit = q->limit;
+
+	if(p->prio == PKT_PRIO_INTERACTIVE)
+		limit += TXQ_PRIO_HEADROOM;
+	return q->bytes + p->len > limit;
+}
+
+static void flow_append(struct txq_flow **head, struct txq_flow **tail, struct txq_flow *f)
+{
+	f->next = NULL;
+	if(*tail != NULL)
+		(*tail)->next = f;
+	else
+		*head = f;
+	*tail = f;
+}
+
+static struct txq_flow *flow_unlink(struct txq_flow **head, struct txq_flow **tail)
+{
+	struct txq_flow *f = *head;
+
+	*head = f->next;
+	if(*head == NULL)
+		*tail = NULL;
+	return f;
+}
+
+/*
+ * flow_take
+ *
+ * Takes the packet at the head of f off it. q->bytes still counts it.
+ */
+static struct pkt *flow_take(struct txq *q, struct txq_flow *f)
+{
+	struct pkt *p = f->head;
+
+	if(p == NULL)
+		return NULL;
+	f->head = p->next;
+	if(f->head == NULL)
+		f->tail = NULL;
+	f->bytes -= p->len;
+	q->fq->packets--;
+	return p;
+}
+
+static void drop(struct txq *q, struct pkt *p)
+{
+	q->drops++;
+	q->bytes -= p->len;
+	pkt_free(p);
+}
+
+/*
+ * shed
+ *
+ * Makes room for len more bytes by dropping packets from the head of the
+ * flow with the most queued, so that a queue full of one bulk transfer
+ * doesn't turn away packets of every other flow. Returns 0 if there is
+ * room now.
+ */
+static int shed(struct txq *q, int len)
+{
+	struct txq_flow *fat = NULL;
+	int i;
+
+	if(q->fq == NULL)
+		return -1;
+	for(i = 0; i < TXQ_FLOWS; i++)
+		if(fat == NULL || q->fq->flows[i].bytes > fat->bytes)
+			fat = &q->fq->flows[i];
+
+	while(q->bytes + len > q->limit && fat->head != NULL && !NUMBERED(fat->head))
+		drop(q, flow_take(q, fat));
+	return (q->bytes + len > q->limit) ? -1 : 0;
+}
+
+/*
+ * txq_push
+ *
+ * Queues p behind other packets of its class, and bulk packets behind other
+ * packets of their flow. Returns -1 if the queue is full, in which case p
+ * has been freed.
+ */
+int txq_push(struct txq *q, struct pkt *p)
+{
+	struct txq_flow *f;
+
+	if(txq_full(q, p) && (p->prio != PKT_PRIO_BULK || NUMBERED(p) || shed(q, p->len) < 0))
+	{
+		q->drops++;
+		pkt_free(p);
+		return -1;
+	}
+
+	p->next = NULL;
+	if(p->prio != PKT_PRIO_BULK)
+	{
+		if(q->tail != NULL)
+			q->tail->next = p;
+		else
+			q->head = p;
+		q->tail = p;
+		q->bytes += p->len;
+		return 0;
+	}
+
+	if(q->fq == NULL && (q->fq = mem_alloc(sizeof(struct txq_fq))) != NULL)
+		memset(q->fq, 0, sizeof(struct txq_fq));
+	if(q->fq == NULL)
+	{
+		q->drops++;
+		pkt_free(p);
+		return -1;
+	}
+
+	f = &q->fq->flows[pkt_flow_hash(p->data, p->len) % TXQ_FLOWS];
+	p->stamp = now_us();
+	if(f->tail != NULL)
+		f->tail->next = p;
+	else
+		f->head = p;
+	f->tail = p;
+	f->bytes += p->len;
+	q->fq->packets++;
+	q->bytes += p->len;
+	if(!f->listed)
+	{
+		f->listed = 1;
+		f->deficit = TXQ_QUANTUM;
+		flow_append(&q->fq->new_head, &q->fq->new_tail, f);
+	}
+	return 0;
+}
+
+/*
+ * txq_push_partial
+ *
+ * Puts p ahead of everything else as a packet that has already started going
+ * out, so nothing can be written before the rest of it. Used to pick up a
+ * stream that another process was in the middle of writing. There must not
+ * be a partly written packet in q already.
+ */
+void txq_push_partial(struct txq *q, struct pkt *p)
+{
+	p->next = NULL;
+	q->cur = p;
+	q->off = 0;
+	q->bytes += p->len;
+}
+
+/*
+ * standing
+ *
+ * Says whether the delay of f's queue, going by p which has just been taken
+ * off it, has been above the target for at least an interval (RFC 8289).
+ * A flow with no more than a packet's worth left is never held to it.
+ */
+static int standing(struct txq_flow *f, struct pkt *p, unsigned int now)
+{
+	if(p == NULL || (int)(now - p->stamp) < TXQ_TARGET_US || f->bytes <= TXQ_QUANTUM)
+	{
+		f->first_above = 0;
+		return 0;
+	}
+	if(f->first_above == 0)
+	{
+		f->first_above = (now + TXQ_INTERVAL_US) | 1;
+		return 0;
+	}
+	return (int)(now - f->first_above) >= 0;
+}
+
+/*
+ * mark_or_drop
+ *
+ * Tells the sender of p that its flow's queue is too long, by marking p if
+ * it can take an ECN mark and dropping it otherwise. Returns 1 if p was
+ * dropped.
+ */
+static int mark_or_drop(struct txq *q, struct pkt *p)
+{
+	if(pkt_set_ce(p->data, p->len))
+	{
+		q->marks++;
+		return 0;
+	}
+	if(NUMBERED(p))
+		return 0;
+	drop(q, p);
+	return 1;
+}
+
+static unsigned int isqrt(unsigned int n)
+{
+	unsigned int r = 0, bit = 1u << 30;
+
+	while(bit > n)
+		bit >>= 2;
+	for(; bit != 0; bit >>= 2)
+	{
+		if(n >= r + bit)
+		{
+			n -= r + bit;
+			r = (r >> 1) + bit;
+		}
+		else
+			r >>= 1;
+	}
+	return r;
+}
+
+/*
+ * control_law
+ *
+ * When to mark or drop next, count marks or drops into a dropping state
+ * that began before t: an interval divided by the square root of count,
+ * so the rate goes up until the senders have slowed down enough.
+ */
+static unsigned int control_law(unsigned int t, unsigned int count)
+{
+	if(count > 0xffff)
+		count = 0xffff;
+	return t + TXQ_INTERVAL_US * 16 / isqrt(count << 8);
+}
+
+/*
+ * codel_take
+ *
+ * Takes the next packet off f that isn't dropped by CoDel, or returns NULL
+ * once f is empty.
+ */
+static struct pkt *codel_take(struct txq *q, struct txq_flow *f, unsigned int now)
+{
+	struct pkt *p = flow_take(q, f);
+	int bad = standing(f, p, now);
+	unsigned int delta;
+
+	if(p == NULL)
+	{
+		f->dropping = 0;
+		return NULL;
+	}
+
+	if(f->dropping)
+	{
+		if(!bad)
+			f->dropping = 0;
+		while(f->dropping && (int)(now - f->drop_next) >= 0)
+		{
+			f->count++;
+			if(!mark_or_drop(q, p))
+			{
+				f->drop_next = control_law(f->drop_next, f->count);
+				return p;
+			}
+			p = flow_take(q, f);
+			if(!standing(f, p, now))
+				f->dropping = 0;
+			else
+				f->drop_next = control_law(f->drop_next, f->count);
+		}
+	}
+	else if(bad)
+	{
+		if(mark_or_drop(q, p))
+			p = flow_take(q, f);
+		f->dropping = 1;
+
+		// Pick up where the last dropping state left off if it ended
+		// only recently, as the senders still need slowing down.
+		delta = f->count - f->lastcount;
+		if(delta > 1 && (int)(now - f->drop_next) < 16 * TXQ_INTERVAL_US)
+			f->count = delta;
+		else
+			f->count = 1;
+		f->lastcount = f->count;
+		f->drop_next = control_law(now, f->count);
+	}
+	return p;
+}
+
+/*
+ * fq_pop
+ *
+ * Takes the next bulk packet to go out off q. New flows go first, then
+ * the flows on the old list in turn, each for a quantum of bytes.
+ */
+static struct pkt *fq_pop(struct txq *q)
+{
+	struct txq_fq *fq = q->fq;
+	unsigned int now = now_us();
+
+	while(1)
+	{
+		struct txq_flow **head, **tail, *f;
+		struct pkt *p;
+
+		if(fq->new_head != NULL)
+		{
+			head = &fq->new_head;
+			tail = &fq->new_tail;
+		}
+		else if(fq->old_head != NULL)
+		{
+			head = &fq->old_head;
+			tail = &fq->old_tail;
+		}
+		else
+			return NULL;
+
+		f = *head;
+		if(f->deficit <= 0)
+		{
+			f->deficit += TXQ_QUANTUM;
+			flow_append(&fq->old_head, &fq->old_tail, flow_unlink(head, tail));
+			continue;
+		}
+
+		if((p = codel_take(q, f, now)) == NULL)
+		{
+			// A new flow that has gone empty goes round the old
+			// list once more before it counts as new again, or a
+			// flow could keep itself new and starve the others.
+			flow_unlink(head, tail);
+			if(head == &fq->new_head && fq->old_head != NULL)
+				flow_append(&fq->old_head, &fq->old_tail, f);
+			else
+				f->listed = 0;
+			continue;
+		}
+		f->deficit -= p->len;
+		return p;
+	}
+}
+
+/*
+ * txq_pop
+ *
+ * Takes the next packet to go out off q, interactive ones first. Bulk
+ * packets CoDel drops on the way are gone for good. q->bytes still counts
+ * the packet returned.
+ */
+struct pkt *txq_pop(struct txq *q)
+{
+	struct pkt *p = q->head;
+
+	if(p != NULL)
+	{
+		q->head = p->next;
+		if(q->head == NULL)
+			q->tail = NULL;
+		return p;
+	}
+	if(q->fq == NULL || q->fq->packets == 0)
+		return NULL;
+	return fq_pop(q);
+}
+
+/*
+ * txq_unpop
+ *
+ * Puts p, which txq_pop() just took, back at the front of its class, and a
+ * bulk packet at the front of its flow. A flow that went empty when p was
+ * taken goes back at the front of the new list, with the bytes of its turn
+ * that p used up given back.
+ */
+void txq_unpop(struct txq *q, struct pkt *p)
+{
+	struct txq_flow *f;
+
+	if(p->prio != PKT_PRIO_BULK)
+	{
+		p->next = q->head;
+		q->head = p;
+		if(q->tail == NULL)
+			q->tail = p;
+		return;
+	}
+
+	f = &q->fq->flows[pkt_flow_hash(p->data, p->len) % TXQ_FLOWS];
+	p->next = f->head;
+	f->head = p;
+	if(f->tail == NULL)
+		f->tail = p;
+	f->bytes += p->len;
+	f->deficit += p->len;
+	q->fq->packets++;
+	if(!f->listed)
+	{
+		f->listed = 1;
+		f->next = q->fq->new_head;
+		q->fq->new_head = f;
+		if(q->fq->new_tail == NULL)
+			q->fq->new_tail = f;
+	}
+}
+
+/*
+ * txq_flush
+ *
+ * Writes as much of the queue to fd as will go without blocking. Returns 0
+ * once the queue is empty, 1 if the socket filled up first, or -1 if the
+ * socket has failed. On failure the queue is purged.
+ */
+int txq_flush(struct txq *q, int fd)
+{
+	while(1)
+	{
+		int n, more, hdr;
+
+		if(q->cur == NULL)
+		{
+			q->cur = txq_pop(q);
+			q->off = 0;
+			if(q->cur == NULL)
+				return 0;
+			if(q->comp != NULL)
+				q->bytes -= comp_compress(q->comp, q->cur);
+		}
+
+		// Tunnel sockets have Nagle turned off. While more packets
+		// are waiting, MSG_MORE lets the kernel fill whole segments
+		// instead of sending one per packet.
+		more = (q->head != NULL || (q->fq != NULL && q->fq->packets > 0)) ? MSG_MORE : 0;
+		hdr = (q->cur->flags & PKT_SEQ) ? sizeof(q->cur->seq) : 0;
+		n = send(fd, q->cur->data - hdr + q->off, q->cur->len + hdr - q->off, MSG_DONTWAIT | MSG_NOSIGNAL | more);
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 1;
+			txq_purge(q);
+			return -1;
+		}
+
+		q->off += n;
+		if(q->off < q->cur->len + hdr)
+			return 1;
+
+		q->bytes -= q->cur->len;
+		pkt_free(q->cur);
+		q->cur = NULL;
+	}
+}
+
+void txq_purge(struct txq *q)
+{
+	struct pkt *p;
+	int i;
+
+	if(q->cur != NULL)
+		pkt_free(q->cur);
+	q->cur = NULL;
+	q->off = 0;
+	while((p = q->head) != NULL)
+	{
+		q->head = p->next;
+		pkt_free(p);
+	}
+	q->tail = NULL;
+	if(q->fq != NULL)
+	{
+		for(i = 0; i < TXQ_FLOWS; i++)
+			while((p = flow_take(q, &q->fq->flows[i])) != NULL)
+				pkt_free(p);
+		mem_free(q->fq);
+		q->fq = NULL;
+	}
+	q->bytes = 0;
+}
+
+/*
+ * txq_set_lowat
+ *
+ * Limits how much unsent data the kernel will buffer for fd. Without this
+ * the socket send buffer soaks up megabytes of bulk traffic, and packets we
+ * have put at the front of the txq still wait behind all of it.
+ */
+int txq_set_lowat(int fd)
+{
+	int lowat = TXQ_NOTSENT_LOWAT;
+
+	return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+}
@@ -0,0 +1,117 @@
+/* simplevpn-txq.h -- Prioritized transmit queue in front of a socket */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_TXQ_H
+#define SIMPLEVPN_TXQ_H
+
+#include "simplevpn-pkt.h"
+#include "simplevpn-comp.h"
+
+// Extra room interactive packets get past the queue limit, so a queue full
+// of bulk traffic doesn't cause ACKs and keepalives to be dropped.
+#define TXQ_PRIO_HEADROOM (64 * 1024)
+
+// Unsent bytes the kernel may hold for a tunnel socket. Anything beyond this
+// waits in the txq, where interactive packets can still jump ahead of it.
+#define TXQ_NOTSENT_LOWAT (16 * 1024)
+
+// Bulk packets are spread over this many flows by a hash of their inner
+// addresses and ports, and the flows take turns sending a quantum of bytes.
+#define TXQ_FLOWS   32
+#define TXQ_QUANTUM 1514
+
+// CoDel: once the packets of a flow have waited longer than the target for
+// a whole interval, its queue is standing rather than a burst going out,
+// and packets are marked or dropped until the delay comes back down.
+#define TXQ_TARGET_US   5000
+#define TXQ_INTERVAL_US 100000
+
+/*
+ * struct txq_flow
+ *
+ * The bulk packets that hash to one flow, and the CoDel state of the flow.
+ */
+struct txq_flow
+{
+	struct pkt *head;
+	struct pkt *tail;
+	struct txq_flow *next;		// On the list of new or old flows
+	int bytes;
+	int deficit;			// Bytes it may still send this turn
+	int listed;			// On one of the lists
+	int dropping;
+	unsigned int first_above;	// When the delay counts as standing, or 0
+	unsigned int drop_next;		// When to mark or drop next while dropping
+	unsigned int count;		// Packets marked or dropped since dropping started
+	unsigned int lastcount;
+};
+
+/*
+ * struct txq_fq
+ *
+ * Bulk packets of a txq by flow. Flows that have just become busy go on
+ * the new list and get a turn ahead of those on the old list, so a flow
+ * that sends now and then is never stuck behind a bulk transfer (RFC 8290).
+ */
+struct txq_fq
+{
+	struct txq_flow *new_head, *new_tail;
+	struct txq_flow *old_head, *old_tail;
+	int packets;
+	struct txq_flow flows[TXQ_FLOWS];
+};
+
+/*
+ * struct txq
+ *
+ * Packets waiting to be written to a tunnel socket. Interactive packets
+ * wait on one list and always go out first. Bulk packets are queued by
+ * flow in fq, which is only allocated once the first one comes along, and
+ * have their queueing delay kept down by CoDel. A packet that has been
+ * partly written sits in cur until the rest of it goes out. On a
+ * connection that compresses headers, comp is set and each packet is
+ * compressed as it comes up to be written.
+ */
+struct txq
+{
+	struct pkt *head;	// Interactive packets
+	struct pkt *tail;
+	struct txq_fq *fq;	// Bulk packets
+	struct pkt *cur;
+	int off;		// Bytes of cur already written
+	int bytes;
+	int limit;
+	unsigned long drops;	// Packets dropped because the queue was full or by CoDel
+	unsigned long marks;	// Packets CoDel marked instead of dropping
+	struct comp *comp;
+};
+
+void txq_init(struct txq *q, int limit);
+int txq_full(struct txq *q, struct pkt *p);
+int txq_push(struct txq *q, struct pkt *p);
+void txq_push_partial(struct txq *q, struct pkt *p);
+struct pkt *txq_pop(struct txq *q);
+void txq_unpop(struct txq *q, struct pkt *p);
+int txq_flush(struct txq *q, int fd);
+int txq_empty(struct txq *q);
+void txq_purge(struct txq *q);
+int txq_set_lowat(int fd);
+
+#endif
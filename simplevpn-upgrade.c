@@ -0,0 +1,185 @@
+/* simplevpn-upgrade.c -- Handing a running server over to a new process */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Messages between an old and a new server go over a Unix sequenced packet
+ * socket, so each one arrives whole, along with any descriptors passed with
+ * it as SCM_RIGHTS. A passed socket is the same socket in both processes:
+ * connections stay up and nothing queued in the kernel is lost.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "simplevpn-upgrade.h"
+
+static int upgrade_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr->sun_path))
+	{
+		fprintf(stderr, "Upgrade socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/*
+ * upgrade_listen
+ *
+ * Creates the upgrade socket at path, replacing whatever was there. Returns
+ * the listening socket, or -1.
+ */
+int upgrade_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(upgrade_addr(path, &addr) < 0)
+		return -1;
+	if((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+	{
+		perror("socket(AF_UNIX)");
+		return -1;
+	}
+	unlink(path);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0)
+	{
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * upgrade_connect
+ *
+ * Connects to a running server's upgrade socket. Returns -1 if no server is
+ * listening there.
+ */
+int upgrade_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(upgrade_addr(path, &addr) < 0)
+		return -1;
+	if((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * upgrade_send
+ *
+ * Sends the message msg, followed by datalen bytes of data, with nfds
+ * descriptors attached. Returns -1 on failure.
+ */
+int upgrade_send(int fd, const void *msg, int len, const void *data, int datalen, const int *fds, int nfds)
+{
+	char cbuf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+	struct iovec iov[2];
+	struct msghdr mh;
+
+	memset(&mh, 0, sizeof(mh));
+	iov[0].iov_base = (void*)msg;
+	iov[0].iov_len = len;
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = datalen;
+	mh.msg_iov = iov;
+	mh.msg_iovlen = (datalen > 0) ? 2 : 1;
+
+	if(nfds > 0)
+	{
+		struct cmsghdr *cm;
+
+		if(nfds > UPGRADE_MAX_FDS)
+			return -1;
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+	}
+
+	while(sendmsg(fd, &mh, MSG_NOSIGNAL) < 0)
+	{
+		if(errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * upgrade_recv
+ *
+ * Receives one message into buf. Descriptors that came with it are stored
+ * in fds, which has room for UPGRADE_MAX_FDS, and counted in nfds. Returns
+ * the length of the message, 0 if the other end went away, or -1.
+ */
+int upgrade_recv(int fd, void *buf, int size, int *fds, int *nfds)
+{
+	char cbuf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	int n;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	while((n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC)) < 0)
+	{
+		if(errno != EINTR)
+			return -1;
+	}
+
+	*nfds = 0;
+	for(cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm))
+	{
+		if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+		{
+			*nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+		}
+	}
+	if(mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		return -1;
+	return n;
+}
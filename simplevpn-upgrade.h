@@ -0,0 +1,145 @@
+/* simplevpn-upgrade.h -- Handing a running server over to a new process */
+
+/* Copyright (C) 2013 Neil Klingensmith
+
+   This file is part of simplevpn.
+
+   simplevpn is free software: you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public License
+   as published by the Free Software Foundation, either version 3 of
+   the License, or (at your option) any later version.
+
+   simplevpn is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with simplevpn.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMPLEVPN_UPGRADE_H
+#define SIMPLEVPN_UPGRADE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "simplevpn-pkt.h"
+#include "simplevpn-comp.h"
+
+#define UPGRADE_MAGIC   0x53565055
+#define UPGRADE_VERSION 6
+
+// Most descriptors sent with one message.
+#define UPGRADE_MAX_FDS 64
+
+// Seconds the old server waits for the new one to take over before it
+// carries on by itself.
+#define UPGRADE_TIMEOUT 30
+
+/*
+ * The new server connects to the old one's upgrade socket and sends HELLO.
+ * The old server stops reading from its clients and sends LISTEN with its
+ * listening sockets, then a SESSION for each client followed by a PKT for
+ * every packet it holds for or from that client, and finally END. The
+ * first stream of a striped client is sent before its other streams. Once the
+ * new server has taken everything over it answers READY and the old one
+ * exits. If anything goes wrong first, the old server carries on.
+ */
+#define UPG_HELLO   1
+#define UPG_LISTEN  2	// Descriptors: listening sockets, the rendezvous socket, the local socket
+#define UPG_SESSION 3	// Descriptors: the client's socket, its rings. Followed by its partial frame
+#define UPG_PKT     4	// Followed by the packet
+#define UPG_END     5
+#define UPG_READY   6
+
+#define UPG_TXQ     0	// Waiting to be written to the client
+#define UPG_RXQ     1	// Received from the client, not forwarded yet
+#define UPG_REORDER 2	// Received from a striped client, waiting for earlier ones
+
+struct upg_hello
+{
+	uint32_t type;
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct upg_listen
+{
+	uint32_t type;
+	uint32_t nlisten;
+	uint32_t rendezvous;	// 1 if the rendezvous socket follows
+	uint32_t local;		// 1 if the local socket follows
+};
+
+/*
+ * struct upg_session
+ *
+ * A client's state. Addresses are in network byte order. rxlen bytes of a
+ * frame the client was in the middle of sending follow. For a stream of a
+ * striped client, group_ip is the address of its first stream and the
+ * sequence numbers are in host byte order. subnets are the networks the
+ * client advertised. A client on the server's host has its shared memory
+ * region and eventfds sent after its socket, and nothing in the rings
+ * needs to be sent. A client that tunnels over the server's UDP socket has
+ * no descriptors, and is known by the address its datagrams come from. A
+ * client that compresses headers has its slots sent along, so the packets
+ * it already compressed against them still make sense to the new server.
+ */
+struct upg_session
+{
+	uint32_t type;
+	uint32_t ip;
+	uint32_t inet_ip;
+	uint32_t cookie;
+	uint32_t udp_registered;
+	uint32_t joining;
+	uint32_t local;		// 1 if the client's rings come with it
+	uint32_t dgram;		// 1 if the client is on the UDP socket, from dgram_addr
+	struct sockaddr_in dgram_addr;
+	struct sockaddr_in udp_addr;
+	uint32_t group_ip;	// 0 if the client isn't striped
+	uint32_t stream;
+	uint32_t streams;
+	uint32_t tx_seq;
+	uint32_t rx_next;
+	uint32_t nsubnets;
+	struct addr_subnet subnets[ADDR_MAX_SUBNETS];
+	uint32_t compress;	// 1 if comp is in use
+	struct comp comp;
+	uint32_t rxlen;
+};
+
+/*
+ * struct upg_pkt
+ *
+ * A queued packet of the last session sent. partial marks the rest of a
+ * packet that had been partly written to the client, which has to go out
+ * before anything else. seq is the packet's sequence number on a striped
+ * connection, in network byte order.
+ */
+struct upg_pkt
+{
+	uint32_t type;
+	uint8_t queue;
+	uint8_t prio;
+	uint8_t partial;
+	uint8_t reserved;
+	uint32_t len;
+	uint32_t seq;
+};
+
+struct upg_end
+{
+	uint32_t type;
+	uint32_t sessions;
+};
+
+// Big enough for any message.
+#define UPGRADE_MSG_MAX (sizeof(struct upg_session) + 2 * PKT_MAX_FRAME)
+
+int upgrade_listen(const char *path);
+int upgrade_connect(const char *path);
+int upgrade_send(int fd, const void *msg, int len, const void *data, int datalen, const int *fds, int nfds);
+int upgrade_recv(int fd, void *buf, int size, int *fds, int *nfds);
+
+#endif